@@ -23,6 +23,7 @@
 #include <freenetconfd/plugin.h>
 
 #include <roxml.h>
+#include <sys/types.h>
 
 #ifndef ARRAY_SIZE
 #define ARRAY_SIZE(a) (sizeof(a) / sizeof(*(a)))
@@ -91,6 +92,31 @@ typedef struct datastore
 	 * You will just want to set it to 1 for most choices you encounter.
 	 */
 	int choice_group;
+
+	/*
+	 * bookkeeping for ds_add_child() and ds_free(), don't set these manually
+	 *
+	 * last_child makes appending O(1), child_index is built once a node
+	 * has enough children and indexes them by position and by name.
+	 * index_chunk and name_index_chunk locate this node in its parent's
+	 * child_index, key_hash and key_state in the key index of its list.
+	 */
+	struct datastore *last_child;
+	unsigned int child_count;
+	struct ds_child_index *child_index;
+	struct ds_chunk *index_chunk;
+	struct ds_chunk *name_index_chunk;
+	unsigned int key_hash;
+	unsigned int key_state;
+
+	// replacement set by ds_publish(), read it with ds_published()
+	struct datastore *published;
+
+	// DS_CHANGE_* marks made while changes are tracked, see ds_track()
+	unsigned int changed;
+
+	// on roots, bumped whenever nodes below are freed, see ds_stream_read()
+	unsigned int generation;
 } datastore_t;
 
 
@@ -101,13 +127,60 @@ typedef struct ds_key
 	struct ds_key *next;
 } ds_key_t;
 
+/**
+ * ds_nip_t - set of xml nodes still in processing during edit-config
+ *
+ * Pointer keyed open addressing set. Nodes are kept in insertion (document)
+ * order in nodes, deleted entries are set to NULL. slots holds index + 1
+ * into nodes, 0 marks an empty slot.
+ */
 typedef struct ds_nip
 {
-	node_t *node;
-	struct ds_nip *next;
-	int is_head;
+	node_t **nodes;
+	unsigned int nodes_count;
+	unsigned int nodes_size;
+	unsigned int *slots;
+	unsigned int slots_size;
+	unsigned int slots_used;
 } ds_nip_t;
 
+/**
+ * ds_get_options_t - list pagination, depth and size for ds_get_all_options()
+ *
+ * Pagination is applied to one list, see ds_get_target(), other lists are
+ * added whole. It starts at the entry identified by cursor, or at the
+ * first entry (last one if backwards is set), skips offset entries and
+ * adds at most limit entries, 0 meaning no limit. The last added entry
+ * gets a next attribute in DS_PAGINATION_NS with cursor of the entry that
+ * follows. paged counts lists paginated, more than one means list named
+ * no single list.
+ *
+ * depth limits the depth of added nodes, top level nodes are at depth 1,
+ * 0 means no limit.
+ *
+ * max_size limits bytes of xml text added nodes take, 0 means no limit.
+ * Nodes are counted in size as they are added, once the next one doesn't
+ * fit nothing more is added and over is set.
+ *
+ * cursor_found is set once a paged list has the entry cursor names.
+ */
+typedef struct ds_get_options
+{
+	unsigned int limit;
+	unsigned int offset;
+	char *cursor;
+	int backwards;
+	char *list;
+	unsigned int paged;
+	unsigned int depth;
+	size_t max_size;
+	size_t size;
+	int over;
+	int cursor_found;
+} ds_get_options_t;
+
+#define DS_PAGINATION_NS "urn:freenetconfd:params:xml:ns:list-pagination"
+
 enum ds_operation {OPERATION_MERGE, OPERATION_REPLACE = 0, OPERATION_CREATE, OPERATION_DELETE, OPERATION_REMOVE};
 
 enum ds_operation ds_get_operation(node_t *node);
@@ -237,6 +310,11 @@ void ds_set_is_config(datastore_t *datastore, int is_config, int set_siblings);
  *
  * You should use this function whenever you want to add a child.
  * It handles all the inner working of the datastore.
+ *
+ * With target_name set, child is added after the target_position-th
+ * child named target_name, or after the last one if target_position is 0
+ * or out of range. Appending and positional inserts don't scan the
+ * list of children.
  */
 void ds_add_child(datastore_t *self, datastore_t *child, char *target_name, int target_position);
 
@@ -255,6 +333,18 @@ datastore_t *ds_find_sibling(datastore_t *root, char *name, char *value);
  */
 datastore_t *ds_find_child(datastore_t *root, char *name, char *value);
 
+/**
+ * ds_next_by_name() - finds next sibling with the same name
+ *
+ * @node datastore node to continue from
+ *
+ * Return: next sibling named like node, NULL if there is none
+ *
+ * Together with ds_find_child() it iterates over list entries
+ * without visiting siblings with other names.
+ */
+datastore_t *ds_next_by_name(datastore_t *node);
+
 /**
  * element_has_key_part() - Checks if an element of a list has a key part with "name" and "value"
  * @elem element of a list
@@ -288,12 +378,217 @@ datastore_t *ds_find_node_by_key(datastore_t *our_root, ds_key_t *key);
 
 void ds_get_all(datastore_t *our_root, node_t *out, int get_config, int check_siblings);
 
+/**
+ * ds_get_all_options() - ds_get_all() with list pagination and depth
+ *
+ * @options see ds_get_options_t, can be NULL
+ *
+ * Return: xml node added for our_root when check_siblings is 0, NULL otherwise
+ */
+node_t *ds_get_all_options(datastore_t *our_root, node_t *out, int get_config, int check_siblings, ds_get_options_t *options);
+
+/**
+ * ds_get_paged() - checks if options request list pagination
+ *
+ * Return: 1 if pagination is requested, 0 otherwise
+ */
+int ds_get_paged(ds_get_options_t *options);
+
+/**
+ * ds_get_target() - checks if list with entry first is the one to paginate
+ *
+ * @selected list is what a filter selects
+ *
+ * With list set in options only the list it names is paginated, list is
+ * a path of node names starting with '/', prefixes of names are ignored.
+ * Otherwise the list a filter selects is.
+ *
+ * Return: 1 if list is paginated, 0 otherwise
+ */
+int ds_get_target(ds_get_options_t *options, datastore_t *first, int selected);
+
+/**
+ * ds_get_list() - adds entries of list starting with first
+ *
+ * @first first entry of the list
+ * @options see ds_get_options_t, can be NULL
+ *
+ * Pagination is applied to this list, callers check ds_get_target().
+ */
+void ds_get_list(datastore_t *first, node_t *out, int get_config, ds_get_options_t *options);
+
+/**
+ * ds_list_cursor() - makes pagination cursor for list entry
+ *
+ * Return: values of entry's keys separated by commas, commas and
+ * backslashes in values escaped with a backslash, NULL if it has no keys,
+ * you're responsible for freeing it
+ */
+char *ds_list_cursor(datastore_t *entry);
+
+/**
+ * ds_list_cursor_find() - finds list entry by cursor made by ds_list_cursor()
+ *
+ * @first first entry of the list
+ *
+ * Entry is looked up in the key index of the list.
+ *
+ * Return: entry, NULL if there is none with the cursor
+ */
+datastore_t *ds_list_cursor_find(datastore_t *first, const char *cursor);
+
+/**
+ * ds_set_next_cursor() - adds cursor of next to out as next attribute
+ */
+void ds_set_next_cursor(node_t *out, datastore_t *next);
+
 void ds_get_all_keys(datastore_t *our_root, node_t *out, int get_config);
 
 void ds_get_list_data(node_t *filter_root, datastore_t *node, node_t *out, int get_config);
 
+/**
+ * ds_get_filtered() - applies subtree filter node filter_root to our_root
+ *
+ * @filter_root filter node, child of <filter>
+ * @our_root first datastore node named like filter_root
+ * @out xml node to add results to
+ * @get_config set to 1 to only get configurable nodes
+ *
+ * Compiles and evaluates filter_root on every call, use filter_compile()
+ * and filter_eval() when the same filter is applied to several modules.
+ */
 void ds_get_filtered(node_t *filter_root, datastore_t *our_root, node_t *out, int get_config);
 
+typedef struct ds_stream ds_stream_t;
+
+/**
+ * ds_stream_create() - starts resumable serialization of datastores
+ *
+ * @roots datastores whose children are serialized, in order
+ * @roots_count number of roots
+ * @get_config 1 to serialize only configurable nodes
+ *
+ * Return: stream, NULL on error, free it with ds_stream_free()
+ *
+ * Produces the same data as ds_get_all() on children of every root, as
+ * xml text, without building the whole reply in memory.
+ */
+ds_stream_t *ds_stream_create(datastore_t **roots, unsigned int roots_count, int get_config);
+
+/**
+ * ds_stream_read() - reads next part of serialized data
+ *
+ * @stream stream to read from
+ * @buf buffer to fill
+ * @size size of buf
+ *
+ * Return: number of bytes read, 0 when done, -1 on error
+ *
+ * Fails if a node of the module being read was freed since the previous
+ * read, nodes the stream is positioned at might be gone.
+ */
+ssize_t ds_stream_read(ds_stream_t *stream, char *buf, size_t size);
+
+/**
+ * ds_stream_end() - stops serialization at the next tag boundary
+ *
+ * @stream stream to end
+ *
+ * Return: 0 on success, -1 if what was read can't be completed
+ *
+ * Following reads return the rest of the tag being read and close tags
+ * of elements still open, then 0. Nodes aren't used for that, so a stream
+ * whose read failed because the datastore changed can still be ended, and
+ * published versions it read may be freed right away.
+ */
+int ds_stream_end(ds_stream_t *stream);
+
+void ds_stream_free(ds_stream_t *stream);
+
+/**
+ * ds_publish() - replaces node's value and children for readers
+ *
+ * @node node that stays in the tree, usually a container of state data
+ * @replacement detached node with the same name, built with ds_create()
+ * and ds_add_child_create()
+ *
+ * Lets a plugin thread refresh state data without going through the
+ * uloop thread. Readers see either the previous version or replacement
+ * with all its children, never a mix. replacement must not be changed
+ * once published, publish another one instead. Previous version is freed
+ * when no reader that might see it is left.
+ *
+ * Only node's position is kept, so edit-config shouldn't touch it, and node
+ * must not be freed while a plugin thread may publish into it.
+ *
+ * Return: 0 on success, -1 on error
+ */
+int ds_publish(datastore_t *node, datastore_t *replacement);
+
+/**
+ * ds_published() - returns what readers should see in place of node
+ */
+datastore_t *ds_published(datastore_t *node);
+
+/**
+ * ds_read_begin() - starts reading datastore nodes that may be published
+ *
+ * Doesn't block, only keeps replaced versions from being freed until
+ * ds_read_end() is called with the returned value.
+ */
+int ds_read_begin(void);
+void ds_read_end(int epoch);
+
+enum ds_change
+{
+	DS_CHANGE_VALUE = 1 << 0, // value was set to a different one
+	DS_CHANGE_CREATE = 1 << 1, // node was added
+	DS_CHANGE_DELETE = 1 << 2, // node is about to be freed
+	DS_CHANGE_BELOW = 1 << 3, // some node below changed
+	DS_CHANGE_TRACKED = 1 << 4, // root passed to ds_track()
+};
+
+typedef void (*ds_change_cb_t)(datastore_t *node, enum ds_change change);
+
+/**
+ * ds_track() - starts tracking changes below root
+ *
+ * ds_set_value(), ds_add_child(), ds_free(), ds_publish() and
+ * ds_replace_children() then mark nodes they change with DS_CHANGE_VALUE
+ * or DS_CHANGE_CREATE and their ancestors with DS_CHANGE_BELOW, plugins
+ * updating state data through them are tracked as well. Published versions
+ * are compared with the one they replace, only nodes that differ are marked.
+ *
+ * cb is called on the thread making the change, for DS_CHANGE_DELETE
+ * before node is freed. Nodes deleted under one added since the marks were
+ * last taken aren't reported.
+ *
+ * Marks left from earlier tracking are dropped. cb NULL stops tracking of
+ * all roots, root is ignored then.
+ */
+void ds_track(datastore_t *root, ds_change_cb_t cb);
+
+/**
+ * ds_changes() - takes marks of changes below root
+ *
+ * visit is called in tree order for every node marked with DS_CHANGE_VALUE
+ * or DS_CHANGE_CREATE, but not for those under a node added, and all marks
+ * are cleared. Published versions are visited in place of nodes they
+ * replace. Nothing may change the datastore meanwhile.
+ *
+ * @visit	NULL only clears marks
+ */
+void ds_changes(datastore_t *root, void (*visit)(datastore_t *node, int changed, void *priv), void *priv);
+
+/**
+ * ds_replace_children() - moves children of from to node, freeing those
+ * node had
+ *
+ * Unlike ds_free() and adding the new children, only what differs is
+ * tracked, see ds_track(). from is left without children.
+ */
+void ds_replace_children(datastore_t *node, datastore_t *from);
+
 /**
  * ds_edit_config()
  *
@@ -26,6 +26,8 @@ typedef enum rpc_error_tag
 	RPC_ERROR_TAG_INVALID_VALUE,
 	RPC_ERROR_TAG_DATA_MISSING,
 	RPC_ERROR_TAG_DATA_EXISTS,
+	RPC_ERROR_TAG_TOO_BIG,
+	RPC_ERROR_TAG_RESOURCE_DENIED,
 	__RPC_ERROR_TAG_COUNT
 } rpc_error_tag_t;
 
@@ -21,6 +21,7 @@
 
 #include <libubox/list.h>
 #include <roxml.h>
+#include <pthread.h>
 
 enum response {RPC_OK, RPC_OK_CLOSE, RPC_DATA, RPC_ERROR, RPC_DATA_EXISTS, RPC_DATA_MISSING};
 
@@ -39,12 +40,30 @@ struct rpc_method
 	int (*handler) (struct rpc_data *data);
 };
 
+/* flags of struct module */
+#define MODULE_THREADED (1 << 0) // rpcs and node callbacks are thread safe
+
+/**
+ * struct module - what init() of a module returns
+ *
+ * Rpc handlers and the get(), set(), update() and other callbacks of the
+ * module's datastore nodes run on the main loop thread, so they may use
+ * uloop timers, ubus and any state shared with the main loop.
+ *
+ * With MODULE_THREADED in flags the module declares them thread safe.
+ * Once worker threads are configured its rpcs run on them, and so do
+ * gets and edits when every loaded module is threaded. Node callbacks
+ * are then serialized only by the module's lock, shared by gets of
+ * modules whose nodes have no update(), so they must not touch uloop,
+ * ubus or other contexts of the main loop.
+ */
 struct module
 {
 	const struct rpc_method *rpcs;
 	int rpc_count;
 	char *ns;
 	struct datastore *datastore;
+	int flags; // MODULE_*
 };
 
 struct module_list
@@ -53,6 +72,35 @@ struct module_list
 	char *name;
 	void *lib;
 	const struct module *m;
+	pthread_rwlock_t lock; // datastore access from worker threads
+	int shared; // no node has update(), so gets may run concurrently
 };
 
+/**
+ * notification_stream_add() - adds event stream sessions may subscribe to
+ *
+ * @name:	letters, digits, '.', '_' and '-'
+ * @description:	shown to clients, can be NULL
+ *
+ * NETCONF stream is always there, its subscribers get the events of all
+ * streams. Usually called from the module's init().
+ *
+ * Return: 0 on success, -1 on error or if the stream exists
+ */
+int notification_stream_add(const char *name, const char *description);
+
+/**
+ * notification_send() - publishes event to the sessions subscribed to it
+ *
+ * @stream:	stream added with notification_stream_add(), NULL for NETCONF
+ * @event:	notification content, one or more elements with their namespace
+ *
+ * Event is copied and gets its eventTime here, it is serialized once and
+ * the same buffer is queued to every session. May be called from any
+ * thread of the daemon, sessions get the event from the main loop.
+ *
+ * Return: 0 on success, -1 on error or if there is no such stream
+ */
+int notification_send(const char *stream, const char *event);
+
 #endif /* __FREENETCONFD_PLUGIN_H__ */
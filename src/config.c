@@ -33,6 +33,35 @@ enum
 	PORT,
 	YANG_DIR,
 	MODULES_DIR,
+	REPLY_WINDOW,
+	REPLY_CHUNK,
+	OUTPUT_HIGH,
+	OUTPUT_LOW,
+	INGEST_SPILL,
+	INGEST_DIR,
+	MAX_RPC_SIZE,
+	MAX_REPLY_SIZE,
+	MAX_OUTPUT,
+	MAX_RPC_RATE,
+	RPC_QUANTUM,
+	RPC_QUANTUM_US,
+	RPC_SLICE_US,
+	READER_TIMEOUT,
+	OUTPUT_TIMEOUT,
+	WORKERS,
+	REPLICAS,
+	REPLICA_REFRESH,
+	DRAIN_TIMEOUT,
+	HELLO_TIMEOUT,
+	IDLE_TIMEOUT,
+	BUFFER_RELEASE,
+	BUFFER_POOL,
+	TLS_CERT,
+	TLS_KEY,
+	TLS_CA,
+	REPLAY_LOG,
+	REPLAY_SIZE,
+	PUSH_DAMPENING,
 	__OPTIONS_COUNT
 };
 
@@ -41,7 +70,36 @@ const struct blobmsg_policy config_policy[__OPTIONS_COUNT] =
 	[ADDR] = { .name = "addr", .type = BLOBMSG_TYPE_STRING },
 	[PORT] = { .name = "port", .type = BLOBMSG_TYPE_STRING },
 	[YANG_DIR] = { .name = "yang_dir", .type = BLOBMSG_TYPE_STRING },
-	[MODULES_DIR] = { .name = "modules_dir", .type = BLOBMSG_TYPE_STRING }
+	[MODULES_DIR] = { .name = "modules_dir", .type = BLOBMSG_TYPE_STRING },
+	[REPLY_WINDOW] = { .name = "reply_window", .type = BLOBMSG_TYPE_INT32 },
+	[REPLY_CHUNK] = { .name = "reply_chunk", .type = BLOBMSG_TYPE_INT32 },
+	[OUTPUT_HIGH] = { .name = "output_high", .type = BLOBMSG_TYPE_INT32 },
+	[OUTPUT_LOW] = { .name = "output_low", .type = BLOBMSG_TYPE_INT32 },
+	[INGEST_SPILL] = { .name = "ingest_spill", .type = BLOBMSG_TYPE_INT32 },
+	[INGEST_DIR] = { .name = "ingest_dir", .type = BLOBMSG_TYPE_STRING },
+	[MAX_RPC_SIZE] = { .name = "max_rpc_size", .type = BLOBMSG_TYPE_INT32 },
+	[MAX_REPLY_SIZE] = { .name = "max_reply_size", .type = BLOBMSG_TYPE_INT32 },
+	[MAX_OUTPUT] = { .name = "max_output", .type = BLOBMSG_TYPE_INT32 },
+	[MAX_RPC_RATE] = { .name = "max_rpc_rate", .type = BLOBMSG_TYPE_INT32 },
+	[RPC_QUANTUM] = { .name = "rpc_quantum", .type = BLOBMSG_TYPE_INT32 },
+	[RPC_QUANTUM_US] = { .name = "rpc_quantum_us", .type = BLOBMSG_TYPE_INT32 },
+	[RPC_SLICE_US] = { .name = "rpc_slice_us", .type = BLOBMSG_TYPE_INT32 },
+	[READER_TIMEOUT] = { .name = "reader_timeout", .type = BLOBMSG_TYPE_INT32 },
+	[OUTPUT_TIMEOUT] = { .name = "output_timeout", .type = BLOBMSG_TYPE_INT32 },
+	[WORKERS] = { .name = "workers", .type = BLOBMSG_TYPE_INT32 },
+	[REPLICAS] = { .name = "replicas", .type = BLOBMSG_TYPE_INT32 },
+	[REPLICA_REFRESH] = { .name = "replica_refresh", .type = BLOBMSG_TYPE_INT32 },
+	[DRAIN_TIMEOUT] = { .name = "drain_timeout", .type = BLOBMSG_TYPE_INT32 },
+	[HELLO_TIMEOUT] = { .name = "hello_timeout", .type = BLOBMSG_TYPE_INT32 },
+	[IDLE_TIMEOUT] = { .name = "idle_timeout", .type = BLOBMSG_TYPE_INT32 },
+	[BUFFER_RELEASE] = { .name = "buffer_release", .type = BLOBMSG_TYPE_INT32 },
+	[BUFFER_POOL] = { .name = "buffer_pool", .type = BLOBMSG_TYPE_INT32 },
+	[TLS_CERT] = { .name = "tls_cert", .type = BLOBMSG_TYPE_STRING },
+	[TLS_KEY] = { .name = "tls_key", .type = BLOBMSG_TYPE_STRING },
+	[TLS_CA] = { .name = "tls_ca", .type = BLOBMSG_TYPE_STRING },
+	[REPLAY_LOG] = { .name = "replay_log", .type = BLOBMSG_TYPE_STRING },
+	[REPLAY_SIZE] = { .name = "replay_size", .type = BLOBMSG_TYPE_INT32 },
+	[PUSH_DAMPENING] = { .name = "push_dampening", .type = BLOBMSG_TYPE_INT32 }
 };
 const struct uci_blob_param_list config_attr_list =
 {
@@ -49,6 +107,214 @@ const struct uci_blob_param_list config_attr_list =
 	.params = config_policy
 };
 
+/* options of "listener" sections */
+enum
+{
+	LISTENER_ADDR,
+	LISTENER_PORT,
+	LISTENER_PATH,
+	LISTENER_MODE,
+	LISTENER_GROUP,
+	LISTENER_BATCH,
+	LISTENER_SUBSYSTEM,
+	LISTENER_MUX,
+	LISTENER_TLS,
+	__LISTENER_COUNT
+};
+
+const struct blobmsg_policy listener_policy[__LISTENER_COUNT] =
+{
+	[LISTENER_ADDR] = { .name = "addr", .type = BLOBMSG_TYPE_STRING },
+	[LISTENER_PORT] = { .name = "port", .type = BLOBMSG_TYPE_STRING },
+	[LISTENER_PATH] = { .name = "path", .type = BLOBMSG_TYPE_STRING },
+	[LISTENER_MODE] = { .name = "mode", .type = BLOBMSG_TYPE_STRING },
+	[LISTENER_GROUP] = { .name = "group", .type = BLOBMSG_TYPE_STRING },
+	[LISTENER_BATCH] = { .name = "batch", .type = BLOBMSG_TYPE_INT32 },
+	[LISTENER_SUBSYSTEM] = { .name = "subsystem", .type = BLOBMSG_TYPE_BOOL },
+	[LISTENER_MUX] = { .name = "mux", .type = BLOBMSG_TYPE_BOOL },
+	[LISTENER_TLS] = { .name = "tls", .type = BLOBMSG_TYPE_BOOL }
+};
+const struct uci_blob_param_list listener_attr_list =
+{
+	.n_params = __LISTENER_COUNT,
+	.params = listener_policy
+};
+
+/*
+ * config_listener() - adds listener described by uci section s
+ */
+static int config_listener(struct uci_section *s)
+{
+	struct blob_attr *tb[__LISTENER_COUNT], *c;
+	struct config_listener *listeners, *l;
+	static struct blob_buf buf;
+	int rc = -1;
+
+	blob_buf_init(&buf, 0);
+	uci_to_blob(&buf, s, &listener_attr_list);
+	blobmsg_parse(listener_policy, __LISTENER_COUNT, tb, blob_data(buf.head), blob_len(buf.head));
+
+	listeners = realloc(config.listeners, (config.listener_count + 1) * sizeof(*listeners));
+
+	if (!listeners)
+		goto exit;
+
+	config.listeners = listeners;
+	l = &listeners[config.listener_count];
+	memset(l, 0, sizeof(*l));
+	l->batch = 64;
+
+	if ((c = tb[LISTENER_ADDR]))
+		l->addr = strdup(blobmsg_get_string(c));
+
+	if ((c = tb[LISTENER_PORT]))
+		l->port = strdup(blobmsg_get_string(c));
+
+	if ((c = tb[LISTENER_PATH]))
+		l->path = strdup(blobmsg_get_string(c));
+
+	/* octal, like chmod */
+	if ((c = tb[LISTENER_MODE]))
+		l->mode = strtoul(blobmsg_get_string(c), NULL, 8);
+
+	if ((c = tb[LISTENER_GROUP]))
+		l->group = strdup(blobmsg_get_string(c));
+
+	/* connections accepted per event */
+	if ((c = tb[LISTENER_BATCH]) && blobmsg_get_u32(c))
+		l->batch = blobmsg_get_u32(c);
+
+	/* clients pass ssh channel descriptors, see freenetconfd-subsystem */
+	if ((c = tb[LISTENER_SUBSYSTEM]))
+		l->subsystem = blobmsg_get_bool(c);
+
+	/* each client carries many sessions in frames */
+	if ((c = tb[LISTENER_MUX]))
+		l->mux = blobmsg_get_bool(c);
+
+	/* netconf over tls, rfc 7589 */
+	if ((c = tb[LISTENER_TLS]))
+		l->tls = blobmsg_get_bool(c);
+
+	config.listener_count++;
+
+	if (!l->path && (!l->addr || !l->port))
+	{
+		ERROR("listener needs path, or addr and port\n");
+		goto exit;
+	}
+
+	if (l->subsystem && !l->path)
+	{
+		ERROR("subsystem listener needs path\n");
+		goto exit;
+	}
+
+	if (l->subsystem && l->mux)
+	{
+		ERROR("listener can't be both subsystem and mux\n");
+		goto exit;
+	}
+
+	if (l->tls && (l->path || l->mux))
+	{
+		ERROR("tls listener needs addr and port\n");
+		goto exit;
+	}
+
+	rc = 0;
+
+exit:
+	blob_buf_free(&buf);
+
+	return rc;
+}
+
+/* options of "stream" sections */
+enum
+{
+	STREAM_NAME,
+	STREAM_DESCRIPTION,
+	STREAM_EVENT,
+	__STREAM_COUNT
+};
+
+const struct blobmsg_policy stream_policy[__STREAM_COUNT] =
+{
+	[STREAM_NAME] = { .name = "name", .type = BLOBMSG_TYPE_STRING },
+	[STREAM_DESCRIPTION] = { .name = "description", .type = BLOBMSG_TYPE_STRING },
+	[STREAM_EVENT] = { .name = "event", .type = BLOBMSG_TYPE_ARRAY }
+};
+const struct uci_blob_param_list stream_attr_list =
+{
+	.n_params = __STREAM_COUNT,
+	.params = stream_policy
+};
+
+/*
+ * config_stream() - adds event stream described by uci section s
+ */
+static int config_stream(struct uci_section *s)
+{
+	struct blob_attr *tb[__STREAM_COUNT], *c, *cur;
+	struct config_stream *streams, *st;
+	static struct blob_buf buf;
+	int rc = -1, rem, count;
+
+	blob_buf_init(&buf, 0);
+	uci_to_blob(&buf, s, &stream_attr_list);
+	blobmsg_parse(stream_policy, __STREAM_COUNT, tb, blob_data(buf.head), blob_len(buf.head));
+
+	streams = realloc(config.streams, (config.stream_count + 1) * sizeof(*streams));
+
+	if (!streams)
+		goto exit;
+
+	config.streams = streams;
+	st = &streams[config.stream_count++];
+	memset(st, 0, sizeof(*st));
+
+	if ((c = tb[STREAM_NAME]))
+		st->name = strdup(blobmsg_get_string(c));
+
+	if ((c = tb[STREAM_DESCRIPTION]))
+		st->description = strdup(blobmsg_get_string(c));
+
+	/* ubus event patterns, '*' at the end matches any suffix */
+	if ((c = tb[STREAM_EVENT]))
+	{
+		count = blobmsg_check_array(c, BLOBMSG_TYPE_STRING);
+
+		if (count < 0)
+		{
+			ERROR("stream events must be strings\n");
+			goto exit;
+		}
+
+		if (count && !(st->events = calloc(count, sizeof(char *))))
+			goto exit;
+
+		blobmsg_for_each_attr(cur, c, rem)
+		{
+			if (blobmsg_type(cur) == BLOBMSG_TYPE_STRING)
+				st->events[st->event_count++] = strdup(blobmsg_get_string(cur));
+		}
+	}
+
+	if (!st->name)
+	{
+		ERROR("stream needs name\n");
+		goto exit;
+	}
+
+	rc = 0;
+
+exit:
+	blob_buf_free(&buf);
+
+	return rc;
+}
+
 /*
  * config_load() - load uci config file
  *
@@ -70,10 +336,40 @@ int config_load(void)
 
 	blob_buf_init(&buf, 0);
 
+	config.listeners = NULL;
+	config.listener_count = 0;
+	config.streams = NULL;
+	config.stream_count = 0;
+
 	struct uci_element *section_elem;
 	uci_foreach_element(&conf->sections, section_elem)
 	{
 		struct uci_section *s = uci_to_section(section_elem);
+
+		if (!strcmp(s->type, "listener"))
+		{
+			if (config_listener(s))
+			{
+				uci_unload(uci, conf);
+				uci_free_context(uci);
+				return -1;
+			}
+
+			continue;
+		}
+
+		if (!strcmp(s->type, "stream"))
+		{
+			if (config_stream(s))
+			{
+				uci_unload(uci, conf);
+				uci_free_context(uci);
+				return -1;
+			}
+
+			continue;
+		}
+
 		uci_to_blob(&buf, s, &config_attr_list);
 	}
 
@@ -84,6 +380,35 @@ int config_load(void)
 	config.port = NULL;
 	config.yang_dir = NULL;
 	config.modules_dir = NULL;
+	config.reply_window = 262144;
+	config.reply_chunk = 16384;
+	config.output_high = 1048576;
+	config.output_low = 262144;
+	config.ingest_spill = 1048576;
+	config.ingest_dir = NULL;
+	config.max_rpc_size = 268435456;
+	config.max_reply_size = 0;
+	config.max_output = 16777216;
+	config.max_rpc_rate = 0;
+	config.rpc_quantum = 8;
+	config.rpc_quantum_us = 10000;
+	config.rpc_slice_us = 10000;
+	config.reader_timeout = 5000;
+	config.output_timeout = 60000;
+	config.workers = 0;
+	config.replicas = 0;
+	config.replica_refresh = 1000;
+	config.drain_timeout = 30000;
+	config.hello_timeout = 60000;
+	config.idle_timeout = 0;
+	config.buffer_release = 10000;
+	config.buffer_pool = 64;
+	config.tls_cert = NULL;
+	config.tls_key = NULL;
+	config.tls_ca = NULL;
+	config.replay_log = NULL;
+	config.replay_size = 4194304;
+	config.push_dampening = 100;
 
 	if ((c = tb[ADDR]))
 		config.addr = strdup(blobmsg_get_string(c));
@@ -97,6 +422,128 @@ int config_load(void)
 	if ((c = tb[MODULES_DIR]))
 		config.modules_dir = strdup(blobmsg_get_string(c));
 
+	if ((c = tb[REPLY_WINDOW]))
+		config.reply_window = blobmsg_get_u32(c);
+
+	if ((c = tb[REPLY_CHUNK]) && blobmsg_get_u32(c))
+		config.reply_chunk = blobmsg_get_u32(c);
+
+	if ((c = tb[OUTPUT_HIGH]) && blobmsg_get_u32(c))
+		config.output_high = blobmsg_get_u32(c);
+
+	if ((c = tb[OUTPUT_LOW]))
+		config.output_low = blobmsg_get_u32(c);
+
+	if (config.output_low > config.output_high)
+		config.output_low = config.output_high;
+
+	if ((c = tb[INGEST_SPILL]))
+		config.ingest_spill = blobmsg_get_u32(c);
+
+	if ((c = tb[INGEST_DIR]))
+		config.ingest_dir = strdup(blobmsg_get_string(c));
+	else
+		config.ingest_dir = strdup("/tmp");
+
+	/* session limits, 0 disables a limit */
+	if ((c = tb[MAX_RPC_SIZE]))
+		config.max_rpc_size = blobmsg_get_u32(c);
+
+	if ((c = tb[MAX_REPLY_SIZE]))
+		config.max_reply_size = blobmsg_get_u32(c);
+
+	if ((c = tb[MAX_OUTPUT]))
+		config.max_output = blobmsg_get_u32(c);
+
+	if ((c = tb[MAX_RPC_RATE]))
+		config.max_rpc_rate = blobmsg_get_u32(c);
+
+	/* scheduling, 0 disables a bound */
+	if ((c = tb[RPC_QUANTUM]))
+		config.rpc_quantum = blobmsg_get_u32(c);
+
+	if ((c = tb[RPC_QUANTUM_US]))
+		config.rpc_quantum_us = blobmsg_get_u32(c);
+
+	if ((c = tb[RPC_SLICE_US]))
+		config.rpc_slice_us = blobmsg_get_u32(c);
+
+	if ((c = tb[READER_TIMEOUT]))
+		config.reader_timeout = blobmsg_get_u32(c);
+
+	if ((c = tb[OUTPUT_TIMEOUT]))
+		config.output_timeout = blobmsg_get_u32(c);
+
+	/* rpcs run on the uloop thread if 0 */
+	if ((c = tb[WORKERS]))
+		config.workers = blobmsg_get_u32(c);
+
+	/* single process if 0 */
+	if ((c = tb[REPLICAS]))
+		config.replicas = blobmsg_get_u32(c);
+
+	if ((c = tb[REPLICA_REFRESH]))
+		config.replica_refresh = blobmsg_get_u32(c);
+
+	/* sessions are waited for forever if 0 */
+	if ((c = tb[DRAIN_TIMEOUT]))
+		config.drain_timeout = blobmsg_get_u32(c);
+
+	/* sessions are never closed for being quiet if 0 */
+	if ((c = tb[HELLO_TIMEOUT]))
+		config.hello_timeout = blobmsg_get_u32(c);
+
+	if ((c = tb[IDLE_TIMEOUT]))
+		config.idle_timeout = blobmsg_get_u32(c);
+
+	/* quiet sessions keep their buffers if 0 */
+	if ((c = tb[BUFFER_RELEASE]))
+		config.buffer_release = blobmsg_get_u32(c);
+
+	if ((c = tb[BUFFER_POOL]))
+		config.buffer_pool = blobmsg_get_u32(c);
+
+	if ((c = tb[TLS_CERT]))
+		config.tls_cert = strdup(blobmsg_get_string(c));
+
+	if ((c = tb[TLS_KEY]))
+		config.tls_key = strdup(blobmsg_get_string(c));
+
+	if ((c = tb[TLS_CA]))
+		config.tls_ca = strdup(blobmsg_get_string(c));
+
+	/* notifications are not kept for replay without a log */
+	if ((c = tb[REPLAY_LOG]))
+		config.replay_log = strdup(blobmsg_get_string(c));
+
+	if ((c = tb[REPLAY_SIZE]) && blobmsg_get_u32(c))
+		config.replay_size = blobmsg_get_u32(c);
+
+	if ((c = tb[PUSH_DAMPENING]))
+		config.push_dampening = blobmsg_get_u32(c);
+
+	/* addr and port are the listener if there are no listener sections */
+	if (!config.listener_count && config.addr && config.port)
+	{
+		config.listeners = calloc(1, sizeof(*config.listeners));
+
+		if (config.listeners)
+		{
+			config.listeners->addr = strdup(config.addr);
+			config.listeners->port = strdup(config.port);
+			config.listeners->batch = 64;
+			config.listener_count = 1;
+		}
+	}
+
+	if (!config.listener_count)
+	{
+		ERROR("no listener configured\n");
+		uci_unload(uci, conf);
+		uci_free_context(uci);
+		return -1;
+	}
+
 	if (!(config.modules_dir))
 	{
 		ERROR("modules directory must be set\n");
@@ -118,4 +565,36 @@ void config_exit(void)
 	free(config.port);
 	free(config.yang_dir);
 	free(config.modules_dir);
+	free(config.ingest_dir);
+	free(config.tls_cert);
+	free(config.tls_key);
+	free(config.tls_ca);
+	free(config.replay_log);
+
+	for (unsigned int i = 0; i < config.listener_count; i++)
+	{
+		free(config.listeners[i].addr);
+		free(config.listeners[i].port);
+		free(config.listeners[i].path);
+		free(config.listeners[i].group);
+	}
+
+	free(config.listeners);
+	config.listeners = NULL;
+	config.listener_count = 0;
+
+	for (unsigned int i = 0; i < config.stream_count; i++)
+	{
+		free(config.streams[i].name);
+		free(config.streams[i].description);
+
+		for (unsigned int j = 0; j < config.streams[i].event_count; j++)
+			free(config.streams[i].events[j]);
+
+		free(config.streams[i].events);
+	}
+
+	free(config.streams);
+	config.streams = NULL;
+	config.stream_count = 0;
 }
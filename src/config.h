@@ -23,12 +23,66 @@
 int config_load(void);
 void config_exit(void);
 
+struct config_listener
+{
+	char *addr;
+	char *port;
+	char *path; // unix socket, instead of addr and port
+	unsigned int mode; // permissions of path, 0 leaves them to umask
+	char *group; // group owning path
+	unsigned int batch; // connections accepted per event
+	bool subsystem; // path takes ssh channels from freenetconfd-subsystem
+	bool mux; // clients are translators multiplexing sessions
+	bool tls; // netconf over tls
+};
+
+struct config_stream
+{
+	char *name;
+	char *description;
+	char **events; // ubus event patterns forwarded to the stream
+	unsigned int event_count;
+};
+
 struct config_t
 {
 	char *addr;
 	char *port;
 	char *yang_dir;
 	char *modules_dir;
+	unsigned int reply_window; // unsent reply bytes per connection
+	unsigned int reply_chunk; // size of streamed reply chunks
+	unsigned int output_high; // unsent bytes at which reading rpcs stops
+	unsigned int output_low; // unsent bytes at which reading rpcs resumes
+	unsigned int ingest_spill; // rpcs bigger than this are spooled to a file
+	char *ingest_dir; // where rpcs are spooled
+	unsigned int max_rpc_size; // per session limits, 0 for no limit
+	unsigned int max_reply_size;
+	unsigned int max_output; // unsent bytes, replies over it are refused
+	unsigned int max_rpc_rate; // rpcs per second
+	unsigned int rpc_quantum; // rpcs handled per session before yielding
+	unsigned int rpc_quantum_us; // time per session before yielding
+	unsigned int rpc_slice_us; // time a long get or edit-config runs before yielding
+	unsigned int reader_timeout; // ms an edit waits for streamed gets before they are stopped
+	unsigned int output_timeout; // ms output may go undrained before the session is closed
+	unsigned int workers; // threads handling rpcs
+	unsigned int replicas; // read-only processes serving gets
+	unsigned int replica_refresh; // ms between snapshots sent to replicas
+	unsigned int drain_timeout; // ms sessions get to finish rpcs on exit or upgrade
+	unsigned int hello_timeout; // ms a new session has to send its hello
+	unsigned int idle_timeout; // ms a session may go without sending anything
+	unsigned int buffer_release; // ms after which a quiet session frees its buffers
+	unsigned int buffer_pool; // freed read buffers kept for reuse
+	char *tls_cert; // server certificate chain of tls listeners, pem
+	char *tls_key;
+	char *tls_ca; // client certificates are verified against these, required
+	char *replay_log; // file notifications are kept in for replay
+	unsigned int replay_size; // bytes of notifications the log keeps
+	unsigned int push_dampening; // ms changes are gathered before yang-push updates
+	struct config_listener *listeners; // addr and port if none are configured
+	unsigned int listener_count;
+	struct config_stream *streams; // event streams besides NETCONF
+	unsigned int stream_count;
 } config;
 
 #endif /* __FREENETCONFD_CONFIG_H__ */
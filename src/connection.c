@@ -17,339 +17,4765 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/uio.h>
+#include <grp.h>
 #include <netinet/in.h>
+#include <arpa/inet.h>
 
+#include <libubox/list.h>
+#include <libubox/blobmsg.h>
 #include <libubox/uloop.h>
-#include <libubox/usock.h>
 #include <libubox/ustream.h>
 
 #include "freenetconfd/freenetconfd.h"
+#include "freenetconfd/netconf.h"
 
 #include "config.h"
 #include "messages.h"
 #include "connection.h"
 #include "methods.h"
+#include "push.h"
+#include "replicas.h"
+#include "tls.h"
+#include "uring.h"
+#include "wheel.h"
+#include "workers.h"
 
 static void connection_accept_cb(struct uloop_fd *fd, unsigned int events);
 static void connection_close(struct ustream *s);
+static void connection_schedule(struct uloop_timeout *t);
+static void connection_guard_cb(struct uloop_timeout *t);
+static void connection_forward_deliver(struct uloop_timeout *t);
+static int connection_forward_pump(void);
+static void connection_forward_send(void);
+static void connection_retire_cb(struct uloop_timeout *t);
+static void connection_takeover_cb(struct uloop_fd *fd, unsigned int events);
+static void server_accept(bool accept);
+static void connection_uring_cb(struct uloop_fd *fd, unsigned int events);
+static void connection_uring_flush_cb(struct uloop_timeout *t);
 
-static struct uloop_fd server = { .cb = connection_accept_cb };
+enum listener_kind
+{
+	LISTENER_NETCONF,
+	LISTENER_SUBSYSTEM, // clients pass ssh channels, see connection_front()
+	LISTENER_MUX, // clients multiplex sessions, see connection_mux_accept()
+	LISTENER_TLS
+};
+
+struct listener
+{
+	struct uloop_fd fd;
+	unsigned int batch; // connections accepted per event
+	int kind;
+	struct uring_req accept; // multishot accept, listeners are only added before accepting starts
+	bool accepting; // accept is to be kept going
+	bool armed; // accept did not complete yet
+};
+
+static struct listener *listeners = NULL;
+static unsigned int listener_count = 0;
 static struct connection *next_connection = NULL;
+static LIST_HEAD(connections);
+static uint32_t session_id = 0;
+static uint32_t session_base = 0; // high bits of ids this process hands out
+static uint32_t session_mask = UINT32_MAX; // bits of ids left to session_id
+
+/* sessions by id, see connection_find() */
+#define CONNECTION_HASH_MIN 256
+
+static struct list_head *session_hash = NULL;
+static unsigned int session_hash_size = 0;
+static unsigned int session_count = 0;
+
+/* session whose rpc is handled on this thread right now */
+static struct connection *handling = NULL;
+
+/* time closed session gets to send its last reply */
+#define CONNECTION_LINGER_MS 5000
+
+/* read buffers freed by quiet sessions, see connection_shrink() */
+#define CONNECTION_READ_BUFFER 16384
+
+static struct ustream_buf *buffer_pool = NULL;
+static unsigned int buffer_pool_count = 0;
+
+/* sessions that used their quantum and have an rpc waiting */
+static LIST_HEAD(run_high);
+static LIST_HEAD(run_normal);
+static struct uloop_timeout scheduler = { .cb = connection_schedule };
+
+/* rpcs spanning several uloop iterations, see connection_guard() */
+#define CONNECTION_EXCLUSIVE_MAX 4
+static unsigned int guard_readers = 0;
+static unsigned int guard_writers = 0;
+static unsigned int guard_writers_waiting = 0;
+static LIST_HEAD(guard_wait);
+static struct uloop_timeout guard_timer = { .cb = connection_guard_cb };
+static void (*guard_exclusive[CONNECTION_EXCLUSIVE_MAX])(void);
+static unsigned int guard_exclusive_count = 0;
+
+/* replica's connection to the writer and sessions with rpcs sent over it */
+static struct connection *upstream = NULL;
+static LIST_HEAD(forward_wait);
+static LIST_HEAD(forward_ready);
+static struct uloop_timeout forward_timer = { .cb = connection_forward_deliver };
+
+/* spooled rpc being sent to the writer, rpcs behind it wait */
+#define CONNECTION_FORWARD_CHUNK 65536
+
+static struct connection *forward_pump = NULL;
+static char forward_buf[CONNECTION_FORWARD_CHUNK];
+
+/* sessions drained before exit or handed over to an upgraded daemon */
+#define CONNECTION_RETIRE_MS 10
+#define CONNECTION_HANDOFF_TIMEOUT 5
+
+static bool retiring = false;
+static int handoff_fd = -1;
+static uint64_t retire_deadline;
+static struct uloop_timeout retire_timer = { .cb = connection_retire_cb };
+static struct uloop_fd takeover = { .cb = connection_takeover_cb, .fd = -1 };
+
+/* plain sessions on io_uring, see connection_uring_init() */
+#define CONNECTION_URING_WINDOW (4 * CONNECTION_READ_BUFFER)
+
+static struct uloop_fd uring_event = { .cb = connection_uring_cb, .fd = -1 };
+static struct uloop_timeout uring_timer = { .cb = connection_uring_flush_cb };
+static LIST_HEAD(uring_flush);
+
+/* beginning of refused rpc kept for its message-id */
+#define CONNECTION_HEAD_SIZE 1024
 
 enum netconf_msg_step
 {
 	NETCONF_MSG_STEP_HELLO,
 	NETCONF_MSG_STEP_HEADER_0,
 	NETCONF_MSG_STEP_HEADER_1,
-	NETCONF_MSG_STEP_HEADER_1_BUF,
 	NETCONF_MSG_STEP_DATA_0,
 	NETCONF_MSG_STEP_DATA_0_BUF,
 	NETCONF_MSG_STEP_DATA_1,
-	NETCONF_MSG_STEP_DATA_1_BUF,
 	__NETCONF_MSG_STEP_MAX
 };
 
 struct connection
 {
-	struct sockaddr_in sin;
+	struct list_head list;
+	uint32_t session_id;
+	struct sockaddr_storage peer;
 	struct ustream_fd us;
+	struct uloop_fd out; // ssh channel output when it is not us, fd -1 otherwise
+	int front; // subsystem front process, exits once this is closed
+	struct connection_mux *mux; // translator link session is multiplexed on
+	uint32_t channel; // session's id on the link
+	struct list_head channel_hash; // entry in link's channel table
+	struct list_head mux_wait; // entry in link's waiting list
+	bool mux_waiting; // output held back until link drains
+	struct tls *tls; // record layer done here, NULL if plain or kernel does it
+	struct connection_uring *uring; // reads and writes go through io_uring, NULL otherwise
 	int step;
 	int base;
-	uint64_t msg_len;
-	char *buf;
+	uint64_t msg_len; // left in current chunk
+	char *buf; // rpc received so far
+	size_t buf_len;
+	size_t buf_size;
+	int spill_fd; // rpc spooled to a file, -1 if in buf
+	char header[16]; // chunk header being received
+	int header_len;
+	uint64_t msg_size; // announced size of rpc being received
+	bool denied; // rpc is over max_rpc_size, rest of it is dropped
+	uint64_t rate_tokens; // millionths of rpcs allowed now
+	uint64_t rate_time; // last refill, in us
+	struct list_head run; // entry in run queue
+	bool queued; // waiting in run queue
+	bool ready; // buf holds complete rpc
+	unsigned int handled; // rpcs handled in this turn
+	uint64_t turn; // start of this turn, in us
+	uint64_t stream_sent; // bytes of streamed reply
+	method_stream_t *stream; // reply being streamed
+	char *stream_buf;
+	char *stream_error; // rpc-error that follows data of streamed reply
+	bool stream_guard; // stream counts among guard_readers
+	method_job_t *job; // rpc handled in time slices
+	struct connection_work
+	{
+		worker_job_t job;
+		int flags; // METHOD_RPC_* of the rpc
+		int rc;
+		char *out;
+		method_stream_t *stream;
+	} work; // rpc handled by a worker thread
+	bool working; // work was submitted and is not done yet
+	bool closed; // connection went away while working
+	bool paused; // reading rpcs stopped until output drains
+	bool closing; // closed, last reply still going out
+	struct list_head hash; // entry in session table
+	struct wheel_timer timer; // hello, idle or linger timeout
+	struct wheel_timer shrink; // frees buffers of quiet session
+	struct wheel_timer stall; // closes session whose output doesn't drain
+	uint64_t written; // output last drained, in us
+	uint64_t active; // data last received, in us
+	bool control; // writer's end of a replica's connection
+	int replica; // replica on the other end of control connection
+	bool upstream; // replica's end, carries rpcs forwarded to the writer
+	struct list_head forward; // entry in forward_wait or forward_ready
+	bool forward_sent; // forwarded rpc went out, or is going out
+	off_t forward_off; // part of spooled rpc sent to the writer
+	char *forward_reply; // writer's reply to forwarded rpc
+	subscription_t *subscription; // notifications the session asked for, NULL if none
+	struct list_head notifications; // connection_notification waiting for output, oldest first
+	size_t notifications_len; // their bytes
 };
 
-static void notify_state(struct ustream *s)
+/* reference to notification shared by all sessions it goes to */
+struct connection_notification
 {
-	struct connection *c = container_of(s, struct connection, us.stream);
-
-	ustream_free(&c->us.stream);
-	close(c->us.fd.fd);
-
-	free(c);
-
-	LOG("connection closed\n");
-}
-
+	struct list_head list;
+	notification_t *n;
+};
 
-static void notify_read(struct ustream *s, int bytes)
+/* session's io_uring requests, outlive it until the kernel is done with them */
+struct connection_uring
 {
-	struct connection *c = container_of(s, struct connection, us.stream);
-
-	char *data, *buf = NULL, *buf1 = NULL, *buf2 = NULL;
-	int data_len, rc;
-
-	DEBUG("starting to read incoming data\n");
-
-	do
-	{
-		data = ustream_get_read_buf(s, &data_len);
-
-		if (!data) break;
+	struct uring_req recv;
+	struct connection *c; // NULL once session is gone
+	int fd;
+	unsigned int requests; // not completed yet
+	bool reading; // multishot recv did not complete yet
+	bool stopping; // recv was cancelled
+	struct list_head chunks; // output, oldest first
+	size_t queued; // bytes of output not sent yet
+	unsigned int sending; // chunks in the chain being sent
+	struct list_head flush; // entry in uring_flush
+};
 
-		switch (c->step)
-		{
-			case NETCONF_MSG_STEP_HELLO:
-				DEBUG("handling hello\n");
+struct connection_chunk
+{
+	struct uring_req req;
+	struct connection_uring *u;
+	struct list_head list;
+	bool sending;
+	size_t len;
+	size_t sent;
+	char data[CONNECTION_READ_BUFFER];
+};
 
-				buf1 = strchr(data, '<');
+/* monotonic time in us */
+static uint64_t connection_now(void)
+{
+	struct timespec ts;
 
-				if (!buf1)
-				{
-					LOG("start of hello message was not found\n");
-					connection_close(s);
-					return;
-				}
+	clock_gettime(CLOCK_MONOTONIC, &ts);
 
-				if (buf1 != data)
-				{
-					LOG("start of hello message not found where expected\n");
-					connection_close(s);
-					return;
-				}
+	return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
 
-				buf2 = strstr(buf1, XML_NETCONF_BASE_1_0_END);
+static void connection_queue(struct connection *c, struct list_head *queue)
+{
+	list_add_tail(&c->run, queue);
+	c->queued = true;
+	uloop_timeout_set(&scheduler, 0);
+}
 
-				if (!buf2)
-				{
-					DEBUG("end of netconf message was not found in this buffer\n");
-					return;
-				}
+/*
+ * connection_guard_arm() - bounds the time writers wait for streamed gets
+ */
+static void connection_guard_arm(void)
+{
+	if (config.reader_timeout && guard_readers && !guard_timer.pending)
+		uloop_timeout_set(&guard_timer, config.reader_timeout);
+}
 
-				*buf2 = '\0';
+/*
+ * connection_guard() - parks session whose rpc would interleave with
+ * a get or edit-config that is only partly done
+ *
+ * Streamed gets read the datastore and spooled edit-configs change it over
+ * several iterations, rpcs on worker threads run next to the uloop thread.
+ * Other rpcs complete in between, so only writes under a reader and
+ * anything touching the datastore under a writer have to wait. Waiting
+ * writers hold off new readers.
+ *
+ * Return: 1 if session was parked, 0 if rpc may run
+ */
+static int connection_guard(struct connection *c)
+{
+	int flags;
 
-				rc = method_analyze_message_hello(buf1, &c->base);
+	if (c->denied || (!c->buf && c->spill_fd < 0))
+		return 0;
 
-				if (rc)
-				{
-					connection_close(s);
-					return;
-				}
+	// only edit-config is applied from a spooled rpc
+	flags = c->spill_fd >= 0 ? METHOD_RPC_WRITE : method_rpc_flags(c->buf, c->buf_len);
 
-				ustream_consume(s, buf2 + strlen(XML_NETCONF_BASE_1_0_END) - data);
+	if (!(flags & (METHOD_RPC_READ | METHOD_RPC_WRITE)))
+		return 0;
 
-				if (c->base)
-					c->step = NETCONF_MSG_STEP_HEADER_1;
-				else
-					c->step = NETCONF_MSG_STEP_HEADER_0;
+	// replica forwards writes, the writer orders them
+	if (upstream && (flags & METHOD_RPC_WRITE))
+		return 0;
 
-				break;
+	if (!guard_writers && !guard_exclusive_count &&
+		!((flags & METHOD_RPC_WRITE) && guard_readers) &&
+		!((flags & METHOD_RPC_READ) && guard_writers_waiting))
+		return 0;
 
-			default:
-				break;
-		}
+	DEBUG("session %" PRIu32 " waits for rpc in progress\n", c->session_id);
 
-		data = ustream_get_read_buf(s, &data_len);
+	if (flags & METHOD_RPC_WRITE)
+	{
+		guard_writers_waiting++;
+		connection_guard_arm();
+	}
 
-		if (!data) break;
+	list_add_tail(&c->run, &guard_wait);
+	c->queued = true;
 
-		switch (c->step)
-		{
-			case NETCONF_MSG_STEP_HEADER_1:
-				DEBUG("handling data header (1.1)\n");
-				buf1 = strchr(data, '#');
+	return 1;
+}
 
-				if (!buf1)
-				{
-					ustream_consume(s, data_len);
-					return;
-				}
+/*
+ * connection_guard_wake() - queues parked sessions once nothing is in progress
+ */
+static void connection_guard_wake(void)
+{
+	struct connection *c, *tmp;
+	void (*exclusive[CONNECTION_EXCLUSIVE_MAX])(void);
+	unsigned int count = guard_exclusive_count;
 
-				buf2 = strstr(buf1, "\n<");
+	if (guard_readers || guard_writers)
+		return;
 
-				if (!buf2)
-				{
-					connection_close(s);
-					return;
-				}
+	uloop_timeout_cancel(&guard_timer);
 
-				*buf1 = ' ';
-				c->msg_len = strtoull(data, NULL, 10);
-				DEBUG("expecting incoming message length: %" PRIu64 "\n", c->msg_len);
+	if (count)
+	{
+		// callbacks may ask to run again
+		memcpy(exclusive, guard_exclusive, sizeof(exclusive));
+		guard_exclusive_count = 0;
 
-				ustream_consume(s, buf2 + 1 - data);
-				c->step = NETCONF_MSG_STEP_DATA_1;
+		for (unsigned int i = 0; i < count; i++)
+			exclusive[i]();
 
-				break;
+		if (!list_empty(&forward_ready))
+			uloop_timeout_set(&forward_timer, 0);
+	}
 
-			case NETCONF_MSG_STEP_HEADER_1_BUF:
-				DEBUG("handling data header buf (1.1)\n");
+	guard_writers_waiting = 0;
 
-				/* FIXME */
-				connection_close(s);
+	if (list_empty(&guard_wait))
+		return;
 
-				break;
+	// they waited already, so they go first
+	list_for_each_entry_safe(c, tmp, &guard_wait, run)
+		list_move_tail(&c->run, &run_high);
 
-			default:
-				break;
-		}
+	uloop_timeout_set(&scheduler, 0);
+}
 
-		data = ustream_get_read_buf(s, &data_len);
+/*
+ * connection_exclusive() - runs cb once no rpc touches the datastore
+ *
+ * New rpcs touching the datastore wait until cb is done. cb waiting
+ * already isn't added again.
+ */
+void connection_exclusive(void (*cb)(void))
+{
+	unsigned int i;
 
-		if (!data) break;
+	for (i = 0; i < guard_exclusive_count && guard_exclusive[i] != cb; i++);
 
-		switch (c->step)
+	if (i == guard_exclusive_count)
+	{
+		if (i == CONNECTION_EXCLUSIVE_MAX)
 		{
-			case NETCONF_MSG_STEP_DATA_1:
-				DEBUG("handling data (1.1)\n");
-
-				if (c->msg_len > (data_len + strlen(XML_NETCONF_BASE_1_1_END)))
-				{
-					c->step = NETCONF_MSG_STEP_DATA_1_BUF;
-					break;
-				}
-
-				if (data_len < strlen(XML_NETCONF_BASE_1_1_END))
-				{
-					/* leftovers from netcat testing */
-					ustream_consume(s, data_len);
-					break;
-				}
+			ERROR("too many callbacks waiting for the datastore\n");
+			return;
+		}
 
-				buf2 = strstr(data, XML_NETCONF_BASE_1_1_END);
+		guard_exclusive[guard_exclusive_count++] = cb;
+	}
 
-				if (!buf2)
-				{
-					connection_close(s);
-					return;
-				}
+	connection_guard_arm();
+	connection_guard_wake();
+}
 
-				*buf2 = '\0';
+int connection_writing(void)
+{
+	return guard_writers > 0;
+}
 
-				DEBUG("received rpc\n\n %s\n\n", data);
-				rc = method_handle_message_rpc(data, &buf);
+/*
+ * connection_pending() - bytes of output not sent yet
+ */
+static size_t connection_pending(struct connection *c)
+{
+	return ustream_pending_data(&c->us.stream, true) + (c->uring ? c->uring->queued : 0) + c->notifications_len;
+}
 
-				if (rc == -1)
-				{
-					/* FIXME */
-					connection_close(s);
-					return;
-				}
+/*
+ * connection_idle() - checks whether session has no rpc in progress and
+ * all replies were sent
+ */
+static int connection_idle(struct connection *c)
+{
+	return !c->working && !c->job && !c->stream && !c->queued && !c->ready && !c->paused &&
+		   !connection_pending(c);
+}
 
-				DEBUG("sending rpc-reply\n\n %s\n\n", buf);
-				ustream_printf(s, "\n#%zu\n%s%s", strlen(buf), buf, XML_NETCONF_BASE_1_1_END);
-				free(buf);
+/*
+ * connection_alloc() - adds read buffer to session, from the pool if
+ * there is one
+ *
+ * ustream frees buffers itself, so pooled ones are plain malloc'd blocks.
+ */
+static int connection_alloc(struct ustream *s, struct ustream_buf_list *l)
+{
+	struct ustream_buf *buf = NULL;
 
-				ustream_consume(s, buf2 + strlen(XML_NETCONF_BASE_1_1_END) - data);
-				c->msg_len = 0;
+	if (buffer_pool && l->buffer_len == CONNECTION_READ_BUFFER)
+	{
+		buf = buffer_pool;
+		buffer_pool = buf->next;
+		buffer_pool_count--;
+	}
+	else
+	{
+		buf = malloc(sizeof(*buf) + l->buffer_len + s->string_data);
+	}
 
-				if (rc == 1)
-				{
-					connection_close(s);
-					return;
-				}
+	if (!buf)
+		return -1;
 
-				if (c->base)
-					c->step = NETCONF_MSG_STEP_HEADER_1;
-				else
-					c->step = NETCONF_MSG_STEP_HEADER_0;
+	memset(buf, 0, sizeof(*buf));
+	buf->data = buf->tail = buf->head;
+	buf->end = buf->head + l->buffer_len;
+	*buf->head = '\0';
 
-				break;
+	if (l->tail)
+		l->tail->next = buf;
+	else
+		l->head = buf;
 
-			case NETCONF_MSG_STEP_DATA_1_BUF:
-				DEBUG("handling data buf (1.1)\n");
+	l->tail = buf;
 
-				/* FIXME */
-				connection_close(s);
+	if (!l->data_tail)
+		l->data_tail = l->head;
 
-				break;
+	l->buffers++;
 
-			default:
-				break;
-		}
-	}
-	while (1);
+	return 0;
 }
 
-static void connection_accept_cb(struct uloop_fd *fd, unsigned int events)
+static void connection_release_buffers(struct ustream_buf_list *l, bool pool)
 {
-	struct connection *c;
-	unsigned int sl = sizeof(struct sockaddr_in);
-	int sfd, rc;
-	char *hello_message = NULL;
+	struct ustream_buf *buf, *next;
 
-	LOG("received new connection\n");
-
-	if (!next_connection)
+	for (buf = l->head; buf; buf = next)
 	{
-		next_connection = calloc(1, sizeof(*next_connection));
-	}
+		next = buf->next;
 
-	if (!next_connection)
-	{
-		ERROR("not enough memory to accept connection\n");
-		return;
+		if (pool && buffer_pool_count < config.buffer_pool && buf->end - buf->head == CONNECTION_READ_BUFFER)
+		{
+			buf->next = buffer_pool;
+			buffer_pool = buf;
+			buffer_pool_count++;
+		}
+		else
+		{
+			free(buf);
+		}
 	}
 
-	c = next_connection;
-	sfd = accept(server.fd, (struct sockaddr *) &c->sin, &sl);
+	// as after ustream_fd_init(), buffers are allocated on demand
+	l->head = l->data_tail = l->tail = NULL;
+	l->buffers = 0;
+}
 
-	if (sfd < 0)
-	{
-		ERROR("failed accepting connection\n");
-		return;
-	}
+/*
+ * connection_shrink() - frees buffers of quiet session
+ *
+ * Only buffers holding no data are freed. A partial rpc is kept, it lives
+ * in the session's own buffer.
+ */
+static void connection_shrink(struct connection *c)
+{
+	struct ustream *s = &c->us.stream;
 
-	DEBUG("configuring connection parameters\n");
+	if (!s->r.data_bytes && s->r.head)
+		connection_release_buffers(&s->r, true);
 
-	c->us.stream.string_data = true;
-	c->us.stream.notify_read = notify_read;
-	c->us.stream.notify_state = notify_state;
-	c->us.stream.r.buffer_len = 16384;
-	c->step = NETCONF_MSG_STEP_HELLO;
+	if (!s->w.data_bytes && s->w.head)
+		connection_release_buffers(&s->w, false);
+}
 
-	DEBUG("crafting hello message\n");
-	rc = method_create_message_hello(&hello_message);
+static void connection_shrink_cb(struct wheel_timer *t)
+{
+	struct connection *c = container_of(t, struct connection, shrink);
+	uint64_t now = connection_now(), deadline = c->active + (uint64_t) config.buffer_release * 1000;
 
-	if (rc)
+	if (!connection_idle(c) || now < deadline)
 	{
-		ERROR("failed to create hello message\n");
-		close(sfd);
+		wheel_timer_set(t, connection_idle(c) ? (deadline - now) / 1000 : config.buffer_release);
 		return;
 	}
 
-	ustream_fd_init(&c->us, sfd);
-	next_connection = NULL;
+	DEBUG("session %" PRIu32 " quiet, freeing its buffers\n", c->session_id);
 
-	DEBUG("sending hello message\n");
-	ustream_printf(&c->us.stream, "%s%s", hello_message, XML_NETCONF_BASE_1_0_END);
-	free(hello_message);
+	connection_shrink(c);
 }
 
-static void
-connection_close(struct ustream *s)
+/*
+ * connection_memory() - bytes held by session
+ */
+static size_t connection_memory(struct connection *c)
 {
-	struct connection *c = container_of(s, struct connection, us.stream);
+	struct ustream *s = &c->us.stream;
+	struct connection_notification *cn;
+	struct ustream_buf *buf;
+	size_t size = sizeof(*c) + c->buf_size;
 
-	char *data;
-	int data_len;
+	for (buf = s->r.head; buf; buf = buf->next)
+		size += sizeof(*buf) + (buf->end - buf->head) + s->string_data;
 
-	data = ustream_get_read_buf(s, &data_len);
+	for (buf = s->w.head; buf; buf = buf->next)
+		size += sizeof(*buf) + (buf->end - buf->head) + s->string_data;
 
-	if (data)
-	{
-		ustream_consume(s, data_len);
-	}
+	if (c->stream_buf)
+		size += config.reply_chunk;
 
-	ustream_set_read_blocked(s, true);
+	if (c->uring)
+		size += sizeof(*c->uring) + c->uring->queued;
 
-	close(c->us.fd.fd);
+	// notifications themselves are shared
+	list_for_each_entry(cn, &c->notifications, list)
+		size += sizeof(*cn);
 
-	LOG("closing connection\n");
+	return size;
 }
 
-int
-server_init()
+static void connection_free(struct connection *c)
 {
-	server.fd = usock(USOCK_TCP | USOCK_SERVER, config.addr, config.port);
+	struct connection_notification *cn, *tmp;
 
-	if (server.fd < 0)
+	list_for_each_entry_safe(cn, tmp, &c->notifications, list)
 	{
-		ERROR("unable to open socket %s:%s\n", config.addr, config.port);
-		return -1;
+		notification_unref(cn->n);
+		free(cn);
 	}
 
-	uloop_fd_add(&server, ULOOP_READ);
+	subscription_free(c->subscription);
+	push_closed(c->session_id);
+	method_stream_free(c->stream);
+	method_job_free(c->job);
+	free(c->stream_buf);
+	free(c->stream_error);
+	free(c->buf);
+	free(c->forward_reply);
 
-	return 0;
+	if (c->spill_fd >= 0)
+		close(c->spill_fd);
+
+	free(c);
+}
+
+/*
+ * connection_hash() - adds session to the session table
+ *
+ * Ids are handed out in sequence, so the low bits spread them evenly.
+ * Table doubles once there are more sessions than buckets.
+ */
+static int connection_hash(struct connection *c)
+{
+	struct list_head *hash;
+	struct connection *cur, *tmp;
+	unsigned int size = session_hash_size ? session_hash_size * 2 : CONNECTION_HASH_MIN;
+
+	if (session_count >= session_hash_size && (hash = malloc(size * sizeof(*hash))))
+	{
+		for (unsigned int i = 0; i < size; i++)
+			INIT_LIST_HEAD(&hash[i]);
+
+		for (unsigned int i = 0; i < session_hash_size; i++)
+		{
+			list_for_each_entry_safe(cur, tmp, &session_hash[i], hash)
+				list_move(&cur->hash, &hash[cur->session_id & (size - 1)]);
+		}
+
+		free(session_hash);
+		session_hash = hash;
+		session_hash_size = size;
+	}
+
+	// longer chains if it could not grow
+	if (!session_hash)
+		return -1;
+
+	list_add(&c->hash, &session_hash[c->session_id & (session_hash_size - 1)]);
+	session_count++;
+
+	return 0;
+}
+
+static void connection_unhash(struct connection *c)
+{
+	if (list_empty(&c->hash))
+		return;
+
+	list_del_init(&c->hash);
+	session_count--;
+}
+
+static struct connection *connection_find(uint32_t id)
+{
+	struct connection *c;
+
+	if (!session_hash)
+		return NULL;
+
+	list_for_each_entry(c, &session_hash[id & (session_hash_size - 1)], hash)
+	{
+		if (c->session_id == id)
+			return c;
+	}
+
+	return NULL;
+}
+
+static void connection_mux_init(struct connection *c);
+static void connection_tls_init(struct connection *c, int fd);
+static void connection_uring_init(struct connection *c, int fd);
+static void connection_mux_detach(struct connection *c);
+static void connection_uring_detach(struct connection *c);
+static void connection_notify_write(struct connection *c);
+
+/*
+ * connection_close_fds() - closes session's descriptors, or its channel
+ */
+static void connection_close_fds(struct connection *c)
+{
+	if (c->mux)
+		connection_mux_detach(c);
+
+	if (c->tls)
+	{
+		uloop_fd_delete(&c->us.fd);
+		tls_free(c->tls);
+		c->tls = NULL;
+	}
+
+	if (c->uring)
+		connection_uring_detach(c);
+
+	if (c->us.fd.fd >= 0)
+		close(c->us.fd.fd);
+
+	if (c->out.fd >= 0)
+	{
+		uloop_fd_delete(&c->out);
+		close(c->out.fd);
+	}
+
+	if (c->front >= 0)
+		close(c->front);
+}
+
+static void notify_state(struct ustream *s)
+{
+	struct connection *c = container_of(s, struct connection, us.stream);
+
+	list_del(&c->list);
+	connection_unhash(c);
+	wheel_timer_cancel(&c->timer);
+	wheel_timer_cancel(&c->shrink);
+	wheel_timer_cancel(&c->stall);
+
+	if (c->queued)
+		list_del(&c->run);
+
+	ustream_free(&c->us.stream);
+	connection_close_fds(c);
+
+	if (c->stream_guard)
+		guard_readers--;
+
+	if (c->job)
+		guard_writers--;
+
+	if (c->control)
+		replicas_lost(c->replica);
+
+	if (c->upstream)
+	{
+		ERROR("connection to writer closed\n");
+		upstream = NULL;
+		forward_pump = NULL;
+		uloop_end();
+	}
+
+	// worker or writer still has the rpc, connection_work_done() or
+	// connection_forward_deliver() frees it
+	if (c->working)
+		c->closed = true;
+	else
+		connection_free(c);
+
+	connection_guard_wake();
+
+	LOG("connection closed\n");
+}
+
+/*
+ * connection_kill() - closes session, its rpc in progress is abandoned
+ *
+ * Return: 0 on success, -1 if there is no such session or it is the one
+ * asking
+ */
+int connection_kill(uint32_t id)
+{
+	struct connection *c = connection_find(id);
+
+	if (!c || c == handling)
+		return -1;
+
+	LOG("session %" PRIu32 " killed\n", id);
+
+	notify_state(&c->us.stream);
+
+	return 0;
+}
+
+/*
+ * connection_arm() - starts hello or idle timeout of session
+ */
+static void connection_arm(struct connection *c)
+{
+	unsigned int ms = c->step == NETCONF_MSG_STEP_HELLO ? config.hello_timeout : config.idle_timeout;
+
+	if (ms)
+		wheel_timer_set(&c->timer, ms);
+	else
+		wheel_timer_cancel(&c->timer);
+}
+
+static void connection_timeout(struct wheel_timer *t)
+{
+	struct connection *c = container_of(t, struct connection, timer);
+	uint64_t now = connection_now(), deadline;
+	int ms;
+
+	if (c->closing)
+	{
+		deadline = c->active + CONNECTION_LINGER_MS * 1000;
+
+		if (connection_pending(c) && now < deadline)
+		{
+			wheel_timer_set(t, (deadline - now) / 1000);
+			return;
+		}
+
+		notify_state(&c->us.stream);
+		return;
+	}
+
+	if (c->step == NETCONF_MSG_STEP_HELLO)
+	{
+		LOG("session %" PRIu32 " sent no hello, closing it\n", c->session_id);
+		notify_state(&c->us.stream);
+		return;
+	}
+
+	// subscriber waits for notifications, being quiet is expected, the
+	// timer only ends its subscription at stopTime
+	if (c->subscription && !subscription_done(c->subscription))
+	{
+		connection_notify_write(c);
+
+		// due one waits for its replay or a streamed reply
+		if ((ms = subscription_timeout(c->subscription)) >= 0)
+			wheel_timer_set(t, ms ? ms : 1000);
+
+		return;
+	}
+
+	// so do sessions with yang-push subscriptions
+	if (push_subscribed(c->session_id))
+	{
+		if (config.idle_timeout)
+			wheel_timer_set(t, config.idle_timeout);
+
+		return;
+	}
+
+	// activity is only noted, the timer catches up when it runs out
+	deadline = c->active + (uint64_t) config.idle_timeout * 1000;
+
+	if (!connection_idle(c) || now < deadline)
+	{
+		wheel_timer_set(t, connection_idle(c) ? (deadline - now) / 1000 : config.idle_timeout);
+		return;
+	}
+
+	LOG("session %" PRIu32 " idle, closing it\n", c->session_id);
+	notify_state(&c->us.stream);
+}
+
+/*
+ * connection_stall_arm() - starts watching output not sent yet
+ *
+ * A client that stops reading its replies is caught here, reading its
+ * rpcs stopped already.
+ */
+static void connection_stall_arm(struct connection *c)
+{
+	if (!config.output_timeout || c->stall.pending || !connection_pending(c))
+		return;
+
+	c->written = connection_now();
+	wheel_timer_set(&c->stall, config.output_timeout);
+}
+
+static void connection_stall_cb(struct wheel_timer *t)
+{
+	struct connection *c = container_of(t, struct connection, stall);
+	uint64_t now = connection_now(), deadline = c->written + (uint64_t) config.output_timeout * 1000;
+
+	if (!connection_pending(c))
+		return;
+
+	if (now < deadline)
+	{
+		wheel_timer_set(t, (deadline - now) / 1000);
+		return;
+	}
+
+	LOG("session %" PRIu32 " doesn't read its output, closing it\n", c->session_id);
+	notify_state(&c->us.stream);
+}
+
+/*
+ * connection_notify_fd() - socket notifications may be written to directly,
+ * -1 if output goes through a stream of its own
+ */
+static int connection_notify_fd(struct connection *c)
+{
+	if (c->mux || c->tls || c->uring || c->out.fd >= 0)
+		return -1;
+
+	return c->us.fd.fd;
+}
+
+static int connection_notify_queue(struct connection *c, notification_t *n, bool first)
+{
+	struct connection_notification *cn = malloc(sizeof(*cn));
+
+	if (!cn)
+	{
+		ERROR("not enough memory\n");
+		return -1;
+	}
+
+	cn->n = notification_ref(n);
+	c->notifications_len += n->len;
+
+	if (first)
+		list_add(&cn->list, &c->notifications);
+	else
+		list_add_tail(&cn->list, &c->notifications);
+
+	connection_stall_arm(c);
+
+	return 0;
+}
+
+/*
+ * connection_notify_next() - queues what the subscription itself has to
+ * send, replayed notifications ahead of live ones queued meanwhile
+ *
+ * Return: 1 if output has to drain before replay goes on, 0 otherwise
+ */
+static int connection_notify_next(struct connection *c)
+{
+	notification_t *n;
+
+	if (!c->subscription)
+		return 0;
+
+	if (subscription_replaying(c->subscription))
+	{
+		// notify_write() calls again as the stream drains
+		if (connection_pending(c) > config.output_low)
+			return 1;
+
+		if ((n = subscription_replay(c->subscription)))
+		{
+			connection_notify_queue(c, n, true);
+			notification_unref(n);
+		}
+	}
+	else if ((n = subscription_complete(c->subscription)))
+	{
+		DEBUG("session %" PRIu32 " reached stopTime\n", c->session_id);
+		connection_notify_queue(c, n, false);
+		notification_unref(n);
+	}
+
+	return 0;
+}
+
+/*
+ * connection_notify_write() - writes queued notifications between replies
+ *
+ * Nothing goes into a reply being streamed. Plain sockets are written from
+ * the shared buffer once earlier output is sent, only what the socket does
+ * not take right away is copied to the session's stream. Other transports
+ * copy it all. Replicas get stream name and time ahead of every
+ * notification.
+ */
+static void connection_notify_write(struct connection *c)
+{
+	struct ustream *s = &c->us.stream;
+	struct connection_notification *cn;
+	char head[sizeof("\n#\n" NOTIFICATION_FORWARD " ?>") + 2 * 20 + NOTIFICATION_STREAM_MAX];
+	struct iovec iov[2];
+	struct msghdr msg = { .msg_iov = iov, .msg_iovlen = 2 };
+	int fd = connection_notify_fd(c);
+	ssize_t written;
+	size_t skip;
+	int len;
+
+	while (!c->stream)
+	{
+		// notify_write() calls again once the stream is empty
+		if (fd >= 0 && ustream_pending_data(s, true))
+			return;
+
+		// replayed notification is queued first and written right away
+		if (connection_notify_next(c) || list_empty(&c->notifications))
+			return;
+
+		cn = list_first_entry(&c->notifications, struct connection_notification, list);
+
+		iov[0].iov_base = head;
+		iov[0].iov_len = 0;
+		iov[1].iov_base = cn->n->data;
+		iov[1].iov_len = cn->n->len;
+
+		if (c->control)
+		{
+			len = snprintf(NULL, 0, NOTIFICATION_FORWARD "%s %" PRIu64 "?>", cn->n->stream, cn->n->time);
+			iov[0].iov_len = snprintf(head, sizeof(head), "\n#%d\n" NOTIFICATION_FORWARD "%s %" PRIu64 "?>",
+									  len, cn->n->stream, cn->n->time);
+		}
+
+		written = fd >= 0 ? sendmsg(fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL) : 0;
+
+		// errors are left to the stream, it writes the rest
+		if (written < 0)
+			written = 0;
+
+		if ((size_t) written < iov[0].iov_len)
+			ustream_write(s, head + written, iov[0].iov_len - written, true);
+
+		skip = (size_t) written > iov[0].iov_len ? written - iov[0].iov_len : 0;
+
+		if (skip < cn->n->len)
+			ustream_write(s, cn->n->data + skip, cn->n->len - skip, false);
+
+		list_del(&cn->list);
+		c->notifications_len -= cn->n->len;
+		notification_unref(cn->n);
+		free(cn);
+		connection_stall_arm(c);
+	}
+}
+
+void connection_notify(notification_t *n)
+{
+	struct connection *c;
+
+	list_for_each_entry(c, &connections, list)
+	{
+		if (c->closing || !(c->control || (c->subscription && subscription_match(c->subscription, n))))
+			continue;
+
+		// slow subscriber misses notifications instead of holding memory
+		if (config.max_output && connection_pending(c) + n->len > config.max_output)
+		{
+			LOG("session %" PRIu32 " output over %u bytes, dropping notification\n", c->session_id, config.max_output);
+			continue;
+		}
+
+		if (!connection_notify_queue(c, n, false))
+			connection_notify_write(c);
+	}
+}
+
+int connection_subscribe(subscription_t *s)
+{
+	int ms;
+
+	// subscription that reached its stopTime makes way for a new one
+	if (!handling || handling->control || (handling->subscription && !subscription_done(handling->subscription)))
+		return -1;
+
+	DEBUG("session %" PRIu32 " subscribed\n", handling->session_id);
+
+	subscription_free(handling->subscription);
+	handling->subscription = s;
+
+	// replay starts once the reply is out
+	if ((ms = subscription_timeout(s)) >= 0)
+		wheel_timer_set(&handling->timer, ms);
+
+	return 0;
+}
+
+/*
+ * connection_stream_unguard() - lets writers in while the stream goes on
+ */
+static void connection_stream_unguard(struct connection *c)
+{
+	if (!c->stream_guard)
+		return;
+
+	c->stream_guard = false;
+	guard_readers--;
+	connection_guard_wake();
+}
+
+/*
+ * connection_stream_free() - drops streamed reply, releases its readers guard
+ */
+static void connection_stream_free(struct connection *c)
+{
+	method_stream_free(c->stream);
+	c->stream = NULL;
+	free(c->stream_buf);
+	c->stream_buf = NULL;
+	free(c->stream_error);
+	c->stream_error = NULL;
+
+	connection_stream_unguard(c);
+}
+
+/*
+ * connection_stream_end() - ends data of streamed reply at a tag boundary
+ *
+ * Open elements get closed, error follows the data. Closing them doesn't
+ * read the datastore, so writers don't wait for it.
+ *
+ * Return: 0 on success, -1 if the reply can't be completed
+ */
+static int connection_stream_end(struct connection *c, char *error)
+{
+	if (!error)
+		return -1;
+
+	c->stream_error = error;
+
+	if (method_stream_end(c->stream))
+		return -1;
+
+	connection_stream_unguard(c);
+
+	return 0;
+}
+
+/*
+ * connection_guard_cb() - ends streamed gets writers waited for too long
+ *
+ * Streamed get goes as fast as its client reads, a slow one would hold
+ * edits off for as long as it likes. Gets on worker threads finish on
+ * their own.
+ */
+static void connection_guard_cb(struct uloop_timeout *t)
+{
+	struct connection *c;
+	char *error;
+
+	if (!guard_writers_waiting && !guard_exclusive_count)
+		return;
+
+	list_for_each_entry(c, &connections, list)
+	{
+		if (!c->stream_guard)
+			continue;
+
+		LOG("session %" PRIu32 " streamed reply holds edits off, stopping it\n", c->session_id);
+		error = netconf_rpc_error("get stopped for a waiting edit", RPC_ERROR_TAG_IN_USE, RPC_ERROR_TYPE_APPLICATION, RPC_ERROR_SEVERITY_ERROR, NULL);
+
+		if (connection_stream_end(c, error))
+		{
+			ERROR("session %" PRIu32 " streamed reply broken, closing\n", c->session_id);
+			connection_stream_free(c);
+			connection_close(&c->us.stream);
+			continue;
+		}
+
+		// rest of the reply goes out as the client reads it
+		if (!c->queued)
+			connection_queue(c, &run_normal);
+	}
+
+	connection_guard_arm();
+}
+
+/*
+ * connection_stream() - sends streamed reply while it fits the reply window
+ *
+ * Return: 1 if there is more to send, 0 when the reply is done
+ */
+static int connection_stream(struct connection *c)
+{
+	struct ustream *s = &c->us.stream;
+	uint64_t start = connection_now();
+	char *error;
+	size_t size;
+	ssize_t len;
+
+	if (!c->stream_buf && !(c->stream_buf = malloc(config.reply_chunk)))
+	{
+		ERROR("not enough memory\n");
+		c->stream_error = netconf_rpc_error("not enough memory", RPC_ERROR_TAG_OPERATION_FAILED, RPC_ERROR_TYPE_APPLICATION, RPC_ERROR_SEVERITY_ERROR, NULL);
+		goto done;
+	}
+
+	while (ustream_pending_data(s, true) < config.reply_window)
+	{
+		// other sessions get a turn, the scheduler continues the stream
+		if (config.rpc_slice_us && connection_now() - start >= config.rpc_slice_us)
+		{
+			if (!c->queued)
+				connection_queue(c, &run_normal);
+
+			return 1;
+		}
+
+		size = config.reply_chunk;
+
+		// data stops at the limit and is completed from there
+		if (config.max_reply_size && !c->stream_error)
+		{
+			if (c->stream_sent >= config.max_reply_size)
+			{
+				LOG("session %" PRIu32 " reply over %u bytes, stopping it\n", c->session_id, config.max_reply_size);
+				error = netconf_rpc_error("reply too big", RPC_ERROR_TAG_RESOURCE_DENIED, RPC_ERROR_TYPE_APPLICATION, RPC_ERROR_SEVERITY_ERROR, NULL);
+
+				if (connection_stream_end(c, error))
+					goto drop;
+
+				continue;
+			}
+
+			if (size > config.max_reply_size - c->stream_sent)
+				size = config.max_reply_size - c->stream_sent;
+		}
+
+		len = method_stream_read(c->stream, c->stream_buf, size);
+
+		if (!len)
+			goto done;
+
+		if (len < 0)
+		{
+			if (c->stream_error)
+				goto drop;
+
+			error = netconf_rpc_error("datastore changed during get", RPC_ERROR_TAG_OPERATION_FAILED, RPC_ERROR_TYPE_APPLICATION, RPC_ERROR_SEVERITY_ERROR, NULL);
+
+			if (connection_stream_end(c, error))
+				goto drop;
+
+			continue;
+		}
+
+		c->stream_sent += len;
+
+		ustream_printf(s, "\n#%zd\n", len);
+		ustream_write(s, c->stream_buf, len, false);
+	}
+
+	connection_stall_arm(c);
+
+	return 1;
+
+done:
+	error = c->stream_error;
+
+	// data is complete, error follows it
+	ustream_printf(s, "\n#%zu\n</data>%s%s%s%s%s",
+				   strlen("</data>") + (error ? strlen("<rpc-error></rpc-error>") + strlen(error) : 0) + strlen(c->stream->tail),
+				   error ? "<rpc-error>" : "", error ? error : "", error ? "</rpc-error>" : "",
+				   c->stream->tail, XML_NETCONF_BASE_1_1_END);
+
+	connection_stream_free(c);
+
+	DEBUG("streamed rpc-reply sent\n");
+
+	connection_notify_write(c);
+
+	return 0;
+
+drop:
+	// reply can't be completed, client must not take part of it as whole
+	ERROR("session %" PRIu32 " streamed reply broken, closing\n", c->session_id);
+
+	connection_stream_free(c);
+	connection_close(s);
+
+	return 1;
+}
+
+/*
+ * connection_pause() - stops reading rpcs while output is over high watermark
+ *
+ * Return: 1 if reading was stopped, 0 otherwise
+ */
+static int connection_pause(struct connection *c)
+{
+	struct ustream *s = &c->us.stream;
+
+	// writer would wait for the replica reading replies, never stop it
+	if (c->upstream)
+		return 0;
+
+	if (!c->paused && connection_pending(c) < config.output_high)
+		return 0;
+
+	if (!c->paused)
+		DEBUG("session %" PRIu32 " output over high watermark, pausing\n", c->session_id);
+
+	c->paused = true;
+	ustream_set_read_blocked(s, true);
+
+	return 1;
+}
+
+static void notify_read(struct ustream *s, int bytes);
+
+static void notify_write(struct ustream *s, int bytes)
+{
+	struct connection *c = container_of(s, struct connection, us.stream);
+
+	// scheduler continuing a stream calls with 0
+	if (bytes > 0)
+		c->written = connection_now();
+
+	if (c->stream && connection_stream(c))
+		return;
+
+	// rest of spooled rpc goes out as the writer reads it
+	if (c->upstream && forward_pump && !connection_forward_pump())
+		connection_forward_send();
+
+	connection_notify_write(c);
+
+	if (!c->paused || connection_pending(c) > config.output_low)
+		return;
+
+	DEBUG("session %" PRIu32 " output under low watermark, resuming\n", c->session_id);
+
+	// continue with rpcs already received, nothing new while retiring
+	c->paused = false;
+	ustream_set_read_blocked(s, retiring && !c->control);
+	notify_read(s, 0);
+}
+
+static int connection_write_all(int fd, const char *data, size_t len)
+{
+	ssize_t written;
+
+	while (len)
+	{
+		written = write(fd, data, len);
+
+		if (written < 0)
+		{
+			if (errno == EINTR)
+				continue;
+
+			return -1;
+		}
+
+		data += written;
+		len -= written;
+	}
+
+	return 0;
+}
+
+/*
+ * connection_spill() - moves rpc received so far to a temporary file
+ */
+static int connection_spill(struct connection *c)
+{
+	char *path = NULL;
+	int rc;
+
+	if (asprintf(&path, "%s/freenetconfd-XXXXXX", config.ingest_dir) < 0)
+		return -1;
+
+	c->spill_fd = mkostemp(path, O_CLOEXEC);
+
+	if (c->spill_fd < 0)
+	{
+		ERROR("unable to create '%s'\n", path);
+		free(path);
+		return -1;
+	}
+
+	// file is removed once the descriptor is closed
+	unlink(path);
+	free(path);
+
+	DEBUG("spooling rpc to file\n");
+
+	rc = connection_write_all(c->spill_fd, c->buf, c->buf_len);
+
+	free(c->buf);
+	c->buf = NULL;
+	c->buf_len = c->buf_size = 0;
+
+	return rc;
+}
+
+/*
+ * connection_keep_head() - drops all but the beginning of rpc being received
+ */
+static void connection_keep_head(struct connection *c)
+{
+	ssize_t len;
+
+	if (c->spill_fd >= 0)
+	{
+		free(c->buf);
+		c->buf = malloc(CONNECTION_HEAD_SIZE + 1);
+		c->buf_len = c->buf_size = 0;
+
+		if (c->buf && (len = pread(c->spill_fd, c->buf, CONNECTION_HEAD_SIZE, 0)) >= 0)
+		{
+			c->buf_len = len;
+			c->buf_size = CONNECTION_HEAD_SIZE + 1;
+			c->buf[len] = '\0';
+		}
+		else
+		{
+			free(c->buf);
+			c->buf = NULL;
+		}
+
+		close(c->spill_fd);
+		c->spill_fd = -1;
+	}
+	else if (c->buf_len > CONNECTION_HEAD_SIZE)
+	{
+		c->buf_len = CONNECTION_HEAD_SIZE;
+		c->buf[c->buf_len] = '\0';
+
+		char *buf = realloc(c->buf, CONNECTION_HEAD_SIZE + 1);
+
+		if (buf)
+		{
+			c->buf = buf;
+			c->buf_size = CONNECTION_HEAD_SIZE + 1;
+		}
+	}
+}
+
+/*
+ * connection_rate() - takes one rpc from the session's max_rpc_rate bucket
+ *
+ * Return: 0 if rpc may be handled, -1 if rate is exceeded
+ */
+static int connection_rate(struct connection *c)
+{
+	uint64_t now, elapsed, burst = (uint64_t) config.max_rpc_rate * 1000000;
+
+	if (!config.max_rpc_rate)
+		return 0;
+
+	now = connection_now();
+	elapsed = now - c->rate_time;
+	c->rate_time = now;
+
+	// rate per second is rate millionths per us, nothing is lost to
+	// rounding however close rpcs are, first rpc finds the bucket full
+	if (elapsed >= 1000000)
+		c->rate_tokens = burst;
+	else
+		c->rate_tokens += elapsed * config.max_rpc_rate;
+
+	if (c->rate_tokens > burst)
+		c->rate_tokens = burst;
+
+	if (c->rate_tokens < 1000000)
+		return -1;
+
+	c->rate_tokens -= 1000000;
+
+	return 0;
+}
+
+/*
+ * connection_append() - adds chunk data to rpc being received
+ */
+static int connection_append(struct connection *c, const char *data, size_t len)
+{
+	if (c->denied)
+	{
+		if (c->buf_len >= CONNECTION_HEAD_SIZE)
+			return 0;
+
+		if (len > CONNECTION_HEAD_SIZE - c->buf_len)
+			len = CONNECTION_HEAD_SIZE - c->buf_len;
+	}
+	else if (c->spill_fd < 0 && config.ingest_spill && c->buf_len + len > config.ingest_spill &&
+			 connection_spill(c))
+	{
+		return -1;
+	}
+
+	if (c->spill_fd >= 0)
+		return connection_write_all(c->spill_fd, data, len);
+
+	if (c->buf_len + len + 1 > c->buf_size)
+	{
+		size_t size = c->buf_size ? c->buf_size : 4096;
+
+		while (c->buf_len + len + 1 > size)
+			size *= 2;
+
+		char *buf = realloc(c->buf, size);
+
+		if (!buf)
+			return -1;
+
+		c->buf = buf;
+		c->buf_size = size;
+	}
+
+	memcpy(c->buf + c->buf_len, data, len);
+	c->buf_len += len;
+	c->buf[c->buf_len] = '\0';
+
+	return 0;
+}
+
+/*
+ * connection_header() - parses chunk header one character at a time
+ *
+ * Headers are "\n#<chunk-size>\n" and "\n##\n" at the end of message.
+ *
+ * Return: 0 if more is needed, 1 for chunk, 2 for end of message, -1 on error
+ */
+static int connection_header(struct connection *c, char ch)
+{
+	char *end;
+
+	// line feeds and leftovers from netcat testing
+	if (!c->header_len && ch != '#')
+		return 0;
+
+	if (ch != '\n')
+	{
+		if (c->header_len == sizeof(c->header) - 1)
+			return -1;
+
+		c->header[c->header_len++] = ch;
+		return 0;
+	}
+
+	c->header[c->header_len] = '\0';
+	c->header_len = 0;
+
+	if (!strcmp(c->header, "##"))
+		return 2;
+
+	/* RFC: http://tools.ietf.org/html/rfc6242#section-4.2 */
+	if (c->header[1] < '1' || c->header[1] > '9')
+		return -1;
+
+	c->msg_len = strtoull(c->header + 1, &end, 10);
+
+	if (*end || c->msg_len > 4294967295ULL)
+		return -1;
+
+	DEBUG("expecting chunk of %" PRIu64 " bytes\n", c->msg_len);
+
+	return 1;
+}
+
+/*
+ * connection_reply() - sends reply of handled rpc
+ *
+ * Return: 1 if reading should stop, 0 otherwise
+ */
+static int connection_reply(struct connection *c, int rc, char *buf)
+{
+	struct ustream *s = &c->us.stream;
+
+	if (rc == -1)
+	{
+		/* FIXME */
+		free(buf);
+		connection_close(s);
+		return 1;
+	}
+
+	// replica applies the snapshot before it delivers the reply
+	if (c->control)
+		replicas_publish();
+
+	if (c->stream)
+	{
+		DEBUG("streaming rpc-reply\n");
+		guard_readers++;
+		c->stream_guard = true;
+		c->stream_sent = strlen(c->stream->head);
+		ustream_printf(s, "\n#%zu\n%s", strlen(c->stream->head), c->stream->head);
+	}
+	else
+	{
+		DEBUG("sending rpc-reply\n\n %s\n\n", buf);
+		ustream_printf(s, "\n#%zu\n%s%s", strlen(buf), buf, XML_NETCONF_BASE_1_1_END);
+		free(buf);
+	}
+
+	if (rc == 1)
+	{
+		connection_close(s);
+		return 1;
+	}
+
+	connection_stall_arm(c);
+
+	// replay of a new subscription follows its reply
+	connection_notify_write(c);
+
+	// replies go out in order, wait for the stream before reading on
+	if (c->stream && connection_stream(c))
+	{
+		c->paused = true;
+		ustream_set_read_blocked(s, true);
+		return 1;
+	}
+
+	return 0;
+}
+
+/*
+ * connection_job() - runs time slice of rpc handled in slices
+ *
+ * Return: 1 if reading should stop, 0 otherwise
+ */
+static int connection_job(struct connection *c)
+{
+	char *buf = NULL;
+	int rc = method_job_run(c->job, config.rpc_slice_us, &buf);
+
+	if (rc == 1)
+	{
+		// other sessions get a turn, the scheduler continues the job
+		connection_queue(c, &run_normal);
+		return 1;
+	}
+
+	method_job_free(c->job);
+	c->job = NULL;
+	guard_writers--;
+	connection_guard_wake();
+
+	return connection_reply(c, rc, buf);
+}
+
+static int connection_finish_rpc(struct connection *c, int rc, char *buf, char *error);
+
+static void connection_work_run(worker_job_t *job)
+{
+	struct connection *c = container_of(job, struct connection, work.job);
+
+	DEBUG("received rpc\n\n %s\n\n", c->buf);
+	c->work.rc = method_handle_message_rpc_stream(c->buf, &c->work.out, &c->work.stream);
+}
+
+/*
+ * connection_work_done() - sends reply of rpc handled by a worker thread
+ */
+static void connection_work_done(worker_job_t *job)
+{
+	struct connection *c = container_of(job, struct connection, work.job);
+
+	c->working = false;
+
+	if (c->work.flags & METHOD_RPC_WRITE)
+		guard_writers--;
+	else
+		guard_readers--;
+
+	if (c->closed)
+	{
+		free(c->work.out);
+		method_stream_free(c->work.stream);
+		connection_free(c);
+	}
+	else
+	{
+		c->stream = c->work.stream;
+
+		// continue with rpcs received meanwhile
+		if (!connection_finish_rpc(c, c->work.rc, c->work.out, NULL))
+			notify_read(&c->us.stream, 0);
+	}
+
+	connection_guard_wake();
+}
+
+/*
+ * connection_work() - hands rpc over to a worker thread
+ *
+ * Session reads nothing more until the reply is sent, so replies stay in
+ * order while rpcs of different sessions run in parallel.
+ *
+ * Return: 1, reading stops
+ */
+static int connection_work(struct connection *c, int flags)
+{
+	c->work.job.run = connection_work_run;
+	c->work.job.done = connection_work_done;
+	c->work.flags = flags;
+	c->work.out = NULL;
+	c->work.stream = NULL;
+	c->working = true;
+
+	if (flags & METHOD_RPC_WRITE)
+		guard_writers++;
+	else
+		guard_readers++;
+
+	workers_submit(&c->work.job);
+
+	return 1;
+}
+
+/*
+ * connection_forward_pump() - sends spooled rpc to the writer while it fits
+ * the reply window
+ *
+ * Rpc goes out in chunks read from the spool file, so the replica never
+ * holds it in memory.
+ *
+ * Return: 1 if there is more to send, 0 when the rpc is sent
+ */
+static int connection_forward_pump(void)
+{
+	struct ustream *s = &upstream->us.stream;
+	struct connection *c = forward_pump;
+	ssize_t len;
+
+	while (ustream_pending_data(s, true) < config.reply_window)
+	{
+		len = pread(c->spill_fd, forward_buf, sizeof(forward_buf), c->forward_off);
+
+		if (len < 0 && errno == EINTR)
+			continue;
+
+		// writer can't parse a cut rpc, it answers with an error
+		if (len < 0)
+			ERROR("unable to read spooled rpc\n");
+
+		if (len <= 0)
+		{
+			ustream_printf(s, "%s", XML_NETCONF_BASE_1_1_END);
+			forward_pump = NULL;
+
+			return 0;
+		}
+
+		c->forward_off += len;
+
+		ustream_printf(s, "\n#%zd\n", len);
+		ustream_write(s, forward_buf, len, false);
+	}
+
+	return 1;
+}
+
+/*
+ * connection_forward_send() - sends forwarded rpcs to the writer in order
+ *
+ * Rpcs wait while a spooled one is being sent, framing of one message
+ * can't be split by another.
+ */
+static void connection_forward_send(void)
+{
+	struct ustream *s = &upstream->us.stream;
+	struct connection *c;
+
+	list_for_each_entry(c, &forward_wait, forward)
+	{
+		if (forward_pump)
+			return;
+
+		if (c->forward_sent)
+			continue;
+
+		c->forward_sent = true;
+
+		if (c->spill_fd >= 0)
+		{
+			forward_pump = c;
+			c->forward_off = 0;
+			connection_forward_pump();
+			continue;
+		}
+
+		ustream_printf(s, "\n#%zu\n", c->buf_len);
+		ustream_write(s, c->buf, c->buf_len, false);
+		ustream_printf(s, "%s", XML_NETCONF_BASE_1_1_END);
+	}
+}
+
+/*
+ * connection_forward() - sends rpc to the writer
+ *
+ * Replica serves a snapshot, so rpcs that may change the datastore run in
+ * the writer. Writer replies in order, session reads nothing more until
+ * its reply is sent.
+ *
+ * Return: 1, reading stops
+ */
+static int connection_forward(struct connection *c)
+{
+	DEBUG("forwarding rpc to writer\n");
+
+	list_add_tail(&c->forward, &forward_wait);
+	c->forward_sent = false;
+	c->working = true;
+
+	connection_forward_send();
+
+	return 1;
+}
+
+/*
+ * connection_forward_reply() - hands reply received from the writer over
+ * to the session waiting for it, notifications to subscribed sessions
+ *
+ * Return: 0, reading goes on
+ */
+static int connection_forward_reply(struct connection *up)
+{
+	struct connection *c;
+
+	up->ready = false;
+
+	if (up->buf && !strncmp(up->buf, NOTIFICATION_FORWARD, strlen(NOTIFICATION_FORWARD)))
+	{
+		if (notifications_forwarded(up->buf, up->buf_len))
+			ERROR("malformed notification from writer\n");
+
+		free(up->buf);
+	}
+	else if (list_empty(&forward_wait))
+	{
+		ERROR("unexpected reply from writer\n");
+		free(up->buf);
+	}
+	else
+	{
+		c = list_first_entry(&forward_wait, struct connection, forward);
+		list_move_tail(&c->forward, &forward_ready);
+		c->forward_reply = up->buf;
+	}
+
+	up->buf = NULL;
+	up->buf_len = up->buf_size = 0;
+	up->msg_size = 0;
+
+	// writer sent the snapshot with the change before the reply
+	replicas_sync();
+
+	uloop_timeout_set(&forward_timer, 0);
+
+	return 0;
+}
+
+uint32_t connection_session(void)
+{
+	return handling && !handling->control ? handling->session_id : 0;
+}
+
+int connection_deliver(uint32_t id, notification_t *n)
+{
+	struct connection *c = connection_find(id);
+
+	if (!c || c->closing || c->control)
+		return -1;
+
+	if (config.max_output && connection_pending(c) + n->len > config.max_output)
+	{
+		LOG("session %" PRIu32 " output over %u bytes, dropping notification\n", c->session_id, config.max_output);
+		return -1;
+	}
+
+	if (connection_notify_queue(c, n, false))
+		return -1;
+
+	connection_notify_write(c);
+
+	return 0;
+}
+
+/*
+ * connection_forward_deliver() - sends replies from the writer once the
+ * snapshot they follow is applied
+ */
+static void connection_forward_deliver(struct uloop_timeout *t)
+{
+	struct connection *c;
+	char *buf;
+
+	// connection_guard_wake() calls again
+	if (guard_exclusive_count)
+		return;
+
+	while (!list_empty(&forward_ready))
+	{
+		c = list_first_entry(&forward_ready, struct connection, forward);
+		list_del(&c->forward);
+
+		buf = c->forward_reply;
+		c->forward_reply = NULL;
+		c->working = false;
+
+		if (c->closed)
+		{
+			free(buf);
+			connection_free(c);
+			continue;
+		}
+
+		// continue with rpcs received meanwhile
+		if (!connection_finish_rpc(c, buf ? RPC_OK : -1, buf, NULL))
+			notify_read(&c->us.stream, 0);
+	}
+}
+
+/*
+ * connection_handle_rpc() - handles received rpc and sends the reply
+ *
+ * Return: 1 if reading should stop, 0 otherwise
+ */
+static int connection_handle_rpc(struct connection *c)
+{
+	char *buf = NULL, *error = NULL;
+	int rc = -1, flags;
+
+	if (c->denied)
+	{
+		error = netconf_rpc_error("rpc too big", RPC_ERROR_TAG_RESOURCE_DENIED, RPC_ERROR_TYPE_RPC, RPC_ERROR_SEVERITY_ERROR, NULL);
+	}
+	else if (!c->control && connection_rate(c))
+	{
+		LOG("session %" PRIu32 " over %u rpcs per second\n", c->session_id, config.max_rpc_rate);
+		connection_keep_head(c);
+		error = netconf_rpc_error("rpc rate exceeded", RPC_ERROR_TAG_RESOURCE_DENIED, RPC_ERROR_TYPE_RPC, RPC_ERROR_SEVERITY_ERROR, NULL);
+	}
+	else if (c->spill_fd >= 0 && upstream)
+	{
+		return connection_forward(c);
+	}
+	else if (c->spill_fd >= 0)
+	{
+		rc = method_handle_message_rpc_fd(c->spill_fd, &buf, &c->job);
+	}
+	else if (c->buf && upstream && (method_rpc_flags(c->buf, c->buf_len) & METHOD_RPC_WRITE))
+	{
+		return connection_forward(c);
+	}
+	else if (c->buf && config.workers &&
+			 ((flags = method_rpc_flags(c->buf, c->buf_len)) & (METHOD_RPC_READ | METHOD_RPC_WRITE)) &&
+			 !(flags & METHOD_RPC_LOOP))
+	{
+		return connection_work(c, flags);
+	}
+	else if (c->buf)
+	{
+		DEBUG("received rpc\n\n %s\n\n", c->buf);
+		handling = c;
+		rc = method_handle_message_rpc_stream(c->buf, &buf, &c->stream);
+		handling = NULL;
+	}
+
+	return connection_finish_rpc(c, rc, buf, error);
+}
+
+/*
+ * connection_finish_rpc() - sends reply or error of handled rpc
+ *
+ * Return: 1 if reading should stop, 0 otherwise
+ */
+static int connection_finish_rpc(struct connection *c, int rc, char *buf, char *error)
+{
+	size_t len;
+
+	// reply is not queued when it would exceed limits
+	if (!error && buf)
+	{
+		len = strlen(buf);
+
+		// gets stop building data at the limit, other replies are small
+		if (config.max_reply_size && len > config.max_reply_size)
+		{
+			LOG("session %" PRIu32 " reply over %u bytes, refusing it\n", c->session_id, config.max_reply_size);
+			error = netconf_rpc_error("reply too big", RPC_ERROR_TAG_RESOURCE_DENIED, RPC_ERROR_TYPE_APPLICATION, RPC_ERROR_SEVERITY_ERROR, NULL);
+		}
+		else if (config.max_output && connection_pending(c) + len > config.max_output)
+		{
+			LOG("session %" PRIu32 " output over %u bytes, refusing reply\n", c->session_id, config.max_output);
+			error = netconf_rpc_error("output queue full", RPC_ERROR_TAG_RESOURCE_DENIED, RPC_ERROR_TYPE_APPLICATION, RPC_ERROR_SEVERITY_ERROR, NULL);
+		}
+
+		if (error)
+		{
+			free(buf);
+			buf = NULL;
+			connection_keep_head(c);
+		}
+	}
+
+	if (error)
+	{
+		rc = method_create_message_error(c->buf ? c->buf : "", c->buf_len, error, &buf);
+		free(error);
+	}
+
+	if (c->spill_fd >= 0)
+	{
+		close(c->spill_fd);
+		c->spill_fd = -1;
+	}
+
+	free(c->buf);
+	c->buf = NULL;
+	c->buf_len = c->buf_size = 0;
+	c->msg_size = 0;
+	c->denied = false;
+
+	if (c->job)
+	{
+		guard_writers++;
+		return connection_job(c);
+	}
+
+	return connection_reply(c, rc, buf);
+}
+
+/*
+ * connection_yield() - queues session until other sessions had their turn
+ *
+ * Sessions waiting with a priority rpc run before others.
+ */
+static void connection_yield(struct connection *c)
+{
+	int priority = c->buf && (method_rpc_flags(c->buf, c->buf_len) & METHOD_RPC_PRIORITY);
+
+	DEBUG("session %" PRIu32 " used its quantum, yielding\n", c->session_id);
+
+	connection_queue(c, priority ? &run_high : &run_normal);
+}
+
+/*
+ * connection_dispatch() - handles received rpc if session has quantum left
+ *
+ * Return: 1 if reading should stop, 0 otherwise
+ */
+static int connection_dispatch(struct connection *c)
+{
+	if (c->upstream)
+		return connection_forward_reply(c);
+
+	if (c->handled &&
+		((config.rpc_quantum && c->handled >= config.rpc_quantum) ||
+		 (config.rpc_quantum_us && connection_now() - c->turn >= config.rpc_quantum_us)))
+	{
+		connection_yield(c);
+		return 1;
+	}
+
+	if (connection_guard(c))
+		return 1;
+
+	c->ready = false;
+	c->handled++;
+
+	return connection_handle_rpc(c);
+}
+
+static void connection_run(struct list_head *queue)
+{
+	struct connection *c;
+
+	while (!list_empty(queue))
+	{
+		c = list_first_entry(queue, struct connection, run);
+		list_del_init(&c->run);
+		c->queued = false;
+
+		if (c->stream)
+			notify_write(&c->us.stream, 0);
+		else
+			notify_read(&c->us.stream, 0);
+	}
+}
+
+static void connection_schedule(struct uloop_timeout *t)
+{
+	LIST_HEAD(high);
+	LIST_HEAD(normal);
+
+	// one turn for every session queued so far, requeued ones wait for the next
+	list_splice_init(&run_high, &high);
+	list_splice_init(&run_normal, &normal);
+
+	connection_run(&high);
+	connection_run(&normal);
+}
+
+static void notify_read(struct ustream *s, int bytes)
+{
+	struct connection *c = container_of(s, struct connection, us.stream);
+
+	char *data, *buf1 = NULL, *buf2 = NULL;
+	int data_len, rc;
+	size_t len;
+
+	if (bytes)
+	{
+		c->active = connection_now();
+
+		// timer catches up with activity when it runs out
+		if (config.buffer_release && !c->shrink.pending && !c->control && !c->upstream)
+			wheel_timer_set(&c->shrink, config.buffer_release);
+	}
+
+	// scheduler or connection_work_done() continues it, closed one is done
+	if (c->queued || c->working || c->closing)
+		return;
+
+	DEBUG("starting to read incoming data\n");
+
+	c->handled = 0;
+	c->turn = connection_now();
+
+	// rpc handled in slices is finished before the next one
+	if (c->job && connection_job(c))
+		return;
+
+	do
+	{
+		if (connection_pause(c))
+			return;
+
+		if (c->ready && connection_dispatch(c))
+			return;
+
+		data = ustream_get_read_buf(s, &data_len);
+
+		if (!data) break;
+
+		switch (c->step)
+		{
+			case NETCONF_MSG_STEP_HELLO:
+				DEBUG("handling hello\n");
+
+				buf1 = strchr(data, '<');
+
+				if (!buf1)
+				{
+					LOG("start of hello message was not found\n");
+					connection_close(s);
+					return;
+				}
+
+				if (buf1 != data)
+				{
+					LOG("start of hello message not found where expected\n");
+					connection_close(s);
+					return;
+				}
+
+				buf2 = strstr(buf1, XML_NETCONF_BASE_1_0_END);
+
+				if (!buf2)
+				{
+					DEBUG("end of netconf message was not found in this buffer\n");
+					return;
+				}
+
+				*buf2 = '\0';
+
+				rc = method_analyze_message_hello(buf1, &c->base);
+
+				if (rc)
+				{
+					connection_close(s);
+					return;
+				}
+
+				ustream_consume(s, buf2 + strlen(XML_NETCONF_BASE_1_0_END) - data);
+
+				if (c->base)
+					c->step = NETCONF_MSG_STEP_HEADER_1;
+				else
+					c->step = NETCONF_MSG_STEP_HEADER_0;
+
+				connection_arm(c);
+
+				break;
+
+			case NETCONF_MSG_STEP_HEADER_1:
+				DEBUG("handling chunk header (1.1)\n");
+
+				for (len = 0, rc = 0; len < data_len && !rc; len++)
+					rc = connection_header(c, data[len]);
+
+				ustream_consume(s, len);
+
+				if (rc < 0)
+				{
+					LOG("invalid chunk header\n");
+					connection_close(s);
+					return;
+				}
+
+				if (rc == 1)
+				{
+					c->step = NETCONF_MSG_STEP_DATA_1;
+					c->msg_size += c->msg_len;
+
+					// declared sizes are checked before anything is stored
+					if (config.max_rpc_size && c->msg_size > config.max_rpc_size && !c->denied && !c->upstream)
+					{
+						LOG("session %" PRIu32 " rpc over %u bytes, dropping it\n", c->session_id, config.max_rpc_size);
+						c->denied = true;
+						connection_keep_head(c);
+					}
+				}
+
+				if (rc == 2)
+					c->ready = true;
+
+				break;
+
+			case NETCONF_MSG_STEP_DATA_1:
+				DEBUG("handling chunk data (1.1)\n");
+
+				len = c->msg_len < data_len ? c->msg_len : data_len;
+
+				if (connection_append(c, data, len))
+				{
+					ERROR("unable to store incoming rpc\n");
+					connection_close(s);
+					return;
+				}
+
+				ustream_consume(s, len);
+				c->msg_len -= len;
+
+				if (!c->msg_len)
+					c->step = NETCONF_MSG_STEP_HEADER_1;
+
+				break;
+
+			default:
+				// base 1.0 framing is not supported after hello
+				return;
+		}
+	}
+	while (1);
+}
+
+/*
+ * connection_out_write() - writes output of session whose input and output
+ * are separate descriptors
+ *
+ * Same as ustream_fd's write, only to out.
+ */
+static int connection_out_write(struct ustream *s, const char *buf, int len, bool more)
+{
+	struct connection *c = container_of(s, struct connection, us.stream);
+	ssize_t written;
+	int ret = 0;
+
+	while (len)
+	{
+		written = write(c->out.fd, buf, len);
+
+		if (written < 0)
+		{
+			if (errno == EINTR)
+				continue;
+
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
+
+			return -1;
+		}
+
+		ret += written;
+		buf += written;
+		len -= written;
+	}
+
+	if (len)
+		uloop_fd_add(&c->out, ULOOP_WRITE);
+
+	return ret;
+}
+
+static void connection_out_cb(struct uloop_fd *fd, unsigned int events)
+{
+	struct connection *c = container_of(fd, struct connection, out);
+
+	if (ustream_write_pending(&c->us.stream))
+		uloop_fd_delete(fd);
+}
+
+/*
+ * connection_output() - sends session's output to fd instead of the one
+ * it reads from, sshd hands channels to subsystems as a pair of pipes
+ */
+static void connection_output(struct connection *c, int fd)
+{
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+	c->out.fd = fd;
+	c->us.stream.write = connection_out_write;
+}
+
+static void connection_init(struct connection *c)
+{
+	c->us.stream.string_data = true;
+	c->us.stream.notify_read = notify_read;
+	c->us.stream.notify_state = notify_state;
+	c->us.stream.notify_write = notify_write;
+	c->us.stream.r.buffer_len = CONNECTION_READ_BUFFER;
+	c->us.stream.r.alloc = connection_alloc;
+	c->step = NETCONF_MSG_STEP_HELLO;
+	c->spill_fd = -1;
+	c->out.fd = -1;
+	c->out.cb = connection_out_cb;
+	c->front = -1;
+	c->replica = -1;
+	c->timer.cb = connection_timeout;
+	c->shrink.cb = connection_shrink_cb;
+	c->stall.cb = connection_stall_cb;
+	c->active = connection_now();
+	INIT_LIST_HEAD(&c->hash);
+	INIT_LIST_HEAD(&c->notifications);
+
+	/* prevent variable overflow */
+	if ((session_id = (session_id + 1) & session_mask) == 0)
+		session_id = 1;
+
+	c->session_id = session_base | session_id;
+}
+
+void connection_id_space(unsigned int index, unsigned int count)
+{
+	unsigned int bits = 0;
+
+	while (bits < 31 && (1u << bits) < count)
+		bits++;
+
+	if (!bits)
+		return;
+
+	session_mask = UINT32_MAX >> bits;
+	session_base = (uint32_t) index << (32 - bits);
+}
+
+/*
+ * connection_start() - starts session on fd, out is -1 if replies go to fd
+ * as well, fd is -1 for session on a translator link
+ *
+ * Descriptors are closed if the session can't be started.
+ *
+ * Return: 0 on success, -1 on error
+ */
+static int connection_start(struct connection *c, int fd, int out)
+{
+	char *hello_message = NULL;
+	int rc;
+
+	DEBUG("configuring connection parameters\n");
+
+	connection_init(c);
+
+	DEBUG("crafting hello message\n");
+	rc = method_create_message_hello(c->session_id, &hello_message);
+
+	if (rc)
+	{
+		ERROR("failed to create hello message\n");
+		goto error;
+	}
+
+	if (connection_hash(c))
+	{
+		ERROR("not enough memory to accept connection\n");
+		free(hello_message);
+		goto error;
+	}
+
+	if (c->mux)
+		connection_mux_init(c);
+	else if (c->tls)
+		connection_tls_init(c, fd);
+	else if (c->uring)
+		connection_uring_init(c, fd);
+	else
+		ustream_fd_init(&c->us, fd);
+
+	if (out >= 0)
+		connection_output(c, out);
+
+	list_add_tail(&c->list, &connections);
+
+	// client that never says hello is not kept forever
+	connection_arm(c);
+
+	DEBUG("sending hello message\n");
+	ustream_printf(&c->us.stream, "%s%s", hello_message, XML_NETCONF_BASE_1_0_END);
+	free(hello_message);
+
+	return 0;
+
+error:
+	if (fd >= 0)
+		close(fd);
+
+	if (out >= 0)
+		close(out);
+
+	return -1;
+}
+
+/*
+ * Front process started by sshd as the netconf subsystem connects to
+ * a subsystem listener and passes its stdin and stdout, just one of them
+ * if they are the same socket. Session then runs on the ssh channel itself,
+ * front waits until its socket is closed and exits with the session.
+ */
+#define CONNECTION_FRONT_TIMEOUT 5000
+
+struct connection_front
+{
+	struct uloop_fd fd;
+	struct wheel_timer timer;
+	struct sockaddr_storage peer;
+};
+
+static void connection_front_free(struct connection_front *f)
+{
+	uloop_fd_delete(&f->fd);
+	wheel_timer_cancel(&f->timer);
+	close(f->fd.fd);
+	free(f);
+}
+
+static void connection_front_timeout(struct wheel_timer *t)
+{
+	struct connection_front *f = container_of(t, struct connection_front, timer);
+
+	ERROR("subsystem front sent no channel\n");
+	connection_front_free(f);
+}
+
+static void connection_front_cb(struct uloop_fd *fd, unsigned int events)
+{
+	struct connection_front *f = container_of(fd, struct connection_front, fd);
+	char control[CMSG_SPACE(2 * sizeof(int))];
+	char byte;
+	struct iovec iov = { .iov_base = &byte, .iov_len = 1 };
+	struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1, .msg_control = control, .msg_controllen = sizeof(control) };
+	struct cmsghdr *cmsg;
+	struct connection *c;
+	int fds[2] = { -1, -1 }, fds_count = 0;
+	ssize_t len;
+
+	len = recvmsg(fd->fd, &msg, MSG_CMSG_CLOEXEC);
+
+	if (len < 0 && (errno == EAGAIN || errno == EINTR))
+		return;
+
+	for (cmsg = CMSG_FIRSTHDR(&msg); len > 0 && cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg))
+	{
+		if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+			continue;
+
+		fds_count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		memcpy(fds, CMSG_DATA(cmsg), fds_count * sizeof(int));
+	}
+
+	c = fds_count ? calloc(1, sizeof(*c)) : NULL;
+
+	if (!c)
+	{
+		ERROR("subsystem front sent no channel\n");
+
+		for (int i = 0; i < fds_count; i++)
+			close(fds[i]);
+
+		connection_front_free(f);
+		return;
+	}
+
+	LOG("received new subsystem session\n");
+
+	c->peer = f->peer;
+
+	if (connection_start(c, fds[0], fds_count > 1 ? fds[1] : -1))
+	{
+		free(c);
+		connection_front_free(f);
+		return;
+	}
+
+	// front's socket stays open as long as the session
+	c->front = fd->fd;
+	uloop_fd_delete(fd);
+	wheel_timer_cancel(&f->timer);
+	free(f);
+}
+
+/*
+ * connection_front() - accepts front process of a subsystem session
+ */
+static int connection_front(struct listener *l)
+{
+	struct connection_front *f = calloc(1, sizeof(*f));
+	socklen_t sl = sizeof(f->peer);
+
+	if (!f)
+	{
+		ERROR("not enough memory to accept connection\n");
+		return -1;
+	}
+
+	f->fd.fd = accept4(l->fd.fd, (struct sockaddr *) &f->peer, &sl, SOCK_CLOEXEC);
+
+	if (f->fd.fd < 0)
+	{
+		free(f);
+
+		if (errno == EAGAIN || errno == EWOULDBLOCK)
+			return 0;
+
+		if (errno == EINTR || errno == ECONNABORTED)
+			return 1;
+
+		ERROR("failed accepting connection\n");
+		return -1;
+	}
+
+	f->fd.cb = connection_front_cb;
+	f->timer.cb = connection_front_timeout;
+	uloop_fd_add(&f->fd, ULOOP_READ);
+	wheel_timer_set(&f->timer, CONNECTION_FRONT_TIMEOUT);
+
+	return 1;
+}
+
+/*
+ * Translator links carry many sessions over one socket, in frames with
+ * a header in network byte order
+ *
+ *   u8 type, u32 channel, u32 payload length
+ *
+ * followed by the payload. Translator picks channel ids and opens them, no
+ * payload, hello is the first data on a new channel. Data goes both ways
+ * as it would on a session's own socket. Either side closes a channel, no
+ * payload; daemon answers translator's close with its own and the id may
+ * be used again after the daemon's close.
+ *
+ * Link stops reading while the session data is for stops reading, output
+ * is held back in sessions while the link's output is over output_high.
+ */
+#define MUX_HEADER_SIZE 9
+#define MUX_HASH 256
+#define MUX_BACKLOG (256 * 1024)
+#define MUX_RESUME_MS 10
+
+enum connection_mux_frame
+{
+	MUX_OPEN = 1,
+	MUX_DATA,
+	MUX_CLOSE
+};
+
+struct connection_mux
+{
+	struct ustream_fd us;
+	struct sockaddr_storage peer;
+	struct list_head channels[MUX_HASH];
+	struct list_head waiting; // sessions with output held back
+	struct uloop_timeout resume;
+	bool blocked; // stopped reading for a session
+	char header[MUX_HEADER_SIZE]; // header being received
+	int header_len;
+	uint8_t type;
+	uint32_t channel;
+	uint32_t left; // payload of current frame not received yet
+};
+
+static struct connection *connection_mux_find(struct connection_mux *m, uint32_t channel)
+{
+	struct connection *c;
+
+	list_for_each_entry(c, &m->channels[channel & (MUX_HASH - 1)], channel_hash)
+	{
+		if (c->channel == channel)
+			return c;
+	}
+
+	return NULL;
+}
+
+static void connection_mux_send(struct connection_mux *m, uint8_t type, uint32_t channel, const char *data, int len, bool more)
+{
+	char header[MUX_HEADER_SIZE];
+	uint32_t value;
+
+	header[0] = type;
+	value = htonl(channel);
+	memcpy(header + 1, &value, sizeof(value));
+	value = htonl(len);
+	memcpy(header + 5, &value, sizeof(value));
+
+	ustream_write(&m->us.stream, header, sizeof(header), len || more);
+
+	if (len)
+		ustream_write(&m->us.stream, data, len, more);
+}
+
+/*
+ * connection_mux_session_write() - frames session's output on its link
+ *
+ * Nothing is taken while link's output is over output_high, session keeps
+ * it until connection_mux_write() finds the link drained.
+ */
+static int connection_mux_session_write(struct ustream *s, const char *buf, int len, bool more)
+{
+	struct connection *c = container_of(s, struct connection, us.stream);
+	struct connection_mux *m = c->mux;
+
+	if (ustream_pending_data(&m->us.stream, true) >= config.output_high)
+	{
+		if (!c->mux_waiting)
+		{
+			list_add_tail(&c->mux_wait, &m->waiting);
+			c->mux_waiting = true;
+		}
+
+		return 0;
+	}
+
+	connection_mux_send(m, MUX_DATA, c->channel, buf, len, more);
+
+	return len;
+}
+
+/*
+ * connection_mux_session_blocked() - resumes link held up by session that
+ * read nothing more
+ */
+static void connection_mux_session_blocked(struct ustream *s)
+{
+	struct connection *c = container_of(s, struct connection, us.stream);
+
+	if (!ustream_read_blocked(s) && c->mux->blocked)
+		uloop_timeout_set(&c->mux->resume, 0);
+}
+
+/*
+ * connection_mux_init() - sets session on a translator link up, in place of
+ * ustream_fd_init()
+ */
+static void connection_mux_init(struct connection *c)
+{
+	struct ustream *s = &c->us.stream;
+
+	c->us.fd.fd = -1;
+	s->r.max_buffers = -1;
+	s->write = connection_mux_session_write;
+	s->set_read_blocked = connection_mux_session_blocked;
+	ustream_init_defaults(s);
+
+	list_add_tail(&c->channel_hash, &c->mux->channels[c->channel & (MUX_HASH - 1)]);
+}
+
+/*
+ * connection_mux_detach() - removes closed session from its link, telling
+ * the translator
+ */
+static void connection_mux_detach(struct connection *c)
+{
+	struct connection_mux *m = c->mux;
+
+	list_del(&c->channel_hash);
+
+	if (c->mux_waiting)
+		list_del(&c->mux_wait);
+
+	c->mux_waiting = false;
+	c->mux = NULL;
+
+	connection_mux_send(m, MUX_CLOSE, c->channel, NULL, 0, false);
+}
+
+static void connection_mux_open(struct connection_mux *m, uint32_t channel)
+{
+	struct connection *c;
+
+	if (connection_mux_find(m, channel))
+	{
+		ERROR("channel %" PRIu32 " is already open\n", channel);
+		return;
+	}
+
+	c = retiring ? NULL : calloc(1, sizeof(*c));
+
+	// refused right away
+	if (!c)
+	{
+		connection_mux_send(m, MUX_CLOSE, channel, NULL, 0, false);
+		return;
+	}
+
+	c->mux = m;
+	c->channel = channel;
+	c->peer = m->peer;
+
+	if (connection_start(c, -1, -1))
+	{
+		connection_mux_send(m, MUX_CLOSE, channel, NULL, 0, false);
+		free(c);
+	}
+}
+
+/*
+ * connection_mux_close() - ends session translator closed, like end of file
+ * on its own socket
+ */
+static void connection_mux_close(struct connection_mux *m, uint32_t channel)
+{
+	struct connection *c = connection_mux_find(m, channel);
+
+	if (!c)
+		return;
+
+	c->us.stream.eof = true;
+	ustream_state_change(&c->us.stream);
+}
+
+/*
+ * connection_mux_deliver() - passes payload to session as if read from its
+ * socket
+ *
+ * Return: bytes taken, 0 if the link has to wait for the session
+ */
+static int connection_mux_deliver(struct connection *c, const char *data, int len)
+{
+	struct ustream *s = &c->us.stream;
+	char *buf;
+	int max;
+
+	if (ustream_read_blocked(s) || s->r.data_bytes > MUX_BACKLOG)
+		return 0;
+
+	buf = ustream_reserve(s, len, &max);
+
+	if (!buf)
+		return 0;
+
+	if (len > max)
+		len = max;
+
+	memcpy(buf, data, len);
+	ustream_fill_read(s, len);
+
+	return len;
+}
+
+/*
+ * connection_mux_frame() - handles header just received
+ *
+ * Return: 0 on success, -1 if the translator broke the protocol
+ */
+static int connection_mux_frame(struct connection_mux *m)
+{
+	uint32_t value;
+
+	m->type = m->header[0];
+	memcpy(&value, m->header + 1, sizeof(value));
+	m->channel = ntohl(value);
+	memcpy(&value, m->header + 5, sizeof(value));
+	m->left = ntohl(value);
+
+	switch (m->type)
+	{
+		case MUX_DATA:
+			return 0;
+
+		case MUX_OPEN:
+			if (m->left)
+				return -1;
+
+			connection_mux_open(m, m->channel);
+			return 0;
+
+		case MUX_CLOSE:
+			if (m->left)
+				return -1;
+
+			connection_mux_close(m, m->channel);
+			return 0;
+	}
+
+	return -1;
+}
+
+static void connection_mux_read(struct ustream *s, int bytes)
+{
+	struct connection_mux *m = container_of(s, struct connection_mux, us.stream);
+	struct connection *c;
+	char *data;
+	int data_len, len;
+
+	while ((data = ustream_get_read_buf(s, &data_len)))
+	{
+		if (m->header_len < MUX_HEADER_SIZE)
+		{
+			len = MUX_HEADER_SIZE - m->header_len;
+
+			if (len > data_len)
+				len = data_len;
+
+			memcpy(m->header + m->header_len, data, len);
+			ustream_consume(s, len);
+			m->header_len += len;
+
+			if (m->header_len < MUX_HEADER_SIZE)
+				continue;
+
+			if (connection_mux_frame(m))
+			{
+				ERROR("translator sent malformed frame, closing link\n");
+				s->eof = true;
+				ustream_state_change(s);
+				return;
+			}
+		}
+		else
+		{
+			len = m->left < (uint32_t) data_len ? (int) m->left : data_len;
+			c = connection_mux_find(m, m->channel);
+
+			// data for closed channel is dropped
+			if (c && !c->closing)
+			{
+				len = connection_mux_deliver(c, data, len);
+
+				if (!len)
+				{
+					m->blocked = true;
+					ustream_set_read_blocked(s, true);
+					uloop_timeout_set(&m->resume, MUX_RESUME_MS);
+					return;
+				}
+			}
+
+			ustream_consume(s, len);
+			m->left -= len;
+		}
+
+		if (!m->left)
+			m->header_len = 0;
+	}
+}
+
+/*
+ * connection_mux_resume() - continues with frames once session that held
+ * the link up reads again
+ */
+static void connection_mux_resume(struct uloop_timeout *t)
+{
+	struct connection_mux *m = container_of(t, struct connection_mux, resume);
+
+	m->blocked = false;
+	ustream_set_read_blocked(&m->us.stream, false);
+	connection_mux_read(&m->us.stream, 0);
+}
+
+static void connection_mux_write(struct ustream *s, int bytes)
+{
+	struct connection_mux *m = container_of(s, struct connection_mux, us.stream);
+	struct connection *c;
+	LIST_HEAD(waiting);
+
+	if (ustream_pending_data(s, true) > config.output_low)
+		return;
+
+	list_splice_init(&m->waiting, &waiting);
+
+	while (!list_empty(&waiting))
+	{
+		c = list_first_entry(&waiting, struct connection, mux_wait);
+		list_del(&c->mux_wait);
+		c->mux_waiting = false;
+
+		// puts itself back if the link fills up again
+		ustream_write_pending(&c->us.stream);
+	}
+}
+
+static void connection_mux_state(struct ustream *s)
+{
+	struct connection_mux *m = container_of(s, struct connection_mux, us.stream);
+	struct connection *c, *tmp;
+
+	for (int i = 0; i < MUX_HASH; i++)
+	{
+		list_for_each_entry_safe(c, tmp, &m->channels[i], channel_hash)
+		{
+			list_del(&c->channel_hash);
+
+			if (c->mux_waiting)
+				list_del(&c->mux_wait);
+
+			c->mux = NULL;
+			notify_state(&c->us.stream);
+		}
+	}
+
+	uloop_timeout_cancel(&m->resume);
+	ustream_free(s);
+	close(m->us.fd.fd);
+	free(m);
+
+	LOG("translator link closed\n");
+}
+
+/*
+ * connection_mux_accept() - accepts translator link
+ */
+static int connection_mux_accept(struct listener *l)
+{
+	struct connection_mux *m = calloc(1, sizeof(*m));
+	socklen_t sl = sizeof(m->peer);
+	int fd;
+
+	if (!m)
+	{
+		ERROR("not enough memory to accept connection\n");
+		return -1;
+	}
+
+	fd = accept4(l->fd.fd, (struct sockaddr *) &m->peer, &sl, SOCK_CLOEXEC);
+
+	if (fd < 0)
+	{
+		free(m);
+
+		if (errno == EAGAIN || errno == EWOULDBLOCK)
+			return 0;
+
+		if (errno == EINTR || errno == ECONNABORTED)
+			return 1;
+
+		ERROR("failed accepting connection\n");
+		return -1;
+	}
+
+	LOG("received new translator link\n");
+
+	for (int i = 0; i < MUX_HASH; i++)
+		INIT_LIST_HEAD(&m->channels[i]);
+
+	INIT_LIST_HEAD(&m->waiting);
+	m->resume.cb = connection_mux_resume;
+	m->us.stream.notify_read = connection_mux_read;
+	m->us.stream.notify_write = connection_mux_write;
+	m->us.stream.notify_state = connection_mux_state;
+	m->us.stream.r.buffer_len = CONNECTION_READ_BUFFER;
+	ustream_fd_init(&m->us, fd);
+
+	return 1;
+}
+
+/*
+ * Sessions over tls are plain sessions once the kernel does the record
+ * layer. Otherwise they read and write through tls_read() and tls_write()
+ * on a plain ustream, their socket in us.fd.
+ */
+static void connection_tls_poll(struct connection *c)
+{
+	struct ustream *s = &c->us.stream;
+	unsigned int flags = 0;
+
+	if (!ustream_read_blocked(s))
+		flags |= ULOOP_READ;
+
+	if (ustream_pending_data(s, true) || tls_want_write(c->tls))
+		flags |= ULOOP_WRITE;
+
+	if (flags)
+		uloop_fd_add(&c->us.fd, flags);
+	else
+		uloop_fd_delete(&c->us.fd);
+}
+
+static void connection_tls_cb(struct uloop_fd *fd, unsigned int events)
+{
+	struct connection *c = container_of(fd, struct connection, us.fd);
+	struct ustream *s = &c->us.stream;
+	char *buf;
+	int len, max;
+
+	if (ustream_pending_data(s, true))
+		ustream_write_pending(s);
+
+	while (!ustream_read_blocked(s) && !s->eof)
+	{
+		buf = ustream_reserve(s, CONNECTION_READ_BUFFER, &max);
+
+		if (!buf)
+			break;
+
+		len = tls_read(c->tls, buf, max);
+
+		if (len < 0 && errno == EAGAIN)
+			break;
+
+		if (len <= 0)
+		{
+			s->eof = true;
+			ustream_state_change(s);
+			break;
+		}
+
+		ustream_fill_read(s, len);
+	}
+
+	connection_tls_poll(c);
+}
+
+static int connection_tls_write(struct ustream *s, const char *buf, int len, bool more)
+{
+	struct connection *c = container_of(s, struct connection, us.stream);
+	int written = tls_write(c->tls, buf, len);
+
+	if (written < 0 && errno != EAGAIN)
+		return -1;
+
+	if (written < len)
+	{
+		uloop_fd_add(&c->us.fd, (ustream_read_blocked(s) ? 0 : ULOOP_READ) | ULOOP_WRITE);
+
+		if (written < 0)
+			written = 0;
+	}
+
+	return written;
+}
+
+static void connection_tls_blocked(struct ustream *s)
+{
+	struct connection *c = container_of(s, struct connection, us.stream);
+
+	connection_tls_poll(c);
+
+	// already decrypted data doesn't wake the socket up, a writable one
+	// does right away
+	if (!ustream_read_blocked(s) && tls_pending(c->tls))
+		uloop_fd_add(&c->us.fd, ULOOP_READ | ULOOP_WRITE);
+}
+
+/*
+ * connection_tls_init() - sets session over tls up, in place of
+ * ustream_fd_init()
+ */
+static void connection_tls_init(struct connection *c, int fd)
+{
+	struct ustream *s = &c->us.stream;
+
+	c->us.fd.fd = fd;
+	c->us.fd.cb = connection_tls_cb;
+	s->write = connection_tls_write;
+	s->set_read_blocked = connection_tls_blocked;
+	ustream_init_defaults(s);
+
+	uloop_fd_add(&c->us.fd, ULOOP_READ);
+}
+
+/* client doing its handshake */
+struct connection_handshake
+{
+	struct uloop_fd fd;
+	struct wheel_timer timer;
+	struct tls *tls;
+	struct sockaddr_storage peer;
+};
+
+static void connection_handshake_free(struct connection_handshake *h)
+{
+	uloop_fd_delete(&h->fd);
+	wheel_timer_cancel(&h->timer);
+	tls_free(h->tls);
+	close(h->fd.fd);
+	free(h);
+}
+
+static void connection_handshake_timeout(struct wheel_timer *t)
+{
+	struct connection_handshake *h = container_of(t, struct connection_handshake, timer);
+
+	LOG("tls handshake timed out\n");
+	connection_handshake_free(h);
+}
+
+static void connection_handshake_cb(struct uloop_fd *fd, unsigned int events)
+{
+	struct connection_handshake *h = container_of(fd, struct connection_handshake, fd);
+	struct connection *c;
+
+	if (tls_handshake(h->tls))
+	{
+		if (errno == EAGAIN)
+		{
+			uloop_fd_add(fd, tls_want_write(h->tls) ? ULOOP_WRITE : ULOOP_READ);
+			return;
+		}
+
+		LOG("tls handshake failed\n");
+		connection_handshake_free(h);
+		return;
+	}
+
+	c = calloc(1, sizeof(*c));
+
+	if (!c)
+	{
+		ERROR("not enough memory to accept connection\n");
+		connection_handshake_free(h);
+		return;
+	}
+
+	uloop_fd_delete(fd);
+	wheel_timer_cancel(&h->timer);
+	c->peer = h->peer;
+
+	if (tls_offloaded(h->tls))
+	{
+		DEBUG("tls record layer offloaded to kernel\n");
+		tls_free(h->tls);
+	}
+	else
+	{
+		c->tls = h->tls;
+	}
+
+	// descriptor is closed on failure
+	if (connection_start(c, fd->fd, -1))
+	{
+		tls_free(c->tls);
+		free(c);
+	}
+
+	free(h);
+}
+
+/*
+ * connection_tls_accept() - accepts client of a tls listener, session
+ * starts once the handshake is done
+ */
+static int connection_tls_accept(struct listener *l)
+{
+	struct connection_handshake *h = calloc(1, sizeof(*h));
+	socklen_t sl = sizeof(h->peer);
+
+	if (!h)
+	{
+		ERROR("not enough memory to accept connection\n");
+		return -1;
+	}
+
+	h->fd.fd = accept4(l->fd.fd, (struct sockaddr *) &h->peer, &sl, SOCK_CLOEXEC | SOCK_NONBLOCK);
+
+	if (h->fd.fd < 0)
+	{
+		free(h);
+
+		if (errno == EAGAIN || errno == EWOULDBLOCK)
+			return 0;
+
+		if (errno == EINTR || errno == ECONNABORTED)
+			return 1;
+
+		ERROR("failed accepting connection\n");
+		return -1;
+	}
+
+	h->tls = tls_new(h->fd.fd);
+
+	if (!h->tls)
+	{
+		ERROR("not enough memory to accept connection\n");
+		close(h->fd.fd);
+		free(h);
+		return 1;
+	}
+
+	LOG("received new tls connection\n");
+
+	h->fd.cb = connection_handshake_cb;
+	h->timer.cb = connection_handshake_timeout;
+	uloop_fd_add(&h->fd, ULOOP_READ);
+
+	if (config.hello_timeout)
+		wheel_timer_set(&h->timer, config.hello_timeout);
+
+	return 1;
+}
+
+/*
+ * Plain sessions on io_uring read with one multishot recv, kernel fills
+ * buffers of its own choosing and data is copied to the session's ustream.
+ * Output is gathered in chunks and sent once per loop iteration, chunks of
+ * a session as one linked chain. Requests go to the kernel together in
+ * connection_uring_flush().
+ */
+static void connection_uring_kick(void)
+{
+	if (!uring_timer.pending)
+		uloop_timeout_set(&uring_timer, 0);
+}
+
+static void connection_uring_free(struct connection_uring *u)
+{
+	struct connection_chunk *k, *tmp;
+
+	list_for_each_entry_safe(k, tmp, &u->chunks, list)
+	{
+		list_del(&k->list);
+		free(k);
+	}
+
+	free(u);
+}
+
+static void connection_uring_read_start(struct connection_uring *u)
+{
+	struct ustream *s = &u->c->us.stream;
+
+	if (uring_recv(&u->recv, u->fd))
+	{
+		ERROR("session %" PRIu32 " unable to read\n", u->c->session_id);
+		s->eof = true;
+		ustream_state_change(s);
+		return;
+	}
+
+	u->reading = true;
+	u->requests++;
+	connection_uring_kick();
+}
+
+static void connection_uring_read(struct uring_req *r, int res, char *data, bool more)
+{
+	struct connection_uring *u = container_of(r, struct connection_uring, recv);
+	struct ustream *s;
+	char *buf;
+	int len = res, max;
+
+	// all of it goes in, the stream takes as many buffers as it needs
+	while (u->c && len > 0)
+	{
+		s = &u->c->us.stream;
+		buf = ustream_reserve(s, len, &max);
+
+		if (!buf)
+		{
+			ERROR("not enough memory\n");
+			s->eof = true;
+			ustream_state_change(s);
+			break;
+		}
+
+		if (max > len)
+			max = len;
+
+		memcpy(buf, data, max);
+		ustream_fill_read(s, max);
+		data += max;
+		len -= max;
+	}
+
+	if (more)
+		return;
+
+	u->reading = u->stopping = false;
+	u->requests--;
+
+	if (!u->c)
+	{
+		if (!u->requests)
+			connection_uring_free(u);
+
+		return;
+	}
+
+	s = &u->c->us.stream;
+
+	// out of buffers or stopped while blocked, anything else ends it
+	if (res == 0 || (res < 0 && res != -ENOBUFS && res != -ECANCELED))
+	{
+		s->eof = true;
+		ustream_state_change(s);
+		return;
+	}
+
+	if (!ustream_read_blocked(s) && !s->eof)
+		connection_uring_read_start(u);
+}
+
+static void connection_uring_sent(struct uring_req *r, int res, char *data, bool more)
+{
+	struct connection_chunk *k = container_of(r, struct connection_chunk, req);
+	struct connection_uring *u = k->u;
+	struct ustream *s;
+
+	k->sending = false;
+	u->sending--;
+	u->requests--;
+
+	if (res > 0)
+	{
+		k->sent += res;
+		u->queued -= res;
+	}
+
+	if (k->sent == k->len || !u->c)
+	{
+		list_del(&k->list);
+		free(k);
+	}
+
+	if (!u->c)
+	{
+		if (!u->requests)
+			connection_uring_free(u);
+
+		return;
+	}
+
+	s = &u->c->us.stream;
+
+	if (res > 0)
+		u->c->written = connection_now();
+
+	// short send cancels the rest of the chain, it is sent again
+	if (res < 0 && res != -ECANCELED)
+	{
+		s->write_error = true;
+		ustream_state_change(s);
+		return;
+	}
+
+	if (u->sending)
+		return;
+
+	if (list_empty(&u->flush) && !list_empty(&u->chunks))
+		list_add_tail(&u->flush, &uring_flush);
+
+	// moves what did not fit the window to chunks, tells the session
+	// its output drained
+	if (ustream_pending_data(s, true))
+		ustream_write_pending(s);
+}
+
+/*
+ * connection_uring_send() - sends chunks of session as one chain
+ */
+static void connection_uring_send(struct connection_uring *u)
+{
+	struct connection_chunk *k;
+	bool link;
+
+	// chain before this one is sent first
+	if (u->sending)
+		return;
+
+	list_for_each_entry(k, &u->chunks, list)
+	{
+		link = k->list.next != &u->chunks;
+
+		if (uring_send(&k->req, u->fd, k->data + k->sent, k->len - k->sent, link))
+			break;
+
+		k->sending = true;
+		u->sending++;
+		u->requests++;
+	}
+
+	// queue was full, rest goes with next chain or next iteration
+	if (!u->sending && list_empty(&u->flush))
+	{
+		list_add_tail(&u->flush, &uring_flush);
+		connection_uring_kick();
+	}
+}
+
+static void connection_uring_flush(void)
+{
+	struct connection_uring *u, *tmp;
+	LIST_HEAD(flush);
+
+	uloop_timeout_cancel(&uring_timer);
+	list_splice_init(&uring_flush, &flush);
+
+	list_for_each_entry_safe(u, tmp, &flush, flush)
+	{
+		list_del_init(&u->flush);
+		connection_uring_send(u);
+	}
+
+	if (uring_submit())
+		ERROR("unable to submit io_uring requests\n");
+}
+
+/*
+ * connection_uring_poll() - handles completions, sends what they produced
+ *
+ * Sends mostly complete while being submitted, their chunks are freed and
+ * output held back is sent right away rather than after another wakeup.
+ */
+static void connection_uring_poll(void)
+{
+	uring_complete();
+	connection_uring_flush();
+	uring_complete();
+	connection_uring_flush();
+}
+
+static void connection_uring_cb(struct uloop_fd *fd, unsigned int events)
+{
+	connection_uring_poll();
+}
+
+static void connection_uring_flush_cb(struct uloop_timeout *t)
+{
+	connection_uring_poll();
+}
+
+static int connection_uring_write(struct ustream *s, const char *buf, int len, bool more)
+{
+	struct connection *c = container_of(s, struct connection, us.stream);
+	struct connection_uring *u = c->uring;
+	struct connection_chunk *k;
+	int n, ret = 0;
+
+	// rest stays with ustream, so pausing still sees it
+	while (len && u->queued < CONNECTION_URING_WINDOW)
+	{
+		k = list_empty(&u->chunks) ? NULL : list_last_entry(&u->chunks, struct connection_chunk, list);
+
+		// chunk being sent belongs to the kernel
+		if (!k || k->sending || k->len == sizeof(k->data))
+		{
+			k = malloc(sizeof(*k));
+
+			if (!k)
+			{
+				ERROR("not enough memory\n");
+				return ret ? ret : -1;
+			}
+
+			k->req.cb = connection_uring_sent;
+			k->u = u;
+			k->sending = false;
+			k->len = k->sent = 0;
+			list_add_tail(&k->list, &u->chunks);
+		}
+
+		n = sizeof(k->data) - k->len;
+
+		if (n > len)
+			n = len;
+
+		memcpy(k->data + k->len, buf, n);
+		k->len += n;
+		u->queued += n;
+		buf += n;
+		len -= n;
+		ret += n;
+	}
+
+	if (ret && list_empty(&u->flush))
+	{
+		list_add_tail(&u->flush, &uring_flush);
+		connection_uring_kick();
+	}
+
+	return ret;
+}
+
+/*
+ * connection_uring_blocked() - stops or restarts recv
+ *
+ * Data received until the cancel completes still goes to the stream.
+ */
+static void connection_uring_blocked(struct ustream *s)
+{
+	struct connection *c = container_of(s, struct connection, us.stream);
+	struct connection_uring *u = c->uring;
+
+	if (ustream_read_blocked(s))
+	{
+		if (u->reading && !u->stopping && !uring_cancel(&u->recv))
+		{
+			u->stopping = true;
+			connection_uring_kick();
+		}
+	}
+	else if (!u->reading && !s->eof)
+	{
+		connection_uring_read_start(u);
+	}
+}
+
+/*
+ * connection_uring_init() - sets session on io_uring up, in place of
+ * ustream_fd_init()
+ */
+static void connection_uring_init(struct connection *c, int fd)
+{
+	struct ustream *s = &c->us.stream;
+	struct connection_uring *u = c->uring;
+
+	memset(u, 0, sizeof(*u));
+	u->recv.cb = connection_uring_read;
+	u->c = c;
+	u->fd = fd;
+	INIT_LIST_HEAD(&u->chunks);
+	INIT_LIST_HEAD(&u->flush);
+
+	c->us.fd.fd = fd;
+	s->write = connection_uring_write;
+	s->set_read_blocked = connection_uring_blocked;
+	// completions can't be left with the kernel, the stream takes them all
+	s->r.max_buffers = -1;
+	ustream_init_defaults(s);
+
+	connection_uring_read_start(u);
+}
+
+/*
+ * connection_uring_detach() - leaves session's requests to complete on
+ * their own, they free what is left
+ *
+ * Requests hold the socket open, they are cancelled before it is closed.
+ */
+static void connection_uring_detach(struct connection *c)
+{
+	struct connection_uring *u = c->uring;
+	struct connection_chunk *k, *tmp;
+
+	c->uring = NULL;
+	u->c = NULL;
+	list_del_init(&u->flush);
+
+	list_for_each_entry_safe(k, tmp, &u->chunks, list)
+	{
+		if (k->sending)
+			continue;
+
+		u->queued -= k->len - k->sent;
+		list_del(&k->list);
+		free(k);
+	}
+
+	if (!u->requests)
+		connection_uring_free(u);
+	else if (uring_cancel_fd(u->fd))
+		ERROR("unable to cancel io_uring requests\n");
+}
+
+static void connection_uring_listen(struct listener *l, bool accept);
+
+/*
+ * connection_uring_accept() - starts session for connection accepted by
+ * listener's multishot accept
+ */
+static void connection_uring_accept(struct uring_req *r, int res, char *data, bool more)
+{
+	struct listener *l = container_of(r, struct listener, accept);
+	struct connection *c;
+	socklen_t sl;
+
+	if (!more)
+	{
+		l->armed = false;
+
+		// accept stops on errors like running out of descriptors, it is
+		// tried again as a level triggered listener would be
+		if (l->accepting)
+			connection_uring_listen(l, true);
+	}
+
+	if (res < 0)
+	{
+		if (res != -ECANCELED)
+			ERROR("failed accepting connection\n");
+
+		return;
+	}
+
+	if (!next_connection)
+		next_connection = calloc(1, sizeof(*next_connection));
+
+	if (next_connection && !next_connection->uring)
+		next_connection->uring = malloc(sizeof(*next_connection->uring));
+
+	if (!next_connection || !next_connection->uring)
+	{
+		ERROR("not enough memory to accept connection\n");
+		close(res);
+		return;
+	}
+
+	c = next_connection;
+	sl = sizeof(c->peer);
+
+	if (getpeername(res, (struct sockaddr *) &c->peer, &sl))
+		memset(&c->peer, 0, sizeof(c->peer));
+
+	LOG("received new connection\n");
+
+	if (!connection_start(c, res, -1))
+		next_connection = NULL;
+}
+
+/*
+ * connection_uring_listen() - starts or stops listener's multishot accept
+ *
+ * Connections accepted before it stopped become sessions right away, so
+ * none is left behind for a daemon taking over.
+ */
+static void connection_uring_listen(struct listener *l, bool accept)
+{
+	l->accepting = accept;
+
+	if (accept && !l->armed)
+	{
+		if (uring_accept(&l->accept, l->fd.fd))
+		{
+			ERROR("unable to accept connections\n");
+			return;
+		}
+
+		l->armed = true;
+		connection_uring_kick();
+	}
+	else if (!accept && l->armed)
+	{
+		if (uring_cancel_sync(l->fd.fd))
+			ERROR("unable to stop accepting connections\n");
+
+		uring_complete();
+	}
+}
+
+/*
+ * connection_uring_start() - moves plain sessions and their listeners to
+ * io_uring, they stay with uloop if the kernel can't do it
+ */
+static void connection_uring_start(void)
+{
+	if (uring_fd() >= 0)
+		return;
+
+	if (uring_init())
+	{
+#ifdef FREENETCONFD_IO_URING
+		LOG("io_uring not available, using uloop\n");
+#endif
+		return;
+	}
+
+	// replica's copy of the writer's is left from before the fork
+	uloop_fd_delete(&uring_event);
+	uring_event.fd = uring_fd();
+	uloop_fd_add(&uring_event, ULOOP_READ);
+
+	DEBUG("plain sessions on io_uring\n");
+}
+
+/*
+ * connection_accept() - accepts one connection
+ *
+ * Return: 1 if a connection was accepted or refused, 0 if there is none
+ * waiting, -1 on error
+ */
+static int connection_accept(struct listener *l)
+{
+	struct connection *c;
+	socklen_t sl = sizeof(c->peer);
+	int sfd;
+
+	if (l->kind == LISTENER_SUBSYSTEM)
+		return connection_front(l);
+
+	if (l->kind == LISTENER_MUX)
+		return connection_mux_accept(l);
+
+	if (l->kind == LISTENER_TLS)
+		return connection_tls_accept(l);
+
+	if (!next_connection)
+	{
+		next_connection = calloc(1, sizeof(*next_connection));
+	}
+
+	if (!next_connection)
+	{
+		ERROR("not enough memory to accept connection\n");
+		return -1;
+	}
+
+	c = next_connection;
+	sfd = accept4(l->fd.fd, (struct sockaddr *) &c->peer, &sl, SOCK_CLOEXEC);
+
+	if (sfd < 0)
+	{
+		if (errno == EAGAIN || errno == EWOULDBLOCK)
+			return 0;
+
+		if (errno == EINTR || errno == ECONNABORTED)
+			return 1;
+
+		ERROR("failed accepting connection\n");
+		return -1;
+	}
+
+	LOG("received new connection\n");
+
+	if (!connection_start(c, sfd, -1))
+		next_connection = NULL;
+
+	return 1;
+}
+
+/*
+ * connection_accept_cb() - accepts connections until none are waiting or
+ * the listener's batch is used up
+ *
+ * Listening socket is level triggered, connections left over are taken in
+ * the next iteration, after other events had their turn.
+ */
+static void connection_accept_cb(struct uloop_fd *fd, unsigned int events)
+{
+	struct listener *l = container_of(fd, struct listener, fd);
+
+	for (unsigned int i = 0; i < l->batch; i++)
+	{
+		if (connection_accept(l) <= 0)
+			break;
+	}
+}
+
+/*
+ * connection_adopt() - takes rpcs forwarded by a replica on fd
+ *
+ * Replica already exchanged hellos and checked limits of its sessions, rpcs
+ * of all of them come in base 1.1 framing.
+ */
+int connection_adopt(int fd, int replica)
+{
+	struct connection *c = calloc(1, sizeof(*c));
+
+	if (!c)
+		return -1;
+
+	connection_init(c);
+	c->step = NETCONF_MSG_STEP_HEADER_1;
+	c->base = 1;
+	c->control = true;
+	c->replica = replica;
+
+	ustream_fd_init(&c->us, fd);
+	list_add_tail(&c->list, &connections);
+
+	return 0;
+}
+
+/*
+ * connection_upstream() - forwards rpcs that may change the datastore
+ * to the writer on fd
+ */
+int connection_upstream(int fd)
+{
+	struct connection *c = calloc(1, sizeof(*c));
+
+	if (!c)
+		return -1;
+
+	connection_init(c);
+	c->step = NETCONF_MSG_STEP_HEADER_1;
+	c->base = 1;
+	c->upstream = true;
+
+	// not a session
+	INIT_LIST_HEAD(&c->list);
+
+	ustream_fd_init(&c->us, fd);
+	upstream = c;
+
+	return 0;
+}
+
+static void
+connection_close(struct ustream *s)
+{
+	struct connection *c = container_of(s, struct connection, us.stream);
+
+	char *data;
+	int data_len;
+
+	data = ustream_get_read_buf(s, &data_len);
+
+	if (data)
+	{
+		ustream_consume(s, data_len);
+	}
+
+	ustream_set_read_blocked(s, true);
+
+	// last reply goes out first, connection_timeout() frees it
+	c->closing = true;
+	c->active = connection_now();
+	wheel_timer_set(&c->timer, 0);
+
+	LOG("closing connection\n");
+}
+
+void
+connection_dump(struct blob_buf *b)
+{
+	struct connection *c;
+	void *array, *table;
+	char addr[INET6_ADDRSTRLEN];
+	struct sockaddr_in *sin;
+	struct sockaddr_in6 *sin6;
+
+	blobmsg_add_u32(b, "pooled-buffers", buffer_pool_count);
+
+	array = blobmsg_open_array(b, "sessions");
+
+	list_for_each_entry(c, &connections, list)
+	{
+		table = blobmsg_open_table(b, NULL);
+		blobmsg_add_u32(b, "session-id", c->session_id);
+
+		if (c->peer.ss_family == AF_INET)
+		{
+			sin = (struct sockaddr_in *) &c->peer;
+
+			if (inet_ntop(AF_INET, &sin->sin_addr, addr, sizeof(addr)))
+				blobmsg_add_string(b, "address", addr);
+
+			blobmsg_add_u32(b, "port", ntohs(sin->sin_port));
+		}
+		else if (c->peer.ss_family == AF_INET6)
+		{
+			sin6 = (struct sockaddr_in6 *) &c->peer;
+
+			if (inet_ntop(AF_INET6, &sin6->sin6_addr, addr, sizeof(addr)))
+				blobmsg_add_string(b, "address", addr);
+
+			blobmsg_add_u32(b, "port", ntohs(sin6->sin6_port));
+		}
+		else if (c->peer.ss_family == AF_UNIX)
+		{
+			blobmsg_add_string(b, "address", "unix");
+		}
+
+		if (c->mux)
+			blobmsg_add_u32(b, "channel", c->channel);
+
+		blobmsg_add_u32(b, "output-queued", connection_pending(c));
+		blobmsg_add_u8(b, "paused", c->paused);
+		blobmsg_add_u8(b, "streaming", !!c->stream);
+		blobmsg_add_u8(b, "queued", c->queued);
+		blobmsg_add_u8(b, "working", c->working);
+		blobmsg_add_u8(b, "replica", c->control);
+		blobmsg_add_u8(b, "subscribed", !!c->subscription);
+		blobmsg_add_u32(b, "memory", connection_memory(c));
+		blobmsg_close_table(b, table);
+	}
+
+	blobmsg_close_array(b, array);
+}
+
+/*
+ * Handoff records, sent over a stream socket to the upgraded daemon. Session
+ * socket, output and front of subsystem session and spool file go along as
+ * descriptors in that order, rpc received so far follows the record and
+ * create-subscription of a subscribed session follows that.
+ *
+ * Each daemon sends a hello before its first record, the old one before
+ * listening sockets and the upgraded one once it is ready. Records are only
+ * read from a peer whose hello matches, fields have the same width on both
+ * ends and no padding.
+ */
+#define HANDOFF_MAGIC 0x66666f646e616866ULL // "fhandoff"
+#define HANDOFF_VERSION 1
+#define HANDOFF_FDS 4
+
+#define HANDOFF_FD_OUT (1<<0)
+#define HANDOFF_FD_FRONT (1<<1)
+#define HANDOFF_FD_SPILL (1<<2)
+
+enum connection_handoff_type
+{
+	HANDOFF_LISTEN = 1, // listening socket
+	HANDOFF_START, // old daemon stopped accepting, last session id
+	HANDOFF_SESSION,
+	HANDOFF_DONE
+};
+
+struct connection_handoff_hello
+{
+	uint64_t magic;
+	uint32_t version;
+	uint32_t record_size; // of struct connection_handoff
+};
+
+struct connection_handoff
+{
+	uint64_t msg_len;
+	uint64_t msg_size;
+	uint64_t rate_tokens;
+	uint64_t rate_time;
+	uint64_t buf_len;
+	uint64_t subscription_len; // create-subscription, after the rpc
+	uint32_t type;
+	uint32_t session_id;
+	uint32_t listeners; // in total, listening socket records only
+	uint32_t batch;
+	int32_t step;
+	int32_t base;
+	int32_t header_len;
+	uint8_t kind;
+	uint8_t denied;
+	uint8_t fds; // HANDOFF_FD_* sent along with session socket
+	uint8_t reserved;
+	char header[16];
+	uint8_t peer[128]; // struct sockaddr_storage
+};
+
+static int connection_send_all(int fd, const char *data, size_t len)
+{
+	ssize_t written;
+
+	while (len)
+	{
+		written = send(fd, data, len, MSG_NOSIGNAL);
+
+		if (written < 0)
+		{
+			if (errno == EINTR)
+				continue;
+
+			return -1;
+		}
+
+		data += written;
+		len -= written;
+	}
+
+	return 0;
+}
+
+static int connection_read_all(int fd, char *data, size_t len)
+{
+	ssize_t got;
+
+	while (len)
+	{
+		got = read(fd, data, len);
+
+		if (got < 0 && errno == EINTR)
+			continue;
+
+		if (got <= 0)
+			return -1;
+
+		data += got;
+		len -= got;
+	}
+
+	return 0;
+}
+
+static int connection_handoff_hello(int fd)
+{
+	struct connection_handoff_hello hello =
+	{
+		.magic = HANDOFF_MAGIC,
+		.version = HANDOFF_VERSION,
+		.record_size = sizeof(struct connection_handoff)
+	};
+
+	return connection_send_all(fd, (char *) &hello, sizeof(hello));
+}
+
+/*
+ * connection_handoff_check() - receives hello of the other daemon
+ *
+ * Return: 0 if it sends records this daemon reads, 1 if it doesn't, -1 on
+ * error or end of file
+ */
+static int connection_handoff_check(int fd)
+{
+	struct connection_handoff_hello hello;
+
+	if (connection_read_all(fd, (char *) &hello, sizeof(hello)))
+		return -1;
+
+	if (hello.magic != HANDOFF_MAGIC)
+	{
+		ERROR("other daemon doesn't speak handoff\n");
+		return 1;
+	}
+
+	if (hello.version != HANDOFF_VERSION || hello.record_size != sizeof(struct connection_handoff))
+	{
+		ERROR("other daemon speaks handoff version %" PRIu32 ", this one %d\n", hello.version, HANDOFF_VERSION);
+		return 1;
+	}
+
+	return 0;
+}
+
+static int connection_handoff_send(struct connection_handoff *h, int *fds, int fds_count, const char *data, size_t len)
+{
+	char control[CMSG_SPACE(HANDOFF_FDS * sizeof(int))];
+	struct iovec iov[2] = { { h, sizeof(*h) }, { (void *) data, len } };
+	struct msghdr msg = { .msg_iov = iov, .msg_iovlen = data ? 2 : 1 };
+	struct cmsghdr *cmsg;
+	ssize_t written;
+
+	if (fds_count)
+	{
+		memset(control, 0, sizeof(control));
+		msg.msg_control = control;
+		msg.msg_controllen = CMSG_SPACE(fds_count * sizeof(int));
+
+		cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(fds_count * sizeof(int));
+		memcpy(CMSG_DATA(cmsg), fds, fds_count * sizeof(int));
+	}
+
+	do
+		written = sendmsg(handoff_fd, &msg, MSG_NOSIGNAL);
+	while (written < 0 && errno == EINTR);
+
+	if (written < 0)
+		return -1;
+
+	// descriptors went with the first byte, the rest is plain data
+	if ((size_t) written < sizeof(*h))
+		return connection_send_all(handoff_fd, (char *) h + written, sizeof(*h) - written) ||
+			   connection_send_all(handoff_fd, data, data ? len : 0);
+
+	written -= sizeof(*h);
+
+	return connection_send_all(handoff_fd, data + written, data ? len - written : 0);
+}
+
+/*
+ * connection_handoff_receive() - receives record with up to HANDOFF_FDS
+ * descriptors
+ *
+ * Return: 0 on success, -1 on error or end of file
+ */
+static int connection_handoff_receive(int fd, struct connection_handoff *h, int *fds, int *fds_count)
+{
+	char control[CMSG_SPACE(HANDOFF_FDS * sizeof(int))];
+	struct iovec iov = { .iov_base = h, .iov_len = sizeof(*h) };
+	struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1, .msg_control = control, .msg_controllen = sizeof(control) };
+	struct cmsghdr *cmsg;
+	ssize_t len;
+
+	*fds_count = 0;
+
+	do
+		len = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC);
+	while (len < 0 && errno == EINTR);
+
+	for (cmsg = CMSG_FIRSTHDR(&msg); len > 0 && cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg))
+	{
+		if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+			continue;
+
+		*fds_count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		memcpy(fds, CMSG_DATA(cmsg), *fds_count * sizeof(int));
+	}
+
+	if (len <= 0 || connection_read_all(fd, (char *) h + len, sizeof(*h) - len))
+	{
+		for (int i = 0; i < *fds_count; i++)
+			close(fds[i]);
+
+		*fds_count = 0;
+
+		return -1;
+	}
+
+	return 0;
+}
+
+static void connection_handoff_timeout(int fd)
+{
+	struct timeval tv = { .tv_sec = CONNECTION_HANDOFF_TIMEOUT };
+
+	// a stuck peer fails the handoff instead of stopping this daemon
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+}
+
+static int connection_handoff_session(struct connection *c)
+{
+	const char *subscription = c->subscription ? subscription_rpc(c->subscription) : NULL;
+	char *data = c->buf;
+	int rc;
+	struct connection_handoff h =
+	{
+		.type = HANDOFF_SESSION,
+		.session_id = c->session_id,
+		.step = c->step,
+		.base = c->base,
+		.msg_len = c->msg_len,
+		.msg_size = c->msg_size,
+		.header_len = c->header_len,
+		.denied = c->denied,
+		.rate_tokens = c->rate_tokens,
+		.rate_time = c->rate_time,
+		.buf_len = c->buf_len,
+		.subscription_len = subscription ? strlen(subscription) : 0
+	};
+	int fds[HANDOFF_FDS] = { c->us.fd.fd }, fds_count = 1;
+
+	if (c->out.fd >= 0)
+	{
+		h.fds |= HANDOFF_FD_OUT;
+		fds[fds_count++] = c->out.fd;
+	}
+
+	if (c->front >= 0)
+	{
+		h.fds |= HANDOFF_FD_FRONT;
+		fds[fds_count++] = c->front;
+	}
+
+	if (c->spill_fd >= 0)
+	{
+		h.fds |= HANDOFF_FD_SPILL;
+		fds[fds_count++] = c->spill_fd;
+	}
+
+	memcpy(h.header, c->header, sizeof(h.header));
+	memcpy(h.peer, &c->peer, sizeof(h.peer));
+
+	if (subscription)
+	{
+		if (!(data = malloc(h.buf_len + h.subscription_len)))
+			return -1;
+
+		if (c->buf_len)
+			memcpy(data, c->buf, c->buf_len);
+
+		memcpy(data + h.buf_len, subscription, h.subscription_len);
+	}
+
+	rc = connection_handoff_send(&h, fds, fds_count, data, h.buf_len + h.subscription_len);
+
+	if (data != c->buf)
+		free(data);
+
+	return rc;
+}
+
+/*
+ * connection_release() - forgets session handed over to the upgraded daemon
+ */
+static void connection_release(struct connection *c)
+{
+	list_del(&c->list);
+	connection_unhash(c);
+	wheel_timer_cancel(&c->timer);
+	wheel_timer_cancel(&c->shrink);
+	wheel_timer_cancel(&c->stall);
+	ustream_free(&c->us.stream);
+	connection_close_fds(c);
+	connection_free(c);
+}
+
+/*
+ * connection_retire_cb() - closes or hands over sessions once they are idle
+ */
+static void connection_retire_cb(struct uloop_timeout *t)
+{
+	struct connection *c, *tmp;
+	bool expired = config.drain_timeout && connection_now() >= retire_deadline;
+	unsigned int left = 0;
+
+	list_for_each_entry_safe(c, tmp, &connections, list)
+	{
+		// replicas drain as well and close theirs when they exit
+		if (c->control)
+		{
+			if (!expired)
+				left++;
+
+			continue;
+		}
+
+		// partial hello is only in the read buffer, it can't be handed over,
+		// neither can a session the kernel still reads for
+		if (!connection_idle(c) ||
+			(handoff_fd >= 0 && (ustream_pending_data(&c->us.stream, false) || (c->uring && c->uring->reading))))
+		{
+			if (!expired)
+			{
+				left++;
+				continue;
+			}
+
+			LOG("session %" PRIu32 " still busy, closing it\n", c->session_id);
+			notify_state(&c->us.stream);
+			continue;
+		}
+
+		// translator opens the channel again on the upgraded daemon, tls
+		// client reconnects unless the kernel does its record layer
+		if (handoff_fd < 0 || c->closing || c->mux || c->tls)
+		{
+			DEBUG("session %" PRIu32 " drained\n", c->session_id);
+			notify_state(&c->us.stream);
+			continue;
+		}
+
+		if (connection_handoff_session(c))
+		{
+			ERROR("unable to hand sessions over, draining them\n");
+			close(handoff_fd);
+			handoff_fd = -1;
+			left++;
+			continue;
+		}
+
+		DEBUG("session %" PRIu32 " handed over\n", c->session_id);
+		connection_release(c);
+	}
+
+	if (left)
+	{
+		uloop_timeout_set(t, CONNECTION_RETIRE_MS);
+		return;
+	}
+
+	if (handoff_fd >= 0)
+	{
+		struct connection_handoff h = { .type = HANDOFF_DONE };
+
+		connection_handoff_send(&h, NULL, 0, NULL, 0);
+		close(handoff_fd);
+		handoff_fd = -1;
+	}
+
+	LOG("no sessions left, exiting\n");
+	uloop_end();
+}
+
+/*
+ * connection_retire() - stops accepting and reading new rpcs
+ *
+ * Rpcs already received are handled and their replies sent, sessions are
+ * then closed or handed over.
+ */
+static void connection_retire(void)
+{
+	struct connection *c;
+
+	retiring = true;
+	retire_deadline = connection_now() + (uint64_t) config.drain_timeout * 1000;
+
+	server_exit();
+
+	list_for_each_entry(c, &connections, list)
+	{
+		if (!c->control)
+			ustream_set_read_blocked(&c->us.stream, true);
+	}
+
+	uloop_timeout_set(&retire_timer, 0);
+}
+
+void connection_drain(void)
+{
+	if (retiring)
+		return;
+
+	LOG("draining sessions\n");
+
+	connection_retire();
+}
+
+int connection_retiring(void)
+{
+	return retiring;
+}
+
+int connection_handoff_listen(int fd)
+{
+	struct connection_handoff h = { .type = HANDOFF_LISTEN, .listeners = listener_count };
+	int rc = 0;
+
+	if (!listener_count)
+		return -1;
+
+	handoff_fd = fd;
+	connection_handoff_timeout(fd);
+
+	rc = connection_handoff_hello(fd);
+
+	for (unsigned int i = 0; i < listener_count && !rc; i++)
+	{
+		h.batch = listeners[i].batch;
+		h.kind = listeners[i].kind;
+		rc = connection_handoff_send(&h, &listeners[i].fd.fd, 1, NULL, 0);
+	}
+
+	handoff_fd = -1;
+
+	return rc;
+}
+
+int connection_handoff(int fd)
+{
+	struct connection_handoff h = { .type = HANDOFF_START };
+
+	if (retiring || !listener_count)
+		return -1;
+
+	connection_handoff_timeout(fd);
+
+	switch (connection_handoff_check(fd))
+	{
+		case 0:
+			break;
+
+		case 1:
+			// it has the listening sockets, clients reconnect to it
+			LOG("upgraded daemon can't take sessions over, draining them\n");
+			close(fd);
+			connection_retire();
+			return 0;
+
+		default:
+			return -1;
+	}
+
+	// sessions accepted from now on are the upgraded daemon's, their ids
+	// continue after the last one here
+	server_accept(false);
+
+	h.session_id = session_id;
+	handoff_fd = fd;
+
+	if (connection_handoff_send(&h, NULL, 0, NULL, 0))
+	{
+		handoff_fd = -1;
+		server_accept(true);
+		return -1;
+	}
+
+	// dynamic subscriptions aren't handed over, subscribers are told
+	push_terminate();
+
+	connection_retire();
+
+	return 0;
+}
+
+/*
+ * connection_takeover_session() - continues session handed over by the old
+ * daemon where it stopped
+ */
+static int connection_takeover_session(int fd, struct connection_handoff *h, int *fds, int fds_count)
+{
+	struct connection *c;
+	char *buf = NULL, *subscription = NULL;
+	subscription_t *s = NULL;
+	int sent = 1, out = -1, front = -1, spill = -1;
+
+	if (h->fds & HANDOFF_FD_OUT)
+		out = sent++;
+
+	if (h->fds & HANDOFF_FD_FRONT)
+		front = sent++;
+
+	if (h->fds & HANDOFF_FD_SPILL)
+		spill = sent++;
+
+	if (h->buf_len)
+	{
+		buf = malloc(h->buf_len + 1);
+
+		if (!buf || connection_read_all(fd, buf, h->buf_len))
+		{
+			free(buf);
+			return -1;
+		}
+
+		buf[h->buf_len] = '\0';
+	}
+
+	if (h->subscription_len)
+	{
+		subscription = malloc(h->subscription_len + 1);
+
+		if (!subscription || connection_read_all(fd, subscription, h->subscription_len))
+		{
+			free(subscription);
+			free(buf);
+			return -1;
+		}
+
+		subscription[h->subscription_len] = '\0';
+
+		// stream may be gone in this version, session goes on without it
+		if (!(s = subscription_restore(subscription)))
+			LOG("session %" PRIu32 " lost its subscription\n", h->session_id);
+
+		free(subscription);
+	}
+
+	c = calloc(1, sizeof(*c));
+
+	if (!c || fds_count != sent || (unsigned int) h->header_len >= sizeof(c->header))
+	{
+		subscription_free(s);
+		free(buf);
+		free(c);
+		return -1;
+	}
+
+	connection_init(c);
+	c->session_id = h->session_id;
+	memcpy(&c->peer, h->peer, sizeof(h->peer));
+	c->step = h->step;
+	c->base = h->base;
+	c->msg_len = h->msg_len;
+	c->msg_size = h->msg_size;
+	memcpy(c->header, h->header, sizeof(c->header));
+	c->header_len = h->header_len;
+	c->denied = h->denied;
+	c->rate_tokens = h->rate_tokens;
+	c->rate_time = h->rate_time;
+	c->buf = buf;
+	c->buf_len = h->buf_len;
+	c->buf_size = buf ? h->buf_len + 1 : 0;
+	c->spill_fd = spill >= 0 ? fds[spill] : -1;
+	c->subscription = s;
+
+	if (connection_hash(c))
+	{
+		// caller closes the descriptors
+		c->spill_fd = -1;
+		connection_free(c);
+		return -1;
+	}
+
+	if (out < 0 && front < 0 && uring_fd() >= 0)
+		c->uring = malloc(sizeof(*c->uring));
+
+	if (c->uring)
+		connection_uring_init(c, fds[0]);
+	else
+		ustream_fd_init(&c->us, fds[0]);
+
+	if (out >= 0)
+		connection_output(c, fds[out]);
+
+	c->front = front >= 0 ? fds[front] : -1;
+	list_add_tail(&c->list, &connections);
+	connection_arm(c);
+
+	// stopTime of the subscription may come before the idle timeout
+	if (s && subscription_timeout(s) >= 0)
+		wheel_timer_set(&c->timer, 0);
+
+	if (retiring)
+		ustream_set_read_blocked(&c->us.stream, true);
+
+	DEBUG("session %" PRIu32 " taken over\n", c->session_id);
+
+	return 0;
+}
+
+static void connection_takeover_cb(struct uloop_fd *fd, unsigned int events)
+{
+	struct connection_handoff h;
+	int fds[HANDOFF_FDS], fds_count;
+
+	if (connection_handoff_receive(fd->fd, &h, fds, &fds_count))
+		goto done;
+
+	switch (h.type)
+	{
+		case HANDOFF_START:
+			session_id = h.session_id;
+			server_accept(true);
+			return;
+
+		case HANDOFF_SESSION:
+			if (!connection_takeover_session(fd->fd, &h, fds, fds_count))
+				return;
+
+			ERROR("unable to take session over\n");
+			break;
+
+		case HANDOFF_DONE:
+			LOG("all sessions taken over\n");
+			break;
+
+		default:
+			ERROR("unexpected handoff record\n");
+			break;
+	}
+
+	for (int i = 0; i < fds_count; i++)
+		close(fds[i]);
+
+done:
+	uloop_fd_delete(fd);
+	close(fd->fd);
+	fd->fd = -1;
+
+	// old daemon went away before it stopped accepting
+	server_accept(true);
+}
+
+void connection_takeover(int fd)
+{
+	connection_handoff_timeout(fd);
+
+	// old daemon drains instead if it can't read this daemon's records
+	if (connection_handoff_hello(fd))
+	{
+		ERROR("daemon being upgraded went away\n");
+		close(fd);
+		server_accept(true);
+		return;
+	}
+
+	takeover.fd = fd;
+	uloop_fd_add(&takeover, ULOOP_READ | ULOOP_BLOCKING);
+}
+
+/*
+ * server_listen() - opens listening socket other processes may bind as well
+ *
+ * Writer and every replica have their own socket on the same address,
+ * kernel spreads new connections among them.
+ */
+static int server_listen(const char *addr, const char *port)
+{
+	struct addrinfo hints = { .ai_flags = AI_PASSIVE, .ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM };
+	struct addrinfo *result, *ai;
+	int fd = -1, on = 1;
+
+	if (getaddrinfo(addr, port, &hints, &result))
+		return -1;
+
+	for (ai = result; ai; ai = ai->ai_next)
+	{
+		fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC | SOCK_NONBLOCK, ai->ai_protocol);
+
+		if (fd < 0)
+			continue;
+
+		if (!setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) &&
+			(!config.replicas || !setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on))) &&
+			!bind(fd, ai->ai_addr, ai->ai_addrlen) &&
+			!listen(fd, SOMAXCONN))
+			break;
+
+		close(fd);
+		fd = -1;
+	}
+
+	freeaddrinfo(result);
+
+	return fd;
+}
+
+/*
+ * server_listen_unix() - opens listening unix socket on path
+ *
+ * Socket left behind by a daemon that did not exit cleanly is replaced.
+ */
+static int server_listen_unix(struct config_listener *cl)
+{
+	struct sockaddr_un sun = { .sun_family = AF_UNIX };
+	struct group *gr;
+	int fd;
+
+	if (strlen(cl->path) >= sizeof(sun.sun_path))
+		return -1;
+
+	strcpy(sun.sun_path, cl->path);
+
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+
+	if (fd < 0)
+		return -1;
+
+	unlink(cl->path);
+
+	if (bind(fd, (struct sockaddr *) &sun, sizeof(sun)))
+		goto error;
+
+	if (cl->mode && chmod(cl->path, cl->mode))
+		goto error;
+
+	if (cl->group)
+	{
+		gr = getgrnam(cl->group);
+
+		if (!gr || chown(cl->path, -1, gr->gr_gid))
+		{
+			ERROR("unable to give '%s' to group '%s'\n", cl->path, cl->group);
+			goto error;
+		}
+	}
+
+	if (listen(fd, SOMAXCONN))
+		goto error;
+
+	return fd;
+
+error:
+	close(fd);
+
+	return -1;
+}
+
+/*
+ * server_add() - adds listening socket, accepting starts with server_accept()
+ */
+static int server_add(int fd, unsigned int batch, int kind)
+{
+	struct listener *l;
+
+	l = realloc(listeners, (listener_count + 1) * sizeof(*listeners));
+
+	if (!l)
+		return -1;
+
+	listeners = l;
+	l = &listeners[listener_count++];
+	memset(l, 0, sizeof(*l));
+	l->fd.fd = fd;
+	l->fd.cb = connection_accept_cb;
+	l->batch = batch ? batch : 1;
+	l->kind = kind;
+	l->accept.cb = connection_uring_accept;
+
+	return 0;
+}
+
+/*
+ * server_accept() - starts or stops accepting connections on all listeners
+ */
+static void server_accept(bool accept)
+{
+	struct listener *l;
+
+	for (unsigned int i = 0; i < listener_count; i++)
+	{
+		l = &listeners[i];
+
+		if (l->kind == LISTENER_NETCONF && uring_fd() >= 0)
+			connection_uring_listen(l, accept);
+		else if (accept && !l->fd.registered)
+			uloop_fd_add(&l->fd, ULOOP_READ);
+		else if (!accept)
+			uloop_fd_delete(&l->fd);
+	}
+}
+
+int
+server_init()
+{
+	struct config_listener *cl;
+	int fd, kind;
+
+	connection_uring_start();
+
+	for (unsigned int i = 0; i < config.listener_count; i++)
+	{
+		cl = &config.listeners[i];
+
+		// path is bound by the writer only
+		if (cl->path && upstream)
+			continue;
+
+		if (cl->path)
+			fd = server_listen_unix(cl);
+		else
+			fd = server_listen(cl->addr, cl->port);
+
+		if (fd < 0)
+		{
+			if (cl->path)
+				ERROR("unable to open socket %s\n", cl->path);
+			else
+				ERROR("unable to open socket %s:%s\n", cl->addr, cl->port);
+
+			server_exit();
+			return -1;
+		}
+
+		kind = cl->subsystem ? LISTENER_SUBSYSTEM : cl->mux ? LISTENER_MUX :
+			   cl->tls ? LISTENER_TLS : LISTENER_NETCONF;
+
+		if (kind == LISTENER_TLS && tls_init())
+		{
+			close(fd);
+			server_exit();
+			return -1;
+		}
+
+		if (server_add(fd, cl->batch, kind))
+		{
+			ERROR("not enough memory\n");
+			close(fd);
+			server_exit();
+			return -1;
+		}
+
+		if (cl->subsystem)
+			LOG("accepting subsystem sessions on '%s'\n", cl->path);
+		else if (cl->mux && cl->path)
+			LOG("accepting multiplexed sessions on '%s'\n", cl->path);
+		else if (cl->mux)
+			LOG("accepting multiplexed sessions on '%s:%s'\n", cl->addr, cl->port);
+		else if (cl->tls)
+			LOG("accepting tls connections on '%s:%s'\n", cl->addr, cl->port);
+		else if (cl->path)
+			LOG("accepting connections on '%s'\n", cl->path);
+		else
+			LOG("accepting connections on '%s:%s'\n", cl->addr, cl->port);
+	}
+
+	server_accept(true);
+
+	return 0;
+}
+
+/*
+ * server_takeover() - takes listening sockets over from the daemon being
+ * upgraded, connections are accepted once it stops accepting
+ *
+ * Sockets are the old daemon's, listeners added to or removed from the
+ * config only take effect after a full restart.
+ */
+int server_takeover(int fd)
+{
+	struct connection_handoff h;
+	int fds[HANDOFF_FDS], fds_count;
+
+	connection_handoff_timeout(fd);
+	connection_uring_start();
+
+	if (connection_handoff_check(fd))
+	{
+		ERROR("unable to take listening sockets over\n");
+		server_exit();
+		return -1;
+	}
+
+	do
+	{
+		if (connection_handoff_receive(fd, &h, fds, &fds_count) || h.type != HANDOFF_LISTEN || fds_count != 1)
+		{
+			for (int i = 0; i < fds_count; i++)
+				close(fds[i]);
+
+			ERROR("unable to take listening socket over\n");
+			server_exit();
+			return -1;
+		}
+
+		if (h.kind == LISTENER_TLS && tls_init())
+		{
+			close(fds[0]);
+			server_exit();
+			return -1;
+		}
+
+		if (server_add(fds[0], h.batch, h.kind))
+		{
+			ERROR("not enough memory\n");
+			close(fds[0]);
+			server_exit();
+			return -1;
+		}
+	}
+	while (listener_count < h.listeners);
+
+	return 0;
+}
+
+/*
+ * server_exit() - closes listening sockets, unix socket paths are left for
+ * the daemon taking over or next one to replace
+ */
+void
+server_exit()
+{
+	server_accept(false);
+
+	for (unsigned int i = 0; i < listener_count; i++)
+		close(listeners[i].fd.fd);
+
+	free(listeners);
+	listeners = NULL;
+	listener_count = 0;
 }
@@ -16,6 +16,145 @@
 #ifndef __FREENETCONFD_CONNECTION_H__
 #define __FREENETCONFD_CONNECTION_H__
 
+#include <stdint.h>
+
+#include <libubox/blobmsg.h>
+
+#include "notifications.h"
+
 int server_init();
+void server_exit();
+
+/**
+ * server_takeover() - takes listening sockets over from the daemon being
+ * upgraded, see connection_handoff_listen()
+ *
+ * Nothing is accepted until connection_takeover() learns that the old
+ * daemon stopped accepting.
+ */
+int server_takeover(int fd);
+
+/**
+ * connection_adopt() - serves rpcs forwarded by replica on fd
+ */
+int connection_adopt(int fd, int replica);
+
+/**
+ * connection_upstream() - forwards rpcs of replica's sessions that may
+ * change the datastore to the writer on fd
+ */
+int connection_upstream(int fd);
+
+/**
+ * connection_id_space() - gives this process its own range of session-ids
+ *
+ * @index 0 in the writer, replica id + 1 in a replica
+ * @count number of processes handing out session-ids
+ *
+ * Session-ids are unique on the server, index goes to their high bits.
+ */
+void connection_id_space(unsigned int index, unsigned int count);
+
+/**
+ * connection_exclusive() - runs cb once no rpc reads or changes the datastore
+ *
+ * Rpcs received meanwhile wait until cb has run.
+ */
+void connection_exclusive(void (*cb)(void));
+
+/**
+ * connection_writing() - checks whether an rpc is changing the datastore
+ */
+int connection_writing(void);
+
+/**
+ * connection_drain() - stops accepting and reading rpcs, exits once every
+ * session is idle
+ *
+ * Rpcs already received are handled and their replies sent before sessions
+ * are closed. Sessions still busy after drain_timeout are closed anyway.
+ */
+void connection_drain(void);
+
+/**
+ * connection_retiring() - checks whether sessions are drained or handed over
+ */
+int connection_retiring(void);
+
+/**
+ * connection_handoff_listen() - sends listening sockets to the upgraded
+ * daemon on fd
+ *
+ * This daemon keeps accepting until connection_handoff() is called.
+ */
+int connection_handoff_listen(int fd);
+
+/**
+ * connection_handoff() - hands sessions over to the upgraded daemon on fd
+ *
+ * Accepting stops and sessions are drained like with connection_drain(),
+ * except that idle sessions are sent to the upgraded daemon with their
+ * socket and framing state instead of being closed. Clients notice nothing.
+ *
+ * Sessions are drained and closed instead if the upgraded daemon speaks
+ * another handoff version.
+ *
+ * Return: 0 on success, -1 if the upgraded daemon went away, this daemon
+ * then goes on as before
+ */
+int connection_handoff(int fd);
+
+/**
+ * connection_takeover() - continues sessions handed over on fd
+ */
+void connection_takeover(int fd);
+
+/**
+ * connection_kill() - closes session with id, unless its rpc is the one
+ * being handled
+ *
+ * Return: 0 on success, -1 if there is no such session
+ */
+int connection_kill(uint32_t id);
+
+/**
+ * connection_subscribe() - gives subscription to the session whose rpc is
+ * being handled
+ *
+ * Session keeps handling rpcs, notifications go out between replies.
+ *
+ * Return: 0 on success, -1 if the session has a subscription already
+ */
+int connection_subscribe(subscription_t *s);
+
+/**
+ * connection_notify() - queues notification to sessions subscribed to it,
+ * and to replicas which match it against theirs
+ */
+void connection_notify(notification_t *n);
+
+/**
+ * connection_session() - id of the session whose rpc is being handled
+ *
+ * Return: the id, 0 if no rpc of a session is being handled
+ */
+uint32_t connection_session(void);
+
+/**
+ * connection_deliver() - queues notification to the session with id only
+ *
+ * Return: 0 on success, -1 if there is no such session or its output is full
+ */
+int connection_deliver(uint32_t id, notification_t *n);
+
+/**
+ * connection_dump() - adds "sessions" array describing open connections to b
+ *
+ * Every session reports its id, peer, the number of reply bytes still
+ * queued for sending, whether reading of rpcs is paused, whether it has a
+ * subscription and the bytes of memory it holds. Read buffers kept for
+ * reuse are in "pooled-buffers".
+ */
+void connection_dump(struct blob_buf *b);
 
 #endif /* __FREENETCONFD_CONNECTION_H__ */
@@ -16,6 +16,9 @@
  */
 
 #include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
 
 #include "freenetconfd/freenetconfd.h"
 #include "freenetconfd/datastore.h"
@@ -23,33 +26,20 @@
 
 // nodes in processing implementation
 
-static ds_nip_t *ds_nip_has_node(ds_nip_t *nip_list_head, node_t *node)
+#define DS_NIP_INITIAL_SIZE 64
+
+static unsigned int ds_nip_hash(node_t *node)
 {
-	if (!nip_list_head)
-		return NULL;
+	uintptr_t p = (uintptr_t) node;
 
-	for (ds_nip_t *cur = nip_list_head->next; cur; cur = cur->next)
-	{
-		if (cur->node == node)
-			return cur;
-	}
+	p ^= p >> 4;
 
-	return NULL;
+	return (unsigned int) (p * 2654435761u);
 }
 
-/**
- * ds_nip_add() adds node to nip_list_head
- *
- * @nip_list_head nip_list_head representing the list
- * @node node to add to the list
- *
- * Return: pointer to nip_list_head, NULL on error
- *
- * Creates new list if nip_list_head == NULL
- */
-static ds_nip_t *ds_nip_add(ds_nip_t *nip_list_head, node_t *node)
+static ds_nip_t *ds_nip_create(void)
 {
-	ds_nip_t *nip = malloc(sizeof(ds_nip_t));
+	ds_nip_t *nip = calloc(1, sizeof(ds_nip_t));
 
 	if (!nip)
 	{
@@ -57,294 +47,1774 @@ static ds_nip_t *ds_nip_add(ds_nip_t *nip_list_head, node_t *node)
 		return NULL;
 	}
 
-	nip->node = node;
-	nip->is_head = 0;
-
-	if (!nip_list_head)
-	{
-		nip_list_head = malloc(sizeof(ds_nip_t));
-
-		if (!nip_list_head)
-		{
-			ERROR("not enough memory\n");
-			return NULL;
-		}
+	nip->nodes = malloc(DS_NIP_INITIAL_SIZE * sizeof(node_t *));
+	nip->slots = calloc(DS_NIP_INITIAL_SIZE * 2, sizeof(unsigned int));
 
-		nip_list_head->is_head = 1;
-		nip->next = NULL;
-	}
-	else
+	if (!nip->nodes || !nip->slots)
 	{
-		nip->next = nip_list_head->next;
+		ERROR("not enough memory\n");
+		free(nip->nodes);
+		free(nip->slots);
+		free(nip);
+		return NULL;
 	}
 
-	nip_list_head->next = nip;
+	nip->nodes_size = DS_NIP_INITIAL_SIZE;
+	nip->slots_size = DS_NIP_INITIAL_SIZE * 2;
 
-	return nip_list_head;
+	return nip;
 }
 
-static ds_nip_t *ds_nip_add_unique(ds_nip_t *nip_list_head, node_t *node)
+static void ds_free_nip(ds_nip_t *nip)
 {
-	if (!ds_nip_has_node(nip_list_head, node))
-		return ds_nip_add(nip_list_head, node);
+	if (!nip)
+		return;
 
-	return nip_list_head;
+	free(nip->nodes);
+	free(nip->slots);
+	free(nip);
 }
 
-static void ds_free_nip(ds_nip_t *nip_list_head)
+/**
+ * ds_nip_slot() finds the slot holding node
+ *
+ * Return: pointer to the slot holding node, or to the empty slot
+ * where node should be inserted
+ */
+static unsigned int *ds_nip_slot(ds_nip_t *nip, node_t *node)
 {
-	if (!nip_list_head)
-		return;
+	unsigned int mask = nip->slots_size - 1;
 
-	ds_free_nip(nip_list_head->next);
-	nip_list_head->next = NULL;
-	free(nip_list_head);
+	for (unsigned int i = ds_nip_hash(node) & mask; ; i = (i + 1) & mask)
+	{
+		unsigned int *slot = &nip->slots[i];
+
+		// deleted nodes are left as tombstones and skipped over
+		if (!*slot || nip->nodes[*slot - 1] == node)
+			return slot;
+	}
 }
 
 /**
- * ds_nip_delete() deletes node from nip_list
+ * ds_nip_rehash() rebuilds slots from nodes, dropping deleted nodes
  *
- * Return: 0 on success, -1 on not found
+ * Return: 0 on success, -1 on error
  */
-static int ds_nip_delete(ds_nip_t *nip_list_head, node_t *node)
+static int ds_nip_rehash(ds_nip_t *nip)
 {
-	if (!nip_list_head)
-		return -1;
+	unsigned int count = 0;
+
+	for (unsigned int i = 0; i < nip->nodes_count; i++)
+	{
+		if (nip->nodes[i])
+			nip->nodes[count++] = nip->nodes[i];
+	}
 
-	ds_nip_t *cur, *prev;
+	nip->nodes_count = count;
 
-	for (prev = nip_list_head, cur = nip_list_head->next; prev && cur; cur = cur->next, prev = prev->next)
+	unsigned int slots_size = nip->slots_size;
+
+	while (count * 2 >= slots_size)
+		slots_size *= 2;
+
+	unsigned int *slots = calloc(slots_size, sizeof(unsigned int));
+
+	if (!slots)
 	{
-		if (cur->node == node)
-		{
-			prev->next = cur->next;
-			free(cur);
-			break;
-		}
+		ERROR("not enough memory\n");
+		return -1;
 	}
 
+	free(nip->slots);
+	nip->slots = slots;
+	nip->slots_size = slots_size;
+	nip->slots_used = count;
+
+	for (unsigned int i = 0; i < count; i++)
+		*ds_nip_slot(nip, nip->nodes[i]) = i + 1;
+
 	return 0;
 }
 
-enum ds_operation ds_get_operation(node_t *node)
+/**
+ * ds_nip_add_unique() adds node to nip if it isn't there already
+ *
+ * Return: 0 on success, -1 on error
+ */
+static int ds_nip_add_unique(ds_nip_t *nip, node_t *node)
 {
-	if (!node)
-		return OPERATION_MERGE;
+	unsigned int *slot = ds_nip_slot(nip, node);
 
-	node_t *operation_attr = roxml_get_attr(node, "operation", 0);
-	char *operation = roxml_get_content(operation_attr, NULL, 0, NULL);
+	if (*slot)
+		return 0;
 
-	if (!operation)
-		return OPERATION_MERGE;
+	// keep load factor (tombstones included) under 3/4
+	if ((nip->slots_used + 1) * 4 > nip->slots_size * 3)
+	{
+		if (ds_nip_rehash(nip))
+			return -1;
 
-	if (!strcmp(operation, "delete"))
-		return OPERATION_DELETE;
+		slot = ds_nip_slot(nip, node);
+	}
 
-	if (!strcmp(operation, "remove"))
-		return OPERATION_REMOVE;
+	if (nip->nodes_count == nip->nodes_size)
+	{
+		node_t **nodes = realloc(nip->nodes, nip->nodes_size * 2 * sizeof(node_t *));
 
-	if (!strcmp(operation, "create"))
-		return OPERATION_CREATE;
+		if (!nodes)
+		{
+			ERROR("not enough memory\n");
+			return -1;
+		}
 
-	if (!strcmp(operation, "merge"))
-		return OPERATION_MERGE;
+		nip->nodes = nodes;
+		nip->nodes_size *= 2;
+	}
 
-	if (!strcmp(operation, "replace"))
-		return OPERATION_REPLACE;
+	nip->nodes[nip->nodes_count++] = node;
+	*slot = nip->nodes_count;
+	nip->slots_used++;
 
-	return OPERATION_MERGE;
+	return 0;
 }
 
-void ds_print_key(ds_key_t *key)
+/**
+ * ds_nip_delete() deletes node from nip
+ *
+ * Return: 0 on success, -1 on not found
+ */
+static int ds_nip_delete(ds_nip_t *nip, node_t *node)
 {
-	printf("KEY:\n");
+	if (!nip)
+		return -1;
 
-	for (ds_key_t *cur = key; cur != NULL; cur = cur->next)
-	{
-		printf("name: %s\nvalue: %s\n-----------------\n", cur->name, cur->value);
-	}
+	unsigned int *slot = ds_nip_slot(nip, node);
+
+	if (!*slot)
+		return -1;
+
+	// slot stays occupied as a tombstone
+	nip->nodes[*slot - 1] = NULL;
+
+	return 0;
 }
 
-void ds_free_key(ds_key_t *key)
+/**
+ * ds_invalidate() tells streams reading below node that nodes get freed
+ *
+ * Called before freeing, possibly from worker threads, so the generation
+ * of node's root is changed atomically.
+ */
+static void ds_invalidate(datastore_t *node)
 {
-	if (key && key->next)
-		ds_free_key(key->next);
+	while (node->parent)
+		node = node->parent;
 
-	free(key);
+	__atomic_add_fetch(&node->generation, 1, __ATOMIC_SEQ_CST);
 }
 
-
-// makes key from xml data
-ds_key_t *ds_get_key_from_xml(node_t *root, datastore_t *our_root)
+/*
+ * versions replaced by ds_publish() waiting for their readers to finish
+ *
+ * Readers count themselves in ds_epoch_readers[] of the epoch parity they
+ * started in. Epoch only moves on once the other parity has no readers,
+ * so two epochs after a version was replaced nobody can still see it.
+ */
+typedef struct ds_retired
 {
-	int child_count = roxml_get_chld_nb(root);
+	datastore_t *node;
+	unsigned long epoch;
+	struct ds_retired *next;
+} ds_retired_t;
 
-	if (!child_count)
-		return NULL;
+static unsigned long ds_epoch;
+static unsigned int ds_epoch_readers[2];
+static ds_retired_t *ds_retired_head, *ds_retired_tail;
+static pthread_mutex_t ds_publish_lock = PTHREAD_MUTEX_INITIALIZER;
 
-	ds_key_t *rc = NULL;
-	ds_key_t *cur_key = NULL;
+// change tracking implementation, see ds_track()
 
-	for (int i = 0; i < child_count; i++)
-	{
-		node_t *child = roxml_get_chld(root, NULL, i);
-		char *key_name = roxml_get_name(child, NULL, 0);
-		char *key_value = roxml_get_content(child, NULL, 0, NULL);
+static ds_change_cb_t ds_change_cb;
 
-		// if it seems to be actual key
-		if (key_name && key_name[0] != '\0' && key_value && key_value[0] != '\0')
-		{
-			// if datastore provided see if tag with key_name has is_key flag
-			if (our_root && !ds_element_has_key_part(our_root, key_name, NULL))
-				continue;
+static const char *ds_string(const char *s)
+{
+	return s ? s : "";
+}
 
-			// make sure key part is correctly allocated
-			if (!rc)
-			{
-				rc = malloc(sizeof(ds_key_t));
+/**
+ * ds_tracking() returns callback if node is in a tracked datastore
+ */
+static ds_change_cb_t ds_tracking(datastore_t *node)
+{
+	ds_change_cb_t cb = __atomic_load_n(&ds_change_cb, __ATOMIC_ACQUIRE);
 
-				if (!rc)
-				{
-					ERROR("not enough memory\n");
-					return NULL;
-				}
+	if (!cb || !node)
+		return NULL;
 
-				cur_key = rc;
-			}
-			else
-			{
-				cur_key->next = malloc(sizeof(ds_key_t));
+	while (node->parent)
+		node = node->parent;
 
-				if (!cur_key->next)
-				{
-					ERROR("not enough memory\n");
-					return NULL;
-				}
+	return __atomic_load_n(&node->changed, __ATOMIC_ACQUIRE) & DS_CHANGE_TRACKED ? cb : NULL;
+}
 
-				cur_key = cur_key->next;
-			}
+/**
+ * ds_mark() marks node as changed and all its ancestors
+ *
+ * Goes all the way up even past ancestors already marked, ds_changes()
+ * may have cleared them since.
+ */
+static void ds_mark(datastore_t *node, unsigned int change)
+{
+	ds_change_cb_t cb = __atomic_load_n(&ds_change_cb, __ATOMIC_ACQUIRE);
 
-			cur_key->name = roxml_get_name(child, NULL, 0);
-			cur_key->value = key_value;
-			cur_key->next = NULL;
-		}
-	}
+	__atomic_or_fetch(&node->changed, change, __ATOMIC_SEQ_CST);
 
-	return rc;
+	for (datastore_t *cur = node->parent; cur; cur = cur->parent)
+		__atomic_or_fetch(&cur->changed, DS_CHANGE_BELOW, __ATOMIC_SEQ_CST);
+
+	if (cb)
+		cb(node, change);
 }
 
-void ds_init(datastore_t *datastore, char *name, char *value, char *ns)
+/**
+ * ds_created() checks if node or any of its ancestors were added since
+ * marks were last taken
+ */
+static int ds_created(datastore_t *node)
 {
-	datastore->name = name;
-	datastore->value = value;
-	datastore->ns = ns;
-	datastore->parent = datastore->child = datastore->prev = datastore->next = NULL;
-	datastore->get = NULL;
-	datastore->set = NULL;
-	datastore->set_multiple = NULL;
-	datastore->del = NULL;
-	datastore->create_child = NULL;
-	datastore->update = NULL;
-	datastore->is_config = 1;
-	datastore->is_list = datastore->is_key = 0;
-	datastore->choice_group = 0;
+	for (; node; node = node->parent)
+	{
+		if (__atomic_load_n(&node->changed, __ATOMIC_ACQUIRE) & DS_CHANGE_CREATE)
+			return 1;
+	}
+
+	return 0;
 }
 
-void ds_free(datastore_t *datastore, int free_siblings)
+static void ds_report_delete(ds_change_cb_t cb, datastore_t *node)
 {
-	if (!datastore)
-		return;
+	if (!ds_created(node))
+		cb(node, DS_CHANGE_DELETE);
+}
 
-	// make a clear end if we're not deleting root node
-	if (datastore->parent && !datastore->prev)
-		datastore->parent->child = datastore->next;
+/*
+ * children of two versions are matched by name, key values of list entries
+ * and, among siblings alike in both, by position
+ */
+typedef struct ds_ident
+{
+	datastore_t *node;
+	unsigned int nth;
+} ds_ident_t;
 
-	free(datastore->name);
-	datastore->name = NULL;
-	free(datastore->value);
-	datastore->value = NULL;
-	free(datastore->ns);
-	datastore->ns = NULL;
-	datastore->is_config = 1;
-	datastore->is_list = datastore->is_key = 0;
-	datastore->choice_group = 0;
+static int ds_keys_cmp(datastore_t *a, datastore_t *b)
+{
+	datastore_t *x = a->child, *y = b->child;
 
-	if (free_siblings)
+	for (;;)
 	{
-		ds_free(datastore->next, 1);
-		datastore->next = NULL;
-	}
+		while (x && !x->is_key)
+			x = x->next;
 
-	// keep the datastore clean and running
-	if (datastore->next)
-	{
-		if (datastore->prev)
-		{
-			datastore->prev->next = datastore->next;
-			datastore->next->prev = datastore->prev;
-		}
-		else
-		{
-			datastore->next->prev = NULL;
-		}
-	}
-	else if (datastore->prev)
-	{
-		datastore->prev->next = NULL;
-	}
+		while (y && !y->is_key)
+			y = y->next;
 
-	ds_free(datastore->child, 1);
-	datastore->child = NULL;
-	free(datastore);
+		if (!x || !y)
+			return !!x - !!y;
+
+		int rc = strcmp(ds_string(x->name), ds_string(y->name));
+
+		if (!rc)
+			rc = strcmp(ds_string(x->value), ds_string(y->value));
+
+		if (rc)
+			return rc;
+
+		x = x->next;
+		y = y->next;
+	}
 }
 
-datastore_t *ds_create(char *name, char *value, char *ns)
+static int ds_ident_alike(const ds_ident_t *a, const ds_ident_t *b)
 {
-	datastore_t *datastore = malloc(sizeof(datastore_t));
+	int rc = strcmp(ds_string(a->node->name), ds_string(b->node->name));
 
-	if (!datastore)
-		return 0;
+	return rc ? rc : ds_keys_cmp(a->node, b->node);
+}
 
-	ds_init(datastore,
-			name ? strdup(name) : NULL,
-			value ? strdup(value) : NULL,
-			ns ? strdup(ns) : NULL);
+static int ds_ident_cmp(const void *a, const void *b)
+{
+	const ds_ident_t *x = a, *y = b;
+	int rc = ds_ident_alike(x, y);
 
-	return datastore;
+	if (rc)
+		return rc;
+
+	return (x->nth > y->nth) - (x->nth < y->nth);
 }
 
-datastore_t *ds_create_path(datastore_t *root, node_t *path_endpoint)
+/**
+ * ds_idents() sorts children of node by identity
+ *
+ * Return: array of node->child_count identities, NULL on error
+ */
+static ds_ident_t *ds_idents(datastore_t *node)
 {
-	if (!root || !path_endpoint)
-		return root;
+	ds_ident_t *idents = malloc((node->child_count + 1) * sizeof(ds_ident_t));
+	unsigned int i = 0;
 
-	ds_nip_t *node_list = NULL;
+	if (!idents)
+		return NULL;
 
-	// get the list of nodes (path_endpoint's parent) in root-down order
-	for (node_t *cur = path_endpoint; strcmp(roxml_get_name(cur, NULL, 0), "config"); cur = roxml_get_parent(cur))
+	for (datastore_t *cur = node->child; cur && i < node->child_count; cur = cur->next, i++)
 	{
-		DEBUG("post-nip.add( %s )\n", roxml_get_name(cur, NULL, 0));
-		node_list = ds_nip_add(node_list, cur);
+		idents[i].node = cur;
+		idents[i].nth = i;
 	}
 
-	// get the real root of the plugin
-	root = root->parent;
+	// sorted by position among alike siblings, which is then their rank
+	qsort(idents, i, sizeof(ds_ident_t), ds_ident_cmp);
 
-	// go down and create one by one
-	for (ds_nip_t *cur = node_list->next; cur; cur = cur->next)
+	for (unsigned int j = 0; j < i; j++)
+		idents[j].nth = j && !ds_ident_alike(&idents[j - 1], &idents[j]) ? idents[j - 1].nth + 1 : 0;
+
+	return idents;
+}
+
+static void ds_diff(ds_change_cb_t cb, datastore_t *from, datastore_t *node);
+
+/**
+ * ds_diff_children() marks children of node that from didn't have or that
+ * differ, reports those of from that node doesn't have as deleted
+ */
+static void ds_diff_children(ds_change_cb_t cb, datastore_t *from, datastore_t *node)
+{
+	ds_ident_t *a = ds_idents(from), *b = ds_idents(node);
+	unsigned int i = 0, j = 0;
+
+	if (!a || !b)
 	{
-		char *cur_name = roxml_get_name(cur->node, NULL, 0);
-		char *cur_value = roxml_get_content(cur->node, NULL, 0, NULL);
+		// everything changed as far as subscribers can tell
+		for (datastore_t *cur = from->child; cur; cur = cur->next)
+			ds_report_delete(cb, cur);
 
-		if (!strlen(cur_value)) cur_value = NULL;
+		for (datastore_t *cur = node->child; cur; cur = cur->next)
+			ds_mark(cur, DS_CHANGE_CREATE);
 
-		DEBUG("ds.create( %s, %s )\n", cur_name, cur_value);
+		free(a);
+		free(b);
+		return;
+	}
 
-		datastore_t *child = ds_find_child(root, cur_name, cur_value);
+	while (i < from->child_count || j < node->child_count)
+	{
+		int rc;
 
-		if (child && child->is_list && ds_list_has_key(child))
-		{
-			ds_key_t *key = ds_get_key_from_xml(path_endpoint, child);
+		if (i == from->child_count)
+			rc = 1;
+		else if (j == node->child_count)
+			rc = -1;
+		else
+			rc = ds_ident_cmp(&a[i], &b[j]);
+
+		if (rc < 0)
+			ds_report_delete(cb, a[i++].node);
+		else if (rc > 0)
+			ds_mark(b[j++].node, DS_CHANGE_CREATE);
+		else
+			ds_diff(cb, a[i++].node, b[j++].node);
+	}
+
+	free(a);
+	free(b);
+}
+
+/**
+ * ds_diff() marks what differs between from and node replacing it
+ *
+ * Marks from was left with are kept on node.
+ */
+static void ds_diff(ds_change_cb_t cb, datastore_t *from, datastore_t *node)
+{
+	unsigned int carried = __atomic_load_n(&from->changed, __ATOMIC_ACQUIRE) & (DS_CHANGE_VALUE | DS_CHANGE_CREATE);
+
+	if (strcmp(ds_string(from->value), ds_string(node->value)))
+		carried |= DS_CHANGE_VALUE;
+
+	if (carried)
+		ds_mark(node, carried);
+
+	ds_diff_children(cb, from, node);
+}
+
+void ds_track(datastore_t *root, ds_change_cb_t cb)
+{
+	if (cb && root)
+	{
+		ds_changes(root, NULL, NULL);
+		__atomic_or_fetch(&root->changed, DS_CHANGE_TRACKED, __ATOMIC_SEQ_CST);
+	}
+
+	__atomic_store_n(&ds_change_cb, cb, __ATOMIC_RELEASE);
+}
+
+static void ds_changes_node(datastore_t *node, void (*visit)(datastore_t *node, int changed, void *priv), void *priv)
+{
+	unsigned int changed = __atomic_fetch_and(&node->changed, DS_CHANGE_TRACKED, __ATOMIC_SEQ_CST);
+
+	if (visit && changed & (DS_CHANGE_VALUE | DS_CHANGE_CREATE))
+		visit(node, changed & (DS_CHANGE_VALUE | DS_CHANGE_CREATE), priv);
+
+	if (!(changed & DS_CHANGE_BELOW))
+		return;
+
+	// node added is visited whole, what changed under it since only cleared
+	if (changed & DS_CHANGE_CREATE)
+		visit = NULL;
+
+	for (datastore_t *cur = node->child; cur; cur = cur->next)
+		ds_changes_node(ds_published(cur), visit, priv);
+}
+
+void ds_changes(datastore_t *root, void (*visit)(datastore_t *node, int changed, void *priv), void *priv)
+{
+	if (root)
+		ds_changes_node(ds_published(root), visit, priv);
+}
+
+// child index implementation
+
+// number of children at which a node gets its child index
+#define DS_CHILD_INDEX_MIN 16
+
+// maximum number of nodes in one chunk of a ds_vec_t
+#define DS_CHUNK_SIZE 256
+
+typedef struct ds_chunk
+{
+	unsigned int count;
+	unsigned int size;
+	datastore_t *nodes[];
+} ds_chunk_t;
+
+/*
+ * ds_vec_t - nodes in sibling order, split into chunks
+ *
+ * Every node points to the chunk it is in, so inserting next to a node,
+ * removing it and finding the n-th node cost O(DS_CHUNK_SIZE + count / DS_CHUNK_SIZE).
+ */
+typedef struct ds_vec
+{
+	ds_chunk_t **chunks;
+	unsigned int chunks_count;
+	unsigned int chunks_size;
+	unsigned int count;
+} ds_vec_t;
+
+typedef struct ds_name_run
+{
+	char *name;
+	ds_vec_t vec; // children with this name
+	datastore_t **keys; // list entries by key, open addressing
+	unsigned int keys_size;
+	unsigned int keys_used;
+	int keys_valid; // keys is rebuilt on lookup when not valid
+	datastore_t **pending; // entries whose key might have changed
+	unsigned int pending_count;
+	unsigned int pending_size;
+} ds_name_run_t;
+
+struct ds_child_index
+{
+	ds_vec_t vec; // all children
+	ds_name_run_t **runs; // open addressing by name
+	unsigned int runs_size;
+	unsigned int runs_used;
+};
+
+static struct ds_chunk **ds_vec_chunk(datastore_t *node, int by_name)
+{
+	return by_name ? &node->name_index_chunk : &node->index_chunk;
+}
+
+static unsigned int ds_vec_chunk_index(ds_vec_t *vec, ds_chunk_t *chunk)
+{
+	unsigned int ci = vec->chunks_count - 1;
+
+	if (vec->chunks[ci] != chunk)
+	{
+		for (ci = 0; vec->chunks[ci] != chunk; ci++);
+	}
+
+	return ci;
+}
+
+/**
+ * ds_vec_add_chunk() adds an empty chunk at position ci
+ *
+ * Return: 0 on success, -1 on error
+ */
+static int ds_vec_add_chunk(ds_vec_t *vec, unsigned int ci, unsigned int size)
+{
+	if (vec->chunks_count == vec->chunks_size)
+	{
+		unsigned int chunks_size = vec->chunks_size ? vec->chunks_size * 2 : 4;
+		ds_chunk_t **chunks = realloc(vec->chunks, chunks_size * sizeof(ds_chunk_t *));
+
+		if (!chunks)
+		{
+			ERROR("not enough memory\n");
+			return -1;
+		}
+
+		vec->chunks = chunks;
+		vec->chunks_size = chunks_size;
+	}
+
+	ds_chunk_t *chunk = malloc(sizeof(ds_chunk_t) + size * sizeof(datastore_t *));
+
+	if (!chunk)
+	{
+		ERROR("not enough memory\n");
+		return -1;
+	}
+
+	chunk->count = 0;
+	chunk->size = size;
+
+	memmove(&vec->chunks[ci + 1], &vec->chunks[ci], (vec->chunks_count - ci) * sizeof(ds_chunk_t *));
+	vec->chunks[ci] = chunk;
+	vec->chunks_count++;
+
+	return 0;
+}
+
+/**
+ * ds_vec_grow_chunk() makes room for one more node in chunk at ci
+ *
+ * Return: 0 on success, -1 on error
+ */
+static int ds_vec_grow_chunk(ds_vec_t *vec, unsigned int ci, int by_name)
+{
+	ds_chunk_t *chunk = vec->chunks[ci];
+
+	if (chunk->count < chunk->size)
+		return 0;
+
+	unsigned int size = chunk->size * 2 < DS_CHUNK_SIZE ? chunk->size * 2 : DS_CHUNK_SIZE;
+	chunk = realloc(chunk, sizeof(ds_chunk_t) + size * sizeof(datastore_t *));
+
+	if (!chunk)
+	{
+		ERROR("not enough memory\n");
+		return -1;
+	}
+
+	chunk->size = size;
+
+	if (chunk != vec->chunks[ci])
+	{
+		vec->chunks[ci] = chunk;
+
+		for (unsigned int i = 0; i < chunk->count; i++)
+			*ds_vec_chunk(chunk->nodes[i], by_name) = chunk;
+	}
+
+	return 0;
+}
+
+/**
+ * ds_vec_insert_after() inserts node right after the node after
+ *
+ * @after node already in vec, NULL to insert at the start
+ *
+ * Return: 0 on success, -1 on error
+ */
+static int ds_vec_insert_after(ds_vec_t *vec, datastore_t *after, datastore_t *node, int by_name)
+{
+	unsigned int ci = 0, pos = 0;
+
+	if (!vec->chunks_count && ds_vec_add_chunk(vec, 0, 4))
+		return -1;
+
+	if (after)
+	{
+		ds_chunk_t *chunk = *ds_vec_chunk(after, by_name);
+
+		ci = ds_vec_chunk_index(vec, chunk);
+		pos = chunk->count - 1;
+
+		if (chunk->nodes[pos] != after)
+		{
+			for (pos = 0; chunk->nodes[pos] != after; pos++);
+		}
+
+		pos++;
+	}
+
+	ds_chunk_t *chunk = vec->chunks[ci];
+
+	if (chunk->count == DS_CHUNK_SIZE)
+	{
+		if (pos == DS_CHUNK_SIZE && ci + 1 < vec->chunks_count && vec->chunks[ci + 1]->count < DS_CHUNK_SIZE)
+		{
+			// goes to the start of the next chunk
+			ci++;
+			pos = 0;
+		}
+		else if (pos == DS_CHUNK_SIZE)
+		{
+			if (ds_vec_add_chunk(vec, ++ci, 4))
+				return -1;
+
+			pos = 0;
+		}
+		else
+		{
+			// split the upper half off to a new chunk
+			unsigned int half = DS_CHUNK_SIZE / 2;
+
+			if (ds_vec_add_chunk(vec, ci + 1, DS_CHUNK_SIZE))
+				return -1;
+
+			ds_chunk_t *upper = vec->chunks[ci + 1];
+
+			memcpy(upper->nodes, &chunk->nodes[half], (DS_CHUNK_SIZE - half) * sizeof(datastore_t *));
+			upper->count = DS_CHUNK_SIZE - half;
+			chunk->count = half;
+
+			for (unsigned int i = 0; i < upper->count; i++)
+				*ds_vec_chunk(upper->nodes[i], by_name) = upper;
+
+			if (pos > half)
+			{
+				ci++;
+				pos -= half;
+			}
+		}
+	}
+
+	if (ds_vec_grow_chunk(vec, ci, by_name))
+		return -1;
+
+	chunk = vec->chunks[ci];
+
+	memmove(&chunk->nodes[pos + 1], &chunk->nodes[pos], (chunk->count - pos) * sizeof(datastore_t *));
+	chunk->nodes[pos] = node;
+	chunk->count++;
+	vec->count++;
+
+	*ds_vec_chunk(node, by_name) = chunk;
+
+	return 0;
+}
+
+static void ds_vec_remove(ds_vec_t *vec, datastore_t *node, int by_name)
+{
+	ds_chunk_t *chunk = *ds_vec_chunk(node, by_name);
+
+	if (!chunk)
+		return;
+
+	unsigned int pos = 0;
+
+	for (pos = 0; pos < chunk->count && chunk->nodes[pos] != node; pos++);
+
+	if (pos == chunk->count)
+		return;
+
+	chunk->count--;
+	memmove(&chunk->nodes[pos], &chunk->nodes[pos + 1], (chunk->count - pos) * sizeof(datastore_t *));
+	vec->count--;
+
+	*ds_vec_chunk(node, by_name) = NULL;
+
+	if (!chunk->count)
+	{
+		unsigned int ci = ds_vec_chunk_index(vec, chunk);
+
+		vec->chunks_count--;
+		memmove(&vec->chunks[ci], &vec->chunks[ci + 1], (vec->chunks_count - ci) * sizeof(ds_chunk_t *));
+		free(chunk);
+	}
+}
+
+/**
+ * ds_vec_nth() returns the n-th node in vec, counting from 0
+ */
+static datastore_t *ds_vec_nth(ds_vec_t *vec, unsigned int n)
+{
+	for (unsigned int ci = 0; ci < vec->chunks_count; ci++)
+	{
+		if (n < vec->chunks[ci]->count)
+			return vec->chunks[ci]->nodes[n];
+
+		n -= vec->chunks[ci]->count;
+	}
+
+	return NULL;
+}
+
+static datastore_t *ds_vec_last(ds_vec_t *vec)
+{
+	if (!vec->count)
+		return NULL;
+
+	ds_chunk_t *chunk = vec->chunks[vec->chunks_count - 1];
+
+	return chunk->nodes[chunk->count - 1];
+}
+
+static void ds_vec_free(ds_vec_t *vec)
+{
+	for (unsigned int ci = 0; ci < vec->chunks_count; ci++)
+		free(vec->chunks[ci]);
+
+	free(vec->chunks);
+}
+
+static unsigned int ds_name_hash(const char *name)
+{
+	unsigned int hash = 2166136261u;
+
+	while (*name)
+		hash = (hash ^ (unsigned char) *name++) * 16777619u;
+
+	return hash;
+}
+
+static ds_name_run_t **ds_index_run_slot(struct ds_child_index *index, const char *name)
+{
+	unsigned int mask = index->runs_size - 1;
+
+	for (unsigned int i = ds_name_hash(name) & mask; ; i = (i + 1) & mask)
+	{
+		ds_name_run_t **slot = &index->runs[i];
+
+		if (!*slot || !strcmp((*slot)->name, name))
+			return slot;
+	}
+}
+
+/**
+ * ds_index_run() finds the run of children with name
+ *
+ * @create create the run if it doesn't exist
+ *
+ * Return: run, NULL if not found or on error
+ */
+static ds_name_run_t *ds_index_run(struct ds_child_index *index, const char *name, int create)
+{
+	ds_name_run_t **slot = ds_index_run_slot(index, name);
+
+	if (*slot || !create)
+		return *slot;
+
+	if ((index->runs_used + 1) * 4 > index->runs_size * 3)
+	{
+		unsigned int old_size = index->runs_size;
+		ds_name_run_t **old_runs = index->runs;
+
+		index->runs = calloc(old_size * 2, sizeof(ds_name_run_t *));
+
+		if (!index->runs)
+		{
+			ERROR("not enough memory\n");
+			index->runs = old_runs;
+			return NULL;
+		}
+
+		index->runs_size = old_size * 2;
+
+		for (unsigned int i = 0; i < old_size; i++)
+		{
+			if (old_runs[i])
+				*ds_index_run_slot(index, old_runs[i]->name) = old_runs[i];
+		}
+
+		free(old_runs);
+		slot = ds_index_run_slot(index, name);
+	}
+
+	ds_name_run_t *run = calloc(1, sizeof(ds_name_run_t));
+
+	if (!run || !(run->name = strdup(name)))
+	{
+		ERROR("not enough memory\n");
+		free(run);
+		return NULL;
+	}
+
+	*slot = run;
+	index->runs_used++;
+
+	return run;
+}
+
+static void ds_index_free(struct ds_child_index *index)
+{
+	if (!index)
+		return;
+
+	for (unsigned int i = 0; i < index->runs_size; i++)
+	{
+		if (!index->runs[i])
+			continue;
+
+		free(index->runs[i]->name);
+		free(index->runs[i]->keys);
+		free(index->runs[i]->pending);
+		ds_vec_free(&index->runs[i]->vec);
+		free(index->runs[i]);
+	}
+
+	free(index->runs);
+	ds_vec_free(&index->vec);
+	free(index);
+}
+
+/**
+ * ds_index_drop() frees the child index of self, children stay linked
+ */
+static void ds_index_drop(datastore_t *self)
+{
+	for (datastore_t *cur = self->child; cur; cur = cur->next)
+	{
+		cur->index_chunk = cur->name_index_chunk = NULL;
+		cur->key_state = 0;
+	}
+
+	ds_index_free(self->child_index);
+	self->child_index = NULL;
+}
+
+static void ds_key_index_touch(datastore_t *entry);
+static void ds_key_index_remove(ds_name_run_t *run, datastore_t *entry);
+
+/**
+ * ds_index_insert() adds node, already linked after after, to index
+ *
+ * Return: 0 on success, -1 on error
+ */
+static int ds_index_insert(struct ds_child_index *index, datastore_t *after, datastore_t *node)
+{
+	if (ds_vec_insert_after(&index->vec, after, node, 0))
+		return -1;
+
+	if (!node->name)
+		return 0;
+
+	ds_name_run_t *run = ds_index_run(index, node->name, 1);
+
+	if (!run)
+		return -1;
+
+	// find the previous sibling with the same name
+	datastore_t *prev = NULL;
+
+	if (node == ds_vec_last(&index->vec))
+	{
+		prev = ds_vec_last(&run->vec);
+	}
+	else
+	{
+		for (prev = node->prev; prev; prev = prev->prev)
+		{
+			if (prev->name && !strcmp(prev->name, node->name))
+				break;
+		}
+	}
+
+	if (ds_vec_insert_after(&run->vec, prev, node, 1))
+		return -1;
+
+	// new entry may come with its key already
+	node->key_state = 0;
+	ds_key_index_touch(node);
+
+	return 0;
+}
+
+static void ds_index_remove(struct ds_child_index *index, datastore_t *node)
+{
+	if (!index)
+		return;
+
+	ds_vec_remove(&index->vec, node, 0);
+
+	if (!node->name)
+		return;
+
+	ds_name_run_t *run = ds_index_run(index, node->name, 0);
+
+	if (run)
+	{
+		ds_vec_remove(&run->vec, node, 1);
+		ds_key_index_remove(run, node);
+	}
+}
+
+/**
+ * ds_index_build() indexes all children of self
+ *
+ * Return: 0 on success, -1 on error
+ */
+static int ds_index_build(datastore_t *self)
+{
+	struct ds_child_index *index = calloc(1, sizeof(struct ds_child_index));
+
+	if (!index)
+	{
+		ERROR("not enough memory\n");
+		return -1;
+	}
+
+	index->runs_size = DS_CHILD_INDEX_MIN;
+	index->runs = calloc(index->runs_size, sizeof(ds_name_run_t *));
+
+	if (!index->runs)
+	{
+		ERROR("not enough memory\n");
+		free(index);
+		return -1;
+	}
+
+	self->child_index = index;
+
+	for (datastore_t *cur = self->child; cur; cur = cur->next)
+	{
+		if (ds_index_insert(index, cur->prev, cur))
+		{
+			ds_index_drop(self);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+// key index implementation
+
+/**
+ * ds_key_hash() hashes key parts in an order independent way
+ */
+static unsigned int ds_key_hash(unsigned int hash, const char *name, const char *value)
+{
+	return hash + ds_name_hash(name) * 31 + ds_name_hash(value ? value : "");
+}
+
+/**
+ * ds_entry_key() hashes and counts key parts of list entry
+ *
+ * Return: number of key parts entry has
+ */
+static int ds_entry_key(datastore_t *entry, unsigned int *hash)
+{
+	int parts = 0;
+
+	*hash = 0;
+
+	for (datastore_t *cur = entry->child; cur; cur = cur->next)
+	{
+		if (!cur->is_key || !cur->name)
+			continue;
+
+		*hash = ds_key_hash(*hash, cur->name, cur->value);
+		parts++;
+	}
+
+	return parts;
+}
+
+/* gets on worker threads build key indexes lazily, one at a time */
+static pthread_mutex_t ds_key_index_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* key_state of list entries */
+#define DS_KEY_INDEXED (1 << 0) // in keys under key_hash
+#define DS_KEY_PENDING (1 << 1) // in pending
+
+static int ds_key_index_build(ds_name_run_t *run)
+{
+	unsigned int size = DS_CHILD_INDEX_MIN;
+
+	while (size < run->vec.count * 2)
+		size *= 2;
+
+	if (size != run->keys_size)
+	{
+		free(run->keys);
+		run->keys_size = 0;
+		run->keys = malloc(size * sizeof(datastore_t *));
+
+		if (!run->keys)
+		{
+			ERROR("not enough memory\n");
+			return -1;
+		}
+
+		run->keys_size = size;
+	}
+
+	memset(run->keys, 0, size * sizeof(datastore_t *));
+	run->keys_used = 0;
+
+	for (unsigned int ci = 0; ci < run->vec.chunks_count; ci++)
+	{
+		ds_chunk_t *chunk = run->vec.chunks[ci];
+
+		for (unsigned int i = 0; i < chunk->count; i++)
+		{
+			datastore_t *entry = chunk->nodes[i];
+			unsigned int hash;
+
+			entry->key_state = 0;
+
+			if (!ds_entry_key(entry, &hash))
+				continue;
+
+			entry->key_hash = hash;
+			entry->key_state = DS_KEY_INDEXED;
+
+			for (hash &= size - 1; run->keys[hash]; hash = (hash + 1) & (size - 1));
+
+			run->keys[hash] = entry;
+			run->keys_used++;
+		}
+	}
+
+	// published for readers that check them without ds_key_index_lock
+	__atomic_store_n(&run->pending_count, 0, __ATOMIC_RELEASE);
+	__atomic_store_n(&run->keys_valid, 1, __ATOMIC_RELEASE);
+
+	return 0;
+}
+
+/**
+ * ds_key_index_unslot() takes entry out of keys
+ *
+ * Entries probing past the freed slot move back, so lookups need no
+ * tombstones.
+ */
+static void ds_key_index_unslot(ds_name_run_t *run, datastore_t *entry)
+{
+	unsigned int mask = run->keys_size - 1;
+	unsigned int i, j;
+
+	for (i = entry->key_hash & mask; run->keys[i] != entry; i = (i + 1) & mask)
+	{
+		if (!run->keys[i])
+			return;
+	}
+
+	for (j = (i + 1) & mask; run->keys[j]; j = (j + 1) & mask)
+	{
+		unsigned int home = run->keys[j]->key_hash & mask;
+
+		// entry at j may fill i unless its home lies cyclically in (i, j]
+		if (j > i ? (home <= i || home > j) : (home <= i && home > j))
+		{
+			run->keys[i] = run->keys[j];
+			i = j;
+		}
+	}
+
+	run->keys[i] = NULL;
+	run->keys_used--;
+	entry->key_state &= ~DS_KEY_INDEXED;
+}
+
+/**
+ * ds_key_index_drop() marks whole key index as stale
+ */
+static void ds_key_index_drop(ds_name_run_t *run)
+{
+	for (unsigned int i = 0; i < run->pending_count; i++)
+		run->pending[i]->key_state &= ~DS_KEY_PENDING;
+
+	run->pending_count = 0;
+	run->keys_valid = 0;
+}
+
+/**
+ * ds_key_index_touch() queues entry to be rehashed on the next lookup
+ *
+ * Called whenever entry's key parts might have changed. Only entries
+ * touched since the last lookup are rehashed, unless so many of them
+ * are that rebuilding the whole index is cheaper.
+ */
+static void ds_key_index_touch(datastore_t *entry)
+{
+	if (!entry || !entry->name || !entry->parent || !entry->parent->child_index)
+		return;
+
+	ds_name_run_t *run = ds_index_run(entry->parent->child_index, entry->name, 0);
+
+	if (!run || !run->keys_valid || (entry->key_state & DS_KEY_PENDING))
+		return;
+
+	if (run->pending_count >= DS_CHILD_INDEX_MIN && run->pending_count * 4 > run->vec.count)
+	{
+		ds_key_index_drop(run);
+		return;
+	}
+
+	if (run->pending_count == run->pending_size)
+	{
+		unsigned int size = run->pending_size ? run->pending_size * 2 : DS_CHILD_INDEX_MIN;
+		datastore_t **pending = realloc(run->pending, size * sizeof(datastore_t *));
+
+		if (!pending)
+		{
+			ds_key_index_drop(run);
+			return;
+		}
+
+		run->pending = pending;
+		run->pending_size = size;
+	}
+
+	run->pending[run->pending_count++] = entry;
+	entry->key_state |= DS_KEY_PENDING;
+}
+
+/**
+ * ds_key_index_remove() takes entry leaving run out of its key index
+ */
+static void ds_key_index_remove(ds_name_run_t *run, datastore_t *entry)
+{
+	if (run->keys_valid && (entry->key_state & DS_KEY_INDEXED))
+		ds_key_index_unslot(run, entry);
+
+	if (run->keys_valid && (entry->key_state & DS_KEY_PENDING))
+	{
+		for (unsigned int i = 0; i < run->pending_count; i++)
+		{
+			if (run->pending[i] == entry)
+			{
+				run->pending[i] = run->pending[--run->pending_count];
+				break;
+			}
+		}
+	}
+
+	entry->key_state = 0;
+}
+
+/**
+ * ds_key_index_update() rehashes entries touched since the last lookup
+ *
+ * Return: 0 on success, -1 on error
+ */
+static int ds_key_index_update(ds_name_run_t *run)
+{
+	for (unsigned int i = 0; i < run->pending_count; i++)
+	{
+		datastore_t *entry = run->pending[i];
+		unsigned int hash;
+
+		if (entry->key_state & DS_KEY_INDEXED)
+			ds_key_index_unslot(run, entry);
+
+		entry->key_state = 0;
+
+		if (!ds_entry_key(entry, &hash))
+			continue;
+
+		// keys stays at most half full
+		if ((run->keys_used + 1) * 2 > run->keys_size)
+			return ds_key_index_build(run);
+
+		entry->key_hash = hash;
+		entry->key_state = DS_KEY_INDEXED;
+
+		for (hash &= run->keys_size - 1; run->keys[hash]; hash = (hash + 1) & (run->keys_size - 1));
+
+		run->keys[hash] = entry;
+		run->keys_used++;
+	}
+
+	__atomic_store_n(&run->pending_count, 0, __ATOMIC_RELEASE);
+
+	return 0;
+}
+
+/**
+ * ds_key_index_find() finds the entry with exactly key in run
+ *
+ * Return: entry, NULL if not found, run itself on error
+ */
+static void *ds_key_index_find(ds_name_run_t *run, ds_key_t *key)
+{
+	if (!__atomic_load_n(&run->keys_valid, __ATOMIC_ACQUIRE) ||
+		__atomic_load_n(&run->pending_count, __ATOMIC_ACQUIRE))
+	{
+		pthread_mutex_lock(&ds_key_index_lock);
+		int rc = !run->keys_valid ? ds_key_index_build(run) :
+				 run->pending_count ? ds_key_index_update(run) : 0;
+		pthread_mutex_unlock(&ds_key_index_lock);
+
+		if (rc)
+			return run;
+	}
+
+	unsigned int hash = 0;
+	int parts = 0;
+
+	for (ds_key_t *key_part = key; key_part; key_part = key_part->next, parts++)
+		hash = ds_key_hash(hash, key_part->name, key_part->value);
+
+	for (hash &= run->keys_size - 1; run->keys[hash]; hash = (hash + 1) & (run->keys_size - 1))
+	{
+		datastore_t *entry = run->keys[hash];
+		unsigned int entry_hash;
+
+		if (ds_entry_key(entry, &entry_hash) == parts && ds_element_has_key(entry, key))
+			return entry;
+	}
+
+	return NULL;
+}
+
+/**
+ * ds_child_insert_point() finds the child new child should be added after
+ *
+ * See ds_add_child() for parameters.
+ *
+ * Return: child to add after, NULL if self has no children
+ */
+static datastore_t *ds_child_insert_point(datastore_t *self, char *target_name, int target_position)
+{
+	if (!self->child)
+		return NULL;
+
+	// children linked before last_child was tracked
+	if (!self->last_child)
+	{
+		for (self->last_child = self->child; self->last_child->next; self->last_child = self->last_child->next);
+	}
+
+	if (!target_name && !target_position)
+		return self->last_child;
+
+	if (self->child_index)
+	{
+		ds_vec_t *vec = &self->child_index->vec;
+
+		if (target_name)
+		{
+			ds_name_run_t *run = ds_index_run(self->child_index, target_name, 0);
+
+			if (!run || !run->vec.count)
+				return self->last_child;
+
+			vec = &run->vec;
+		}
+
+		if (target_position <= 0 || (unsigned int) target_position >= vec->count)
+			return ds_vec_last(vec);
+
+		return ds_vec_nth(vec, target_position - 1);
+	}
+
+	datastore_t *cur;
+	int cur_pos = 0;
+
+	if (target_name)
+	{
+		for (cur = self->child; cur->next != 0; cur = cur->next)
+		{
+			if (!strcmp(cur->name, target_name))
+			{
+				// if it's last of its name
+				if (strcmp(cur->next->name, target_name))
+					break;
+
+				// if at desired position
+				if (target_position && ++cur_pos >= target_position)
+					break;
+			}
+		}
+	}
+	else
+	{
+		for (cur = self->child; cur->next != 0; cur = cur->next)
+		{
+			if (target_position && ++cur_pos >= target_position)
+				break;
+		}
+	}
+
+	return cur;
+}
+
+enum ds_operation ds_get_operation(node_t *node)
+{
+	if (!node)
+		return OPERATION_MERGE;
+
+	node_t *operation_attr = roxml_get_attr(node, "operation", 0);
+	char *operation = roxml_get_content(operation_attr, NULL, 0, NULL);
+
+	if (!operation)
+		return OPERATION_MERGE;
+
+	if (!strcmp(operation, "delete"))
+		return OPERATION_DELETE;
+
+	if (!strcmp(operation, "remove"))
+		return OPERATION_REMOVE;
+
+	if (!strcmp(operation, "create"))
+		return OPERATION_CREATE;
+
+	if (!strcmp(operation, "merge"))
+		return OPERATION_MERGE;
+
+	if (!strcmp(operation, "replace"))
+		return OPERATION_REPLACE;
+
+	return OPERATION_MERGE;
+}
+
+void ds_print_key(ds_key_t *key)
+{
+	printf("KEY:\n");
+
+	for (ds_key_t *cur = key; cur != NULL; cur = cur->next)
+	{
+		printf("name: %s\nvalue: %s\n-----------------\n", cur->name, cur->value);
+	}
+}
+
+void ds_free_key(ds_key_t *key)
+{
+	if (key && key->next)
+		ds_free_key(key->next);
+
+	free(key);
+}
+
+
+// makes key from xml data
+ds_key_t *ds_get_key_from_xml(node_t *root, datastore_t *our_root)
+{
+	int child_count = roxml_get_chld_nb(root);
+
+	if (!child_count)
+		return NULL;
+
+	ds_key_t *rc = NULL;
+	ds_key_t *cur_key = NULL;
+
+	for (int i = 0; i < child_count; i++)
+	{
+		node_t *child = roxml_get_chld(root, NULL, i);
+		char *key_name = roxml_get_name(child, NULL, 0);
+		char *key_value = roxml_get_content(child, NULL, 0, NULL);
+
+		// if it seems to be actual key
+		if (key_name && key_name[0] != '\0' && key_value && key_value[0] != '\0')
+		{
+			// if datastore provided see if tag with key_name has is_key flag
+			if (our_root && !ds_element_has_key_part(our_root, key_name, NULL))
+				continue;
+
+			// make sure key part is correctly allocated
+			if (!rc)
+			{
+				rc = malloc(sizeof(ds_key_t));
+
+				if (!rc)
+				{
+					ERROR("not enough memory\n");
+					return NULL;
+				}
+
+				cur_key = rc;
+			}
+			else
+			{
+				cur_key->next = malloc(sizeof(ds_key_t));
+
+				if (!cur_key->next)
+				{
+					ERROR("not enough memory\n");
+					return NULL;
+				}
+
+				cur_key = cur_key->next;
+			}
+
+			cur_key->name = roxml_get_name(child, NULL, 0);
+			cur_key->value = key_value;
+			cur_key->next = NULL;
+		}
+	}
+
+	return rc;
+}
+
+void ds_init(datastore_t *datastore, char *name, char *value, char *ns)
+{
+	datastore->name = name;
+	datastore->value = value;
+	datastore->ns = ns;
+	datastore->parent = datastore->child = datastore->prev = datastore->next = NULL;
+	datastore->get = NULL;
+	datastore->set = NULL;
+	datastore->set_multiple = NULL;
+	datastore->del = NULL;
+	datastore->create_child = NULL;
+	datastore->update = NULL;
+	datastore->is_config = 1;
+	datastore->is_list = datastore->is_key = 0;
+	datastore->choice_group = 0;
+	datastore->last_child = NULL;
+	datastore->child_count = 0;
+	datastore->child_index = NULL;
+	datastore->index_chunk = datastore->name_index_chunk = NULL;
+	datastore->key_hash = datastore->key_state = 0;
+	datastore->published = NULL;
+	datastore->changed = datastore->generation = 0;
+}
+
+/**
+ * ds_unlink() removes datastore from its parent and siblings
+ */
+static void ds_unlink(datastore_t *datastore)
+{
+	datastore_t *parent = datastore->parent;
+
+	if (datastore->prev)
+		datastore->prev->next = datastore->next;
+	else if (parent && parent->child == datastore)
+		parent->child = datastore->next;
+
+	if (datastore->next)
+		datastore->next->prev = datastore->prev;
+	else if (parent && parent->last_child == datastore)
+		parent->last_child = datastore->prev;
+
+	if (parent)
+	{
+		parent->child_count--;
+		ds_index_remove(parent->child_index, datastore);
+
+		if (datastore->is_key)
+			ds_key_index_touch(parent);
+	}
+
+	datastore->prev = datastore->next = NULL;
+}
+
+/**
+ * ds_free_node() frees already unlinked datastore with all its children
+ *
+ * Recurses only into depth, siblings are freed iteratively.
+ */
+static void ds_free_node(datastore_t *datastore)
+{
+	for (datastore_t *cur = datastore->child; cur; )
+	{
+		datastore_t *next = cur->next;
+		ds_free_node(cur);
+		cur = next;
+	}
+
+	// node isn't read anymore, nor is what it published
+	if (datastore->published)
+		ds_free_node(datastore->published);
+
+	ds_index_free(datastore->child_index);
+	free(datastore->name);
+	free(datastore->value);
+	free(datastore->ns);
+	free(datastore);
+}
+
+void ds_free(datastore_t *datastore, int free_siblings)
+{
+	if (!datastore)
+		return;
+
+	datastore_t *parent = datastore->parent;
+	ds_change_cb_t cb = ds_tracking(datastore);
+
+	for (datastore_t *cur = datastore; cb && cur; cur = free_siblings ? cur->next : NULL)
+		ds_report_delete(cb, cur);
+
+	ds_invalidate(datastore);
+
+	if (!free_siblings)
+	{
+		ds_unlink(datastore);
+		ds_free_node(datastore);
+		return;
+	}
+
+	// make a clear end if we're not deleting root node
+	if (parent && parent->child == datastore)
+	{
+		// all the children are going, so is the index
+		ds_index_free(parent->child_index);
+		parent->child_index = NULL;
+		parent->child = parent->last_child = NULL;
+		parent->child_count = 0;
+	}
+	else
+	{
+		if (datastore->prev)
+			datastore->prev->next = NULL;
+
+		if (parent)
+		{
+			parent->last_child = datastore->prev;
+
+			for (datastore_t *cur = datastore; cur; cur = cur->next)
+			{
+				parent->child_count--;
+				ds_index_remove(parent->child_index, cur);
+			}
+		}
+	}
+
+	// parent may have lost key parts
+	ds_key_index_touch(parent);
+
+	for (datastore_t *cur = datastore; cur; )
+	{
+		datastore_t *next = cur->next;
+		ds_free_node(cur);
+		cur = next;
+	}
+}
+
+int ds_read_begin(void)
+{
+	int epoch = __atomic_load_n(&ds_epoch, __ATOMIC_SEQ_CST) & 1;
+
+	__atomic_add_fetch(&ds_epoch_readers[epoch], 1, __ATOMIC_SEQ_CST);
+
+	return epoch;
+}
+
+void ds_read_end(int epoch)
+{
+	__atomic_sub_fetch(&ds_epoch_readers[epoch], 1, __ATOMIC_RELEASE);
+}
+
+datastore_t *ds_published(datastore_t *node)
+{
+	datastore_t *published = __atomic_load_n(&node->published, __ATOMIC_ACQUIRE);
+
+	return published ? published : node;
+}
+
+/**
+ * ds_reclaim() frees replaced versions no reader can see anymore
+ *
+ * Called with ds_publish_lock held.
+ */
+static void ds_reclaim(void)
+{
+	unsigned long epoch = __atomic_load_n(&ds_epoch, __ATOMIC_SEQ_CST);
+	ds_retired_t *retired;
+
+	// move on while readers of the previous epoch are gone
+	while (ds_retired_head && ds_retired_head->epoch + 2 > epoch &&
+		   !__atomic_load_n(&ds_epoch_readers[(epoch + 1) & 1], __ATOMIC_SEQ_CST))
+	{
+		__atomic_store_n(&ds_epoch, ++epoch, __ATOMIC_SEQ_CST);
+	}
+
+	while ((retired = ds_retired_head) && retired->epoch + 2 <= epoch)
+	{
+		ds_retired_head = retired->next;
+
+		if (!ds_retired_head)
+			ds_retired_tail = NULL;
+
+		ds_free_node(retired->node);
+		free(retired);
+	}
+}
+
+int ds_publish(datastore_t *node, datastore_t *replacement)
+{
+	datastore_t *old;
+	ds_retired_t *retired;
+	ds_change_cb_t cb;
+	int epoch = 0;
+
+	if (!node || !replacement)
+		return -1;
+
+	// version replaced is compared once published, it must not go meanwhile
+	cb = ds_tracking(node);
+
+	if (cb)
+		epoch = ds_read_begin();
+
+	// readers going up skip the node replacement stands in for
+	replacement->parent = node->parent;
+	replacement->prev = replacement->next = NULL;
+
+	retired = malloc(sizeof(ds_retired_t));
+
+	if (!retired)
+	{
+		ERROR("not enough memory\n");
+
+		if (cb)
+			ds_read_end(epoch);
+
+		return -1;
+	}
+
+	pthread_mutex_lock(&ds_publish_lock);
+
+	old = __atomic_exchange_n(&node->published, replacement, __ATOMIC_SEQ_CST);
+
+	if (old)
+	{
+		retired->node = old;
+		retired->epoch = __atomic_load_n(&ds_epoch, __ATOMIC_SEQ_CST);
+		retired->next = NULL;
+
+		if (ds_retired_tail)
+			ds_retired_tail->next = retired;
+		else
+			ds_retired_head = retired;
+
+		ds_retired_tail = retired;
+	}
+	else
+	{
+		free(retired);
+	}
+
+	ds_reclaim();
+
+	pthread_mutex_unlock(&ds_publish_lock);
+
+	// marked only now, so ds_changes() can't take marks before they're seen
+	if (cb)
+	{
+		ds_diff(cb, old ? old : node, replacement);
+		ds_read_end(epoch);
+	}
+
+	return 0;
+}
+
+/**
+ * ds_move_children() moves all children of from to node without any
+ */
+static void ds_move_children(datastore_t *node, datastore_t *from)
+{
+	node->child = from->child;
+	node->last_child = from->last_child;
+	node->child_count = from->child_count;
+	node->child_index = from->child_index;
+
+	for (datastore_t *cur = node->child; cur; cur = cur->next)
+		cur->parent = node;
+
+	from->child = from->last_child = NULL;
+	from->child_count = 0;
+	from->child_index = NULL;
+}
+
+void ds_replace_children(datastore_t *node, datastore_t *from)
+{
+	ds_change_cb_t cb;
+	datastore_t old;
+
+	if (!node || !from)
+		return;
+
+	cb = ds_tracking(node);
+
+	// stands in for node, deleted children are reported with their path
+	ds_init(&old, node->name, NULL, node->ns);
+	old.parent = node->parent;
+	old.changed = node->changed & DS_CHANGE_TRACKED;
+
+	ds_move_children(&old, node);
+	ds_move_children(node, from);
+
+	if (cb)
+		ds_diff_children(cb, &old, node);
+
+	ds_invalidate(node);
+
+	for (datastore_t *cur = old.child; cur; )
+	{
+		datastore_t *next = cur->next;
+		ds_free_node(cur);
+		cur = next;
+	}
+
+	ds_index_free(old.child_index);
+}
+
+datastore_t *ds_create(char *name, char *value, char *ns)
+{
+	datastore_t *datastore = malloc(sizeof(datastore_t));
+
+	if (!datastore)
+		return 0;
+
+	ds_init(datastore,
+			name ? strdup(name) : NULL,
+			value ? strdup(value) : NULL,
+			ns ? strdup(ns) : NULL);
+
+	return datastore;
+}
+
+datastore_t *ds_create_path(datastore_t *root, node_t *path_endpoint)
+{
+	if (!root || !path_endpoint)
+		return root;
+
+	int depth = 0;
+
+	for (node_t *cur = path_endpoint; strcmp(roxml_get_name(cur, NULL, 0), "config"); cur = roxml_get_parent(cur))
+		depth++;
+
+	node_t **path = malloc(depth * sizeof(node_t *));
+
+	if (!path)
+	{
+		ERROR("not enough memory\n");
+		return NULL;
+	}
+
+	// get the list of nodes (path_endpoint's parent) in root-down order
+	node_t *path_cur = path_endpoint;
+
+	for (int i = depth - 1; i >= 0; i--, path_cur = roxml_get_parent(path_cur))
+		path[i] = path_cur;
+
+	// get the real root of the plugin
+	root = root->parent;
+
+	// go down and create one by one
+	for (int i = 0; i < depth; i++)
+	{
+		char *cur_name = roxml_get_name(path[i], NULL, 0);
+		char *cur_value = roxml_get_content(path[i], NULL, 0, NULL);
+
+		if (!strlen(cur_value)) cur_value = NULL;
+
+		DEBUG("ds.create( %s, %s )\n", cur_name, cur_value);
+
+		datastore_t *child = ds_find_child(root, cur_name, cur_value);
+
+		if (child && child->is_list && ds_list_has_key(child))
+		{
+			ds_key_t *key = ds_get_key_from_xml(path_endpoint, child);
 			datastore_t *node = ds_find_node_by_key(child, key);
 			enum ds_operation operation = ds_get_operation(path_endpoint);
 			if (OPERATION_CREATE == operation && !node)
@@ -352,309 +1822,1194 @@ datastore_t *ds_create_path(datastore_t *root, node_t *path_endpoint)
 			ds_free_key(key);
 		}
 
-		if (!child)
+		if (!child)
+		{
+			root = root->create_child ? (datastore_t *) root->create_child(root, cur_name, cur_value, NULL, NULL, 0)
+									  : ds_add_child_create(root, cur_name, cur_value, NULL, NULL, 0);
+			if (root->set)
+				root->set(root, cur_value);
+		}
+		else
+		{
+			root = child;
+		}
+
+		if (!child)
+			DEBUG("\tcreated %s->%s\n", root->parent->name, root->name);
+	}
+
+	free(path);
+
+	return root;
+}
+
+int ds_purge_choice_group(datastore_t *parent, int choice_group)
+{
+	if (!parent)
+		return -1;
+
+	if(!choice_group)
+		return 0;
+
+	for (datastore_t *child = parent->child; child; )
+	{
+		datastore_t *tmp = child;
+		child = child->next;
+
+		if (tmp->choice_group == choice_group)
+			ds_free(tmp, 0);
+	}
+
+	return 0;
+}
+
+int ds_set_value(datastore_t *datastore, char *value)
+{
+	if (!datastore || !value)
+		return -1;
+
+	if (datastore->set)
+	{
+		int sr = datastore->set(datastore, value);
+
+		if (sr)
+			return RPC_ERROR; // TODO error-option
+	}
+
+	int changed = strcmp(ds_string(datastore->value), value);
+
+	free(datastore->value);
+	datastore->value = strdup(value);
+
+	if (datastore->is_key && changed)
+		ds_key_index_touch(datastore->parent);
+
+	if (!datastore->value)
+		return -1;
+
+	if (changed && ds_tracking(datastore))
+		ds_mark(datastore, DS_CHANGE_VALUE);
+
+	DEBUG("ds_set_value( %s, %s )\n", datastore->name, value);
+
+	return 0;
+}
+
+void ds_set_is_config(datastore_t *datastore, int is_config, int set_siblings)
+{
+	if (!datastore)
+		return;
+
+	datastore->is_config = is_config;
+
+	if (is_config)
+		return; // is_config is only recursively set if it's false
+
+	if (set_siblings)
+		ds_set_is_config(datastore->next, is_config, 1);
+
+	ds_set_is_config(datastore->child, is_config, 1);
+}
+
+
+void ds_add_child(datastore_t *self, datastore_t *child, char *target_name, int target_position)
+{
+	datastore_t *cur = ds_child_insert_point(self, target_name, target_position);
+
+	if (cur)
+	{
+		child->next = cur->next;
+
+		if (cur->next)
+			cur->next->prev = child;
+		else
+			self->last_child = child;
+
+		cur->next = child;
+		child->prev = cur;
+	}
+	else
+	{
+		self->child = self->last_child = child;
+	}
+
+	child->parent = self;
+	self->child_count++;
+
+	// child may become a key part of self, self is rehashed on next lookup
+	ds_key_index_touch(self);
+
+	if (self->child_index)
+	{
+		// on error fall back to scanning
+		if (ds_index_insert(self->child_index, cur, child))
+			ds_index_drop(self);
+	}
+	else if (self->child_count >= DS_CHILD_INDEX_MIN)
+	{
+		ds_index_build(self);
+	}
+
+	ds_set_is_config(child, self->is_config, 0);
+
+	if (ds_tracking(self))
+		ds_mark(child, DS_CHANGE_CREATE);
+}
+
+datastore_t *ds_add_child_create(datastore_t *datastore, char *name, char *value, char *ns, char *target_name, int target_position)
+{
+	datastore_t *child = ds_create(name, value, ns);
+
+	if (!child)
+		return 0;
+
+	ds_add_child(datastore, child, target_name, target_position);
+
+	return child;
+}
+
+datastore_t *ds_add_from_filter(datastore_t *datastore, node_t *filter_root, ds_nip_t *nip)
+{
+	if (!datastore || !filter_root)
+		return NULL;
+
+	char *name = roxml_get_name(filter_root, NULL, 0);
+	DEBUG("add_from_filter( %s, %s )\n", name, roxml_get_content(filter_root, NULL, 0, NULL));
+	DEBUG("\tadding_to %s->%s\n", datastore->parent->name, datastore->name);
+
+	char *value = roxml_get_content(filter_root, NULL, 0, NULL);
+	char *ns = roxml_get_content(roxml_get_ns(filter_root), NULL, 0, NULL);
+
+	datastore_t *rc = datastore->create_child ? (datastore_t *) datastore->create_child(datastore, name, value, ns, name, 0)
+											  : ds_add_child_create(datastore, name, value, ns, name, 0);
+	if (rc->set)
+		rc->set(rc, value);
+
+	ds_nip_delete(nip, filter_root);
+
+	int child_count = roxml_get_chld_nb(filter_root);
+
+	for (int i = 0; i < child_count; i++)
+	{
+		node_t *child = roxml_get_chld(filter_root, NULL, i);
+
+		ds_add_from_filter(rc, child, nip);
+	}
+
+	return rc;
+}
+
+
+datastore_t *ds_find_sibling(datastore_t *root, char *name, char *value)
+{
+	for (datastore_t *cur = root; cur != NULL; cur = cur->next)
+	{
+		// check name
+		if (cur->name && !strcmp(cur->name, name))
+		{
+			// check value if requested
+			if (value)
+			{
+				if (cur->value && !strcmp(cur->value, value))
+					return cur;
+			}
+			else
+			{
+				return cur;
+			}
+		}
+	}
+
+	return NULL;
+}
+
+datastore_t *ds_find_child(datastore_t *root, char *name, char *value)
+{
+	root = ds_published(root);
+
+	if (!root->child_index || !name)
+		return ds_find_sibling(root->child, name, value);
+
+	ds_name_run_t *run = ds_index_run(root->child_index, name, 0);
+
+	if (!run)
+		return NULL;
+
+	if (!value)
+		return ds_vec_nth(&run->vec, 0);
+
+	for (unsigned int ci = 0; ci < run->vec.chunks_count; ci++)
+	{
+		ds_chunk_t *chunk = run->vec.chunks[ci];
+
+		for (unsigned int i = 0; i < chunk->count; i++)
+		{
+			datastore_t *cur = chunk->nodes[i];
+
+			if (cur->value && !strcmp(cur->value, value))
+				return cur;
+		}
+	}
+
+	return NULL;
+}
+
+datastore_t *ds_next_by_name(datastore_t *node)
+{
+	if (node->next && !strcmp(node->next->name, node->name))
+		return node->next;
+
+	if (!node->name_index_chunk)
+		return ds_find_sibling(node->next, node->name, NULL);
+
+	// end of a contiguous run, continue from the name index
+	ds_name_run_t *run = ds_index_run(node->parent->child_index, node->name, 0);
+	ds_chunk_t *chunk = node->name_index_chunk;
+	unsigned int i;
+
+	for (i = 0; chunk->nodes[i] != node; i++);
+
+	if (++i < chunk->count)
+		return chunk->nodes[i];
+
+	unsigned int ci = ds_vec_chunk_index(&run->vec, chunk) + 1;
+
+	return ci < run->vec.chunks_count ? run->vec.chunks[ci]->nodes[0] : NULL;
+}
+
+int ds_element_has_key_part(datastore_t *elem, char *name, char *value)
+{
+	if (!name)
+		return 0;
+
+	for (datastore_t *cur = elem->child; cur != NULL; cur = cur->next)
+	{
+		if (cur->name && !strcmp(cur->name, name))
+		{
+			// names match
+			if (!value || (cur->value && !strcmp(cur->value, value)))
+			{
+				// if we don't need value or values match
+				return cur->is_key; // key found
+			}
+		}
+	}
+
+	return 0; // no key found
+}
+
+int ds_element_has_key(datastore_t *elem, ds_key_t *key)
+{
+	if (!elem || !key)
+		return 0;
+
+	for (ds_key_t *key_part = key; key_part != NULL; key_part = key_part->next)
+	{
+		if (!ds_element_has_key_part(elem, key_part->name, key_part->value))
+			return 0; // doesn't have key if misses at least one key part
+	}
+
+	return 1; // found all key parts so has key
+}
+
+int ds_list_has_key(datastore_t *list)
+{
+	if (!list)
+		return 0;
+
+	for (datastore_t *cur = list->child; cur != NULL; cur = cur->next)
+	{
+		if (cur->is_key)
+			return 1;
+	}
+
+	return 0;
+}
+
+datastore_t *ds_find_node_by_key(datastore_t *our_root, ds_key_t *key)
+{
+	// complete keys of indexed lists are looked up in the key index
+	if (key && our_root && our_root->name && our_root->parent && our_root->parent->child_index)
+	{
+		ds_name_run_t *run = ds_index_run(our_root->parent->child_index, our_root->name, 0);
+		unsigned int hash;
+		int parts = 0;
+
+		for (ds_key_t *key_part = key; key_part; key_part = key_part->next)
+			parts++;
+
+		if (run && ds_entry_key(our_root, &hash) == parts)
+		{
+			void *entry = ds_key_index_find(run, key);
+
+			if (entry != run)
+				return entry;
+		}
+	}
+
+	for (datastore_t *cur = our_root; cur != NULL; cur = cur->next)
+	{
+		if (ds_element_has_key(cur, key))
+			return cur;
+	}
+
+	return NULL;
+}
+
+
+int ds_get_paged(ds_get_options_t *options)
+{
+	return options && (options->limit || options->offset || options->cursor || options->backwards);
+}
+
+/**
+ * ds_path_match() checks whether path of node names leads to node
+ */
+static int ds_path_match(datastore_t *node, const char *path)
+{
+	const char *end = path + strlen(path);
+
+	for (; node->parent; node = node->parent)
+	{
+		const char *start = end;
+
+		while (start > path && start[-1] != '/')
+			start--;
+
+		// no leading '/'
+		if (start == path)
+			return 0;
+
+		const char *name = memchr(start, ':', end - start);
+
+		if (name)
+			start = name + 1;
+
+		if ((size_t) (end - start) != strlen(node->name) || strncmp(start, node->name, end - start))
+			return 0;
+
+		while (end > path && end[-1] != '/')
+			end--;
+
+		end--;
+	}
+
+	return end == path;
+}
+
+int ds_get_target(ds_get_options_t *options, datastore_t *first, int selected)
+{
+	if (!ds_get_paged(options))
+		return 0;
+
+	if (options->list)
+		return ds_path_match(first, options->list);
+
+	return selected;
+}
+
+/**
+ * ds_prev_by_name() finds previous sibling with the same name
+ */
+static datastore_t *ds_prev_by_name(datastore_t *node)
+{
+	if (node->prev && !strcmp(node->prev->name, node->name))
+		return node->prev;
+
+	if (!node->name_index_chunk)
+	{
+		for (datastore_t *cur = node->prev; cur; cur = cur->prev)
+		{
+			if (cur->name && !strcmp(cur->name, node->name))
+				return cur;
+		}
+
+		return NULL;
+	}
+
+	// start of a contiguous run, continue from the name index
+	ds_name_run_t *run = ds_index_run(node->parent->child_index, node->name, 0);
+	ds_chunk_t *chunk = node->name_index_chunk;
+	unsigned int i;
+
+	for (i = 0; chunk->nodes[i] != node; i++);
+
+	if (i)
+		return chunk->nodes[i - 1];
+
+	unsigned int ci = ds_vec_chunk_index(&run->vec, chunk);
+
+	if (!ci)
+		return NULL;
+
+	chunk = run->vec.chunks[ci - 1];
+
+	return chunk->nodes[chunk->count - 1];
+}
+
+static datastore_t *ds_list_last(datastore_t *first)
+{
+	if (first->name_index_chunk)
+		return ds_vec_last(&ds_index_run(first->parent->child_index, first->name, 0)->vec);
+
+	datastore_t *last = first;
+
+	for (datastore_t *cur = first; cur; cur = ds_next_by_name(cur))
+		last = cur;
+
+	return last;
+}
+
+static unsigned int ds_vec_position(ds_vec_t *vec, datastore_t *node)
+{
+	ds_chunk_t *chunk = node->index_chunk;
+	unsigned int position = 0;
+
+	for (unsigned int ci = 0; vec->chunks[ci] != chunk; ci++)
+		position += vec->chunks[ci]->count;
+
+	for (unsigned int i = 0; chunk->nodes[i] != node; i++)
+		position++;
+
+	return position;
+}
+
+/**
+ * ds_run_end() finds the last of contiguous siblings named like first
+ */
+static datastore_t *ds_run_end(datastore_t *first)
+{
+	if (first->name_index_chunk)
+	{
+		struct ds_child_index *index = first->parent->child_index;
+		ds_vec_t *run = &ds_index_run(index, first->name, 0)->vec;
+		datastore_t *last = ds_vec_last(run);
+
+		// run is contiguous if nothing else is between first and last
+		if (ds_vec_position(&index->vec, last) - ds_vec_position(&index->vec, first) + 1 == run->count)
+			return last;
+	}
+
+	datastore_t *cur = first;
+
+	while (cur->next && !strcmp(cur->next->name, first->name))
+		cur = cur->next;
+
+	return cur;
+}
+
+/**
+ * ds_cursor_value() cuts next value out of cursor, in place
+ *
+ * Return: the value, *cursor is moved past it, set to NULL after the last
+ */
+static char *ds_cursor_value(char **cursor)
+{
+	char *value = *cursor, *r = value, *w = value;
+
+	for (; *r && *r != ','; r++)
+	{
+		if (*r == '\\' && r[1])
+			r++;
+
+		*w++ = *r;
+	}
+
+	*cursor = *r ? r + 1 : NULL;
+	*w = '\0';
+
+	return value;
+}
+
+datastore_t *ds_list_cursor_find(datastore_t *first, const char *cursor)
+{
+	ds_key_t *key = NULL;
+	datastore_t *entry = NULL;
+	char *values = strdup(cursor);
+	char *value = values;
+
+	if (!values)
+	{
+		ERROR("not enough memory\n");
+		return NULL;
+	}
+
+	for (datastore_t *cur = first->child; cur; cur = cur->next)
+	{
+		if (!cur->is_key)
+			continue;
+
+		if (!value)
+			goto exit;
+
+		ds_key_t *key_part = malloc(sizeof(ds_key_t));
+
+		if (!key_part)
+		{
+			ERROR("not enough memory\n");
+			goto exit;
+		}
+
+		key_part->name = cur->name;
+		key_part->value = ds_cursor_value(&value);
+		key_part->next = key;
+		key = key_part;
+	}
+
+	// more values than keys
+	if (key && !value)
+		entry = ds_find_node_by_key(first, key);
+
+exit:
+	ds_free_key(key);
+	free(values);
+
+	return entry;
+}
+
+char *ds_list_cursor(datastore_t *entry)
+{
+	size_t len = 0;
+
+	for (datastore_t *cur = entry->child; cur; cur = cur->next)
+	{
+		if (!cur->is_key || !cur->value)
+			continue;
+
+		len += strlen(cur->value) + 1;
+
+		for (char *c = cur->value; *c; c++)
 		{
-			root = root->create_child ? (datastore_t *) root->create_child(root, cur_name, cur_value, NULL, NULL, 0)
-									  : ds_add_child_create(root, cur_name, cur_value, NULL, NULL, 0);
-			if (root->set)
-				root->set(root, cur_value);
+			if (*c == ',' || *c == '\\')
+				len++;
 		}
-		else
+	}
+
+	if (!len)
+		return NULL;
+
+	char *cursor = malloc(len);
+
+	if (!cursor)
+	{
+		ERROR("not enough memory\n");
+		return NULL;
+	}
+
+	char *p = cursor;
+
+	for (datastore_t *cur = entry->child; cur; cur = cur->next)
+	{
+		if (!cur->is_key || !cur->value)
+			continue;
+
+		if (p != cursor)
+			*p++ = ',';
+
+		// values may hold commas themselves
+		for (char *c = cur->value; *c; c++)
 		{
-			root = child;
+			if (*c == ',' || *c == '\\')
+				*p++ = '\\';
+
+			*p++ = *c;
 		}
+	}
 
-		if (!child)
-			DEBUG("\tcreated %s->%s\n", root->parent->name, root->name);
+	*p = '\0';
+
+	return cursor;
+}
+
+void ds_set_next_cursor(node_t *out, datastore_t *next)
+{
+	char *cursor = ds_list_cursor(next);
+
+	if (!out || !cursor)
+	{
+		free(cursor);
+		return;
 	}
 
-	ds_free_nip(node_list);
+	roxml_add_node(out, 0, ROXML_ATTR_NODE, "xmlns:lp", DS_PAGINATION_NS);
+	roxml_add_node(out, 0, ROXML_ATTR_NODE, "lp:next", cursor);
 
-	return root;
+	free(cursor);
 }
 
-int ds_purge_choice_group(datastore_t *parent, int choice_group)
+static void ds_get_siblings(datastore_t *first, node_t *out, int get_config, ds_get_options_t *options, unsigned int level);
+static void ds_get_window(datastore_t *first, node_t *out, int get_config, ds_get_options_t *options, unsigned int level);
+
+/**
+ * ds_get_node() adds node and its children up to requested depth to out
+ *
+ * Return: added xml node, NULL if node was skipped
+ */
+static node_t *ds_get_node(datastore_t *node, node_t *out, int get_config, ds_get_options_t *options, unsigned int level)
 {
-	if (!parent)
-		return -1;
+	if (options && options->over)
+		return NULL;
 
-	if(!choice_group)
-		return 0;
+	node = ds_published(node);
 
-	for (datastore_t *child = parent->child; child; )
+	// skip non-configurable nodes if only configurable are requested
+	if (get_config && !node->is_config)
+		return NULL;
+
+	if (node->update)
+		node->update(node);
+
+	// use get() if available
+	char *value;
+
+	if (node->get)
+		value = node->get(node);
+	else
+		value = node->value;
+
+	if (options && options->max_size)
 	{
-		datastore_t *tmp = child;
-		child = child->next;
+		// text of the node itself, children are counted as they are added
+		size_t size = 2 * strlen(node->name) + strlen("<></>") + (value ? strlen(value) : 0) +
+					  (node->ns ? strlen(" xmlns=\"\"") + strlen(node->ns) : 0);
 
-		if (tmp->choice_group == choice_group)
-			ds_free(tmp, 0);
+		if (options->size + size > options->max_size)
+		{
+			options->over = 1;
+
+			if (node->get)
+				free(value);
+
+			return NULL;
+		}
+
+		options->size += size;
 	}
 
-	return 0;
+	node_t *nn = roxml_add_node(out, 0, ROXML_ELM_NODE, node->name, value);
+
+	if (node->ns)
+		roxml_add_node(nn, 0, ROXML_ATTR_NODE, "xmlns", node->ns); // add namespace
+
+	// free value if returned with get (get always allocates)
+	if (node->get)
+		free(value);
+
+	if (!options || !options->depth || level < options->depth)
+		ds_get_siblings(node->child, nn, get_config, options, level + 1);
+
+	return nn;
 }
 
-int ds_set_value(datastore_t *datastore, char *value)
+static void ds_get_siblings(datastore_t *first, node_t *out, int get_config, ds_get_options_t *options, unsigned int level)
 {
-	if (!datastore || !value)
-		return -1;
+	int paged = ds_get_paged(options) && options->list;
 
-	if (datastore->set)
+	for (datastore_t *cur = first; cur && !(options && options->over); cur = cur->next)
 	{
-		int sr = datastore->set(datastore, value);
+		if (paged && cur->is_list && cur->parent && ds_get_target(options, cur, 0))
+		{
+			// whole list is added with its first entry
+			if (ds_find_child(cur->parent, cur->name, NULL) != cur)
+				continue;
 
-		if (sr)
-			return RPC_ERROR; // TODO error-option
+			ds_get_window(cur, out, get_config, options, level);
+
+			// skip the rest of the list
+			cur = ds_run_end(cur);
+			continue;
+		}
+
+		ds_get_node(cur, out, get_config, options, level);
 	}
+}
 
-	free(datastore->value);
-	datastore->value = strdup(value);
+/**
+ * ds_get_window() adds entries of list starting with first selected by options
+ */
+static void ds_get_window(datastore_t *first, node_t *out, int get_config, ds_get_options_t *options, unsigned int level)
+{
+	datastore_t *(*next)(datastore_t *) = options->backwards ? ds_prev_by_name : ds_next_by_name;
+	datastore_t *cur;
+	node_t *last = NULL;
 
-	if (!datastore->value)
-		return -1;
+	options->paged++;
 
-	DEBUG("ds_set_value( %s, %s )\n", datastore->name, value);
+	if (options->cursor)
+	{
+		if ((cur = ds_list_cursor_find(first, options->cursor)))
+			options->cursor_found = 1;
+	}
+	else
+		cur = options->backwards ? ds_list_last(first) : first;
 
-	return 0;
+	for (unsigned int skipped = 0; cur && skipped < options->offset; cur = next(cur))
+	{
+		if (!get_config || cur->is_config)
+			skipped++;
+	}
+
+	for (unsigned int count = 0; cur && (!options->limit || count < options->limit) && !options->over; cur = next(cur))
+	{
+		node_t *nn = ds_get_node(cur, out, get_config, options, level);
+
+		if (nn)
+		{
+			last = nn;
+			count++;
+		}
+	}
+
+	// let client know where to continue
+	for (; cur; cur = next(cur))
+	{
+		if (!get_config || cur->is_config)
+		{
+			ds_set_next_cursor(last, cur);
+			break;
+		}
+	}
 }
 
-void ds_set_is_config(datastore_t *datastore, int is_config, int set_siblings)
+/**
+ * ds_get_level() returns depth of node, top level nodes are at depth 1
+ */
+static unsigned int ds_get_level(datastore_t *node)
 {
-	if (!datastore)
+	unsigned int level = 1;
+
+	for (datastore_t *cur = node->parent; cur && cur->parent; cur = cur->parent)
+		level++;
+
+	return level;
+}
+
+node_t *ds_get_all_options(datastore_t *our_root, node_t *out, int get_config, int check_siblings, ds_get_options_t *options)
+{
+	if (!our_root)
+		return NULL;
+
+	unsigned int level = ds_get_level(our_root);
+
+	if (!check_siblings)
+		return ds_get_node(our_root, out, get_config, options, level);
+
+	ds_get_siblings(our_root, out, get_config, options, level);
+
+	return NULL;
+}
+
+void ds_get_all(datastore_t *our_root, node_t *out, int get_config, int check_siblings)
+{
+	ds_get_all_options(our_root, out, get_config, check_siblings, NULL);
+}
+
+void ds_get_list(datastore_t *first, node_t *out, int get_config, ds_get_options_t *options)
+{
+	if (!first)
 		return;
 
-	datastore->is_config = is_config;
+	unsigned int level = ds_get_level(first);
 
-	if (is_config)
-		return; // is_config is only recursively set if it's false
+	if (!ds_get_paged(options))
+	{
+		for (datastore_t *cur = first; cur; cur = ds_next_by_name(cur))
+			ds_get_node(cur, out, get_config, options, level);
 
-	if (set_siblings)
-		ds_set_is_config(datastore->next, is_config, 1);
+		return;
+	}
 
-	ds_set_is_config(datastore->child, is_config, 1);
+	ds_get_window(first, out, get_config, options, level);
 }
 
+// streaming serializer implementation
 
-void ds_add_child(datastore_t *self, datastore_t *child, char *target_name, int target_position)
+struct ds_stream
 {
-	if (self->child)
+	datastore_t **roots; // children of roots are serialized
+	unsigned int roots_count;
+	unsigned int root;
+	int get_config;
+	datastore_t **stack; // current node on each level
+	unsigned int depth;
+	unsigned int stack_size;
+	char *names; // names of open elements, so they close without nodes
+	size_t names_len;
+	size_t names_size;
+	size_t *name_off; // where name of the element open on each level starts
+	char *piece; // text of the last generated tag
+	size_t piece_len;
+	size_t piece_size;
+	size_t piece_off; // part of piece already read
+	unsigned int generation; // of the root being read, see ds_invalidate()
+	int epoch; // published versions read stay until the stream ends, -1 after
+	int ending; // only close tags of open elements are left
+	int broken; // piece or stack incomplete after an error
+};
+
+ds_stream_t *ds_stream_create(datastore_t **roots, unsigned int roots_count, int get_config)
+{
+	ds_stream_t *stream = calloc(1, sizeof(ds_stream_t));
+
+	if (!stream)
+	{
+		ERROR("not enough memory\n");
+		return NULL;
+	}
+
+	stream->roots = malloc((roots_count ? roots_count : 1) * sizeof(datastore_t *));
+
+	if (!stream->roots)
 	{
-		datastore_t *cur;
-		int cur_pos = 0;
+		ERROR("not enough memory\n");
+		free(stream);
+		return NULL;
+	}
 
-		if (target_name)
+	memcpy(stream->roots, roots, roots_count * sizeof(datastore_t *));
+	stream->roots_count = roots_count;
+	stream->get_config = get_config;
+	stream->epoch = ds_read_begin();
+
+	return stream;
+}
+
+void ds_stream_free(ds_stream_t *stream)
+{
+	if (!stream)
+		return;
+
+	if (stream->epoch >= 0)
+		ds_read_end(stream->epoch);
+
+	free(stream->roots);
+	free(stream->stack);
+	free(stream->names);
+	free(stream->name_off);
+	free(stream->piece);
+	free(stream);
+}
+
+/**
+ * ds_stream_append() appends str to stream->piece
+ *
+ * @escape 0 to append str as is, 1 to escape it as text, 2 as attribute value
+ */
+static int ds_stream_append(ds_stream_t *stream, const char *str, int escape)
+{
+	for (; *str; str++)
+	{
+		const char *entity = NULL;
+
+		if (escape)
 		{
-			for (cur = self->child; cur->next != 0; cur = cur->next)
+			switch (*str)
 			{
-				if (!strcmp(cur->name, target_name))
-				{
-					// if it's last of its name
-					if (strcmp(cur->next->name, target_name))
-						break;
+				case '&':
+					entity = "&amp;";
+					break;
 
-					// if at desired position
-					if (target_position && ++cur_pos >= target_position)
-						break;
-				}
+				case '<':
+					entity = "&lt;";
+					break;
+
+				case '>':
+					entity = "&gt;";
+					break;
+
+				case '"':
+					if (escape > 1)
+						entity = "&quot;";
+					break;
 			}
 		}
-		else
+
+		size_t len = entity ? strlen(entity) : 1;
+
+		if (stream->piece_len + len > stream->piece_size)
 		{
-			for (cur = self->child; cur->next != 0; cur = cur->next)
+			size_t size = stream->piece_size ? stream->piece_size * 2 : 256;
+
+			while (size < stream->piece_len + len)
+				size *= 2;
+
+			char *piece = realloc(stream->piece, size);
+
+			if (!piece)
 			{
-				if (target_position && ++cur_pos >= target_position)
-					break;
+				ERROR("not enough memory\n");
+				return -1;
 			}
+
+			stream->piece = piece;
+			stream->piece_size = size;
 		}
 
-		child->next = cur->next;
+		memcpy(stream->piece + stream->piece_len, entity ? entity : str, len);
+		stream->piece_len += len;
+	}
 
-		if (cur->next) cur->next->prev = child;
+	return 0;
+}
 
-		cur->next = child;
-		child->prev = cur;
-	}
-	else
+static int ds_stream_push(ds_stream_t *stream, datastore_t *node)
+{
+	if (stream->depth == stream->stack_size)
 	{
-		self->child = child;
+		unsigned int size = stream->stack_size ? stream->stack_size * 2 : 16;
+		size_t *name_off = realloc(stream->name_off, size * sizeof(size_t));
+
+		if (!name_off)
+		{
+			ERROR("not enough memory\n");
+			return -1;
+		}
+
+		stream->name_off = name_off;
+
+		datastore_t **stack = realloc(stream->stack, size * sizeof(datastore_t *));
+
+		if (!stack)
+		{
+			ERROR("not enough memory\n");
+			return -1;
+		}
+
+		stream->stack = stack;
+		stream->stack_size = size;
 	}
 
-	child->parent = self;
+	stream->stack[stream->depth++] = node;
 
-	ds_set_is_config(child, self->is_config, 0);
+	return 0;
 }
 
-datastore_t *ds_add_child_create(datastore_t *datastore, char *name, char *value, char *ns, char *target_name, int target_position)
+/**
+ * ds_stream_open() keeps name of the element opened on the top level
+ */
+static int ds_stream_open(ds_stream_t *stream, const char *name)
 {
-	datastore_t *child = ds_create(name, value, ns);
+	size_t len = strlen(name) + 1;
 
-	if (!child)
-		return 0;
+	if (stream->names_len + len > stream->names_size)
+	{
+		size_t size = stream->names_size ? stream->names_size * 2 : 256;
 
-	ds_add_child(datastore, child, target_name, target_position);
+		while (size < stream->names_len + len)
+			size *= 2;
 
-	return child;
+		char *names = realloc(stream->names, size);
+
+		if (!names)
+		{
+			ERROR("not enough memory\n");
+			return -1;
+		}
+
+		stream->names = names;
+		stream->names_size = size;
+	}
+
+	stream->name_off[stream->depth - 1] = stream->names_len;
+	memcpy(stream->names + stream->names_len, name, len);
+	stream->names_len += len;
+
+	return 0;
 }
 
-datastore_t *ds_add_from_filter(datastore_t *datastore, node_t *filter_root, ds_nip_t *nip)
+/**
+ * ds_stream_next() generates text of the next tag into stream->piece
+ *
+ * Return: 1 if text was generated, 0 when done, -1 on error
+ */
+static int ds_stream_next(ds_stream_t *stream)
 {
-	if (!datastore || !filter_root)
-		return NULL;
+	int rc = 0;
 
-	char *name = roxml_get_name(filter_root, NULL, 0);
-	DEBUG("add_from_filter( %s, %s )\n", name, roxml_get_content(filter_root, NULL, 0, NULL));
-	DEBUG("\tadding_to %s->%s\n", datastore->parent->name, datastore->name);
+	stream->piece_len = stream->piece_off = 0;
 
-	char *value = roxml_get_content(filter_root, NULL, 0, NULL);
-	char *ns = roxml_get_content(roxml_get_ns(filter_root), NULL, 0, NULL);
+	// nodes might be gone, names kept close the elements
+	if (stream->ending)
+	{
+		if (stream->depth < 2)
+			return 0;
 
-	datastore_t *rc = datastore->create_child ? (datastore_t *) datastore->create_child(datastore, name, value, ns, name, 0)
-											  : ds_add_child_create(datastore, name, value, ns, name, 0);
-	if (rc->set)
-		rc->set(rc, value);
+		stream->depth--;
+		stream->names_len = stream->name_off[stream->depth - 1];
 
-	ds_nip_delete(nip, filter_root);
+		rc |= ds_stream_append(stream, "</", 0);
+		rc |= ds_stream_append(stream, stream->names + stream->names_len, 0);
+		rc |= ds_stream_append(stream, ">", 0);
 
-	int child_count = roxml_get_chld_nb(filter_root);
+		return rc ? -1 : 1;
+	}
 
-	for (int i = 0; i < child_count; i++)
+	for (;;)
 	{
-		node_t *child = roxml_get_chld(filter_root, NULL, i);
+		if (!stream->depth)
+		{
+			if (stream->root == stream->roots_count)
+				return 0;
 
-		ds_add_from_filter(rc, child, nip);
-	}
+			datastore_t *first = ds_published(stream->roots[stream->root++])->child;
 
-	return rc;
-}
+			if (first && ds_stream_push(stream, first))
+				return -1;
 
+			continue;
+		}
 
-datastore_t *ds_find_sibling(datastore_t *root, char *name, char *value)
-{
-	for (datastore_t *cur = root; cur != NULL; cur = cur->next)
-	{
-		// check name
-		if (cur->name && !strcmp(cur->name, name))
+		datastore_t **top = &stream->stack[stream->depth - 1];
+		datastore_t *cur = *top;
+
+		// end of children, close the parent
+		if (!cur)
 		{
-			// check value if requested
-			if (value)
-			{
-				if (cur->value && !strcmp(cur->value, value))
-					return cur;
-			}
-			else
-			{
-				return cur;
-			}
+			if (!--stream->depth)
+				continue;
+
+			top = &stream->stack[stream->depth - 1];
+			cur = *top;
+			*top = cur->next;
+			stream->names_len = stream->name_off[stream->depth - 1];
+
+			rc |= ds_stream_append(stream, "</", 0);
+			rc |= ds_stream_append(stream, cur->name, 0);
+			rc |= ds_stream_append(stream, ">", 0);
+
+			return rc ? -1 : 1;
 		}
-	}
 
-	return NULL;
-}
+		// position stays in the tree, content may be published
+		datastore_t *node = ds_published(cur);
 
-datastore_t *ds_find_child(datastore_t *root, char *name, char *value)
-{
-	return ds_find_sibling(root->child, name, value);
-}
+		// skip non-configurable nodes if only configurable are requested
+		if (stream->get_config && !node->is_config)
+		{
+			*top = cur->next;
+			continue;
+		}
 
-int ds_element_has_key_part(datastore_t *elem, char *name, char *value)
-{
-	if (!name)
-		return 0;
+		if (node->update)
+			node->update(node);
 
-	for (datastore_t *cur = elem->child; cur != NULL; cur = cur->next)
-	{
-		if (cur->name && !strcmp(cur->name, name))
+		// use get() if available
+		char *value = node->get ? node->get(node) : node->value;
+
+		rc |= ds_stream_append(stream, "<", 0);
+		rc |= ds_stream_append(stream, node->name, 0);
+
+		if (node->ns)
 		{
-			// names match
-			if (!value || (cur->value && !strcmp(cur->value, value)))
-			{
-				// if we don't need value or values match
-				return cur->is_key; // key found
-			}
+			rc |= ds_stream_append(stream, " xmlns=\"", 0);
+			rc |= ds_stream_append(stream, node->ns, 2);
+			rc |= ds_stream_append(stream, "\"", 0);
 		}
-	}
 
-	return 0; // no key found
-}
+		if (node->child)
+		{
+			rc |= ds_stream_append(stream, ">", 0);
+			rc |= ds_stream_append(stream, value ? value : "", 1);
+			rc |= ds_stream_open(stream, node->name);
+			rc |= ds_stream_push(stream, node->child);
+		}
+		else if (value && *value)
+		{
+			*top = cur->next;
 
-int ds_element_has_key(datastore_t *elem, ds_key_t *key)
-{
-	if (!elem || !key)
-		return 0;
+			rc |= ds_stream_append(stream, ">", 0);
+			rc |= ds_stream_append(stream, value, 1);
+			rc |= ds_stream_append(stream, "</", 0);
+			rc |= ds_stream_append(stream, node->name, 0);
+			rc |= ds_stream_append(stream, ">", 0);
+		}
+		else
+		{
+			*top = cur->next;
 
-	for (ds_key_t *key_part = key; key_part != NULL; key_part = key_part->next)
-	{
-		if (!ds_element_has_key_part(elem, key_part->name, key_part->value))
-			return 0; // doesn't have key if misses at least one key part
-	}
+			rc |= ds_stream_append(stream, "/>", 0);
+		}
 
-	return 1; // found all key parts so has key
+		// free value if returned with get (get always allocates)
+		if (node->get)
+			free(value);
+
+		return rc ? -1 : 1;
+	}
 }
 
-int ds_list_has_key(datastore_t *list)
+/**
+ * ds_stream_generation() returns generation of the root stream is reading
+ */
+static unsigned int ds_stream_generation(ds_stream_t *stream)
 {
-	if (!list)
+	if (!stream->root)
 		return 0;
 
-	for (datastore_t *cur = list->child; cur != NULL; cur = cur->next)
-	{
-		if (cur->is_key)
-			return 1;
-	}
-
-	return 0;
+	return __atomic_load_n(&stream->roots[stream->root - 1]->generation, __ATOMIC_SEQ_CST);
 }
 
-datastore_t *ds_find_node_by_key(datastore_t *our_root, ds_key_t *key)
+ssize_t ds_stream_read(ds_stream_t *stream, char *buf, size_t size)
 {
-	for (datastore_t *cur = our_root; cur != NULL; cur = cur->next)
+	size_t len = 0;
+
+	if (stream->broken)
+		return -1;
+
+	// nodes on the stack might be gone if their module freed any
+	if (!stream->ending && stream->depth &&
+		stream->generation != ds_stream_generation(stream))
 	{
-		if (ds_element_has_key(cur, key))
-			return cur;
+		ERROR("datastore changed during streaming\n");
+		return -1;
 	}
 
-	return NULL;
-}
+	while (len < size)
+	{
+		if (stream->piece_off == stream->piece_len)
+		{
+			int rc = ds_stream_next(stream);
 
+			if (rc < 0)
+			{
+				stream->broken = 1;
+				return -1;
+			}
 
-void ds_get_all(datastore_t *our_root, node_t *out, int get_config, int check_siblings)
-{
-	if (!our_root)
-		return;
+			if (!rc)
+				break;
+		}
 
-	// skip non-configurable nodes if only configurable are requested
-	if (get_config && !our_root->is_config)
-	{
-		// still have to check siblings, they may be configurable
-		if (check_siblings)
-			ds_get_all(our_root->next, out, get_config, 1);
+		size_t n = stream->piece_len - stream->piece_off;
 
-		return;
-	}
+		if (n > size - len)
+			n = size - len;
 
-	if (our_root->update)
-		our_root->update(our_root);
+		memcpy(buf + len, stream->piece + stream->piece_off, n);
+		stream->piece_off += n;
+		len += n;
+	}
 
-	// use get() if available
-	char *value;
+	// changes made by update() during this read are safe
+	stream->generation = ds_stream_generation(stream);
 
-	if (our_root->get)
-		value = our_root->get(our_root);
-	else
-		value = our_root->value;
+	return len;
+}
 
-	node_t *nn = roxml_add_node(out, 0, ROXML_ELM_NODE, our_root->name, value);
+int ds_stream_end(ds_stream_t *stream)
+{
+	if (stream->broken)
+		return -1;
 
-	if (our_root->ns)
-		roxml_add_node(nn, 0, ROXML_ATTR_NODE, "xmlns", our_root->ns); // add namespace
+	stream->ending = 1;
 
-	// free value if returned with get (get always allocates)
-	if (our_root->get)
-		free(value);
+	// only names of open elements are read from now on
+	if (stream->epoch >= 0)
+		ds_read_end(stream->epoch);
 
-	if (check_siblings)
-		ds_get_all(our_root->next, out, get_config, 1);
+	stream->epoch = -1;
 
-	ds_get_all(our_root->child, nn, get_config, 1);
+	return 0;
 }
 
 void ds_get_all_keys(datastore_t *our_root, node_t *out, int get_config)
@@ -722,134 +3077,37 @@ void ds_get_list_data(node_t *filter_root, datastore_t *node, node_t *out, int g
 	}
 }
 
-void ds_get_filtered(node_t *filter_root, datastore_t *our_root, node_t *out, int get_config)
+int ds_edit_config(node_t *filter_root, datastore_t *our_root, ds_nip_t *nodes_in_processing)
 {
-	if (!our_root)
-		return;
-
-	// recursively check siblings
-	node_t *filter_root_sibling = roxml_get_next_sibling(filter_root);
-
-	if (filter_root_sibling && our_root->next)
-	{
-		ds_get_filtered(filter_root_sibling, our_root->next, out, get_config);
-	}
-
-	// skip non-configurable nodes if only configurable are requested
-	if (get_config && !our_root->is_config)
-		return;
-
-	node_t *filter_root_child = roxml_get_chld(filter_root, NULL, 0);
-
-	if (our_root->is_list && filter_root_child)
-	{
-		// handle list filtering
-		if (!ds_list_has_key(our_root))
-			return; // this shouldn't happen
-
-		ds_key_t *key = ds_get_key_from_xml(filter_root, NULL);
-		ds_print_key(key);
-
-		if (!key)
-		{
-			ds_get_all_keys(our_root, out, get_config);
-			return;
-		}
-
-		datastore_t *node = ds_find_node_by_key(our_root, key);
-		ds_free_key(key);
-
-		if (!node)
-			DEBUG("node IS NULL\n");
-		else
-			DEBUG("node name: %s\nfilter_root name: %s\n", node->name, roxml_get_name(filter_root, NULL, 0));
-
-		ds_get_list_data(filter_root, node, out, get_config);
-	}
-	else if (filter_root_child)
-	{
-		// we're not calling update() sooner because ds_get_all and ds_get_all_keys
-		// will call it too and we don't want to call it twice in the same get
-		if (our_root->update)
-			our_root->update(our_root);
-
-		out = roxml_add_node(out, 0, ROXML_ELM_NODE, our_root->name, NULL);
-
-		if (our_root->ns)
-			roxml_add_node(out, 0, ROXML_ATTR_NODE, "xmlns", our_root->ns); // add namespace
-
-		datastore_t *our_child = ds_find_child(our_root, roxml_get_name(filter_root_child, NULL, 0), NULL);
-
-		if (our_child)
-		{
-			ds_get_filtered(filter_root_child, our_child, out, get_config);
-		}
-		else
-		{
-			// when fetching multiple nodes and some of them are missing, we have to check their siblings anyway
-			node_t *filter_root_child_sibling;
-			while ((filter_root_child_sibling = roxml_get_next_sibling(filter_root_child)))
-			{
-				datastore_t *child = ds_find_child(our_root, roxml_get_name(filter_root_child_sibling, NULL, 0), NULL);
-				if (child)
-				{
-					ds_get_filtered(filter_root_child_sibling, child, out, get_config);
-					break;
-				}
-			}
-		}
-	}
-	else if (our_root->is_list)
-	{
-		// leaf list
-
-		// we're not calling update() sooner because ds_get_all and ds_get_all_keys
-		// will call it too and we don't want to call it twice in the same get
-		if (our_root->update)
-			our_root->update(our_root);
+	if (!filter_root)
+		return 0;
 
-		for (datastore_t *cur = our_root; cur != NULL; cur = cur->next)
-		{
-			if (!strcmp(cur->name, our_root->name))
-			{
-				char *value;
+	// original call owns the set for the whole request
+	ds_nip_t *nip = nodes_in_processing ? nodes_in_processing : ds_nip_create();
 
-				if (cur->get)
-					value = cur->get(cur); // use get() if available
-				else
-					value = cur->value;
+	if (!nip)
+		return -1;
 
-				roxml_add_node(out, 0, ROXML_ELM_NODE, our_root->name, value);
+	int rc = 0;
 
-				if (cur->get)
-					free(value); // free value if returned with get (get always allocates)
-			}
-		}
-	}
-	else
+	// always add nodes to nip if they exist
+	if (ds_nip_add_unique(nip, filter_root))
 	{
-		ds_get_all(our_root, out, get_config, 0);
+		rc = -1;
+		goto exit;
 	}
-}
-
-int ds_edit_config(node_t *filter_root, datastore_t *our_root, ds_nip_t *nodes_in_processing)
-{
-	if (!filter_root)
-		return 0;
 
-	// always add nodes to nip if they exist
-	ds_nip_t *nip = ds_nip_add_unique(nodes_in_processing, filter_root);
-
-	if(!our_root)
-		return 0;
+	if (!our_root)
+		goto exit;
 
 	// finding match
 	char *filter_name = roxml_get_name(filter_root, NULL, 0);
 
 	if (!filter_name || !our_root->name)
-		return -1;
-
-	int rc = 0;
+	{
+		rc = -1;
+		goto exit;
+	}
 
 	DEBUG("\t\tfilter: %s\t our: %s\n", filter_name, our_root->name);
 
@@ -892,9 +3150,9 @@ int ds_edit_config(node_t *filter_root, datastore_t *our_root, ds_nip_t *nodes_i
 			if (!child)
 			{
 				if (operation == OPERATION_DELETE)
-					return RPC_DATA_MISSING;
+					rc = RPC_DATA_MISSING;
 
-				return 0;
+				goto exit;
 			}
 
 			DEBUG("delete( %s, %s )\n", child->name, child->value);
@@ -905,7 +3163,7 @@ int ds_edit_config(node_t *filter_root, datastore_t *our_root, ds_nip_t *nodes_i
 			ds_free(child, 0);
 			ds_nip_delete(nip, filter_root);
 
-			return 0;
+			goto exit;
 		}
 
 		if (operation == OPERATION_CREATE &&
@@ -922,7 +3180,8 @@ int ds_edit_config(node_t *filter_root, datastore_t *our_root, ds_nip_t *nodes_i
 				DEBUG("%s exists and cannot be created\n", roxml_get_name(filter_root, NULL, 0));
 
 				ds_nip_delete(nip, filter_root);
-				return RPC_DATA_EXISTS;
+				rc = RPC_DATA_EXISTS;
+				goto exit;
 			}
 		}
 
@@ -932,7 +3191,10 @@ int ds_edit_config(node_t *filter_root, datastore_t *our_root, ds_nip_t *nodes_i
 			DEBUG("set_multiple( %s, %s )\n", our_root->name, roxml_get_name(filter_root, NULL, 0));
 
 			if (smr)
-				return RPC_ERROR; // TODO error-option
+			{
+				rc = RPC_ERROR; // TODO error-option
+				goto exit;
+			}
 		}
 
 		if (our_root->is_list)
@@ -951,7 +3213,7 @@ int ds_edit_config(node_t *filter_root, datastore_t *our_root, ds_nip_t *nodes_i
 					// since filter_root is already in nip, we gracefully exit
 					// node will be created
 					ds_free_key(key);
-					return 0;
+					goto exit;
 				}
 
 				// replace values in datastore for all the values in filter
@@ -1027,16 +3289,23 @@ exit_edit:
 
 	if (!nodes_in_processing) // original call, recursion is done!
 	{
-		for (ds_nip_t *cur = nip->next; cur; cur = cur->next)
+		// nodes are visited in document order, parents before their children
+		for (unsigned int i = 0; i < nip->nodes_count; i++)
 		{
-			DEBUG("processing %s->%s\n", roxml_get_name(roxml_get_parent(cur->node), NULL, 0), roxml_get_name(cur->node, NULL, 0));
-			enum ds_operation cur_operation = ds_get_operation(cur->node);
+			node_t *cur = nip->nodes[i];
+
+			// already handled, possibly as part of a tree added below
+			if (!cur)
+				continue;
+
+			DEBUG("processing %s->%s\n", roxml_get_name(roxml_get_parent(cur), NULL, 0), roxml_get_name(cur, NULL, 0));
+			enum ds_operation cur_operation = ds_get_operation(cur);
 
 			if (cur_operation == OPERATION_DELETE)
 			{
 				// we should have deleted this but it doesn't exist in datastore
-				ds_free_nip(nip);
-				return RPC_DATA_MISSING; // TODO handle error-option
+				rc = RPC_DATA_MISSING; // TODO handle error-option
+				break;
 			}
 			else if (cur_operation == OPERATION_REMOVE)
 			{
@@ -1044,20 +3313,24 @@ exit_edit:
 			}
 			else // create or merge or replace but needs to create the node
 			{
-				datastore_t *nn = ds_create_path(our_root, cur->node);
-				ds_set_value(nn, roxml_get_content(cur->node, NULL, 0, NULL));
+				datastore_t *nn = ds_create_path(our_root, cur);
+				ds_set_value(nn, roxml_get_content(cur, NULL, 0, NULL));
+				ds_nip_delete(nip, cur);
 
 				// add whole trees if they are missing
-				int child_count = roxml_get_chld_nb(cur->node);
-				for (int i = 0; i < child_count; i++)
+				int child_count = roxml_get_chld_nb(cur);
+				for (int j = 0; j < child_count; j++)
 				{
-					ds_add_from_filter(nn, roxml_get_chld(cur->node, NULL, i), nip);
+					ds_add_from_filter(nn, roxml_get_chld(cur, NULL, j), nip);
 				}
 			}
 		}
+	}
 
+exit:
+
+	if (!nodes_in_processing)
 		ds_free_nip(nip);
-	}
 
 	return rc;
 }
@@ -0,0 +1,584 @@
+/*
+ * Copyright (C) 2014 Sartura, Ltd.
+ * Copyright (C) 2014 Cisco Systems, Inc.
+ *
+ * Author: Luka Perkov <luka.perkov@sartura.hr>
+ * Author: Petar Koretic <petar.koretic@sartura.hr>
+ *
+ * freenetconfd is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with freenetconfd. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#include "freenetconfd/freenetconfd.h"
+#include "freenetconfd/datastore.h"
+#include "freenetconfd/plugin.h"
+
+#include "filter.h"
+#include "modules.h"
+
+static int filter_match(filter_node_t *fn, datastore_t *parent, node_t *out, int get_config, ds_get_options_t *options);
+
+static int filter_is_blank(char *value)
+{
+	if (!value)
+		return 1;
+
+	for (; *value; value++)
+	{
+		if (!isspace((unsigned char) *value))
+			return 0;
+	}
+
+	return 1;
+}
+
+static void filter_free_node(filter_node_t *fn, int owned)
+{
+	if (!fn)
+		return;
+
+	for (int i = 0; i < fn->children_count; i++)
+		filter_free_node(fn->children[i], owned);
+
+	if (owned)
+	{
+		free(fn->name);
+		free(fn->value);
+	}
+
+	free(fn->children);
+	free(fn);
+}
+
+/*
+ * filter_compile_node() - compiles filter node and its children
+ *
+ * @owned	copy names and values instead of pointing into the xml
+ */
+static filter_node_t *filter_compile_node(node_t *node, int owned)
+{
+	filter_node_t *fn = calloc(1, sizeof(filter_node_t));
+
+	if (!fn)
+	{
+		ERROR("not enough memory\n");
+		return NULL;
+	}
+
+	fn->name = roxml_get_name(node, NULL, 0);
+
+	if (owned && fn->name && !(fn->name = strdup(fn->name)))
+	{
+		ERROR("not enough memory\n");
+		free(fn);
+		return NULL;
+	}
+
+	int child_count = roxml_get_chld_nb(node);
+
+	if (!child_count)
+	{
+		char *value = roxml_get_content(node, NULL, 0, NULL);
+
+		if (filter_is_blank(value))
+		{
+			fn->type = FILTER_SELECTION;
+		}
+		else
+		{
+			fn->type = FILTER_CONTENT_MATCH;
+			fn->value = owned ? strdup(value) : value;
+
+			if (!fn->value)
+			{
+				ERROR("not enough memory\n");
+				filter_free_node(fn, owned);
+				return NULL;
+			}
+		}
+
+		return fn;
+	}
+
+	fn->type = FILTER_CONTAINMENT;
+	fn->children = calloc(child_count, sizeof(filter_node_t *));
+
+	if (!fn->children)
+	{
+		ERROR("not enough memory\n");
+		filter_free_node(fn, owned);
+		return NULL;
+	}
+
+	for (int i = 0; i < child_count; i++)
+	{
+		filter_node_t *child = filter_compile_node(roxml_get_chld(node, NULL, i), owned);
+
+		if (!child)
+		{
+			filter_free_node(fn, owned);
+			return NULL;
+		}
+
+		fn->children[fn->children_count++] = child;
+
+		if (child->type == FILTER_CONTENT_MATCH)
+			fn->content_match_count++;
+	}
+
+	return fn;
+}
+
+/**
+ * filter_find_module() finds module datastore filter node belongs to
+ *
+ * Modules are matched by namespace, or by top level node name if the
+ * filter node has no namespace.
+ */
+static datastore_t *filter_find_module(node_t *node)
+{
+	char *name = roxml_get_name(node, NULL, 0);
+	char *ns = roxml_get_content(roxml_get_ns(node), NULL, 0, NULL);
+
+	struct list_head *modules = get_modules();
+	struct module_list *elem;
+
+	list_for_each_entry(elem, modules, list)
+	{
+		if (!elem->m->datastore)
+			continue;
+
+		if (ns && *ns)
+		{
+			if (elem->m->ns && !strcmp(ns, elem->m->ns))
+				return elem->m->datastore;
+		}
+		else if (name && ds_find_child(elem->m->datastore, name, NULL))
+		{
+			return elem->m->datastore;
+		}
+	}
+
+	return NULL;
+}
+
+filter_t *filter_compile(node_t *filter)
+{
+	filter_t *f = calloc(1, sizeof(filter_t));
+
+	if (!f)
+	{
+		ERROR("not enough memory\n");
+		return NULL;
+	}
+
+	int child_count = roxml_get_chld_nb(filter);
+
+	if (!child_count)
+		return f;
+
+	f->nodes = calloc(child_count, sizeof(filter_node_t *));
+
+	if (!f->nodes)
+	{
+		ERROR("not enough memory\n");
+		free(f);
+		return NULL;
+	}
+
+	for (int i = 0; i < child_count; i++)
+	{
+		node_t *node = roxml_get_chld(filter, NULL, i);
+		datastore_t *module = filter_find_module(node);
+
+		if (!module)
+		{
+			DEBUG("no module for filter node: %s\n", roxml_get_name(node, NULL, 0));
+			continue;
+		}
+
+		filter_node_t *fn = filter_compile_node(node, 0);
+
+		if (!fn)
+		{
+			filter_free(f);
+			return NULL;
+		}
+
+		fn->module = module;
+		f->nodes[f->nodes_count++] = fn;
+	}
+
+	return f;
+}
+
+filter_t *filter_compile_event(node_t *filter)
+{
+	filter_t *f = calloc(1, sizeof(filter_t));
+	int child_count = roxml_get_chld_nb(filter);
+
+	if (!f || (child_count && !(f->nodes = calloc(child_count, sizeof(filter_node_t *)))))
+	{
+		ERROR("not enough memory\n");
+		free(f);
+		return NULL;
+	}
+
+	f->owned = 1;
+
+	for (int i = 0; i < child_count; i++)
+	{
+		filter_node_t *fn = filter_compile_node(roxml_get_chld(filter, NULL, i), 1);
+
+		if (!fn)
+		{
+			filter_free(f);
+			return NULL;
+		}
+
+		f->nodes[f->nodes_count++] = fn;
+	}
+
+	return f;
+}
+
+void filter_free(filter_t *filter)
+{
+	if (!filter)
+		return;
+
+	for (int i = 0; i < filter->nodes_count; i++)
+		filter_free_node(filter->nodes[i], filter->owned);
+
+	free(filter->nodes);
+	free(filter);
+}
+
+/**
+ * filter_value_matches() compares node's value to value
+ */
+static int filter_value_matches(datastore_t *node, char *value)
+{
+	char *node_value = node->get ? node->get(node) : node->value;
+	int rc = node_value && !strcmp(node_value, value);
+
+	// get always allocates
+	if (node->get)
+		free(node_value);
+
+	return rc;
+}
+
+/**
+ * filter_content_matches() checks if node has a child matching content match node cm
+ *
+ * Any entry of a leaf-list is enough for a match.
+ */
+static int filter_content_matches(filter_node_t *cm, datastore_t *node)
+{
+	for (datastore_t *cur = ds_find_child(node, cm->name, NULL); cur; cur = ds_next_by_name(cur))
+	{
+		if (filter_value_matches(cur, cm->value))
+			return 1;
+	}
+
+	return 0;
+}
+
+/**
+ * filter_key() makes list key from content match nodes of fn
+ *
+ * Return: key, NULL if content match nodes don't cover the whole key of entry
+ */
+static ds_key_t *filter_key(filter_node_t *fn, datastore_t *entry)
+{
+	ds_key_t *key = NULL;
+	int key_parts = 0, parts = 0;
+
+	for (datastore_t *cur = entry->child; cur; cur = cur->next)
+	{
+		if (cur->is_key)
+			key_parts++;
+	}
+
+	if (!key_parts)
+		return NULL;
+
+	for (int i = 0; i < fn->children_count; i++)
+	{
+		filter_node_t *cm = fn->children[i];
+
+		if (cm->type != FILTER_CONTENT_MATCH || !ds_element_has_key_part(entry, cm->name, NULL))
+			continue;
+
+		ds_key_t *key_part = malloc(sizeof(ds_key_t));
+
+		if (!key_part)
+		{
+			ERROR("not enough memory\n");
+			ds_free_key(key);
+			return NULL;
+		}
+
+		key_part->name = cm->name;
+		key_part->value = cm->value;
+		key_part->next = key;
+		key = key_part;
+		parts++;
+	}
+
+	if (parts != key_parts)
+	{
+		ds_free_key(key);
+		return NULL;
+	}
+
+	return key;
+}
+
+static node_t *filter_add_node(datastore_t *node, node_t *out, char *value)
+{
+	node_t *nn = roxml_add_node(out, 0, ROXML_ELM_NODE, node->name, value);
+
+	if (node->ns)
+		roxml_add_node(nn, 0, ROXML_ATTR_NODE, "xmlns", node->ns); // add namespace
+
+	return nn;
+}
+
+/**
+ * filter_node() evaluates filter node fn on datastore node
+ *
+ * Return: 1 if node was selected, 0 otherwise
+ */
+static int filter_node(filter_node_t *fn, datastore_t *node, node_t *out, int get_config, ds_get_options_t *options)
+{
+	node = ds_published(node);
+
+	// skip non-configurable nodes if only configurable are requested
+	if (get_config && !node->is_config)
+		return 0;
+
+	switch (fn->type)
+	{
+		case FILTER_SELECTION:
+			ds_get_all_options(node, out, get_config, 0, options);
+			return 1;
+
+		case FILTER_CONTENT_MATCH:
+			if (!filter_value_matches(node, fn->value))
+				return 0;
+
+			ds_get_all_options(node, out, get_config, 0, options);
+			return 1;
+
+		case FILTER_CONTAINMENT:
+			break;
+	}
+
+	// fresh values are needed for content matching, ds_get_all() below
+	// is called on children only so update() isn't called twice
+	if (node->update)
+		node->update(node);
+
+	// all content match nodes have to match
+	for (int i = 0; i < fn->children_count; i++)
+	{
+		if (fn->children[i]->type == FILTER_CONTENT_MATCH && !filter_content_matches(fn->children[i], node))
+			return 0;
+	}
+
+	// only content match nodes select the whole node
+	if (fn->content_match_count == fn->children_count)
+	{
+		char *value = node->get ? node->get(node) : node->value;
+		node_t *nn = filter_add_node(node, out, value);
+
+		if (node->get)
+			free(value);
+
+		ds_get_all_options(node->child, nn, get_config, 1, options);
+
+		return 1;
+	}
+
+	node_t *nn = filter_add_node(node, out, NULL);
+	int matched = 0;
+
+	for (int i = 0; i < fn->children_count; i++)
+	{
+		filter_node_t *child = fn->children[i];
+
+		if (child->type == FILTER_CONTENT_MATCH)
+			roxml_add_node(nn, 0, ROXML_ELM_NODE, child->name, child->value);
+		else
+			matched += filter_match(child, node, nn, get_config, options);
+	}
+
+	// containment node without any match isn't part of the result
+	if (!matched && !fn->content_match_count)
+	{
+		roxml_del_node(nn);
+		return 0;
+	}
+
+	return 1;
+}
+
+/**
+ * filter_match() evaluates filter node fn on all children of parent it names
+ *
+ * Return: number of selected nodes
+ */
+static int filter_match(filter_node_t *fn, datastore_t *parent, node_t *out, int get_config, ds_get_options_t *options)
+{
+	datastore_t *first = ds_find_child(parent, fn->name, NULL);
+
+	if (!first)
+		return 0;
+
+	// list entry selected by its whole key is looked up directly
+	if (fn->content_match_count && first->is_list)
+	{
+		ds_key_t *key = filter_key(fn, first);
+
+		if (key)
+		{
+			datastore_t *entry = ds_find_node_by_key(first, key);
+			ds_free_key(key);
+
+			return entry ? filter_node(fn, entry, out, get_config, options) : 0;
+		}
+	}
+
+	// selected list is paginated as a whole
+	if (fn->type == FILTER_SELECTION && first->is_list && ds_get_target(options, first, 1))
+	{
+		ds_get_list(first, out, get_config, options);
+		return 1;
+	}
+
+	int matched = 0;
+
+	for (datastore_t *cur = first; cur; cur = ds_next_by_name(cur))
+		matched += filter_node(fn, cur, out, get_config, options);
+
+	return matched;
+}
+
+void filter_eval(filter_t *filter, node_t *out, int get_config, ds_get_options_t *options)
+{
+	for (int i = 0; i < filter->nodes_count; i++)
+		filter_match(filter->nodes[i], filter->nodes[i]->module, out, get_config, options);
+}
+
+void ds_get_filtered(node_t *filter_root, datastore_t *our_root, node_t *out, int get_config)
+{
+	if (!our_root)
+		return;
+
+	filter_node_t *fn = filter_compile_node(filter_root, 0);
+
+	if (!fn)
+		return;
+
+	if (our_root->parent)
+		filter_match(fn, our_root->parent, out, get_config, NULL);
+	else
+		filter_node(fn, our_root, out, get_config, NULL);
+
+	filter_free_node(fn, 0);
+}
+
+static int filter_event_children(filter_node_t *fn, node_t *parent);
+
+/**
+ * filter_event_value() compares content of event node to value
+ */
+static int filter_event_value(node_t *node, char *value)
+{
+	char *content = roxml_get_content(node, NULL, 0, NULL);
+
+	return content && !strcmp(content, value);
+}
+
+/**
+ * filter_event_node() evaluates filter node fn on event node, like
+ * filter_node() does on datastore nodes
+ *
+ * Return: 1 if node was selected, 0 otherwise
+ */
+static int filter_event_node(filter_node_t *fn, node_t *node)
+{
+	switch (fn->type)
+	{
+		case FILTER_SELECTION:
+			return 1;
+
+		case FILTER_CONTENT_MATCH:
+			return filter_event_value(node, fn->value);
+
+		case FILTER_CONTAINMENT:
+			break;
+	}
+
+	// all content match nodes have to match
+	for (int i = 0; i < fn->children_count; i++)
+	{
+		if (fn->children[i]->type == FILTER_CONTENT_MATCH && !filter_event_children(fn->children[i], node))
+			return 0;
+	}
+
+	if (fn->content_match_count)
+		return 1;
+
+	for (int i = 0; i < fn->children_count; i++)
+	{
+		if (filter_event_children(fn->children[i], node))
+			return 1;
+	}
+
+	return 0;
+}
+
+/**
+ * filter_event_children() evaluates filter node fn on children of parent
+ * it names
+ *
+ * Return: 1 if any of them was selected, 0 otherwise
+ */
+static int filter_event_children(filter_node_t *fn, node_t *parent)
+{
+	int child_count = roxml_get_chld_nb(parent);
+
+	for (int i = 0; i < child_count; i++)
+	{
+		node_t *child = roxml_get_chld(parent, NULL, i);
+		char *name = roxml_get_name(child, NULL, 0);
+
+		if (name && fn->name && !strcmp(name, fn->name) && filter_event_node(fn, child))
+			return 1;
+	}
+
+	return 0;
+}
+
+int filter_match_event(filter_t *filter, node_t *notification)
+{
+	for (int i = 0; i < filter->nodes_count; i++)
+	{
+		if (filter_event_children(filter->nodes[i], notification))
+			return 1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,97 @@
+/*
+ * Copyright (C) 2014 Sartura, Ltd.
+ * Copyright (C) 2014 Cisco Systems, Inc.
+ *
+ * Author: Luka Perkov <luka.perkov@sartura.hr>
+ * Author: Petar Koretic <petar.koretic@sartura.hr>
+ *
+ * freenetconfd is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with freenetconfd. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __FREENETCONFD_FILTER_H__
+#define __FREENETCONFD_FILTER_H__
+
+#include <roxml.h>
+
+#include "freenetconfd/datastore.h"
+
+/* RFC: http://tools.ietf.org/html/rfc6241#section-6 */
+enum filter_node_type
+{
+	FILTER_SELECTION,
+	FILTER_CONTAINMENT,
+	FILTER_CONTENT_MATCH
+};
+
+typedef struct filter_node
+{
+	char *name;
+	char *value; // content match value
+	enum filter_node_type type;
+	struct filter_node **children;
+	int children_count;
+	int content_match_count;
+	datastore_t *module; // module datastore, top level nodes only
+} filter_node_t;
+
+typedef struct filter
+{
+	filter_node_t **nodes; // top level nodes
+	int nodes_count;
+	int owned; // names and values are copies, see filter_compile_event()
+} filter_t;
+
+/**
+ * filter_compile() - compiles subtree filter into evaluation plan
+ *
+ * @filter <filter> xml node
+ *
+ * Return: compiled filter, NULL on error, free it with filter_free()
+ *
+ * Top level nodes are resolved to module datastores by namespace, nodes
+ * that don't match any module are dropped. Names and values point into the
+ * xml, so the filter can't outlive it.
+ */
+filter_t *filter_compile(node_t *filter);
+
+/**
+ * filter_eval() - adds data selected by filter to out
+ *
+ * @filter compiled filter
+ * @out xml node to add data to
+ * @get_config 1 to select only configuration data
+ * @options list pagination and depth, can be NULL
+ */
+void filter_eval(filter_t *filter, node_t *out, int get_config, ds_get_options_t *options);
+
+/**
+ * filter_compile_event() - compiles subtree filter of create-subscription
+ *
+ * @filter <filter> xml node
+ *
+ * Return: compiled filter, NULL on error, free it with filter_free()
+ *
+ * Names and values are copied, so the filter outlives the rpc. Nodes are
+ * not resolved to modules, events are matched as they are.
+ */
+filter_t *filter_compile_event(node_t *filter);
+
+/**
+ * filter_match_event() - checks whether filter selects anything of event
+ *
+ * @filter compiled with filter_compile_event()
+ * @notification <notification> xml node, its children are matched
+ *
+ * Return: 1 if it does, 0 otherwise
+ */
+int filter_match_event(filter_t *filter, node_t *notification);
+
+void filter_free(filter_t *filter);
+
+#endif /* __FREENETCONFD_FILTER_H__ */
@@ -25,7 +25,14 @@
 #include "connection.h"
 #include "config.h"
 #include "modules.h"
+#include "notifications.h"
+#include "push.h"
+#include "replicas.h"
+#include "restart.h"
+#include "tls.h"
 #include "ubus.h"
+#include "uring.h"
+#include "workers.h"
 
 int
 main(int argc, char **argv)
@@ -48,7 +55,7 @@ main(int argc, char **argv)
 		goto exit;
 	}
 
-	rc = server_init();
+	rc = restart_init(argv);
 
 	if (rc)
 	{
@@ -56,6 +63,22 @@ main(int argc, char **argv)
 		goto exit;
 	}
 
+	rc = notifications_init();
+
+	if (rc)
+	{
+		ERROR("notifications init failed\n");
+		goto exit;
+	}
+
+	rc = push_init();
+
+	if (rc)
+	{
+		ERROR("yang-push init failed\n");
+		goto exit;
+	}
+
 	rc = ubus_init();
 
 	if (rc)
@@ -72,14 +95,52 @@ main(int argc, char **argv)
 		goto exit;
 	}
 
-	LOG("%s is accepting connections on '%s:%s'\n", PROJECT_NAME, config.addr, config.port);
+	rc = replicas_init();
+
+	if (rc)
+	{
+		ERROR("replica processes init failed\n");
+		goto exit;
+	}
+
+	rc = workers_init();
+
+	if (rc)
+	{
+		ERROR("worker threads init failed\n");
+		goto exit;
+	}
+
+	rc = restart_ready();
+
+	if (rc)
+	{
+		ERROR("signal handling init failed\n");
+		goto exit;
+	}
+
+	LOG("%s is accepting connections\n", PROJECT_NAME);
 
 	/* main loop */
 	uloop_run();
 
 	rc = EXIT_SUCCESS;
 exit:
-	/* FIXME: implement netconf_exit() */
+	/* sessions were drained or handed over on SIGTERM and SIGUSR2 */
+
+	restart_exit();
+
+	tls_exit();
+
+	uring_exit();
+
+	workers_exit();
+
+	notifications_exit();
+
+	push_exit();
+
+	replicas_exit();
 
 	uloop_done();
 
@@ -0,0 +1,564 @@
+/*
+ * Copyright (C) 2014 Sartura, Ltd.
+ * Copyright (C) 2014 Cisco Systems, Inc.
+ *
+ * Author: Luka Perkov <luka.perkov@sartura.hr>
+ * Author: Petar Koretic <petar.koretic@sartura.hr>
+ *
+ * freenetconfd is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with freenetconfd. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "freenetconfd/freenetconfd.h"
+
+#include "ingest.h"
+
+#define INGEST_MAX_DEPTH 64
+#define INGEST_HEAD_DEPTH 3 // rpc, edit-config and config
+#define INGEST_CONTEXT_SIZE 4096 // leading leaves repeated in every piece
+
+enum ingest_markup
+{
+	INGEST_START,
+	INGEST_EMPTY,
+	INGEST_END,
+	INGEST_OTHER
+};
+
+typedef struct ingest_element
+{
+	const char *tag; // start tag
+	size_t tag_len;
+	const char *name; // qualified name
+	size_t name_len;
+	const char *content; // between start and end tag
+	const char *content_end;
+	const char *end; // after end tag
+	int leaf; // has no child elements
+} ingest_element_t;
+
+typedef struct ingest_level
+{
+	ingest_element_t e;
+	const char *context; // leading leaves, like list keys
+	size_t context_len;
+	const char *pos; // next child to look at
+	const char *batch; // children not sent yet
+	const char *batch_end;
+	int started; // context was looked for
+	int emitted; // first piece of this element was sent
+} ingest_level_t;
+
+struct ingest
+{
+	ingest_level_t levels[INGEST_MAX_DEPTH];
+	int depth;
+	char *buf; // piece being built
+	size_t len;
+	size_t size;
+};
+
+static const char *ingest_find(const char *p, const char *end, const char *s)
+{
+	const char *found = memmem(p, end - p, s, strlen(s));
+
+	return found ? found + strlen(s) : NULL;
+}
+
+/*
+ * ingest_markup() - finds end of markup starting at p
+ *
+ * Return: pointer after markup or NULL if it is not terminated
+ */
+static const char *ingest_markup(const char *p, const char *end, enum ingest_markup *type)
+{
+	size_t left = end - p;
+	char quote = 0;
+
+	*type = INGEST_OTHER;
+
+	if (left >= 4 && !memcmp(p, "<!--", 4))
+		return ingest_find(p + 4, end, "-->");
+
+	if (left >= 9 && !memcmp(p, "<![CDATA[", 9))
+		return ingest_find(p + 9, end, "]]>");
+
+	if (left >= 2 && p[1] == '?')
+		return ingest_find(p + 2, end, "?>");
+
+	if (left >= 2 && p[1] == '!')
+		return ingest_find(p + 2, end, ">");
+
+	*type = (left >= 2 && p[1] == '/') ? INGEST_END : INGEST_START;
+
+	for (const char *q = p + 1; q < end; q++)
+	{
+		if (quote)
+		{
+			if (*q == quote)
+				quote = 0;
+		}
+		else if (*q == '"' || *q == '\'')
+		{
+			quote = *q;
+		}
+		else if (*q == '>')
+		{
+			if (*type == INGEST_START && q[-1] == '/')
+				*type = INGEST_EMPTY;
+
+			return q + 1;
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * ingest_next() - finds next element before end tag of the parent
+ *
+ * Return: 1 if found, 0 if there are no more elements, -1 on error
+ */
+static int ingest_next(const char *p, const char *end, const char **at)
+{
+	enum ingest_markup type;
+	const char *next;
+
+	while ((p = memchr(p, '<', end - p)))
+	{
+		if (!(next = ingest_markup(p, end, &type)))
+			return -1;
+
+		if (type == INGEST_START || type == INGEST_EMPTY)
+		{
+			*at = p;
+			return 1;
+		}
+
+		if (type == INGEST_END)
+			return 0;
+
+		p = next;
+	}
+
+	return 0;
+}
+
+static int ingest_element(const char *p, const char *end, ingest_element_t *e)
+{
+	enum ingest_markup type;
+	const char *q = ingest_markup(p, end, &type);
+	int depth = 1;
+
+	if (!q || (type != INGEST_START && type != INGEST_EMPTY))
+		return -1;
+
+	e->tag = p;
+	e->tag_len = q - p;
+	e->name = p + 1;
+	e->name_len = 0;
+
+	while (e->name + e->name_len < q && !strchr(" \t\r\n/>", e->name[e->name_len]))
+		e->name_len++;
+
+	e->leaf = 1;
+	e->content = q;
+
+	if (type == INGEST_EMPTY)
+	{
+		e->content_end = e->end = q;
+		return 0;
+	}
+
+	while ((p = memchr(q, '<', end - q)))
+	{
+		if (!(q = ingest_markup(p, end, &type)))
+			return -1;
+
+		if (type == INGEST_START)
+		{
+			depth++;
+			e->leaf = 0;
+		}
+		else if (type == INGEST_EMPTY)
+		{
+			e->leaf = 0;
+		}
+		else if (type == INGEST_END && !--depth)
+		{
+			e->content_end = p;
+			e->end = q;
+			return 0;
+		}
+	}
+
+	return -1;
+}
+
+static int ingest_is(const char *name, size_t name_len, const char *local)
+{
+	const char *colon = memchr(name, ':', name_len);
+
+	if (colon)
+	{
+		name_len -= colon + 1 - name;
+		name = colon + 1;
+	}
+
+	return strlen(local) == name_len && !memcmp(name, local, name_len);
+}
+
+/*
+ * ingest_attr() - finds attribute by its local name in start tag of e
+ *
+ * Return: start of the attribute including preceding whitespace or NULL,
+ * attr_end is set after its value
+ */
+static const char *ingest_attr(const ingest_element_t *e, const char *name, const char **attr_end,
+							   const char **value, size_t *value_len)
+{
+	const char *q = e->name + e->name_len;
+	const char *end = e->tag + e->tag_len - 1;
+
+	while (q < end)
+	{
+		const char *start = q;
+
+		while (q < end && strchr(" \t\r\n", *q))
+			q++;
+
+		if (q >= end || *q == '/')
+			break;
+
+		const char *attr = q;
+
+		while (q < end && !strchr(" \t\r\n=/", *q))
+			q++;
+
+		size_t attr_len = q - attr;
+
+		while (q < end && strchr(" \t\r\n", *q))
+			q++;
+
+		if (q >= end || *q != '=')
+			break;
+
+		q++;
+
+		while (q < end && strchr(" \t\r\n", *q))
+			q++;
+
+		if (q >= end || (*q != '"' && *q != '\''))
+			break;
+
+		const char *v = q + 1;
+
+		if (!(q = memchr(v, *q, end - v)))
+			break;
+
+		q++;
+
+		if (ingest_is(attr, attr_len, name))
+		{
+			*attr_end = q;
+			*value = v;
+			*value_len = q - 1 - v;
+			return start;
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * ingest_splittable() - checks if element may be sent in several pieces
+ *
+ * Content of deleted elements is not looked at, sending them more than
+ * once would fail with data-missing.
+ */
+static int ingest_splittable(const ingest_element_t *e)
+{
+	const char *attr_end, *value;
+	size_t value_len;
+
+	if (e->leaf)
+		return 0;
+
+	if (!ingest_attr(e, "operation", &attr_end, &value, &value_len))
+		return 1;
+
+	return !ingest_is(value, value_len, "delete") && !ingest_is(value, value_len, "remove");
+}
+
+static int ingest_append(ingest_t *ing, const char *s, size_t len)
+{
+	if (ing->len + len + 1 > ing->size)
+	{
+		size_t size = ing->size ? ing->size : INGEST_PIECE_SIZE;
+
+		while (ing->len + len + 1 > size)
+			size *= 2;
+
+		char *buf = realloc(ing->buf, size);
+
+		if (!buf)
+			return -1;
+
+		ing->buf = buf;
+		ing->size = size;
+	}
+
+	memcpy(ing->buf + ing->len, s, len);
+	ing->len += len;
+	ing->buf[ing->len] = '\0';
+
+	return 0;
+}
+
+/*
+ * ingest_flush() - builds piece wrapped in its ancestors
+ */
+static int ingest_flush(ingest_t *ing, const char *piece, size_t piece_len)
+{
+	const char *attr, *attr_end, *value;
+	size_t value_len;
+	int rc = 0;
+
+	ing->len = 0;
+
+	for (int i = 0; i < ing->depth; i++)
+	{
+		ingest_level_t *l = &ing->levels[i];
+		const char *tag_end = l->e.tag + l->e.tag_len;
+
+		// later pieces merge into what the first one created
+		if (l->emitted && (attr = ingest_attr(&l->e, "operation", &attr_end, &value, &value_len)))
+		{
+			rc |= ingest_append(ing, l->e.tag, attr - l->e.tag);
+			rc |= ingest_append(ing, attr_end, tag_end - attr_end);
+		}
+		else
+		{
+			rc |= ingest_append(ing, l->e.tag, l->e.tag_len);
+		}
+
+		rc |= ingest_append(ing, l->context, l->context_len);
+	}
+
+	rc |= ingest_append(ing, piece, piece_len);
+
+	for (int i = ing->depth - 1; i >= 0; i--)
+	{
+		rc |= ingest_append(ing, "</", 2);
+		rc |= ingest_append(ing, ing->levels[i].e.name, ing->levels[i].e.name_len);
+		rc |= ingest_append(ing, ">", 1);
+	}
+
+	if (rc)
+	{
+		ERROR("not enough memory\n");
+		return -1;
+	}
+
+	for (int i = 0; i < ing->depth; i++)
+		ing->levels[i].emitted = 1;
+
+	return 1;
+}
+
+/*
+ * ingest_context() - skips leading leaves of the innermost level
+ */
+static int ingest_context(ingest_t *ing, ingest_level_t *l)
+{
+	ingest_element_t e;
+	const char *at, *attr_end, *value;
+	size_t value_len;
+	int rc;
+
+	l->started = 1;
+	l->context = l->pos;
+	l->context_len = 0;
+
+	// leading leaves identify the element, every piece needs them
+	while (ing->depth > INGEST_HEAD_DEPTH && (rc = ingest_next(l->pos, l->e.content_end, &at)) == 1)
+	{
+		if (ingest_element(at, l->e.content_end, &e))
+			return -1;
+
+		if (!e.leaf || e.end - l->context > INGEST_CONTEXT_SIZE ||
+			ingest_attr(&e, "operation", &attr_end, &value, &value_len))
+			break;
+
+		l->pos = e.end;
+		l->context_len = l->pos - l->context;
+	}
+
+	return 0;
+}
+
+char *ingest_skeleton(const char *msg, size_t len)
+{
+	ingest_element_t rpc, operation;
+	const char *at;
+	char *skeleton = NULL;
+	int rc;
+
+	if (ingest_next(msg, msg + len, &at) != 1 || ingest_element(at, msg + len, &rpc))
+		return NULL;
+
+	if (ingest_next(rpc.content, rpc.content_end, &at) != 1 || ingest_element(at, rpc.content_end, &operation))
+		return NULL;
+
+	if (operation.content == operation.end)
+		rc = asprintf(&skeleton, "%.*s%.*s</%.*s>",
+					  (int) rpc.tag_len, rpc.tag, (int) operation.tag_len, operation.tag,
+					  (int) rpc.name_len, rpc.name);
+	else
+		rc = asprintf(&skeleton, "%.*s%.*s</%.*s></%.*s>",
+					  (int) rpc.tag_len, rpc.tag, (int) operation.tag_len, operation.tag,
+					  (int) operation.name_len, operation.name, (int) rpc.name_len, rpc.name);
+
+	return rc < 0 ? NULL : skeleton;
+}
+
+ingest_t *ingest_edit_config(const char *msg, size_t len)
+{
+	ingest_t *ing = calloc(1, sizeof(*ing));
+	const char *p = msg, *end = msg + len, *at;
+
+	if (!ing)
+	{
+		ERROR("not enough memory\n");
+		return NULL;
+	}
+
+	// rpc, edit-config and its config child
+	for (int i = 0; i < INGEST_HEAD_DEPTH; i++)
+	{
+		ingest_element_t *e = &ing->levels[i].e;
+
+		if (ingest_next(p, end, &at) != 1 || ingest_element(at, end, e))
+			goto error;
+
+		while (i == INGEST_HEAD_DEPTH - 1 && !ingest_is(e->name, e->name_len, "config"))
+		{
+			if (ingest_next(e->end, end, &at) != 1 || ingest_element(at, end, e))
+				goto error;
+		}
+
+		ing->levels[i].pos = e->content;
+		p = e->content;
+		end = e->content_end;
+	}
+
+	ing->depth = INGEST_HEAD_DEPTH;
+
+	return ing;
+
+error:
+	free(ing);
+
+	return NULL;
+}
+
+int ingest_piece(ingest_t *ing, char **fragment, size_t *len)
+{
+	ingest_element_t e;
+	const char *at;
+	int rc;
+
+	*fragment = NULL;
+	*len = 0;
+
+	while (ing->depth >= INGEST_HEAD_DEPTH)
+	{
+		ingest_level_t *l = &ing->levels[ing->depth - 1];
+
+		if (!l->started && ingest_context(ing, l))
+			return -1;
+
+		if ((rc = ingest_next(l->pos, l->e.content_end, &at)) < 0)
+			return -1;
+
+		if (!rc)
+		{
+			// element holding only its leading leaves is sent once as well
+			if (l->batch || !l->emitted)
+			{
+				rc = ingest_flush(ing, l->batch, l->batch_end - l->batch);
+				l->batch = NULL;
+			}
+			else
+			{
+				ing->depth--;
+				continue;
+			}
+		}
+		else if (ingest_element(at, l->e.content_end, &e))
+		{
+			return -1;
+		}
+		else if (e.end - at > INGEST_PIECE_SIZE && ing->depth < INGEST_MAX_DEPTH && ingest_splittable(&e))
+		{
+			// children of e go in pieces of their own
+			if (l->batch)
+			{
+				rc = ingest_flush(ing, l->batch, l->batch_end - l->batch);
+				l->batch = NULL;
+			}
+			else
+			{
+				ingest_level_t *child = &ing->levels[ing->depth++];
+
+				l->pos = e.end;
+				memset(child, 0, sizeof(*child));
+				child->e = e;
+				child->pos = e.content;
+				continue;
+			}
+		}
+		else if (l->batch && e.end - l->batch > INGEST_PIECE_SIZE)
+		{
+			rc = ingest_flush(ing, l->batch, l->batch_end - l->batch);
+			l->batch = NULL;
+		}
+		else
+		{
+			if (!l->batch)
+				l->batch = at;
+
+			l->batch_end = e.end;
+			l->pos = e.end;
+			continue;
+		}
+
+		if (rc < 0)
+			return -1;
+
+		*fragment = ing->buf;
+		*len = ing->len;
+
+		return 1;
+	}
+
+	return 0;
+}
+
+void ingest_free(ingest_t *ing)
+{
+	if (!ing)
+		return;
+
+	free(ing->buf);
+	free(ing);
+}
@@ -0,0 +1,67 @@
+/*
+ * Copyright (C) 2014 Sartura, Ltd.
+ * Copyright (C) 2014 Cisco Systems, Inc.
+ *
+ * Author: Luka Perkov <luka.perkov@sartura.hr>
+ * Author: Petar Koretic <petar.koretic@sartura.hr>
+ *
+ * freenetconfd is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with freenetconfd. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __FREENETCONFD_INGEST_H__
+#define __FREENETCONFD_INGEST_H__
+
+#include <stddef.h>
+
+/* size of config pieces applied at once */
+#define INGEST_PIECE_SIZE 65536
+
+typedef struct ingest ingest_t;
+
+/**
+ * ingest_skeleton() - rpc with the operation element emptied
+ *
+ * Returns malloc'd "<rpc ...><operation ...></operation></rpc>" built from
+ * the start tags of msg, enough to create the reply and to check which
+ * operation was called, or NULL if msg is not an rpc.
+ */
+char *ingest_skeleton(const char *msg, size_t len);
+
+/**
+ * ingest_edit_config() - starts splitting config of an edit-config rpc
+ *
+ * Scans msg without building a DOM. ingest_piece() then returns documents
+ * holding consecutive config subtrees of at most INGEST_PIECE_SIZE bytes.
+ * Bigger subtrees are split into their children, repeating the start tags
+ * of their ancestors and the leading leaves (list keys) in every piece.
+ * Operation attribute of a split element is sent only with its first piece
+ * so later pieces merge into what the first one created.
+ *
+ * msg has to stay mapped until ingest_free() is called.
+ *
+ * Return: state for ingest_piece() or NULL if msg is malformed
+ */
+ingest_t *ingest_edit_config(const char *msg, size_t len);
+
+/**
+ * ingest_piece() - builds next piece of config
+ *
+ * Continuation is kept in ing, so pieces may be taken one at a time with
+ * other work done in between.
+ *
+ * @fragment:	NUL terminated rpc holding only this piece of config, valid
+ *		until the next call
+ *
+ * Return: 1 if a piece was built, 0 when done, -1 if msg is malformed
+ */
+int ingest_piece(ingest_t *ing, char **fragment, size_t *len);
+
+void ingest_free(ingest_t *ing);
+
+#endif /* __FREENETCONFD_INGEST_H__ */
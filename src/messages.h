@@ -27,6 +27,12 @@
   "<capability>urn:ietf:params:netconf:base:1.0</capability>" \
   "<capability>urn:ietf:params:netconf:base:1.1</capability>" \
   "<capability>urn:ietf:params:netconf:capability:writable-running:1.0</capability>" \
+  "<capability>urn:ietf:params:netconf:capability:xpath:1.0</capability>" \
+  "<capability>urn:ietf:params:netconf:capability:notification:1.0</capability>" \
+  "<capability>urn:ietf:params:netconf:capability:interleave:1.0</capability>" \
+  "<capability>urn:ietf:params:xml:ns:yang:ietf-subscribed-notifications?module=ietf-subscribed-notifications&amp;revision=2019-09-09</capability>" \
+  "<capability>urn:ietf:params:xml:ns:yang:ietf-yang-push?module=ietf-yang-push&amp;revision=2019-09-09&amp;features=on-change</capability>" \
+  "<capability>urn:freenetconfd:params:netconf:capability:list-pagination:1.0</capability>" \
  "</capabilities>" \
 "</hello>"
 
@@ -18,6 +18,12 @@
 #include <string.h>
 #include <roxml.h>
 #include <stdint.h>
+#include <inttypes.h>
+#include <ctype.h>
+#include <limits.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "freenetconfd/freenetconfd.h"
 #include "freenetconfd/datastore.h"
@@ -27,13 +33,19 @@
 #include "methods.h"
 #include "messages.h"
 #include "config.h"
+#include "connection.h"
 #include "modules.h"
+#include "filter.h"
+#include "xpath.h"
+#include "ingest.h"
+#include "notifications.h"
+#include "push.h"
 
 #ifndef ARRAY_SIZE
 #define ARRAY_SIZE(a) (sizeof(a) / sizeof(*(a)))
 #endif
 
-static int get(struct rpc_data *data, datastore_t *datastore);
+static int get(struct rpc_data *data, datastore_t *datastore, ds_get_options_t *options);
 static int method_handle_get(struct rpc_data *data);
 static int method_handle_get_config(struct rpc_data *data);
 static int method_handle_edit_config(struct rpc_data *data);
@@ -44,6 +56,9 @@ static int method_handle_unlock(struct rpc_data *data);
 static int method_handle_close_session(struct rpc_data *data);
 static int method_handle_kill_session(struct rpc_data *data);
 static int method_handle_get_schema(struct rpc_data *data);
+static int method_handle_create_subscription(struct rpc_data *data);
+static int method_handle_establish_subscription(struct rpc_data *data);
+static int method_handle_delete_subscription(struct rpc_data *data);
 
 const struct rpc_method rpc_methods[] =
 {
@@ -57,6 +72,9 @@ const struct rpc_method rpc_methods[] =
 	{ "unlock", method_handle_unlock },
 	{ "close-session", method_handle_close_session },
 	{ "kill-session", method_handle_kill_session },
+	{ "create-subscription", method_handle_create_subscription },
+	{ "establish-subscription", method_handle_establish_subscription },
+	{ "delete-subscription", method_handle_delete_subscription },
 };
 
 /*
@@ -120,15 +138,10 @@ exit:
 	return rc;
 }
 
-int method_create_message_hello(char **xml_out)
+int method_create_message_hello(uint32_t session_id, char **xml_out)
 {
 	int rc = -1, len;
 	char c_session_id[BUFSIZ];
-	static uint32_t session_id = 0;
-
-	/* prevent variable overflow */
-	if (++session_id == 0)
-		session_id = 1;
 
 	node_t *root = roxml_load_buf(XML_NETCONF_HELLO);
 	netconf_capabilites_from_yang(config.yang_dir, root);
@@ -147,7 +160,7 @@ int method_create_message_hello(char **xml_out)
 		goto exit;
 	}
 
-	len = snprintf(c_session_id, BUFSIZ, "%d", session_id);
+	len = snprintf(c_session_id, BUFSIZ, "%" PRIu32, session_id);
 
 	if (len <= 0)
 	{
@@ -180,6 +193,270 @@ exit:
 	return rc;
 }
 
+/*
+ * cheap rpcs that release other sessions are scheduled before the rest,
+ * rpcs not listed may change the datastore
+ */
+static const struct
+{
+	const char *name;
+	int flags;
+} rpc_flags[] =
+{
+	{ "get", METHOD_RPC_READ },
+	{ "get-config", METHOD_RPC_READ },
+	{ "get-schema", 0 },
+	{ "close-session", METHOD_RPC_PRIORITY },
+	{ "kill-session", METHOD_RPC_PRIORITY },
+	{ "lock", METHOD_RPC_PRIORITY },
+	{ "unlock", METHOD_RPC_PRIORITY },
+	// subscription belongs to the session, it is made where the session is
+	{ "create-subscription", 0 },
+	{ "establish-subscription", 0 },
+	{ "delete-subscription", 0 },
+};
+
+int method_rpc_flags(const char *rpc, size_t len)
+{
+	const char *p = rpc, *end = rpc + len, *name;
+	char quote = 0;
+	int depth = 0;
+
+	// name of first element inside rpc, without a full parse
+	while (p < end && (p = memchr(p, '<', end - p)))
+	{
+		if (p + 1 < end && (p[1] == '?' || p[1] == '!'))
+		{
+			const char *close = p[1] == '?' ? "?>" : (end - p > 4 && !memcmp(p, "<!--", 4)) ? "-->" : ">";
+
+			if (!(p = memmem(p, end - p, close, strlen(close))))
+				return METHOD_RPC_WRITE | METHOD_RPC_LOOP;
+
+			continue;
+		}
+
+		if (depth)
+			break;
+
+		// skip rpc start tag
+		for (p++; p < end && (quote || *p != '>'); p++)
+		{
+			if (quote && *p == quote)
+				quote = 0;
+			else if (!quote && (*p == '"' || *p == '\''))
+				quote = *p;
+		}
+
+		depth++;
+	}
+
+	if (!p || p >= end)
+		return METHOD_RPC_WRITE | METHOD_RPC_LOOP;
+
+	name = ++p;
+
+	while (p < end && !isspace(*p) && *p != '/' && *p != '>')
+	{
+		if (*p++ == ':')
+			name = p;
+	}
+
+	int flags = METHOD_RPC_WRITE;
+
+	for (int i = 0; i < ARRAY_SIZE(rpc_flags); i++)
+	{
+		if (strlen(rpc_flags[i].name) == p - name && !memcmp(rpc_flags[i].name, name, p - name))
+		{
+			flags = rpc_flags[i].flags;
+			break;
+		}
+	}
+
+	// plugins run on worker threads only if they say they can
+	if ((flags & (METHOD_RPC_READ | METHOD_RPC_WRITE)) && !modules_threaded(name, p - name))
+		flags |= METHOD_RPC_LOOP;
+
+	return flags;
+}
+
+/*
+ * method_message_id() - finds message-id attribute at the start of rpc
+ *
+ * Used when rpc can not be parsed, so reply may still be matched.
+ */
+static char *method_message_id(const char *rpc, size_t len)
+{
+	const char *end = rpc + len;
+	const char *p = memmem(rpc, len, "message-id", strlen("message-id"));
+
+	if (!p)
+		return NULL;
+
+	for (p += strlen("message-id"); p < end && isspace(*p); p++);
+
+	if (p == end || *p++ != '=')
+		return NULL;
+
+	for (; p < end && isspace(*p); p++);
+
+	if (p == end || (*p != '"' && *p != '\''))
+		return NULL;
+
+	const char *value = p + 1;
+	const char *value_end = memchr(value, *p, end - value);
+
+	return value_end ? strndup(value, value_end - value) : NULL;
+}
+
+int method_create_message_error(const char *rpc, size_t len, char *error, char **xml_out)
+{
+	char *message_id = method_message_id(rpc, len);
+	int rc = -1;
+
+	node_t *root = roxml_load_buf(XML_NETCONF_REPLY_TEMPLATE);
+	node_t *rpc_out = roxml_get_chld(root, NULL, 0);
+
+	if (!rpc_out)
+	{
+		ERROR("unable to load 'netconf reply' message template\n");
+		goto exit;
+	}
+
+	roxml_add_node(rpc_out, 0, ROXML_ATTR_NODE | ROXML_NS_NODE, "", "urn:ietf:params:xml:ns:netconf:base:1.0");
+
+	if (message_id)
+		roxml_add_node(rpc_out, 0, ROXML_ATTR_NODE, "message-id", message_id);
+
+	roxml_add_node(rpc_out, 0, ROXML_ELM_NODE, "rpc-error", error);
+
+	if (roxml_commit_changes(rpc_out, NULL, xml_out, 0) <= 0)
+	{
+		ERROR("unable to create 'netconf reply' message\n");
+		goto exit;
+	}
+
+	rc = 0;
+
+exit:
+	roxml_close(root);
+	free(message_id);
+
+	return rc;
+}
+
+ssize_t method_stream_read(method_stream_t *stream, char *buf, size_t size)
+{
+	ssize_t len;
+
+	modules_lock_all(0);
+	len = ds_stream_read(stream->data, buf, size);
+	modules_unlock_all();
+
+	return len;
+}
+
+int method_stream_end(method_stream_t *stream)
+{
+	return ds_stream_end(stream->data);
+}
+
+void method_stream_free(method_stream_t *stream)
+{
+	if (!stream)
+		return;
+
+	free(stream->head);
+	free(stream->tail);
+	ds_stream_free(stream->data);
+	free(stream);
+}
+
+/*
+ * method_get_stream() - creates reply stream for get of whole datastores
+ *
+ * @operation get or get-config node
+ * @rpc_out rpc-reply node
+ *
+ * Return: reply stream, NULL if the reply can't be streamed
+ */
+static method_stream_t *method_get_stream(node_t *operation, node_t *rpc_out)
+{
+	char *name = roxml_get_name(operation, NULL, 0);
+	char *reply = NULL;
+	method_stream_t *stream = NULL;
+
+	if (!name || (strcmp(name, "get") && strcmp(name, "get-config")))
+		return NULL;
+
+	// filtered and paginated replies are small, build them in memory
+	if (roxml_get_chld(operation, "filter", 0) ||
+			roxml_get_chld(operation, "list-pagination", 0) ||
+			roxml_get_chld(operation, "depth", 0))
+		return NULL;
+
+	struct list_head *modules = get_modules();
+	struct module_list *elem;
+	unsigned int roots_count = 0;
+
+	list_for_each_entry(elem, modules, list)
+		roots_count++;
+
+	datastore_t **roots = calloc(roots_count ? roots_count : 1, sizeof(datastore_t *));
+
+	if (!roots)
+		goto error;
+
+	roots_count = 0;
+
+	list_for_each_entry(elem, modules, list)
+	{
+		if (elem->m->datastore)
+			roots[roots_count++] = elem->m->datastore;
+	}
+
+	roxml_add_node(rpc_out, 0, ROXML_ELM_NODE, "data", NULL);
+
+	if (roxml_commit_changes(rpc_out, NULL, &reply, 0) <= 0)
+		goto error;
+
+	// split the reply around data
+	char *split = strstr(reply, "<data/>");
+
+	if (!split)
+		goto error;
+
+	stream = calloc(1, sizeof(method_stream_t));
+
+	if (!stream)
+		goto error;
+
+	if (asprintf(&stream->head, "%.*s<data>", (int) (split - reply), reply) < 0)
+	{
+		stream->head = NULL;
+		goto error;
+	}
+
+	stream->tail = strdup(split + strlen("<data/>"));
+	stream->data = ds_stream_create(roots, roots_count, !strcmp(name, "get-config"));
+
+	if (!stream->tail || !stream->data)
+		goto error;
+
+	free(reply);
+	free(roots);
+
+	return stream;
+
+error:
+	ERROR("unable to create reply stream\n");
+
+	method_stream_free(stream);
+	free(reply);
+	free(roots);
+
+	return NULL;
+}
+
 /*
  * method_handle_message - handle all rpc messages
  *
@@ -190,11 +467,118 @@ exit:
  * will parse and return response message.
  */
 int method_handle_message_rpc(char *xml_in, char **xml_out)
+{
+	return method_handle_message_rpc_stream(xml_in, xml_out, NULL);
+}
+
+/*
+ * method_create_reply() - creates rpc-reply for rpc
+ *
+ * Copies all arguments from rpc to rpc-reply.
+ *
+ * Return: rpc-reply node, roxml_close() it when done
+ */
+static node_t *method_create_reply(node_t *rpc_in)
+{
+	node_t *root_out = roxml_load_buf(XML_NETCONF_REPLY_TEMPLATE);
+	node_t *rpc_out = roxml_get_chld(root_out, NULL, 0);
+
+	int args = roxml_get_attr_nb(rpc_in);
+
+	for (int i = 0; i < args; i++)
+	{
+
+		int flags = ROXML_ATTR_NODE;
+		node_t *n_arg = roxml_get_attr(rpc_in, NULL, i);
+
+		char *name = roxml_get_name(n_arg, NULL, 0);
+
+		// default namespace
+		if (!strcmp(name, ""))
+			flags |= ROXML_NS_NODE;
+
+		char *value = roxml_get_content(n_arg, NULL, 0, NULL);
+
+		roxml_add_node(rpc_out, 0, flags, name, value);
+	}
+
+	return rpc_out;
+}
+
+/*
+ * method_finish_reply() - adds result of rpc method to rpc-reply
+ *
+ * Return: 1 if session should be closed, 0 otherwise
+ */
+static int method_finish_reply(struct rpc_data *data, int rc)
+{
+	switch (rc)
+	{
+		case RPC_OK:
+			roxml_add_node(data->out, 0, ROXML_ELM_NODE, "ok", NULL);
+			rc = 0;
+			break;
+
+		case RPC_OK_CLOSE:
+			roxml_add_node(data->out, 0, ROXML_ELM_NODE, "ok", NULL);
+			rc = 1;
+			break;
+
+		case RPC_DATA:
+			rc = 0;
+			break;
+
+		case RPC_ERROR:
+			if (!data->error)
+				data->error = netconf_rpc_error("UNKNOWN ERROR", 0, 0, 0, NULL);
+
+			roxml_add_node(data->out, 0, ROXML_ELM_NODE, "rpc-error", data->error);
+
+			free(data->error);
+			data->error = NULL;
+
+			rc = 0;
+			break;
+
+		case RPC_DATA_EXISTS:
+			if (!data->error)
+				data->error = netconf_rpc_error("Data exists!", RPC_ERROR_TAG_DATA_EXISTS, RPC_ERROR_TYPE_RPC, RPC_ERROR_SEVERITY_ERROR, NULL);
+
+			roxml_add_node(data->out, 0, ROXML_ELM_NODE, "rpc-error", data->error);
+
+			free(data->error);
+			data->error = NULL;
+
+			rc = 0;
+			break;
+
+		case RPC_DATA_MISSING:
+			if (!data->error)
+				data->error = netconf_rpc_error("Data missing!", RPC_ERROR_TAG_DATA_MISSING, RPC_ERROR_TYPE_RPC, RPC_ERROR_SEVERITY_ERROR, NULL);
+
+			roxml_add_node(data->out, 0, ROXML_ELM_NODE, "rpc-error", data->error);
+
+			free(data->error);
+			data->error = NULL;
+
+			rc = 0;
+			break;
+	}
+
+	return rc;
+}
+
+int method_handle_message_rpc_stream(char *xml_in, char **xml_out, method_stream_t **stream)
 {
 	int rc = -1;
 	char *operation_name = NULL;
 	char *ns = NULL;
 	struct rpc_data data = { NULL, NULL, NULL, 0};
+	// versions published by plugin threads stay while the rpc reads them
+	int epoch = ds_read_begin();
+
+	if (stream)
+		*stream = NULL;
 
 	node_t *root_in = roxml_load_buf(xml_in);
 
@@ -223,33 +607,21 @@ int method_handle_message_rpc(char *xml_in, char **xml_out)
 
 	DEBUG("received rpc '%s' (%s)\n", operation_name, ns);
 
-	data.out = roxml_load_buf(XML_NETCONF_REPLY_TEMPLATE);
-	node_t *rpc_out = roxml_get_chld(data.out, NULL, 0);
-
-	/* copy all arguments from rpc to rpc-reply */
-	int args = roxml_get_attr_nb(rpc_in);
+	data.out = method_create_reply(rpc_in);
 
-	for (int i = 0; i < args; i++)
+	if (stream && (*stream = method_get_stream(operation, data.out)))
 	{
-
-		int flags = ROXML_ATTR_NODE;
-		node_t *n_arg = roxml_get_attr(rpc_in, NULL, i);
-
-		char *name = roxml_get_name(n_arg, NULL, 0);
-
-		// default namespace
-		if (!strcmp(name, ""))
-			flags |= ROXML_NS_NODE;
-
-		char *value = roxml_get_content(n_arg, NULL, 0, NULL);
-
-		roxml_add_node(rpc_out, 0, flags, name, value);
+		roxml_close(data.out);
+		data.out = NULL;
+		*xml_out = NULL;
+		rc = 0;
+		goto exit;
 	}
 
 	data.in = operation;
-	data.out = rpc_out;
 
 	const struct rpc_method *method = NULL;
+	struct module_list *owner = NULL;
 
 	for (int i = 0; i < ARRAY_SIZE(rpc_methods); i++)
 	{
@@ -279,6 +651,7 @@ int method_handle_message_rpc(char *xml_in, char **xml_out)
 				{
 					DEBUG("method found in module: %s (%s)\n", elem->m->rpcs[i].query, elem->m->ns);
 					method = &elem->m->rpcs[i];
+					owner = elem;
 					found = 1;
 					break;
 				}
@@ -292,81 +665,150 @@ int method_handle_message_rpc(char *xml_in, char **xml_out)
 		data.error = netconf_rpc_error("method not supported", RPC_ERROR_TAG_OPERATION_NOT_SUPPORTED, 0, 0, NULL);
 		rc = RPC_ERROR;
 	}
+	else if (owner)
+	{
+		// module rpcs may change their datastore
+		modules_lock(owner, 1);
+		rc = method->handler(&data);
+		modules_unlock(owner);
+	}
 	else
 	{
 		rc = method->handler(&data);
 	}
 
-	switch (rc)
+	rc = method_finish_reply(&data, rc);
+
+exit:
+
+	if (data.out)
 	{
-		case RPC_OK:
-			roxml_add_node(data.out, 0, ROXML_ELM_NODE, "ok", NULL);
-			rc = 0;
-			break;
+		roxml_commit_changes(data.out, NULL, xml_out, 0);
+		roxml_close(data.out);
+	}
 
-		case RPC_OK_CLOSE:
-			roxml_add_node(data.out, 0, ROXML_ELM_NODE, "ok", NULL);
-			rc = 1;
-			break;
+	roxml_release(RELEASE_ALL);
+	roxml_close(root_in);
 
-		case RPC_DATA:
-			rc = 0;
-			break;
+	ds_read_end(epoch);
 
-		case RPC_ERROR:
-			if (!data.error)
-				data.error = netconf_rpc_error("UNKNOWN ERROR", 0, 0, 0, NULL);
+	return rc;
+}
 
-			roxml_add_node(data.out, 0, ROXML_ELM_NODE, "rpc-error", data.error);
+static int
+method_get_uint(node_t *node, unsigned int *value)
+{
+	char *content = roxml_get_content(node, NULL, 0, NULL);
+	char *end;
 
-			free(data.error);
-			data.error = NULL;
+	if (!content || !isdigit((unsigned char) *content))
+		return -1;
 
-			rc = 0;
-			break;
+	unsigned long v = strtoul(content, &end, 10);
 
-		case RPC_DATA_EXISTS:
-			if (!data.error)
-				data.error = netconf_rpc_error("Data exists!", RPC_ERROR_TAG_DATA_EXISTS, RPC_ERROR_TYPE_RPC, RPC_ERROR_SEVERITY_ERROR, NULL);
+	if (*end || v > UINT_MAX)
+		return -1;
 
-			roxml_add_node(data.out, 0, ROXML_ELM_NODE, "rpc-error", data.error);
+	*value = v;
 
-			free(data.error);
-			data.error = NULL;
+	return 0;
+}
 
-			rc = 0;
-			break;
+/**
+ * method_get_options() parses list pagination and depth parameters of get
+ *
+ * Return: 0 on success, -1 on invalid parameter
+ */
+static int
+method_get_options(node_t *in, ds_get_options_t *options)
+{
+	node_t *n_pagination = roxml_get_chld(in, "list-pagination", 0);
+	node_t *n_depth = roxml_get_chld(in, "depth", 0);
+	node_t *n;
 
-		case RPC_DATA_MISSING:
-			if (!data.error)
-				data.error = netconf_rpc_error("Data missing!", RPC_ERROR_TAG_DATA_MISSING, RPC_ERROR_TYPE_RPC, RPC_ERROR_SEVERITY_ERROR, NULL);
+	if (n_depth && method_get_uint(n_depth, &options->depth))
+		return -1;
 
-			roxml_add_node(data.out, 0, ROXML_ELM_NODE, "rpc-error", data.error);
+	if (!n_pagination)
+		return 0;
 
-			free(data.error);
-			data.error = NULL;
+	if ((n = roxml_get_chld(n_pagination, "limit", 0)) && method_get_uint(n, &options->limit))
+		return -1;
 
-			rc = 0;
-			break;
+	if ((n = roxml_get_chld(n_pagination, "offset", 0)) && method_get_uint(n, &options->offset))
+		return -1;
+
+	if ((n = roxml_get_chld(n_pagination, "cursor", 0)))
+		options->cursor = roxml_get_content(n, NULL, 0, NULL);
+
+	if ((n = roxml_get_chld(n_pagination, "list", 0)))
+	{
+		options->list = roxml_get_content(n, NULL, 0, NULL);
+
+		if (!options->list || *options->list != '/')
+			return -1;
 	}
 
-exit:
+	if ((n = roxml_get_chld(n_pagination, "direction", 0)))
+	{
+		char *direction = roxml_get_content(n, NULL, 0, NULL);
 
-	if (data.out)
+		if (direction && !strcmp(direction, "backwards"))
+			options->backwards = 1;
+		else if (!direction || strcmp(direction, "forwards"))
+			return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * method_get_done() - replaces data of get that grew over max_reply_size,
+ * paginated more than one list or whose cursor named no list entry with
+ * an error
+ *
+ * Return: RPC_ERROR if data was dropped, RPC_DATA otherwise
+ */
+static int
+method_get_done(struct rpc_data *data, node_t *n_data, ds_get_options_t *options)
+{
+	if (options->over)
 	{
-		roxml_commit_changes(data.out, NULL, xml_out, 0);
-		roxml_close(data.out);
+		LOG("reply over %u bytes, refusing it\n", config.max_reply_size);
+		data->error = netconf_rpc_error("reply too big", RPC_ERROR_TAG_RESOURCE_DENIED, RPC_ERROR_TYPE_APPLICATION, RPC_ERROR_SEVERITY_ERROR, NULL);
+	}
+	else if (options->paged > 1)
+	{
+		data->error = netconf_rpc_error("list pagination matches more than one list", RPC_ERROR_TAG_INVALID_VALUE, RPC_ERROR_TYPE_PROTOCOL, RPC_ERROR_SEVERITY_ERROR, NULL);
+	}
+	else if (options->cursor && !options->cursor_found)
+	{
+		data->error = netconf_rpc_error("unknown list pagination cursor", RPC_ERROR_TAG_INVALID_VALUE, RPC_ERROR_TYPE_PROTOCOL, RPC_ERROR_SEVERITY_ERROR, NULL);
+	}
+	else
+	{
+		return RPC_DATA;
 	}
 
-	roxml_release(RELEASE_ALL);
-	roxml_close(root_in);
+	roxml_del_node(n_data);
 
-	return rc;
+	return RPC_ERROR;
 }
 
 static int
 method_handle_get(struct rpc_data *data)
 {
+	ds_get_options_t options = { 0 };
+
+	// building the data stops once it can't fit the reply
+	options.max_size = config.max_reply_size;
+
+	if (method_get_options(data->in, &options))
+	{
+		data->error = netconf_rpc_error("invalid list pagination or depth parameter", RPC_ERROR_TAG_INVALID_VALUE, RPC_ERROR_TYPE_PROTOCOL, RPC_ERROR_SEVERITY_ERROR, NULL);
+		return RPC_ERROR;
+	}
+
 	node_t *n_data = roxml_add_node(data->out, 0, ROXML_ELM_NODE, "data", NULL);
 
 	int nb = 0;
@@ -377,66 +819,79 @@ method_handle_get(struct rpc_data *data)
 
 	if ((n_filter = roxml_xpath(data->in, "//filter", &nb)))
 	{
-		nb = roxml_get_chld_nb(n_filter[0]);
-
-		/* empty filter */
-		if (!nb)
-			return RPC_DATA;
+		node_t *n_type = roxml_get_attr(n_filter[0], "type", 0);
+		char *type = roxml_get_content(n_type, NULL, 0, NULL);
 
-		while (--nb >= 0)
+		if (type && !strcmp(type, "xpath"))
 		{
-			n = roxml_get_chld(n_filter[0], NULL, nb);
-			char *module = roxml_get_name(n, NULL, 0);
-			char *ns = roxml_get_content(roxml_get_ns(n), NULL, 0, NULL);
-			DEBUG("filter for module: %s (%s)\n", module, ns);
+			node_t *n_select = roxml_get_attr(n_filter[0], "select", 0);
+			char *select = roxml_get_content(n_select, NULL, 0, NULL);
 
-			list_for_each_entry(elem, modules, list)
+			DEBUG("compiling xpath filter: %s\n", select);
+			xpath_t *xpath = select ? xpath_compile(select) : NULL;
+
+			if (!xpath)
 			{
-				DEBUG("module: %s\n", elem->name);
+				roxml_del_node(n_data);
+				data->error = netconf_rpc_error("invalid xpath expression", RPC_ERROR_TAG_INVALID_VALUE, RPC_ERROR_TYPE_PROTOCOL, RPC_ERROR_SEVERITY_ERROR, NULL);
+				return RPC_ERROR;
+			}
 
-				if (!strcmp(ns, elem->m->ns))
-				{
-					DEBUG("calling module: %s (%s) \n", module, ns);
-					struct rpc_data d = {n, n_data, NULL, data->get_config};
+			modules_lock_all(0);
+			xpath_eval(xpath, n_data, data->get_config, &options);
+			modules_unlock_all();
+			xpath_free(xpath);
 
-					get(&d, elem->m->datastore);
+			return method_get_done(data, n_data, &options);
+		}
 
-					break;
-				}
-			}
+		DEBUG("compiling filter\n");
+		filter_t *filter = filter_compile(n_filter[0]);
+
+		if (!filter)
+		{
+			roxml_del_node(n_data);
+			data->error = netconf_rpc_error("unable to process filter", RPC_ERROR_TAG_OPERATION_FAILED, RPC_ERROR_TYPE_APPLICATION, RPC_ERROR_SEVERITY_ERROR, NULL);
+			return RPC_ERROR;
 		}
+
+		modules_lock_all(0);
+		filter_eval(filter, n_data, data->get_config, &options);
+		modules_unlock_all();
+		filter_free(filter);
 	}
 	else
 	{
+		// every list would be a candidate, client names the one to page
+		if (ds_get_paged(&options) && !options.list)
+		{
+			roxml_del_node(n_data);
+			data->error = netconf_rpc_error("list pagination without filter needs list", RPC_ERROR_TAG_INVALID_VALUE, RPC_ERROR_TYPE_PROTOCOL, RPC_ERROR_SEVERITY_ERROR, NULL);
+			return RPC_ERROR;
+		}
+
 		DEBUG("no filter requested, processing all modules\n");
 		list_for_each_entry(elem, modules, list)
 		{
 			DEBUG("calling module: %s\n", elem->name);
 			n = data->in;
 			struct rpc_data d = {n, n_data, NULL, data->get_config};
-			get(&d, elem->m->datastore);
+			modules_lock(elem, 0);
+			get(&d, elem->m->datastore, &options);
+			modules_unlock(elem);
+
+			if (options.over)
+				break;
 		}
 	}
 
-	return RPC_DATA;
+	return method_get_done(data, n_data, &options);
 }
 
-static int get(struct rpc_data *data, datastore_t *datastore)
+static int get(struct rpc_data *data, datastore_t *datastore, ds_get_options_t *options)
 {
-	node_t *ro_root = data->in;
-	char *ro_root_name = roxml_get_name(ro_root, NULL, 0);
-
-	// client requested get all
-	if (ro_root_name && (!strcmp("get", ro_root_name) || !strcmp("get-config", ro_root_name)))
-	{
-		ds_get_all(datastore->child, data->out, data->get_config, 1);
-
-		return RPC_DATA;
-	}
-
-	// client requested filtered get
-	datastore_t *our_root = ds_find_child(datastore, ro_root_name, NULL);
-	ds_get_filtered(ro_root, our_root, data->out, data->get_config);
+	// filtered get is handled by filter_eval()
+	ds_get_all_options(datastore->child, data->out, data->get_config, 1, options);
 
 	return RPC_DATA;
 }
@@ -480,7 +935,9 @@ method_handle_edit_config(struct rpc_data *data)
 			if (!strcmp(ns, elem->m->ns))
 			{
 				DEBUG("calling module: %s (%s) \n", module, ns);
+				modules_lock(elem, 1);
 				rc = ds_edit_config(cur, elem->m->datastore->child, NULL);
+				modules_unlock(elem);
 				break;
 			}
 		}
@@ -489,6 +946,191 @@ method_handle_edit_config(struct rpc_data *data)
 	return rc;
 }
 
+/*
+ * method_ingest_piece() - applies one piece of a spooled edit-config
+ */
+static int method_ingest_piece(char *fragment, struct rpc_data *data)
+{
+	struct rpc_data piece = { NULL, data->out, NULL, 0 };
+	int rc = RPC_ERROR;
+
+	node_t *root = roxml_load_buf(fragment);
+	node_t *rpc = roxml_get_chld(root, NULL, 0);
+
+	if ((piece.in = roxml_get_chld(rpc, NULL, 0)))
+		rc = method_handle_edit_config(&piece);
+
+	data->error = piece.error;
+
+	roxml_release(RELEASE_ALL);
+	roxml_close(root);
+
+	return rc;
+}
+
+struct method_job
+{
+	char *msg; // mapped spooled rpc
+	size_t len;
+	char *skeleton;
+	node_t *root_in;
+	struct rpc_data data;
+	ingest_t *ingest;
+};
+
+int method_handle_message_rpc_fd(int fd, char **xml_out, method_job_t **job)
+{
+	int rc = -1;
+	struct stat st;
+	char *msg = MAP_FAILED, *skeleton = NULL;
+	node_t *root_in = NULL;
+	struct rpc_data data = { NULL, NULL, NULL, 0};
+	ingest_t *ingest = NULL;
+
+	*job = NULL;
+
+	if (fstat(fd, &st) || !st.st_size)
+		goto exit;
+
+	msg = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+	if (msg == MAP_FAILED)
+	{
+		ERROR("unable to map spooled rpc\n");
+		goto exit;
+	}
+
+	// pieces are scanned once, front to back
+	madvise(msg, st.st_size, MADV_SEQUENTIAL);
+
+	skeleton = ingest_skeleton(msg, st.st_size);
+
+	if (!skeleton) goto exit;
+
+	root_in = roxml_load_buf(skeleton);
+
+	node_t *rpc_in = roxml_get_chld(root_in, NULL, 0);
+
+	if (!rpc_in) goto exit;
+
+	node_t *operation = roxml_get_chld(rpc_in, NULL, 0);
+
+	if (!operation) goto exit;
+
+	char *operation_name = roxml_get_name(operation, NULL, 0);
+
+	DEBUG("received spooled rpc '%s' (%lld bytes)\n", operation_name, (long long) st.st_size);
+
+	data.out = method_create_reply(rpc_in);
+
+	if (!operation_name || strcmp(operation_name, "edit-config"))
+	{
+		ERROR("only edit-config can be applied from spooled rpc\n");
+		data.error = netconf_rpc_error("rpc too big", RPC_ERROR_TAG_TOO_BIG, RPC_ERROR_TYPE_RPC, RPC_ERROR_SEVERITY_ERROR, NULL);
+		rc = RPC_ERROR;
+	}
+	else if (!(ingest = ingest_edit_config(msg, st.st_size)) || !(*job = calloc(1, sizeof(**job))))
+	{
+		data.error = netconf_rpc_error("malformed config", RPC_ERROR_TAG_OPERATION_FAILED, RPC_ERROR_TYPE_RPC, RPC_ERROR_SEVERITY_ERROR, NULL);
+		rc = RPC_ERROR;
+	}
+	else
+	{
+		// pieces are applied by method_job_run()
+		(*job)->msg = msg;
+		(*job)->len = st.st_size;
+		(*job)->skeleton = skeleton;
+		(*job)->root_in = root_in;
+		(*job)->data = data;
+		(*job)->ingest = ingest;
+
+		roxml_release(RELEASE_ALL);
+
+		return RPC_OK;
+	}
+
+	rc = method_finish_reply(&data, rc);
+
+exit:
+
+	if (data.out)
+	{
+		roxml_commit_changes(data.out, NULL, xml_out, 0);
+		roxml_close(data.out);
+	}
+
+	roxml_release(RELEASE_ALL);
+	roxml_close(root_in);
+	free(skeleton);
+	ingest_free(ingest);
+
+	if (msg != MAP_FAILED)
+		munmap(msg, st.st_size);
+
+	return rc;
+}
+
+static uint64_t method_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+int method_job_run(method_job_t *job, unsigned int budget_us, char **xml_out)
+{
+	uint64_t start = method_now();
+	char *fragment;
+	size_t len;
+	int rc;
+
+	*xml_out = NULL;
+
+	for (;;)
+	{
+		rc = ingest_piece(job->ingest, &fragment, &len);
+
+		if (rc < 0)
+		{
+			job->data.error = netconf_rpc_error("malformed config", RPC_ERROR_TAG_OPERATION_FAILED, RPC_ERROR_TYPE_RPC, RPC_ERROR_SEVERITY_ERROR, NULL);
+			rc = RPC_ERROR;
+			break;
+		}
+
+		if (!rc)
+			break;
+
+		// first failing piece ends the rpc, like in ds_edit_config()
+		if ((rc = method_ingest_piece(fragment, &job->data)) != RPC_OK)
+			break;
+
+		if (budget_us && method_now() - start >= budget_us)
+			return 1;
+	}
+
+	rc = method_finish_reply(&job->data, rc);
+
+	roxml_commit_changes(job->data.out, NULL, xml_out, 0);
+	roxml_release(RELEASE_ALL);
+
+	return rc;
+}
+
+void method_job_free(method_job_t *job)
+{
+	if (!job)
+		return;
+
+	roxml_close(job->data.out);
+	roxml_close(job->root_in);
+	free(job->skeleton);
+	ingest_free(job->ingest);
+	munmap(job->msg, job->len);
+	free(job);
+}
+
 static int
 method_handle_copy_config(struct rpc_data *data)
 {
@@ -519,10 +1161,103 @@ method_handle_close_session(struct rpc_data *data)
 	return RPC_OK_CLOSE;
 }
 
+/*
+ * method_handle_kill_session() - closes another session
+ *
+ * Session being killed gets no reply to its rpc in progress.
+ */
 static int
 method_handle_kill_session(struct rpc_data *data)
 {
-	return RPC_OK_CLOSE;
+	node_t *n_session_id = roxml_get_chld(data->in, "session-id", 0);
+	char *c_session_id = roxml_get_content(n_session_id, NULL, 0, NULL);
+	char *end;
+	unsigned long id;
+
+	if (!n_session_id || !c_session_id)
+		goto invalid;
+
+	id = strtoul(c_session_id, &end, 10);
+
+	// killing own session is an error as well
+	if (*end || end == c_session_id || !id || id > UINT32_MAX || connection_kill(id))
+		goto invalid;
+
+	return RPC_OK;
+
+invalid:
+	data->error = netconf_rpc_error("invalid session-id", RPC_ERROR_TAG_INVALID_VALUE, RPC_ERROR_TYPE_PROTOCOL, RPC_ERROR_SEVERITY_ERROR, NULL);
+
+	return RPC_ERROR;
+}
+
+/*
+ * method_handle_create_subscription() - starts sending notifications to the
+ * session
+ */
+static int
+method_handle_create_subscription(struct rpc_data *data)
+{
+	subscription_t *s = subscription_create(data->in, &data->error);
+
+	if (!s)
+		return RPC_ERROR;
+
+	if (connection_subscribe(s))
+	{
+		subscription_free(s);
+		data->error = netconf_rpc_error("session already has a subscription", RPC_ERROR_TAG_IN_USE, RPC_ERROR_TYPE_PROTOCOL, RPC_ERROR_SEVERITY_ERROR, NULL);
+
+		return RPC_ERROR;
+	}
+
+	return RPC_OK;
+}
+
+/*
+ * method_handle_establish_subscription() - starts pushing changes of data
+ * selected to the session (RFC 8641)
+ */
+static int
+method_handle_establish_subscription(struct rpc_data *data)
+{
+	uint32_t id;
+	char c_id[12];
+	node_t *n_id;
+
+	if (push_establish(data->in, connection_session(), &id, &data->error))
+		return RPC_ERROR;
+
+	snprintf(c_id, sizeof(c_id), "%" PRIu32, id);
+	n_id = roxml_add_node(data->out, 0, ROXML_ELM_NODE, "id", c_id);
+	roxml_add_node(n_id, 0, ROXML_ATTR_NODE, "xmlns", PUSH_SUBSCRIBED_NS);
+
+	return RPC_DATA;
+}
+
+static int
+method_handle_delete_subscription(struct rpc_data *data)
+{
+	node_t *n_id = roxml_get_chld(data->in, "id", 0);
+	char *c_id = roxml_get_content(n_id, NULL, 0, NULL);
+	char *end;
+	unsigned long id;
+
+	if (!n_id || !c_id)
+		goto invalid;
+
+	id = strtoul(c_id, &end, 10);
+
+	// only the session's own subscriptions
+	if (*end || end == c_id || !id || id > UINT32_MAX || push_delete(id, connection_session()))
+		goto invalid;
+
+	return RPC_OK;
+
+invalid:
+	data->error = netconf_rpc_error("no such subscription", RPC_ERROR_TAG_INVALID_VALUE, RPC_ERROR_TYPE_APPLICATION, RPC_ERROR_SEVERITY_ERROR, NULL);
+
+	return RPC_ERROR;
 }
 
 static int method_handle_get_schema(struct rpc_data *data)
@@ -17,8 +17,98 @@
 #ifndef __FREENETCONFD_METHODS_H__
 #define __FREENETCONFD_METHODS_H__
 
+#include <stdint.h>
+
+#include "freenetconfd/datastore.h"
+
 int method_analyze_message_hello(char *method_in, int *base);
-int method_create_message_hello(char **method_out);
+int method_create_message_hello(uint32_t session_id, char **method_out);
 int method_handle_message_rpc(char *method_in, char **method_out);
 
+/**
+ * method_job_t - rpc handled in time slices, see method_job_run()
+ */
+typedef struct method_job method_job_t;
+
+/**
+ * method_handle_message_rpc_fd() - handle rpc spooled to a file
+ *
+ * Used for messages too big to be parsed in memory. Config of edit-config
+ * is applied in pieces (see ingest_edit_config()) by @job, other rpcs are
+ * answered with too-big error.
+ *
+ * @job set to the job applying the config, method_out is NULL then
+ */
+int method_handle_message_rpc_fd(int fd, char **method_out, method_job_t **job);
+
+/**
+ * method_job_run() - continues job until it is done or budget_us elapsed
+ *
+ * At least one piece is applied per call, budget_us 0 runs the job to the
+ * end.
+ *
+ * Return: 1 if there is more work, otherwise like method_handle_message_rpc()
+ * with reply in method_out
+ */
+int method_job_run(method_job_t *job, unsigned int budget_us, char **method_out);
+
+void method_job_free(method_job_t *job);
+
+/**
+ * method_create_message_error() - rpc-reply with error for unhandled rpc
+ *
+ * @rpc:	beginning of the rpc, only its message-id is looked for
+ * @error:	rpc-error content created with netconf_rpc_error()
+ */
+int method_create_message_error(const char *rpc, size_t len, char *error, char **method_out);
+
+#define METHOD_RPC_PRIORITY (1 << 0) // close-session, kill-session, lock, unlock
+#define METHOD_RPC_READ (1 << 1) // reads the datastore
+#define METHOD_RPC_WRITE (1 << 2) // may change the datastore
+#define METHOD_RPC_LOOP (1 << 3) // runs callbacks of modules that aren't thread safe
+
+/**
+ * method_rpc_flags() - classifies rpc without parsing it
+ *
+ * Return: METHOD_RPC_* flags, rpcs that can not be classified are
+ * METHOD_RPC_WRITE and METHOD_RPC_LOOP
+ */
+int method_rpc_flags(const char *rpc, size_t len);
+
+/**
+ * method_stream_t - rpc-reply generated incrementally
+ *
+ * Reply is head, then data read from data with ds_stream_read(),
+ * then "</data>" and tail.
+ */
+typedef struct method_stream
+{
+	char *head;
+	char *tail;
+	ds_stream_t *data;
+} method_stream_t;
+
+/**
+ * method_handle_message_rpc_stream() - method_handle_message_rpc() with streaming
+ *
+ * @stream set to the reply stream if reply is streamed, method_out is
+ * NULL then
+ *
+ * Gets of whole datastores are streamed, everything else is handled by
+ * method_handle_message_rpc().
+ */
+int method_handle_message_rpc_stream(char *method_in, char **method_out, method_stream_t **stream);
+
+/**
+ * method_stream_read() - ds_stream_read() with datastores locked
+ */
+ssize_t method_stream_read(method_stream_t *stream, char *buf, size_t size);
+
+/**
+ * method_stream_end() - ds_stream_end() on data of the reply
+ */
+int method_stream_end(method_stream_t *stream);
+
+void method_stream_free(method_stream_t *stream);
+
 #endif /* __FREENETCONFD_METHODS_H__ */
@@ -19,6 +19,7 @@
 #include <dlfcn.h>
 #include <dirent.h>
 #include <string.h>
+#include <pthread.h>
 
 #include "freenetconfd/freenetconfd.h"
 
@@ -38,6 +39,23 @@ int modules_init()
 	return modules_load(config.modules_dir, &module_list);
 }
 
+/*
+ * module_shared() - checks that no node of datastore has update()
+ *
+ * update() rebuilds nodes while they are read, so such modules can not
+ * be read by several threads at once.
+ */
+static int module_shared(datastore_t *node)
+{
+	for (; node; node = node->next)
+	{
+		if (node->update || !module_shared(node->child))
+			return 0;
+	}
+
+	return 1;
+}
+
 static int module_load(char *modules_path, char *name, struct module_list **e)
 {
 	if (!name)
@@ -88,6 +106,8 @@ static int module_load(char *modules_path, char *name, struct module_list **e)
 
 	(*e)->name = strdup(name);
 	(*e)->lib = lib;
+	(*e)->shared = (*e)->m->datastore ? module_shared((*e)->m->datastore) : 1;
+	pthread_rwlock_init(&(*e)->lock, NULL);
 
 	return 0;
 }
@@ -100,6 +120,7 @@ static void module_unload(struct module_list **elem)
 	if (destroy) destroy();
 
 	free((*elem)->name);
+	pthread_rwlock_destroy(&(*elem)->lock);
 	dlclose((*elem)->lib);
 	list_del(&(*elem)->list);
 	free(*elem);
@@ -175,3 +196,61 @@ int modules_reload(char *module_name)
 
 	return 1;
 }
+
+int modules_threaded(const char *rpc, size_t len)
+{
+	struct module_list *elem;
+	int threaded = 1;
+
+	list_for_each_entry(elem, &module_list, list)
+	{
+		for (int i = 0; i < elem->m->rpc_count; i++)
+		{
+			const char *query = elem->m->rpcs[i].query;
+
+			if (strlen(query) == len && !memcmp(query, rpc, len))
+				return !!(elem->m->flags & MODULE_THREADED);
+		}
+
+		// base rpcs run callbacks of every module
+		if (!(elem->m->flags & MODULE_THREADED))
+			threaded = 0;
+	}
+
+	return threaded;
+}
+
+void modules_lock(struct module_list *elem, int write)
+{
+	if (!config.workers)
+		return;
+
+	if (write || !elem->shared)
+		pthread_rwlock_wrlock(&elem->lock);
+	else
+		pthread_rwlock_rdlock(&elem->lock);
+}
+
+void modules_unlock(struct module_list *elem)
+{
+	if (!config.workers)
+		return;
+
+	pthread_rwlock_unlock(&elem->lock);
+}
+
+void modules_lock_all(int write)
+{
+	struct module_list *elem;
+
+	list_for_each_entry(elem, &module_list, list)
+		modules_lock(elem, write);
+}
+
+void modules_unlock_all(void)
+{
+	struct module_list *elem;
+
+	list_for_each_entry(elem, &module_list, list)
+		modules_unlock(elem);
+}
@@ -27,4 +27,31 @@ int modules_reload(char *module_name);
 int modules_init();
 struct list_head *get_modules();
 
+/**
+ * modules_threaded() - checks whether rpc may run on a worker thread
+ *
+ * @rpc name of the rpc, not terminated
+ * @len length of the name
+ *
+ * Return: 1 if rpc is of a module with MODULE_THREADED, or if it isn't a
+ * module rpc and every module has MODULE_THREADED, 0 otherwise
+ */
+int modules_threaded(const char *rpc, size_t len);
+
+/**
+ * modules_lock() - locks datastore of module for rpc running on a worker
+ *
+ * Gets lock it shared unless the module updates its nodes while they are
+ * read, edits lock it exclusive. Nothing is locked if there are no worker
+ * threads. Modules are always locked in modules list order.
+ */
+void modules_lock(struct module_list *elem, int write);
+void modules_unlock(struct module_list *elem);
+
+/**
+ * modules_lock_all() - modules_lock() on every module
+ */
+void modules_lock_all(int write);
+void modules_unlock_all(void);
+
 #endif /* __FREENETCONFD_MODULES_H_ */
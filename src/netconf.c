@@ -105,7 +105,9 @@ char *rpc_error_tags[__RPC_ERROR_TAG_COUNT] =
 	"in-use",
 	"invalid-value",
 	"data-missing",
-	"data-exists"
+	"data-exists",
+	"too-big",
+	"resource-denied"
 };
 
 char *rpc_error_types[__RPC_ERROR_TYPE_COUNT] =
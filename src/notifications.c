@@ -0,0 +1,759 @@
+/*
+ * Copyright (C) 2014 Sartura, Ltd.
+ * Copyright (C) 2014 Cisco Systems, Inc.
+ *
+ * Author: Luka Perkov <luka.perkov@sartura.hr>
+ * Author: Petar Koretic <petar.koretic@sartura.hr>
+ *
+ * freenetconfd is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with freenetconfd. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <ctype.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include <sys/time.h>
+
+#include <libubox/list.h>
+#include <libubox/uloop.h>
+
+#include "freenetconfd/freenetconfd.h"
+#include "freenetconfd/plugin.h"
+#include "freenetconfd/netconf.h"
+
+#include "notifications.h"
+#include "messages.h"
+#include "config.h"
+#include "connection.h"
+#include "filter.h"
+#include "replay.h"
+
+static void notifications_cb(struct uloop_fd *fd, unsigned int events);
+
+struct notification_stream
+{
+	struct list_head list;
+	char *name;
+	char *description;
+};
+
+struct subscription
+{
+	char *stream;
+	filter_t *filter; // NULL selects everything
+	char *rpc; // create-subscription it was made with
+	uint64_t stop; // stopTime, µs since the epoch, 0 if none
+	uint64_t replay; // position in replay log of next record to replay
+	uint64_t replay_end; // where live notifications took over
+	bool replaying;
+	bool done; // notificationComplete was sent
+};
+
+/* streams and events published by other threads */
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static LIST_HEAD(streams);
+static LIST_HEAD(pending);
+
+/* wakes uloop when events were published */
+static struct uloop_fd event_fd = { .cb = notifications_cb, .fd = -1 };
+
+static struct notification_stream *notification_stream_find(const char *name)
+{
+	struct notification_stream *st;
+
+	list_for_each_entry(st, &streams, list)
+	{
+		if (!strcmp(st->name, name))
+			return st;
+	}
+
+	return NULL;
+}
+
+static int notification_stream_valid(const char *name)
+{
+	size_t len = strlen(name);
+
+	if (!len || len > NOTIFICATION_STREAM_MAX)
+		return 0;
+
+	// name goes into a processing instruction on the way to replicas
+	return strspn(name, "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789._-") == len;
+}
+
+int notification_stream_add(const char *name, const char *description)
+{
+	struct notification_stream *st;
+	int rc = -1;
+
+	if (!name || !notification_stream_valid(name))
+	{
+		ERROR("invalid stream name\n");
+		return -1;
+	}
+
+	pthread_mutex_lock(&lock);
+
+	if (notification_stream_find(name))
+	{
+		ERROR("stream '%s' exists\n", name);
+		goto exit;
+	}
+
+	st = calloc(1, sizeof(*st));
+
+	if (!st || !(st->name = strdup(name)) || (description && !(st->description = strdup(description))))
+	{
+		ERROR("not enough memory\n");
+
+		if (st)
+			free(st->name);
+
+		free(st);
+		goto exit;
+	}
+
+	list_add_tail(&st->list, &streams);
+	rc = 0;
+
+exit:
+	pthread_mutex_unlock(&lock);
+
+	return rc;
+}
+
+/*
+ * notification_alloc() - allocates framed notification of xml_len bytes
+ *
+ * Caller writes the notification element to n->xml.
+ */
+static notification_t *notification_alloc(const char *stream, size_t xml_len)
+{
+	char head[32];
+	int head_len = snprintf(head, sizeof(head), "\n#%zu\n", xml_len);
+	size_t len = head_len + xml_len + strlen(XML_NETCONF_BASE_1_1_END);
+	notification_t *n = malloc(sizeof(*n) + len + 1 + strlen(stream) + 1);
+
+	if (!n)
+	{
+		ERROR("not enough memory\n");
+		return NULL;
+	}
+
+	memset(n, 0, sizeof(*n));
+	memcpy(n->data, head, head_len);
+	n->len = len;
+	n->xml = n->data + head_len;
+	n->xml_len = xml_len;
+	n->stream = strcpy(n->data + len + 1, stream);
+
+	return n;
+}
+
+/*
+ * notification_seal() - ends message written to n->xml
+ */
+static void notification_seal(notification_t *n)
+{
+	memcpy(n->xml + n->xml_len, XML_NETCONF_BASE_1_1_END, strlen(XML_NETCONF_BASE_1_1_END) + 1);
+}
+
+static uint64_t notification_now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+
+	return (uint64_t) tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+/*
+ * notification_time() - parses RFC 3339 date-time into µs since the epoch
+ *
+ * Return: 0 on success, -1 if str is not a date-time
+ */
+static int notification_time(const char *str, uint64_t *time)
+{
+	struct tm tm = { 0 };
+	uint64_t usec = 0, scale = 1000000;
+	int len = 0, hours, minutes;
+	time_t t;
+
+	/* RFC: http://tools.ietf.org/html/rfc3339#section-5.6 */
+	if (!str || sscanf(str, "%4d-%2d-%2d%*1[Tt]%2d:%2d:%2d%n", &tm.tm_year, &tm.tm_mon, &tm.tm_mday,
+					   &tm.tm_hour, &tm.tm_min, &tm.tm_sec, &len) != 6 || !len)
+		return -1;
+
+	str += len;
+
+	if (*str == '.')
+	{
+		if (!isdigit((unsigned char) *++str))
+			return -1;
+
+		for (; isdigit((unsigned char) *str); str++)
+		{
+			if (scale /= 10)
+				usec += (*str - '0') * scale;
+		}
+	}
+
+	tm.tm_year -= 1900;
+	tm.tm_mon -= 1;
+
+	if ((t = timegm(&tm)) == (time_t) -1 || t < 0)
+		return -1;
+
+	if (*str == 'Z' || *str == 'z')
+	{
+		str++;
+	}
+	else if ((*str == '+' || *str == '-') && sscanf(str + 1, "%2d:%2d%n", &hours, &minutes, &len) == 2 && len == 5)
+	{
+		t += (*str == '+' ? -1 : 1) * (hours * 3600 + minutes * 60);
+		str += 1 + len;
+	}
+	else
+	{
+		return -1;
+	}
+
+	if (*str || t < 0)
+		return -1;
+
+	*time = (uint64_t) t * 1000000 + usec;
+
+	return 0;
+}
+
+notification_t *notification_ref(notification_t *n)
+{
+	n->refs++;
+
+	return n;
+}
+
+void notification_unref(notification_t *n)
+{
+	if (!--n->refs)
+		free(n);
+}
+
+/*
+ * notification_release() - frees content parsed for filters
+ *
+ * Runs on the uloop thread, never inside an rpc.
+ */
+static void notification_release(notification_t *n)
+{
+	if (n->root)
+	{
+		roxml_close(n->root);
+		roxml_release(RELEASE_ALL);
+	}
+
+	free(n->copy);
+	n->root = NULL;
+	n->copy = NULL;
+	n->parsed = false;
+}
+
+/*
+ * notification_deliver() - queues notification to its subscribers
+ */
+static void notification_deliver(notification_t *n)
+{
+	n->refs = 1;
+
+	connection_notify(n);
+	notification_release(n);
+	notification_unref(n);
+}
+
+notification_t *notification_create(const char *stream, const char *event)
+{
+	static const char *format = "<notification xmlns=\"" NOTIFICATION_NS "\"><eventTime>%s.%06uZ</eventTime>%s</notification>";
+	uint64_t now = notification_now();
+	time_t sec = now / 1000000;
+	unsigned int usec = now % 1000000;
+	notification_t *n;
+	struct tm tm;
+	char stamp[32];
+	int len;
+
+	/* RFC: http://tools.ietf.org/html/rfc3339#section-5.6 */
+	gmtime_r(&sec, &tm);
+	strftime(stamp, sizeof(stamp), "%Y-%m-%dT%H:%M:%S", &tm);
+
+	len = snprintf(NULL, 0, format, stamp, usec, event);
+
+	if (len < 0 || !(n = notification_alloc(stream, len)))
+		return NULL;
+
+	snprintf(n->xml, len + 1, format, stamp, usec, event);
+	notification_seal(n);
+	n->time = now;
+	n->refs = 1;
+
+	return n;
+}
+
+int notification_send(const char *stream, const char *event)
+{
+	notification_t *n;
+	uint64_t one = 1;
+
+	if (!stream)
+		stream = NOTIFICATION_STREAM_DEFAULT;
+
+	if (!event || !(n = notification_create(stream, event)))
+		return -1;
+
+	pthread_mutex_lock(&lock);
+
+	if (event_fd.fd < 0 || !notification_stream_find(stream))
+	{
+		pthread_mutex_unlock(&lock);
+		free(n);
+		return -1;
+	}
+
+	list_add_tail(&n->list, &pending);
+
+	if (write(event_fd.fd, &one, sizeof(one)) < 0)
+		ERROR("unable to wake main loop\n");
+
+	pthread_mutex_unlock(&lock);
+
+	return 0;
+}
+
+/*
+ * notifications_cb() - delivers events published since the last call
+ */
+static void notifications_cb(struct uloop_fd *fd, unsigned int events)
+{
+	LIST_HEAD(published);
+	notification_t *n, *tmp;
+	uint64_t count;
+
+	if (read(fd->fd, &count, sizeof(count)) < 0)
+		return;
+
+	pthread_mutex_lock(&lock);
+	list_splice_init(&pending, &published);
+	pthread_mutex_unlock(&lock);
+
+	list_for_each_entry_safe(n, tmp, &published, list)
+	{
+		list_del(&n->list);
+
+		// replicas read the log the writer keeps
+		if (replay_append(n->time, n->stream, n->data, n->len))
+			LOG("notification of %zu bytes not kept for replay\n", n->len);
+
+		notification_deliver(n);
+	}
+}
+
+int notifications_forwarded(const char *buf, size_t len)
+{
+	const char *stream = buf + strlen(NOTIFICATION_FORWARD), *space, *end, *xml;
+	char name[NOTIFICATION_STREAM_MAX + 1], *stamp_end;
+	notification_t *n;
+	uint64_t time;
+
+	if (len < strlen(NOTIFICATION_FORWARD) || memcmp(buf, NOTIFICATION_FORWARD, strlen(NOTIFICATION_FORWARD)))
+		return -1;
+
+	end = memmem(stream, buf + len - stream, "?>", 2);
+	space = end ? memchr(stream, ' ', end - stream) : NULL;
+
+	if (!space || space - stream > NOTIFICATION_STREAM_MAX)
+		return -1;
+
+	time = strtoull(space + 1, &stamp_end, 10);
+
+	if (stamp_end != end)
+		return -1;
+
+	memcpy(name, stream, space - stream);
+	name[space - stream] = '\0';
+	xml = end + 2;
+
+	if (!(n = notification_alloc(name, buf + len - xml)))
+		return -1;
+
+	memcpy(n->xml, xml, n->xml_len);
+	notification_seal(n);
+	n->time = time;
+	notification_deliver(n);
+
+	return 0;
+}
+
+static void notifications_prepare(void)
+{
+	pthread_mutex_lock(&lock);
+}
+
+static void notifications_parent(void)
+{
+	pthread_mutex_unlock(&lock);
+}
+
+/*
+ * notifications_child() - leaves events to the writer
+ *
+ * Replicas get notifications from the writer, nothing is published in them.
+ */
+static void notifications_child(void)
+{
+	notification_t *n, *tmp;
+
+	list_for_each_entry_safe(n, tmp, &pending, list)
+	{
+		list_del(&n->list);
+		free(n);
+	}
+
+	if (event_fd.fd >= 0)
+		close(event_fd.fd);
+
+	event_fd.fd = -1;
+
+	pthread_mutex_unlock(&lock);
+}
+
+int notifications_init(void)
+{
+	if (notification_stream_add(NOTIFICATION_STREAM_DEFAULT, "default NETCONF event stream"))
+		return -1;
+
+	for (unsigned int i = 0; i < config.stream_count; i++)
+	{
+		if (notification_stream_add(config.streams[i].name, config.streams[i].description))
+			return -1;
+	}
+
+	if (replay_init())
+		return -1;
+
+	if (pthread_atfork(notifications_prepare, notifications_parent, notifications_child))
+		return -1;
+
+	event_fd.fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+	if (event_fd.fd < 0)
+	{
+		ERROR("unable to create eventfd\n");
+		return -1;
+	}
+
+	uloop_fd_add(&event_fd, ULOOP_READ);
+
+	return 0;
+}
+
+void notifications_exit(void)
+{
+	struct notification_stream *st, *tmp;
+	notification_t *n, *ntmp;
+
+	pthread_mutex_lock(&lock);
+
+	if (event_fd.fd >= 0)
+	{
+		uloop_fd_delete(&event_fd);
+		close(event_fd.fd);
+		event_fd.fd = -1;
+	}
+
+	list_for_each_entry_safe(n, ntmp, &pending, list)
+	{
+		list_del(&n->list);
+		free(n);
+	}
+
+	list_for_each_entry_safe(st, tmp, &streams, list)
+	{
+		list_del(&st->list);
+		free(st->name);
+		free(st->description);
+		free(st);
+	}
+
+	pthread_mutex_unlock(&lock);
+
+	replay_exit();
+}
+
+subscription_t *subscription_create(node_t *operation, char **error)
+{
+	node_t *n_stream = roxml_get_chld(operation, "stream", 0);
+	node_t *n_filter = roxml_get_chld(operation, "filter", 0);
+	node_t *n_start = roxml_get_chld(operation, "startTime", 0);
+	node_t *n_stop = roxml_get_chld(operation, "stopTime", 0);
+	char *stream = NOTIFICATION_STREAM_DEFAULT, *type;
+	subscription_t *s = NULL;
+	uint64_t start = 0, stop = 0;
+	int found;
+
+	*error = NULL;
+
+	// replay needs the log
+	if (n_start && !replay_enabled())
+	{
+		*error = netconf_rpc_error("replay not supported", RPC_ERROR_TAG_OPERATION_NOT_SUPPORTED, RPC_ERROR_TYPE_PROTOCOL, RPC_ERROR_SEVERITY_ERROR, NULL);
+		return NULL;
+	}
+
+	if ((n_start && notification_time(roxml_get_content(n_start, NULL, 0, NULL), &start)) ||
+		(n_stop && notification_time(roxml_get_content(n_stop, NULL, 0, NULL), &stop)))
+	{
+		*error = netconf_rpc_error("invalid date-time", RPC_ERROR_TAG_INVALID_VALUE, RPC_ERROR_TYPE_PROTOCOL, RPC_ERROR_SEVERITY_ERROR, NULL);
+		return NULL;
+	}
+
+	if (n_stop && (!n_start || stop < start))
+	{
+		*error = netconf_rpc_error("stopTime without earlier startTime", RPC_ERROR_TAG_INVALID_VALUE, RPC_ERROR_TYPE_PROTOCOL, RPC_ERROR_SEVERITY_ERROR, NULL);
+		return NULL;
+	}
+
+	if (start > notification_now())
+	{
+		*error = netconf_rpc_error("startTime in the future", RPC_ERROR_TAG_INVALID_VALUE, RPC_ERROR_TYPE_PROTOCOL, RPC_ERROR_SEVERITY_ERROR, NULL);
+		return NULL;
+	}
+
+	if (n_stream)
+		stream = roxml_get_content(n_stream, NULL, 0, NULL);
+
+	pthread_mutex_lock(&lock);
+	found = stream && notification_stream_find(stream);
+	pthread_mutex_unlock(&lock);
+
+	if (!found)
+	{
+		*error = netconf_rpc_error("no such stream", RPC_ERROR_TAG_INVALID_VALUE, RPC_ERROR_TYPE_PROTOCOL, RPC_ERROR_SEVERITY_ERROR, NULL);
+		return NULL;
+	}
+
+	type = n_filter ? roxml_get_content(roxml_get_attr(n_filter, "type", 0), NULL, 0, NULL) : NULL;
+
+	if (type && strcmp(type, "subtree"))
+	{
+		*error = netconf_rpc_error("only subtree filters are supported", RPC_ERROR_TAG_OPERATION_NOT_SUPPORTED, RPC_ERROR_TYPE_PROTOCOL, RPC_ERROR_SEVERITY_ERROR, NULL);
+		return NULL;
+	}
+
+	if (!(s = calloc(1, sizeof(*s))) || !(s->stream = strdup(stream)))
+		goto error;
+
+	if (n_filter && !(s->filter = filter_compile_event(n_filter)))
+		goto error;
+
+	if (roxml_commit_changes(operation, NULL, &s->rpc, 0) <= 0)
+		goto error;
+
+	// epoch itself is no stopTime, it is before any notification anyway
+	s->stop = n_stop ? (stop ? stop : 1) : 0;
+
+	if (n_start)
+	{
+		s->replaying = true;
+		s->replay_end = replay_end();
+		s->replay = replay_seek(start);
+	}
+
+	return s;
+
+error:
+	*error = netconf_rpc_error("unable to create subscription", RPC_ERROR_TAG_OPERATION_FAILED, RPC_ERROR_TYPE_APPLICATION, RPC_ERROR_SEVERITY_ERROR, NULL);
+	subscription_free(s);
+
+	return NULL;
+}
+
+const char *subscription_rpc(subscription_t *s)
+{
+	return s->rpc;
+}
+
+subscription_t *subscription_restore(const char *rpc)
+{
+	char *buf = strdup(rpc), *error = NULL;
+	subscription_t *s = NULL;
+	node_t *root = buf ? roxml_load_buf(buf) : NULL;
+	node_t *operation = root ? roxml_get_chld(root, NULL, 0) : NULL;
+
+	if (operation)
+		s = subscription_create(operation, &error);
+
+	if (s)
+		s->replaying = false;
+
+	roxml_release(RELEASE_ALL);
+	roxml_close(root);
+	free(buf);
+	free(error);
+
+	return s;
+}
+
+int subscription_match(subscription_t *s, notification_t *n)
+{
+	if (s->done || (s->stop && n->time > s->stop))
+		return 0;
+
+	if (strcmp(s->stream, NOTIFICATION_STREAM_DEFAULT) && strcmp(s->stream, n->stream))
+		return 0;
+
+	if (!s->filter)
+		return 1;
+
+	if (!n->parsed)
+	{
+		n->parsed = true;
+
+		if ((n->copy = strndup(n->xml, n->xml_len)))
+			n->root = roxml_load_buf(n->copy);
+	}
+
+	node_t *notification = n->root ? roxml_get_chld(n->root, NULL, 0) : NULL;
+
+	return notification && filter_match_event(s->filter, notification);
+}
+
+/*
+ * notification_stored() - notification from replay log record
+ */
+static notification_t *notification_stored(const struct replay_entry *e)
+{
+	notification_t *n = malloc(sizeof(*n) + e->len + 1 + e->stream_len + 1);
+	char *xml;
+
+	if (!n)
+	{
+		ERROR("not enough memory\n");
+		return NULL;
+	}
+
+	memset(n, 0, sizeof(*n));
+	memcpy(n->data, e->data, e->len);
+	n->data[e->len] = '\0';
+	n->len = e->len;
+	n->time = e->time;
+	n->stream = memcpy(n->data + e->len + 1, e->stream, e->stream_len);
+	n->data[e->len + 1 + e->stream_len] = '\0';
+	n->refs = 1;
+
+	// message is framed as one chunk, the notification follows its header
+	xml = e->len > 2 ? memchr(n->data + 1, '\n', e->len - 1) : NULL;
+
+	if (!xml || n->data[0] != '\n' || n->data + n->len - ++xml < (ptrdiff_t) strlen(XML_NETCONF_BASE_1_1_END))
+	{
+		free(n);
+		return NULL;
+	}
+
+	n->xml = xml;
+	n->xml_len = n->data + n->len - xml - strlen(XML_NETCONF_BASE_1_1_END);
+
+	return n;
+}
+
+notification_t *subscription_replay(subscription_t *s)
+{
+	struct replay_entry e;
+	notification_t *n;
+
+	if (!s->replaying)
+		return NULL;
+
+	while (!replay_get(&s->replay, s->replay_end, &e))
+	{
+		s->replay = e.next;
+
+		if (s->stop && e.time > s->stop)
+			break;
+
+		// writer may have overwritten it meanwhile
+		if (!(n = notification_stored(&e)) || !replay_valid(&e))
+		{
+			free(n);
+			continue;
+		}
+
+		if (subscription_match(s, n))
+		{
+			notification_release(n);
+			return n;
+		}
+
+		notification_release(n);
+		notification_unref(n);
+	}
+
+	s->replaying = false;
+
+	return notification_create(s->stream, "<replayComplete xmlns=\"" NOTIFICATION_NETMOD_NS "\"/>");
+}
+
+bool subscription_replaying(subscription_t *s)
+{
+	return s->replaying;
+}
+
+notification_t *subscription_complete(subscription_t *s)
+{
+	if (s->done || !s->stop || s->replaying || notification_now() <= s->stop)
+		return NULL;
+
+	s->done = true;
+
+	return notification_create(s->stream, "<notificationComplete xmlns=\"" NOTIFICATION_NETMOD_NS "\"/>");
+}
+
+int subscription_timeout(subscription_t *s)
+{
+	uint64_t now = notification_now();
+
+	if (s->done || !s->stop)
+		return -1;
+
+	if (now > s->stop)
+		return 0;
+
+	// far stopTime is checked again every hour, clock may be set meanwhile
+	return (s->stop - now) / 1000 > 3600000 ? 3600000 : (s->stop - now) / 1000 + 1;
+}
+
+bool subscription_done(subscription_t *s)
+{
+	return s->done;
+}
+
+void subscription_free(subscription_t *s)
+{
+	if (!s)
+		return;
+
+	free(s->stream);
+	filter_free(s->filter);
+	free(s->rpc);
+	free(s);
+}
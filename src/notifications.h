@@ -0,0 +1,150 @@
+/*
+ * Copyright (C) 2014 Sartura, Ltd.
+ * Copyright (C) 2014 Cisco Systems, Inc.
+ *
+ * Author: Luka Perkov <luka.perkov@sartura.hr>
+ * Author: Petar Koretic <petar.koretic@sartura.hr>
+ *
+ * freenetconfd is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with freenetconfd. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __FREENETCONFD_NOTIFICATIONS_H__
+#define __FREENETCONFD_NOTIFICATIONS_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <libubox/list.h>
+#include <roxml.h>
+
+/* RFC: http://tools.ietf.org/html/rfc5277 */
+#define NOTIFICATION_NS "urn:ietf:params:xml:ns:netconf:notification:1.0"
+#define NOTIFICATION_NETMOD_NS "urn:ietf:params:xml:ns:netmod:notification"
+#define NOTIFICATION_STREAM_DEFAULT "NETCONF"
+#define NOTIFICATION_STREAM_MAX 64
+
+/*
+ * Writer sends every notification to replicas as one message, stream name
+ * and event time in a processing instruction and the notification after it.
+ */
+#define NOTIFICATION_FORWARD "<?stream "
+
+/**
+ * notification_t - event serialized once for all sessions it goes to
+ *
+ * Message is complete with base 1.1 framing, sessions write it as it is.
+ * Queued sessions hold references, the last one frees it.
+ */
+typedef struct notification
+{
+	unsigned int refs;
+	struct list_head list; // entry in list of events not delivered yet
+	const char *stream;
+	uint64_t time; // eventTime, µs since the epoch
+	size_t len;
+	char *xml; // notification element inside data
+	size_t xml_len;
+	bool parsed; // content was parsed for filters, root is NULL if it failed
+	node_t *root;
+	char *copy; // what root was parsed from
+	char data[];
+} notification_t;
+
+typedef struct subscription subscription_t;
+
+/**
+ * notifications_init() - adds NETCONF stream and those of config, opens
+ * replay log, starts taking events from plugins
+ */
+int notifications_init(void);
+void notifications_exit(void);
+
+/**
+ * notifications_forwarded() - delivers notification received from the writer
+ *
+ * @buf:	message starting with NOTIFICATION_FORWARD
+ *
+ * Return: 0 on success, -1 if message is malformed
+ */
+int notifications_forwarded(const char *buf, size_t len);
+
+/**
+ * notification_create() - serializes event as notification of now
+ *
+ * Return: notification with one reference, NULL if out of memory
+ */
+notification_t *notification_create(const char *stream, const char *event);
+
+notification_t *notification_ref(notification_t *n);
+void notification_unref(notification_t *n);
+
+/**
+ * subscription_create() - checks create-subscription and compiles its filter
+ *
+ * Replay starts where the log has startTime, notifications logged from
+ * now on are left to the live ones.
+ *
+ * @operation:	create-subscription node
+ * @error:	set to rpc-error content on error
+ *
+ * Return: subscription, NULL on error, free it with subscription_free()
+ */
+subscription_t *subscription_create(node_t *operation, char **error);
+
+/**
+ * subscription_rpc() - create-subscription the subscription was made with
+ */
+const char *subscription_rpc(subscription_t *s);
+
+/**
+ * subscription_restore() - subscription_create() from subscription_rpc()
+ * of a session handed over, without replaying again
+ */
+subscription_t *subscription_restore(const char *rpc);
+
+/**
+ * subscription_match() - checks whether notification goes to subscriber
+ *
+ * Content of notification is parsed for the first filter that needs it,
+ * once for all subscribers.
+ */
+int subscription_match(subscription_t *s, notification_t *n);
+
+/**
+ * subscription_replay() - next notification replayed to subscriber
+ *
+ * replayComplete follows the last one.
+ *
+ * Return: notification, NULL once replay is complete, unref it
+ */
+notification_t *subscription_replay(subscription_t *s);
+bool subscription_replaying(subscription_t *s);
+
+/**
+ * subscription_complete() - ends subscription that reached its stopTime
+ *
+ * Return: notificationComplete, NULL if it is not time yet, unref it
+ */
+notification_t *subscription_complete(subscription_t *s);
+
+/**
+ * subscription_timeout() - ms until subscription_complete() is due, -1 if
+ * subscription has no stopTime or it is done
+ */
+int subscription_timeout(subscription_t *s);
+
+/**
+ * subscription_done() - subscription ended with notificationComplete
+ */
+bool subscription_done(subscription_t *s);
+
+void subscription_free(subscription_t *s);
+
+#endif /* __FREENETCONFD_NOTIFICATIONS_H__ */
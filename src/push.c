@@ -0,0 +1,1012 @@
+/*
+ * Copyright (C) 2014 Sartura, Ltd.
+ * Copyright (C) 2014 Cisco Systems, Inc.
+ *
+ * Author: Luka Perkov <luka.perkov@sartura.hr>
+ * Author: Petar Koretic <petar.koretic@sartura.hr>
+ *
+ * freenetconfd is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with freenetconfd. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+#include <libubox/list.h>
+#include <libubox/uloop.h>
+
+#include "freenetconfd/freenetconfd.h"
+#include "freenetconfd/netconf.h"
+#include "freenetconfd/datastore.h"
+
+#include "config.h"
+#include "connection.h"
+#include "filter.h"
+#include "modules.h"
+#include "notifications.h"
+#include "push.h"
+#include "xpath.h"
+
+#define PUSH_PATCH_NS "urn:ietf:params:xml:ns:yang:ietf-yang-patch"
+
+/* updates go to one session each, they belong to no event stream */
+#define PUSH_STREAM "yang-push"
+
+/**
+ * push_edit_t - yang-patch edit serialized once for all subscriptions
+ * selecting it
+ */
+typedef struct push_edit
+{
+	unsigned int refs;
+	char xml[]; // <edit> element
+} push_edit_t;
+
+/**
+ * push_change_t - changed node copied with its ancestors
+ *
+ * Ancestors have only their keys, the copy is what targets are made of
+ * and what selection filters are matched against.
+ */
+typedef struct push_change
+{
+	struct push_change *next;
+	enum ds_change change;
+	datastore_t *node;
+} push_change_t;
+
+typedef struct push_subscription
+{
+	struct list_head list;
+	uint32_t id;
+	uint32_t session_id;
+	xpath_t *xpath;
+	filter_t *filter;
+	char *subtree; // datastore-subtree-filter, compiled again for push-update
+	unsigned int dampening; // ms between push-change-updates
+	uint64_t last; // when the last one went out
+	uint32_t patches;
+	bool sync; // push-update is due
+	push_edit_t **edits; // selected, waiting for dampening period to pass
+	unsigned int edits_count;
+	unsigned int edits_size;
+	struct uloop_timeout timer;
+} push_subscription_t;
+
+static LIST_HEAD(subscriptions);
+static uint32_t subscription_id = 0;
+static uint64_t edit_id = 0;
+static bool tracking = false;
+
+/* changes are reported on the threads making them */
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static push_change_t *deleted = NULL, **deleted_tail = &deleted;
+static int changed = 0;
+static struct uloop_fd event_fd = { .fd = -1 };
+
+static void push_flush_cb(struct uloop_timeout *t);
+static struct uloop_timeout flush_timer = { .cb = push_flush_cb };
+
+/* monotonic time in ms */
+static uint64_t push_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/*
+ * push_copy_tree() - copies node as readers see it, with everything below
+ */
+static datastore_t *push_copy_tree(datastore_t *node)
+{
+	datastore_t *copy, *child;
+	char *value;
+
+	node = ds_published(node);
+	value = node->get ? node->get(node) : node->value;
+	copy = ds_create(node->name, value, node->ns);
+
+	// get always allocates
+	if (node->get)
+		free(value);
+
+	if (!copy)
+		return NULL;
+
+	copy->is_list = node->is_list;
+	copy->is_key = node->is_key;
+
+	for (datastore_t *cur = node->child; cur; cur = cur->next)
+	{
+		if (!(child = push_copy_tree(cur)))
+		{
+			ds_free(copy, 0);
+			return NULL;
+		}
+
+		ds_add_child(copy, child, NULL, 0);
+	}
+
+	return copy;
+}
+
+/*
+ * push_copy_key() - copies node without its children, value only if it is
+ * a key part, get() is not called
+ */
+static datastore_t *push_copy_key(datastore_t *node)
+{
+	datastore_t *copy;
+
+	node = ds_published(node);
+	copy = ds_create(node->name, node->is_key ? node->value : NULL, node->ns);
+
+	if (!copy)
+		return NULL;
+
+	copy->is_list = node->is_list;
+	copy->is_key = node->is_key;
+
+	return copy;
+}
+
+/*
+ * push_copy_keys() - adds copies of key parts of entry, but skip, to copy
+ */
+static void push_copy_keys(datastore_t *copy, datastore_t *entry, datastore_t *skip)
+{
+	datastore_t *key;
+
+	// keys make list entries part of targets and filters
+	for (datastore_t *k = entry->child; k; k = k->next)
+	{
+		if (k->is_key && k != skip && (key = push_copy_key(k)))
+			ds_add_child(copy, key, NULL, 0);
+	}
+}
+
+/*
+ * push_copy() - copies node with its ancestors up to the module root,
+ * ancestors with their keys only
+ *
+ * @deep 1 to copy everything below node, 0 for its keys only
+ *
+ * Return: copy of node, NULL if out of memory
+ */
+static datastore_t *push_copy(datastore_t *node, int deep)
+{
+	datastore_t *copy = deep ? push_copy_tree(node) : push_copy_key(node), *top = copy, *parent;
+	datastore_t *cur = node->parent, *prev = node;
+
+	if (copy && !deep)
+		push_copy_keys(copy, node, NULL);
+
+	for (; top && cur; prev = cur, cur = cur->parent)
+	{
+		if (!(parent = ds_create(cur->name, NULL, cur->ns)))
+			break;
+
+		parent->is_list = cur->is_list;
+		ds_add_child(parent, top, NULL, 0);
+		top = parent;
+
+		push_copy_keys(parent, cur, prev);
+	}
+
+	if (top && !cur)
+		return copy;
+
+	ds_free(top, 0);
+
+	return NULL;
+}
+
+static push_change_t *push_change(datastore_t *node, enum ds_change change)
+{
+	push_change_t *c = malloc(sizeof(*c));
+
+	// deleted node is going, its path and keys are enough
+	if (!c || !(c->node = push_copy(node, !(change & DS_CHANGE_DELETE))))
+	{
+		ERROR("not enough memory, change is not pushed\n");
+		free(c);
+		return NULL;
+	}
+
+	c->next = NULL;
+	c->change = change;
+
+	return c;
+}
+
+static datastore_t *push_change_root(push_change_t *c)
+{
+	datastore_t *root = c->node;
+
+	while (root->parent)
+		root = root->parent;
+
+	return root;
+}
+
+static void push_change_free(push_change_t *c)
+{
+	ds_free(push_change_root(c), 0);
+	free(c);
+}
+
+/*
+ * push_changed() - notes change of a tracked datastore, see ds_track()
+ *
+ * Path and keys of deleted nodes are copied right away, the first change
+ * of a flush wakes the main loop.
+ */
+static void push_changed(datastore_t *node, enum ds_change change)
+{
+	push_change_t *c;
+	uint64_t one = 1;
+
+	if ((change & DS_CHANGE_DELETE) && (c = push_change(node, DS_CHANGE_DELETE)))
+	{
+		pthread_mutex_lock(&lock);
+		*deleted_tail = c;
+		deleted_tail = &c->next;
+		pthread_mutex_unlock(&lock);
+	}
+
+	if (!__atomic_exchange_n(&changed, 1, __ATOMIC_SEQ_CST) && write(event_fd.fd, &one, sizeof(one)) < 0)
+		ERROR("unable to wake main loop\n");
+}
+
+static void push_changed_cb(struct uloop_fd *u, unsigned int events)
+{
+	uint64_t count;
+
+	if (read(u->fd, &count, sizeof(count)) < 0)
+		return;
+
+	// changes made meanwhile go out with these
+	if (!flush_timer.pending)
+		uloop_timeout_set(&flush_timer, config.push_dampening);
+}
+
+static void push_drop_deleted(void)
+{
+	push_change_t *c;
+
+	pthread_mutex_lock(&lock);
+
+	while ((c = deleted))
+	{
+		deleted = c->next;
+		push_change_free(c);
+	}
+
+	deleted_tail = &deleted;
+
+	pthread_mutex_unlock(&lock);
+}
+
+/*
+ * push_untrack() - stops tracking once there are no subscriptions
+ */
+static void push_untrack(void)
+{
+	if (!tracking || !list_empty(&subscriptions))
+		return;
+
+	ds_track(NULL, NULL);
+	tracking = false;
+	push_drop_deleted();
+}
+
+/*
+ * push_track() - tracks changes as long as there are subscriptions
+ *
+ * Starting drops changes from before, so it runs with nothing changing
+ * the datastore.
+ */
+static void push_track(void)
+{
+	struct module_list *elem;
+
+	push_untrack();
+
+	if (tracking || list_empty(&subscriptions))
+		return;
+
+	if (event_fd.fd < 0)
+	{
+		event_fd.fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+		if (event_fd.fd < 0)
+		{
+			ERROR("unable to create eventfd, changes are not pushed\n");
+			return;
+		}
+
+		event_fd.cb = push_changed_cb;
+		uloop_fd_add(&event_fd, ULOOP_READ);
+	}
+
+	push_drop_deleted();
+
+	list_for_each_entry(elem, get_modules(), list)
+	{
+		if (elem->m->datastore)
+			ds_track(elem->m->datastore, push_changed);
+	}
+
+	tracking = true;
+}
+
+static void push_edit_unref(push_edit_t *e)
+{
+	if (e && !--e->refs)
+		free(e);
+}
+
+static void push_render(datastore_t *node, node_t *out)
+{
+	node_t *n = roxml_add_node(out, 0, ROXML_ELM_NODE, node->name, node->value);
+
+	if (node->ns)
+		roxml_add_node(n, 0, ROXML_ATTR_NODE, "xmlns", node->ns);
+
+	for (datastore_t *cur = node->child; cur; cur = cur->next)
+		push_render(cur, n);
+}
+
+/*
+ * push_target() - writes path of node, list entries with their keys
+ */
+static void push_target(FILE *f, datastore_t *node)
+{
+	// root stands for the datastore
+	if (!node->parent)
+		return;
+
+	push_target(f, node->parent);
+	fprintf(f, "/%s", node->name);
+
+	for (datastore_t *key = node->child; node->is_list && key; key = key->next)
+	{
+		const char *value = key->value ? key->value : "";
+
+		if (key->is_key)
+			fprintf(f, strchr(value, '\'') ? "[%s=\"%s\"]" : "[%s='%s']", key->name, value);
+	}
+}
+
+/*
+ * push_edit() - serializes change as yang-patch edit
+ *
+ * Return: edit with one reference, NULL if out of memory
+ */
+static push_edit_t *push_edit(push_change_t *c)
+{
+	node_t *root = roxml_load_buf("<edit/>");
+	node_t *edit = roxml_get_chld(root, NULL, 0), *value;
+	char *target = NULL, *xml = NULL, id[24];
+	size_t target_len;
+	push_edit_t *e = NULL;
+	FILE *f;
+	int len;
+
+	if (!edit || !(f = open_memstream(&target, &target_len)))
+		goto exit;
+
+	push_target(f, c->node);
+	fclose(f);
+
+	snprintf(id, sizeof(id), "%" PRIu64, ++edit_id);
+	roxml_add_node(edit, 0, ROXML_ELM_NODE, "edit-id", id);
+
+	switch (c->change)
+	{
+		case DS_CHANGE_CREATE:
+			roxml_add_node(edit, 0, ROXML_ELM_NODE, "operation", "create");
+			break;
+
+		case DS_CHANGE_DELETE:
+			roxml_add_node(edit, 0, ROXML_ELM_NODE, "operation", "delete");
+			break;
+
+		default:
+			roxml_add_node(edit, 0, ROXML_ELM_NODE, "operation", "replace");
+			break;
+	}
+
+	roxml_add_node(edit, 0, ROXML_ELM_NODE, "target", target);
+
+	if (c->change != DS_CHANGE_DELETE)
+	{
+		value = roxml_add_node(edit, 0, ROXML_ELM_NODE, "value", NULL);
+		push_render(c->node, value);
+	}
+
+	if ((len = roxml_commit_changes(edit, NULL, &xml, 0)) <= 0 || !(e = malloc(sizeof(*e) + len + 1)))
+		goto exit;
+
+	e->refs = 1;
+	memcpy(e->xml, xml, len);
+	e->xml[len] = '\0';
+
+exit:
+	if (!e)
+		ERROR("unable to serialize change\n");
+
+	roxml_close(root);
+	free(target);
+	free(xml);
+
+	return e;
+}
+
+static int push_selected(datastore_t *node, void *priv)
+{
+	datastore_t *changed = priv;
+
+	// selected node is the changed one, in it or above it
+	for (datastore_t *cur = node; cur; cur = cur->parent)
+	{
+		if (cur == changed)
+			return 1;
+	}
+
+	for (datastore_t *cur = changed; cur; cur = cur->parent)
+	{
+		if (cur == node)
+			return 1;
+	}
+
+	return 0;
+}
+
+static int push_hold(push_subscription_t *s, push_edit_t *e)
+{
+	push_edit_t **edits;
+	unsigned int size = s->edits_size ? s->edits_size * 2 : 16;
+
+	if (s->edits_count == s->edits_size)
+	{
+		if (!(edits = realloc(s->edits, size * sizeof(*edits))))
+		{
+			ERROR("not enough memory, change is not pushed\n");
+			return -1;
+		}
+
+		s->edits = edits;
+		s->edits_size = size;
+	}
+
+	e->refs++;
+	s->edits[s->edits_count++] = e;
+
+	return 0;
+}
+
+/*
+ * push_dispatch() - gives change to subscriptions selecting it
+ *
+ * Edit is serialized with the first one, subtree filters are matched
+ * against the copy rendered once.
+ */
+static void push_dispatch(push_change_t *c)
+{
+	push_subscription_t *s;
+	push_edit_t *e = NULL;
+	datastore_t *root = push_change_root(c);
+	node_t *doc = NULL, *data = NULL;
+	int match;
+
+	list_for_each_entry(s, &subscriptions, list)
+	{
+		// push-update has it all
+		if (s->sync)
+			continue;
+
+		if (s->xpath)
+		{
+			match = xpath_select(s->xpath, root, push_selected, c->node);
+		}
+		else if (s->filter)
+		{
+			if (!doc && (doc = roxml_load_buf("<data/>")) && (data = roxml_get_chld(doc, NULL, 0)))
+			{
+				for (datastore_t *cur = root->child; cur; cur = cur->next)
+					push_render(cur, data);
+			}
+
+			match = data && filter_match_event(s->filter, data);
+		}
+		else
+		{
+			match = 1;
+		}
+
+		if (!match || (!e && !(e = push_edit(c))))
+			continue;
+
+		push_hold(s, e);
+	}
+
+	push_edit_unref(e);
+
+	if (doc)
+		roxml_close(doc);
+}
+
+static void push_send(push_subscription_t *s, const char *event)
+{
+	notification_t *n = notification_create(PUSH_STREAM, event);
+
+	if (!n)
+	{
+		ERROR("not enough memory, update is not pushed\n");
+		return;
+	}
+
+	connection_deliver(s->session_id, n);
+	notification_unref(n);
+}
+
+/*
+ * push_update() - sends edits held by subscription as push-change-update
+ *
+ * Unless forced, it waits for the dampening period to pass.
+ */
+static void push_update(push_subscription_t *s, bool force)
+{
+	uint64_t now = push_now();
+	char *buf = NULL;
+	size_t len;
+	FILE *f;
+
+	if (!s->edits_count)
+		return;
+
+	if (!force && s->last && now < s->last + s->dampening)
+	{
+		if (!s->timer.pending)
+			uloop_timeout_set(&s->timer, s->last + s->dampening - now);
+
+		return;
+	}
+
+	if ((f = open_memstream(&buf, &len)))
+	{
+		fprintf(f, "<push-change-update xmlns=\"" PUSH_NS "\"><id>%" PRIu32 "</id>"
+				"<datastore-changes><yang-patch xmlns=\"" PUSH_PATCH_NS "\">"
+				"<patch-id>%" PRIu32 "-%" PRIu32 "</patch-id>", s->id, s->id, ++s->patches);
+
+		for (unsigned int i = 0; i < s->edits_count; i++)
+			fputs(s->edits[i]->xml, f);
+
+		fputs("</yang-patch></datastore-changes></push-change-update>", f);
+
+		if (!fclose(f))
+			push_send(s, buf);
+	}
+
+	free(buf);
+
+	for (unsigned int i = 0; i < s->edits_count; i++)
+		push_edit_unref(s->edits[i]);
+
+	s->edits_count = 0;
+	s->last = now;
+	uloop_timeout_cancel(&s->timer);
+}
+
+static void push_timer_cb(struct uloop_timeout *t)
+{
+	push_update(container_of(t, push_subscription_t, timer), false);
+}
+
+/*
+ * push_sync() - sends push-update with all data subscription selects
+ */
+static void push_sync(push_subscription_t *s)
+{
+	node_t *root = roxml_load_buf("<push-update xmlns=\"" PUSH_NS "\"/>");
+	node_t *update = roxml_get_chld(root, NULL, 0), *contents;
+	node_t *subtree_root = NULL;
+	char *subtree = NULL, *xml = NULL, id[12];
+	struct module_list *elem;
+	filter_t *filter = NULL;
+
+	s->sync = false;
+
+	if (!update)
+		goto exit;
+
+	snprintf(id, sizeof(id), "%" PRIu32, s->id);
+	roxml_add_node(update, 0, ROXML_ELM_NODE, "id", id);
+	contents = roxml_add_node(update, 0, ROXML_ELM_NODE, "datastore-contents", NULL);
+
+	// subtree filter of a get resolves modules, the one kept doesn't
+	if (s->subtree && (!(subtree = strdup(s->subtree)) || !(subtree_root = roxml_load_buf(subtree)) ||
+					   !(filter = filter_compile(roxml_get_chld(subtree_root, NULL, 0)))))
+		goto exit;
+
+	modules_lock_all(0);
+
+	if (s->xpath)
+	{
+		xpath_eval(s->xpath, contents, 0, NULL);
+	}
+	else if (filter)
+	{
+		filter_eval(filter, contents, 0, NULL);
+	}
+	else
+	{
+		list_for_each_entry(elem, get_modules(), list)
+		{
+			if (elem->m->datastore)
+				ds_get_all_options(elem->m->datastore->child, contents, 0, 1, NULL);
+		}
+	}
+
+	modules_unlock_all();
+
+	if (roxml_commit_changes(update, NULL, &xml, 0) > 0)
+		push_send(s, xml);
+
+exit:
+	if (!xml)
+		ERROR("unable to build push-update of subscription %" PRIu32 "\n", s->id);
+
+	filter_free(filter);
+
+	if (subtree_root)
+		roxml_close(subtree_root);
+
+	if (root)
+		roxml_close(root);
+
+	free(subtree);
+	free(xml);
+}
+
+static void push_collect(datastore_t *node, int change, void *priv)
+{
+	push_change_t ***tail = priv, *c;
+
+	if ((c = push_change(node, change & DS_CHANGE_CREATE ? DS_CHANGE_CREATE : DS_CHANGE_VALUE)))
+	{
+		**tail = c;
+		*tail = &c->next;
+	}
+}
+
+/*
+ * push_flush() - takes changes since the last flush and hands them to
+ * subscriptions, runs with no rpc touching the datastore
+ *
+ * Deletions come first, they were noted as they happened.
+ */
+static void push_flush(void)
+{
+	push_change_t *changes, *c, **tail;
+	push_subscription_t *s, *tmp;
+	struct module_list *elem;
+	int epoch;
+
+	__atomic_store_n(&changed, 0, __ATOMIC_SEQ_CST);
+
+	push_track();
+
+	pthread_mutex_lock(&lock);
+	changes = deleted;
+	deleted = NULL;
+	deleted_tail = &deleted;
+	pthread_mutex_unlock(&lock);
+
+	for (tail = &changes; *tail; tail = &(*tail)->next);
+
+	if (tracking)
+	{
+		epoch = ds_read_begin();
+		modules_lock_all(1);
+
+		list_for_each_entry(elem, get_modules(), list)
+		{
+			if (elem->m->datastore)
+				ds_changes(elem->m->datastore, push_collect, &tail);
+		}
+
+		modules_unlock_all();
+		ds_read_end(epoch);
+	}
+
+	while ((c = changes))
+	{
+		changes = c->next;
+		push_dispatch(c);
+		push_change_free(c);
+	}
+
+	list_for_each_entry_safe(s, tmp, &subscriptions, list)
+	{
+		if (s->sync)
+			push_sync(s);
+
+		push_update(s, false);
+	}
+
+	roxml_release(RELEASE_ALL);
+}
+
+static void push_flush_cb(struct uloop_timeout *t)
+{
+	connection_exclusive(push_flush);
+}
+
+static void push_free(push_subscription_t *s)
+{
+	list_del(&s->list);
+	uloop_timeout_cancel(&s->timer);
+
+	for (unsigned int i = 0; i < s->edits_count; i++)
+		push_edit_unref(s->edits[i]);
+
+	xpath_free(s->xpath);
+	filter_free(s->filter);
+	free(s->subtree);
+	free(s->edits);
+	free(s);
+}
+
+/*
+ * push_terminated() - sends edits held and subscription-terminated
+ */
+static void push_terminated(push_subscription_t *s)
+{
+	char event[sizeof("<subscription-terminated xmlns=\"\"><id></id><reason xmlns:sn=\"\">sn:no-such-subscription</reason></subscription-terminated>") +
+			   2 * sizeof(PUSH_SUBSCRIBED_NS) + 10];
+
+	push_update(s, true);
+
+	snprintf(event, sizeof(event), "<subscription-terminated xmlns=\"" PUSH_SUBSCRIBED_NS "\"><id>%" PRIu32 "</id>"
+			 "<reason xmlns:sn=\"" PUSH_SUBSCRIBED_NS "\">sn:no-such-subscription</reason></subscription-terminated>", s->id);
+
+	push_send(s, event);
+}
+
+static void push_child(void)
+{
+	push_subscription_t *s, *tmp;
+
+	// subscriptions belong to sessions of the parent
+	list_for_each_entry_safe(s, tmp, &subscriptions, list)
+		push_free(s);
+
+	push_untrack();
+	uloop_timeout_cancel(&flush_timer);
+
+	if (event_fd.fd >= 0)
+		close(event_fd.fd);
+
+	event_fd.fd = -1;
+}
+
+int push_init(void)
+{
+	return pthread_atfork(NULL, NULL, push_child) ? -1 : 0;
+}
+
+void push_exit(void)
+{
+	push_subscription_t *s, *tmp;
+
+	list_for_each_entry_safe(s, tmp, &subscriptions, list)
+		push_free(s);
+
+	push_untrack();
+	uloop_timeout_cancel(&flush_timer);
+
+	if (event_fd.fd >= 0)
+	{
+		uloop_fd_delete(&event_fd);
+		close(event_fd.fd);
+	}
+
+	event_fd.fd = -1;
+}
+
+static char *push_error(char *message, rpc_error_tag_t tag)
+{
+	rpc_error_type_t type = tag == RPC_ERROR_TAG_OPERATION_FAILED ? RPC_ERROR_TYPE_APPLICATION : RPC_ERROR_TYPE_PROTOCOL;
+
+	return netconf_rpc_error(message, tag, type, RPC_ERROR_SEVERITY_ERROR, NULL);
+}
+
+int push_establish(node_t *operation, uint32_t session_id, uint32_t *id, char **error)
+{
+	node_t *n_datastore = roxml_get_chld(operation, "datastore", 0);
+	node_t *n_xpath = roxml_get_chld(operation, "datastore-xpath-filter", 0);
+	node_t *n_subtree = roxml_get_chld(operation, "datastore-subtree-filter", 0);
+	node_t *n_change = roxml_get_chld(operation, "on-change", 0);
+	node_t *n_dampening = n_change ? roxml_get_chld(n_change, "dampening-period", 0) : NULL;
+	node_t *n_sync = n_change ? roxml_get_chld(n_change, "sync-on-start", 0) : NULL;
+	char *datastore, *value, *end, *local;
+	unsigned long dampening = 0;
+	push_subscription_t *s;
+
+	*error = NULL;
+
+	if (!session_id)
+	{
+		*error = push_error("subscription needs a session", RPC_ERROR_TAG_OPERATION_FAILED);
+		return -1;
+	}
+
+	if (!n_datastore || !n_change)
+	{
+		*error = push_error("only on-change subscriptions to a datastore are supported", RPC_ERROR_TAG_OPERATION_NOT_SUPPORTED);
+		return -1;
+	}
+
+	// one datastore has both configuration and state
+	datastore = roxml_get_content(n_datastore, NULL, 0, NULL);
+	local = datastore ? strrchr(datastore, ':') : NULL;
+	local = local ? local + 1 : datastore;
+
+	if (!local || (strcmp(local, "running") && strcmp(local, "operational")))
+	{
+		*error = push_error("no such datastore", RPC_ERROR_TAG_INVALID_VALUE);
+		return -1;
+	}
+
+	if (n_xpath && n_subtree)
+	{
+		*error = push_error("only one selection filter is allowed", RPC_ERROR_TAG_INVALID_VALUE);
+		return -1;
+	}
+
+	if (n_dampening)
+	{
+		value = roxml_get_content(n_dampening, NULL, 0, NULL);
+		dampening = value ? strtoul(value, &end, 10) : 0;
+
+		// centiseconds
+		if (!value || *end || end == value || dampening > UINT32_MAX / 10)
+		{
+			*error = push_error("invalid dampening-period", RPC_ERROR_TAG_INVALID_VALUE);
+			return -1;
+		}
+	}
+
+	if (!(s = calloc(1, sizeof(*s))))
+		goto error;
+
+	INIT_LIST_HEAD(&s->list);
+
+	if (n_xpath)
+	{
+		value = roxml_get_content(n_xpath, NULL, 0, NULL);
+
+		if (!value || !(s->xpath = xpath_compile(value)))
+		{
+			push_free(s);
+			*error = push_error("invalid xpath expression", RPC_ERROR_TAG_INVALID_VALUE);
+			return -1;
+		}
+	}
+
+	if (n_subtree && (!(s->filter = filter_compile_event(n_subtree)) ||
+					  roxml_commit_changes(n_subtree, NULL, &s->subtree, 0) <= 0))
+		goto error;
+
+	value = n_sync ? roxml_get_content(n_sync, NULL, 0, NULL) : NULL;
+
+	s->sync = !value || strcmp(value, "false");
+	s->dampening = dampening * 10;
+	s->session_id = session_id;
+	s->timer.cb = push_timer_cb;
+
+	if (!++subscription_id)
+		++subscription_id;
+
+	s->id = *id = subscription_id;
+	list_add_tail(&s->list, &subscriptions);
+
+	DEBUG("session %" PRIu32 " established subscription %" PRIu32 "\n", session_id, s->id);
+
+	// tracking starts and push-update goes once the reply is out
+	uloop_timeout_set(&flush_timer, 0);
+
+	return 0;
+
+error:
+	*error = push_error("unable to establish subscription", RPC_ERROR_TAG_OPERATION_FAILED);
+
+	if (s)
+		push_free(s);
+
+	return -1;
+}
+
+static push_subscription_t *push_find(uint32_t id)
+{
+	push_subscription_t *s;
+
+	list_for_each_entry(s, &subscriptions, list)
+	{
+		if (s->id == id)
+			return s;
+	}
+
+	return NULL;
+}
+
+int push_delete(uint32_t id, uint32_t session_id)
+{
+	push_subscription_t *s = push_find(id);
+
+	if (!s || s->session_id != session_id)
+		return -1;
+
+	DEBUG("session %" PRIu32 " deleted subscription %" PRIu32 "\n", session_id, id);
+
+	push_free(s);
+	push_untrack();
+
+	return 0;
+}
+
+bool push_subscribed(uint32_t session_id)
+{
+	push_subscription_t *s;
+
+	list_for_each_entry(s, &subscriptions, list)
+	{
+		if (s->session_id == session_id)
+			return true;
+	}
+
+	return false;
+}
+
+void push_closed(uint32_t session_id)
+{
+	push_subscription_t *s, *tmp;
+
+	list_for_each_entry_safe(s, tmp, &subscriptions, list)
+	{
+		if (s->session_id == session_id)
+			push_free(s);
+	}
+
+	push_untrack();
+}
+
+void push_terminate(void)
+{
+	push_subscription_t *s, *tmp;
+
+	list_for_each_entry_safe(s, tmp, &subscriptions, list)
+	{
+		push_terminated(s);
+		push_free(s);
+	}
+
+	push_untrack();
+}
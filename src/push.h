@@ -0,0 +1,82 @@
+/*
+ * Copyright (C) 2014 Sartura, Ltd.
+ * Copyright (C) 2014 Cisco Systems, Inc.
+ *
+ * Author: Luka Perkov <luka.perkov@sartura.hr>
+ * Author: Petar Koretic <petar.koretic@sartura.hr>
+ *
+ * freenetconfd is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with freenetconfd. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef __FREENETCONFD_PUSH_H__
+#define __FREENETCONFD_PUSH_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <roxml.h>
+
+/* RFC: https://tools.ietf.org/html/rfc8639 and https://tools.ietf.org/html/rfc8641 */
+#define PUSH_SUBSCRIBED_NS "urn:ietf:params:xml:ns:yang:ietf-subscribed-notifications"
+#define PUSH_NS "urn:ietf:params:xml:ns:yang:ietf-yang-push"
+
+/*
+ * YANG-push on-change subscriptions. Changes of module datastores are
+ * tracked while there are subscriptions, see ds_track(). Once changes are
+ * noticed, push_dampening ms pass before they are taken at once and sent
+ * as yang-patch edits to the subscriptions selecting them, each edit
+ * serialized once for all of them. Every process tracks its own datastore,
+ * replicas the snapshots they get.
+ */
+
+int push_init(void);
+void push_exit(void);
+
+/**
+ * push_establish() - establish-subscription of session
+ *
+ * Only on-change subscriptions to datastore nodes are supported, with an
+ * xpath or subtree selection filter. With sync-on-start, which is the
+ * default, a push-update with all selected data follows the reply.
+ *
+ * @operation:	establish-subscription node
+ * @id:		set to id of the subscription
+ * @error:	set to rpc-error content on error
+ *
+ * Return: 0 on success, -1 on error
+ */
+int push_establish(node_t *operation, uint32_t session_id, uint32_t *id, char **error);
+
+/**
+ * push_delete() - ends subscription with id
+ *
+ * @session_id:	session the subscription has to belong to
+ *
+ * Return: 0 on success, -1 if session has no such subscription
+ */
+int push_delete(uint32_t id, uint32_t session_id);
+
+/**
+ * push_subscribed() - checks whether session has subscriptions
+ */
+bool push_subscribed(uint32_t session_id);
+
+/**
+ * push_closed() - drops subscriptions of session that went away
+ */
+void push_closed(uint32_t session_id);
+
+/**
+ * push_terminate() - ends all subscriptions, subscribers are sent
+ * subscription-terminated
+ */
+void push_terminate(void);
+
+#endif /* __FREENETCONFD_PUSH_H__ */
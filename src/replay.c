@@ -0,0 +1,355 @@
+/*
+ * Copyright (C) 2014 Sartura, Ltd.
+ * Copyright (C) 2014 Cisco Systems, Inc.
+ *
+ * Author: Luka Perkov <luka.perkov@sartura.hr>
+ * Author: Petar Koretic <petar.koretic@sartura.hr>
+ *
+ * freenetconfd is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with freenetconfd. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "freenetconfd/freenetconfd.h"
+
+#include "replay.h"
+#include "config.h"
+
+#define REPLAY_MAGIC 0x79616c7072646e66ULL // "fndrplay"
+#define REPLAY_VERSION 1
+#define REPLAY_INDEX 1024
+#define REPLAY_ALIGN 8
+#define REPLAY_MIN (REPLAY_INDEX * 64)
+
+struct replay_index
+{
+	uint64_t time;
+	uint64_t pos;
+};
+
+struct replay_header
+{
+	uint64_t magic;
+	uint32_t version;
+	uint32_t index_count;
+	uint64_t size; // bytes of records after the header
+	uint64_t head; // position of the oldest record
+	uint64_t tail; // position after the newest record
+	uint64_t last; // time of the newest record
+	struct replay_index index[REPLAY_INDEX]; // first record of each segment
+};
+
+struct replay_record
+{
+	uint64_t time; // never older than the record before it
+	uint32_t len; // 0 pads the rest of the ring
+	uint16_t stream_len;
+	uint16_t reserved;
+	char data[]; // stream name, then framed message
+};
+
+static struct replay_header *header = NULL;
+static char *records = NULL;
+static size_t map_len = 0;
+static uint64_t segment = 0; // bytes per index entry
+static int log_fd = -1;
+
+static uint64_t replay_record_size(size_t stream_len, size_t len)
+{
+	uint64_t size = sizeof(struct replay_record) + stream_len + len;
+
+	return (size + REPLAY_ALIGN - 1) & ~(uint64_t) (REPLAY_ALIGN - 1);
+}
+
+static struct replay_record *replay_record(uint64_t pos)
+{
+	return (struct replay_record *) (records + pos % header->size);
+}
+
+/*
+ * replay_next() - position after record at pos
+ *
+ * Record that would not fit before the end of the ring starts the next lap,
+ * padding at pos ends the lap.
+ */
+static uint64_t replay_next(uint64_t pos)
+{
+	uint64_t room = header->size - pos % header->size;
+	struct replay_record *r = replay_record(pos);
+
+	if (room < sizeof(*r) || !r->len)
+		return pos + room;
+
+	return pos + replay_record_size(r->stream_len, r->len);
+}
+
+/*
+ * replay_check() - checks that mapped log is one of ours and of size bytes
+ */
+static int replay_check(uint64_t size)
+{
+	return header->magic == REPLAY_MAGIC && header->version == REPLAY_VERSION &&
+		   header->index_count == REPLAY_INDEX && header->size == size &&
+		   header->head <= header->tail && header->tail - header->head <= size;
+}
+
+int replay_init(void)
+{
+	uint64_t size = config.replay_size / (REPLAY_INDEX * REPLAY_ALIGN) * (REPLAY_INDEX * REPLAY_ALIGN);
+	struct stat st;
+	void *map;
+	int rc = 0;
+
+	if (!config.replay_log)
+		return 0;
+
+	if (size < REPLAY_MIN)
+		size = REPLAY_MIN;
+
+	map_len = sizeof(*header) + size;
+	log_fd = open(config.replay_log, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+
+	// daemon being replaced may still write to it
+	if (log_fd < 0 || flock(log_fd, LOCK_EX) || fstat(log_fd, &st))
+		goto error;
+
+	// blocks are allocated up front, a full disk can't fault a write later
+	if ((size_t) st.st_size != map_len)
+	{
+		if (ftruncate(log_fd, 0) || (rc = posix_fallocate(log_fd, 0, map_len)))
+		{
+			errno = rc ? rc : errno;
+			goto error;
+		}
+	}
+
+	map = mmap(NULL, map_len, PROT_READ | PROT_WRITE, MAP_SHARED, log_fd, 0);
+
+	if (map == MAP_FAILED)
+		goto error;
+
+	header = map;
+	records = (char *) map + sizeof(*header);
+	segment = size / REPLAY_INDEX;
+
+	if (!replay_check(size))
+	{
+		LOG("starting new replay log %s\n", config.replay_log);
+
+		memset(header, 0, sizeof(*header));
+		header->magic = REPLAY_MAGIC;
+		header->version = REPLAY_VERSION;
+		header->index_count = REPLAY_INDEX;
+		header->size = size;
+	}
+
+	flock(log_fd, LOCK_UN);
+
+	return 0;
+
+error:
+	ERROR("unable to open replay log %s: %s\n", config.replay_log, strerror(errno));
+
+	if (log_fd >= 0)
+		close(log_fd);
+
+	log_fd = -1;
+
+	return -1;
+}
+
+void replay_exit(void)
+{
+	if (header)
+		munmap(header, map_len);
+
+	if (log_fd >= 0)
+		close(log_fd);
+
+	header = NULL;
+	records = NULL;
+	log_fd = -1;
+}
+
+bool replay_enabled(void)
+{
+	return header;
+}
+
+int replay_append(uint64_t time, const char *stream, const char *data, size_t len)
+{
+	size_t stream_len = strlen(stream);
+	uint64_t need = replay_record_size(stream_len, len), head, tail, room, pos;
+	struct replay_record *r;
+	struct replay_index *i;
+
+	if (!header)
+		return 0;
+
+	// one notification may not push out most of the log
+	if (!len || len > UINT32_MAX || stream_len > UINT16_MAX || need > header->size / 4)
+		return -1;
+
+	if (flock(log_fd, LOCK_EX))
+		return -1;
+
+	head = header->head;
+	tail = header->tail;
+	room = header->size - tail % header->size;
+	pos = room < need ? tail + room : tail;
+
+	while (pos + need - head > header->size)
+		head = replay_next(head);
+
+	// readers see records dropped before they are overwritten
+	__atomic_store_n(&header->head, head, __ATOMIC_SEQ_CST);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+	if (pos != tail && room >= sizeof(*r))
+		replay_record(tail)->len = 0;
+
+	if (time < header->last)
+		time = header->last;
+
+	r = replay_record(pos);
+	r->time = time;
+	r->len = len;
+	r->stream_len = stream_len;
+	r->reserved = 0;
+	memcpy(r->data, stream, stream_len);
+	memcpy(r->data + stream_len, data, len);
+
+	// first record to start in a segment on this lap indexes it
+	i = &header->index[pos % header->size / segment];
+
+	if (i->pos / segment != pos / segment)
+	{
+		__atomic_store_n(&i->pos, pos, __ATOMIC_RELAXED);
+		__atomic_store_n(&i->time, time, __ATOMIC_RELAXED);
+	}
+
+	header->last = time;
+	__atomic_store_n(&header->tail, pos + need, __ATOMIC_RELEASE);
+
+	flock(log_fd, LOCK_UN);
+
+	return 0;
+}
+
+uint64_t replay_end(void)
+{
+	return header ? __atomic_load_n(&header->tail, __ATOMIC_ACQUIRE) : 0;
+}
+
+int replay_get(uint64_t *pos, uint64_t end, struct replay_entry *e)
+{
+	uint64_t head, room, size;
+	struct replay_record *r;
+	uint32_t len;
+	uint16_t stream_len;
+
+	if (!header)
+		return -1;
+
+	head = __atomic_load_n(&header->head, __ATOMIC_ACQUIRE);
+
+	if (*pos < head)
+		*pos = head;
+
+	while (*pos < end)
+	{
+		room = header->size - *pos % header->size;
+		r = replay_record(*pos);
+
+		if (room < sizeof(*r) || !(len = __atomic_load_n(&r->len, __ATOMIC_RELAXED)))
+		{
+			*pos += room;
+			continue;
+		}
+
+		stream_len = __atomic_load_n(&r->stream_len, __ATOMIC_RELAXED);
+		size = replay_record_size(stream_len, len);
+
+		e->pos = *pos;
+		e->time = r->time;
+		e->stream = r->data;
+		e->data = r->data + stream_len;
+
+		// record is being overwritten, replay_valid() fails it
+		if (!stream_len || size > room)
+		{
+			e->next = *pos + room;
+			e->stream_len = 0;
+			e->len = 0;
+		}
+		else
+		{
+			e->next = *pos + size;
+			e->stream_len = stream_len;
+			e->len = len;
+		}
+
+		return 0;
+	}
+
+	return -1;
+}
+
+bool replay_valid(const struct replay_entry *e)
+{
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+	return e->stream_len && e->len && e->pos >= __atomic_load_n(&header->head, __ATOMIC_SEQ_CST);
+}
+
+uint64_t replay_seek(uint64_t time)
+{
+	uint64_t head, tail, pos, best, p;
+	struct replay_entry e;
+
+	if (!header)
+		return 0;
+
+	head = __atomic_load_n(&header->head, __ATOMIC_ACQUIRE);
+	tail = __atomic_load_n(&header->tail, __ATOMIC_ACQUIRE);
+	best = head;
+
+	// newest indexed record before time, records only get newer after it
+	for (unsigned int i = 0; i < REPLAY_INDEX; i++)
+	{
+		p = __atomic_load_n(&header->index[i].pos, __ATOMIC_RELAXED);
+
+		if (p > best && p < tail && __atomic_load_n(&header->index[i].time, __ATOMIC_RELAXED) < time)
+			best = p;
+	}
+
+	// index entry being rewritten may pair a position with an older time
+	pos = best;
+
+	if (best != head && (replay_get(&pos, tail, &e) || e.pos != best || e.time >= time || !replay_valid(&e)))
+		pos = head;
+
+	while (!replay_get(&pos, tail, &e))
+	{
+		if (e.time >= time && replay_valid(&e))
+			break;
+
+		pos = e.next;
+	}
+
+	return pos;
+}
@@ -0,0 +1,88 @@
+/*
+ * Copyright (C) 2014 Sartura, Ltd.
+ * Copyright (C) 2014 Cisco Systems, Inc.
+ *
+ * Author: Luka Perkov <luka.perkov@sartura.hr>
+ * Author: Petar Koretic <petar.koretic@sartura.hr>
+ *
+ * freenetconfd is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with freenetconfd. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef __FREENETCONFD_REPLAY_H__
+#define __FREENETCONFD_REPLAY_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Notifications kept for replay, in a file the writer and its replicas map.
+ * Framed messages are stored as they were sent, in a ring of replay_size
+ * bytes that drops the oldest first. Positions count every byte ever
+ * written, so a position alone tells whether its record was dropped. A
+ * sparse index holds the time of the first record in each of REPLAY_INDEX
+ * segments of the ring, replays start near their time without a scan.
+ */
+struct replay_entry
+{
+	uint64_t pos;
+	uint64_t next; // position of the record after it
+	uint64_t time; // µs since the epoch
+	const char *stream; // not terminated
+	size_t stream_len;
+	const char *data; // framed message
+	size_t len;
+};
+
+/**
+ * replay_init() - maps the log, creates it if it is missing or was made
+ * for another replay_size
+ *
+ * Return: 0 on success or without a log configured, -1 on error
+ */
+int replay_init(void);
+void replay_exit(void);
+
+bool replay_enabled(void);
+
+/**
+ * replay_append() - stores notification, only the writer does
+ *
+ * Return: 0 on success or without a log, -1 if it was not stored
+ */
+int replay_append(uint64_t time, const char *stream, const char *data, size_t len);
+
+/**
+ * replay_end() - position the next record is stored at
+ */
+uint64_t replay_end(void);
+
+/**
+ * replay_seek() - position of the first record at or after time
+ */
+uint64_t replay_seek(uint64_t time);
+
+/**
+ * replay_get() - gets record at or after *pos, before end
+ *
+ * @pos:	moved to the oldest record if its record was dropped
+ * @e:	points into the log, copy it and check it with replay_valid(),
+ *	continue from e->next either way
+ *
+ * Return: 0 on success, -1 if there are no more records
+ */
+int replay_get(uint64_t *pos, uint64_t end, struct replay_entry *e);
+
+/**
+ * replay_valid() - checks that record was not overwritten while copied
+ */
+bool replay_valid(const struct replay_entry *e);
+
+#endif /* __FREENETCONFD_REPLAY_H__ */
@@ -0,0 +1,566 @@
+/*
+ * Copyright (C) 2014 Sartura, Ltd.
+ * Copyright (C) 2014 Cisco Systems, Inc.
+ *
+ * Author: Luka Perkov <luka.perkov@sartura.hr>
+ * Author: Petar Koretic <petar.koretic@sartura.hr>
+ *
+ * freenetconfd is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with freenetconfd. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+
+#include <libubox/uloop.h>
+
+#include "freenetconfd/freenetconfd.h"
+
+#include "config.h"
+#include "connection.h"
+#include "replicas.h"
+#include "snapshot.h"
+
+/* writer retries publishing while a write is in progress */
+#define REPLICAS_RETRY_MS 10
+#define REPLICAS_RESTART_MS 1000
+
+static void replicas_started_cb(struct uloop_fd *fd, unsigned int events);
+static void replicas_snapshot_cb(struct uloop_fd *fd, unsigned int events);
+static void replicas_refresh_cb(struct uloop_timeout *t);
+static void replicas_restart_cb(struct uloop_timeout *t);
+
+struct replica
+{
+	int snapshot_fd; // writer's end of snapshot socket, -1 if not running
+	bool starting; // launcher was asked to start it
+};
+
+/* writer */
+static struct replica *replicas = NULL;
+static struct uloop_fd launcher = { .cb = replicas_started_cb, .fd = -1 };
+static struct uloop_timeout refresh = { .cb = replicas_refresh_cb };
+static struct uloop_timeout restart = { .cb = replicas_restart_cb };
+static pid_t launcher_pid = -1;
+static bool draining = false;
+
+/* replica */
+static struct uloop_fd snapshot = { .cb = replicas_snapshot_cb, .fd = -1 };
+static int snapshot_pending = -1; // received and not applied yet
+static bool snapshot_scheduled = false;
+static bool listening = false;
+
+static int replicas_send(int sock, const void *data, size_t len, int *fds, int fds_count)
+{
+	char control[CMSG_SPACE(2 * sizeof(int))];
+	struct iovec iov = { .iov_base = (void *) data, .iov_len = len };
+	struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1 };
+	struct cmsghdr *cmsg;
+
+	if (fds_count)
+	{
+		memset(control, 0, sizeof(control));
+		msg.msg_control = control;
+		msg.msg_controllen = CMSG_SPACE(fds_count * sizeof(int));
+
+		cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(fds_count * sizeof(int));
+		memcpy(CMSG_DATA(cmsg), fds, fds_count * sizeof(int));
+	}
+
+	return sendmsg(sock, &msg, MSG_DONTWAIT | MSG_NOSIGNAL) == (ssize_t) len ? 0 : -1;
+}
+
+/*
+ * replicas_receive() - receives message with up to two descriptors
+ *
+ * Return: length of message, 0 on end of file, -1 on error
+ */
+static ssize_t replicas_receive(int sock, void *data, size_t len, int *fds, int *fds_count, int flags)
+{
+	char control[CMSG_SPACE(2 * sizeof(int))];
+	struct iovec iov = { .iov_base = data, .iov_len = len };
+	struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1, .msg_control = control, .msg_controllen = sizeof(control) };
+	struct cmsghdr *cmsg;
+	ssize_t rc;
+
+	*fds_count = 0;
+
+	do
+		rc = recvmsg(sock, &msg, flags | MSG_CMSG_CLOEXEC);
+	while (rc < 0 && errno == EINTR);
+
+	if (rc < 0)
+		return -1;
+
+	for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg))
+	{
+		if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+			continue;
+
+		*fds_count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		memcpy(fds, CMSG_DATA(cmsg), *fds_count * sizeof(int));
+	}
+
+	return rc;
+}
+
+static void replicas_apply(void)
+{
+	struct stat st;
+	void *map;
+	int fd = snapshot_pending;
+
+	snapshot_scheduled = false;
+	snapshot_pending = -1;
+
+	if (fd < 0)
+		return;
+
+	if (fstat(fd, &st) || !st.st_size)
+	{
+		ERROR("unable to read datastore snapshot\n");
+		close(fd);
+		return;
+	}
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+
+	if (map == MAP_FAILED)
+	{
+		ERROR("unable to map datastore snapshot\n");
+		return;
+	}
+
+	if (!snapshot_apply(map, st.st_size))
+		DEBUG("datastore snapshot of %zu bytes applied\n", (size_t) st.st_size);
+
+	munmap(map, st.st_size);
+
+	// sessions never see the datastore as it was before the first snapshot
+	if (!listening && !connection_retiring())
+	{
+		if (server_init())
+		{
+			ERROR("replica unable to accept connections\n");
+			uloop_end();
+			return;
+		}
+
+		listening = true;
+		LOG("replica is accepting connections\n");
+	}
+}
+
+void replicas_sync(void)
+{
+	char byte;
+	int fds[2], fds_count;
+
+	if (snapshot.fd < 0)
+		return;
+
+	// only the latest snapshot matters
+	while (replicas_receive(snapshot.fd, &byte, sizeof(byte), fds, &fds_count, MSG_DONTWAIT) > 0)
+	{
+		for (int i = 0; i < fds_count; i++)
+		{
+			if (snapshot_pending >= 0)
+				close(snapshot_pending);
+
+			snapshot_pending = fds[i];
+		}
+	}
+
+	if (snapshot_pending >= 0 && !snapshot_scheduled)
+	{
+		snapshot_scheduled = true;
+		connection_exclusive(replicas_apply);
+	}
+}
+
+static void replicas_snapshot_cb(struct uloop_fd *fd, unsigned int events)
+{
+	replicas_sync();
+}
+
+/*
+ * replicas_start() - turns freshly forked process into a replica
+ */
+static int replicas_start(uint32_t id, int rpc_fd, int snapshot_fd)
+{
+	// launcher goes away with the writer, so does the replica
+	prctl(PR_SET_PDEATHSIG, SIGTERM);
+	signal(SIGCHLD, SIG_DFL);
+
+	if (uloop_init() || connection_upstream(rpc_fd))
+	{
+		ERROR("unable to start replica %" PRIu32 "\n", id);
+		_exit(EXIT_FAILURE);
+	}
+
+	connection_id_space(id + 1, config.replicas + 1);
+
+	snapshot.fd = snapshot_fd;
+	uloop_fd_add(&snapshot, ULOOP_READ);
+
+	LOG("replica %" PRIu32 " started\n", id);
+
+	return 0;
+}
+
+/*
+ * replicas_launcher() - forks replicas when the writer asks for them
+ *
+ * Return: 0 in a new replica, launcher itself never returns
+ */
+static int replicas_launcher(int sock, pid_t writer)
+{
+	int rpc[2], snap[2], fds[2];
+	uint32_t id;
+	ssize_t len;
+	pid_t pid;
+
+	// nothing from the writer's loop is ours
+	uloop_done();
+	server_exit();
+
+	prctl(PR_SET_PDEATHSIG, SIGTERM);
+
+	// replicas join the group, replicas_drain() signals all of them
+	setpgid(0, 0);
+
+	if (getppid() != writer)
+		_exit(EXIT_SUCCESS);
+
+	// exited replicas are reaped by the kernel
+	signal(SIGCHLD, SIG_IGN);
+
+	while (1)
+	{
+		len = read(sock, &id, sizeof(id));
+
+		if (len < 0 && errno == EINTR)
+			continue;
+
+		// writer is gone
+		if (len != sizeof(id))
+			_exit(EXIT_SUCCESS);
+
+		if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, rpc))
+		{
+			replicas_send(sock, &id, sizeof(id), NULL, 0);
+			continue;
+		}
+
+		if (socketpair(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0, snap))
+		{
+			close(rpc[0]);
+			close(rpc[1]);
+			replicas_send(sock, &id, sizeof(id), NULL, 0);
+			continue;
+		}
+
+		pid = fork();
+
+		if (!pid)
+		{
+			close(sock);
+			close(rpc[0]);
+			close(snap[0]);
+
+			return replicas_start(id, rpc[1], snap[1]);
+		}
+
+		fds[0] = rpc[0];
+		fds[1] = snap[0];
+
+		// writer learns about a failed fork from missing descriptors
+		replicas_send(sock, &id, sizeof(id), fds, pid > 0 ? 2 : 0);
+
+		close(rpc[0]);
+		close(rpc[1]);
+		close(snap[0]);
+		close(snap[1]);
+	}
+}
+
+static void replicas_request(uint32_t id)
+{
+	if (write(launcher.fd, &id, sizeof(id)) != sizeof(id))
+	{
+		ERROR("unable to request replica %" PRIu32 "\n", id);
+		uloop_timeout_set(&restart, REPLICAS_RESTART_MS);
+		return;
+	}
+
+	replicas[id].starting = true;
+}
+
+static void replicas_started_cb(struct uloop_fd *fd, unsigned int events)
+{
+	uint32_t id;
+	int fds[2], fds_count;
+	ssize_t len;
+
+	len = replicas_receive(fd->fd, &id, sizeof(id), fds, &fds_count, MSG_DONTWAIT);
+
+	if (len < 0 && errno == EAGAIN)
+		return;
+
+	if (len <= 0)
+	{
+		if (!draining)
+			ERROR("replica launcher exited\n");
+
+		uloop_fd_delete(fd);
+		close(fd->fd);
+		fd->fd = -1;
+		return;
+	}
+
+	if (len != sizeof(id) || id >= config.replicas || fds_count != 2)
+	{
+		for (int i = 0; i < fds_count; i++)
+			close(fds[i]);
+
+		if (len == sizeof(id) && id < config.replicas)
+		{
+			ERROR("unable to start replica %" PRIu32 "\n", id);
+			replicas[id].starting = false;
+			uloop_timeout_set(&restart, REPLICAS_RESTART_MS);
+		}
+
+		return;
+	}
+
+	replicas[id].starting = false;
+
+	if (connection_adopt(fds[0], id))
+	{
+		ERROR("unable to connect replica %" PRIu32 "\n", id);
+		close(fds[0]);
+		close(fds[1]);
+		uloop_timeout_set(&restart, REPLICAS_RESTART_MS);
+		return;
+	}
+
+	replicas[id].snapshot_fd = fds[1];
+
+	DEBUG("replica %" PRIu32 " connected\n", id);
+
+	// it starts with the datastore as of modules_init()
+	replicas_publish();
+}
+
+void replicas_lost(int id)
+{
+	if (!replicas || id < 0 || (unsigned int) id >= config.replicas)
+		return;
+
+	if (replicas[id].snapshot_fd >= 0)
+		close(replicas[id].snapshot_fd);
+
+	replicas[id].snapshot_fd = -1;
+
+	if (draining)
+		return;
+
+	LOG("replica %d exited, restarting it\n", id);
+
+	uloop_timeout_set(&restart, REPLICAS_RESTART_MS);
+}
+
+static void replicas_restart_cb(struct uloop_timeout *t)
+{
+	if (launcher.fd < 0)
+		return;
+
+	for (uint32_t id = 0; id < config.replicas; id++)
+	{
+		if (replicas[id].snapshot_fd < 0 && !replicas[id].starting)
+			replicas_request(id);
+	}
+}
+
+void replicas_publish(void)
+{
+	char *buf = NULL;
+	size_t len;
+	int fd = -1;
+
+	if (!replicas)
+		return;
+
+	uloop_timeout_cancel(&refresh);
+
+	if (connection_writing())
+	{
+		uloop_timeout_set(&refresh, REPLICAS_RETRY_MS);
+		return;
+	}
+
+	if (snapshot_create(&buf, &len))
+		goto exit;
+
+	// sealed, so replicas may map it without copying
+	fd = memfd_create("freenetconfd-snapshot", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+
+	if (fd < 0 || ftruncate(fd, len) || pwrite(fd, buf, len, 0) != (ssize_t) len ||
+		fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL))
+	{
+		ERROR("unable to publish datastore snapshot\n");
+		goto exit;
+	}
+
+	for (uint32_t id = 0; id < config.replicas; id++)
+	{
+		if (replicas[id].snapshot_fd < 0)
+			continue;
+
+		// a replica this far behind catches up with the next one
+		if (replicas_send(replicas[id].snapshot_fd, "", 1, &fd, 1))
+			DEBUG("replica %" PRIu32 " missed datastore snapshot\n", id);
+	}
+
+	DEBUG("datastore snapshot of %zu bytes published\n", len);
+
+exit:
+	if (fd >= 0)
+		close(fd);
+
+	free(buf);
+
+	if (config.replica_refresh)
+		uloop_timeout_set(&refresh, config.replica_refresh);
+}
+
+static void replicas_refresh_cb(struct uloop_timeout *t)
+{
+	replicas_publish();
+}
+
+int replicas_init(void)
+{
+	int sv[2];
+	pid_t pid, writer = getpid();
+
+	if (!config.replicas)
+		return 0;
+
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv))
+		return -1;
+
+	pid = fork();
+
+	if (pid < 0)
+	{
+		close(sv[0]);
+		close(sv[1]);
+		return -1;
+	}
+
+	if (!pid)
+	{
+		close(sv[0]);
+
+		return replicas_launcher(sv[1], writer);
+	}
+
+	close(sv[1]);
+
+	launcher_pid = pid;
+	setpgid(pid, pid);
+
+	// replicas hand out session-ids of their own
+	connection_id_space(0, config.replicas + 1);
+
+	replicas = calloc(config.replicas, sizeof(*replicas));
+
+	if (!replicas)
+	{
+		close(sv[0]);
+		return -1;
+	}
+
+	launcher.fd = sv[0];
+	uloop_fd_add(&launcher, ULOOP_READ);
+
+	for (uint32_t id = 0; id < config.replicas; id++)
+	{
+		replicas[id].snapshot_fd = -1;
+		replicas_request(id);
+	}
+
+	return 0;
+}
+
+void replicas_drain(void)
+{
+	if (!replicas || draining)
+		return;
+
+	draining = true;
+	uloop_timeout_cancel(&restart);
+
+	// launcher dies, replicas drain their sessions like the writer does
+	if (launcher_pid > 0)
+		kill(-launcher_pid, SIGTERM);
+}
+
+void replicas_exit(void)
+{
+	uloop_timeout_cancel(&refresh);
+	uloop_timeout_cancel(&restart);
+
+	// launcher exits on end of file, replicas follow it
+	if (launcher.fd >= 0)
+	{
+		uloop_fd_delete(&launcher);
+		close(launcher.fd);
+		launcher.fd = -1;
+	}
+
+	if (replicas)
+	{
+		for (uint32_t id = 0; id < config.replicas; id++)
+		{
+			if (replicas[id].snapshot_fd >= 0)
+				close(replicas[id].snapshot_fd);
+		}
+
+		free(replicas);
+		replicas = NULL;
+	}
+
+	if (snapshot.fd >= 0)
+	{
+		uloop_fd_delete(&snapshot);
+		close(snapshot.fd);
+		snapshot.fd = -1;
+	}
+
+	if (snapshot_pending >= 0)
+		close(snapshot_pending);
+
+	snapshot_pending = -1;
+}
@@ -0,0 +1,66 @@
+/*
+ * Copyright (C) 2014 Sartura, Ltd.
+ * Copyright (C) 2014 Cisco Systems, Inc.
+ *
+ * Author: Luka Perkov <luka.perkov@sartura.hr>
+ * Author: Petar Koretic <petar.koretic@sartura.hr>
+ *
+ * freenetconfd is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with freenetconfd. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __FREENETCONFD_REPLICAS_H__
+#define __FREENETCONFD_REPLICAS_H__
+
+/**
+ * replicas_init() - starts read-only replica processes
+ *
+ * Replicas are forked by a launcher process forked here, so they start
+ * from the state after modules_init() no matter when they are restarted.
+ * Every replica listens on its own socket bound to the same address and
+ * serves rpcs from snapshots of the datastore published by this process,
+ * the writer. Rpcs that may change the datastore are forwarded to the
+ * writer over a connection per replica.
+ *
+ * Returns in the writer and, once more, in every replica started later.
+ *
+ * Return: 0 on success, -1 on error
+ */
+int replicas_init(void);
+void replicas_exit(void);
+
+/**
+ * replicas_drain() - asks replicas to drain their sessions and exit
+ *
+ * Replicas are not restarted anymore. Their connections to the writer
+ * close once they are done.
+ */
+void replicas_drain(void);
+
+/**
+ * replicas_publish() - sends snapshot of the datastore to all replicas
+ *
+ * Postponed while a write is in progress, so replicas never see one half
+ * applied.
+ */
+void replicas_publish(void);
+
+/**
+ * replicas_lost() - restarts replica whose connection to the writer closed
+ */
+void replicas_lost(int id);
+
+/**
+ * replicas_sync() - applies snapshots that arrived to the replica
+ *
+ * Snapshot is applied once no rpc touching the datastore is in progress,
+ * see connection_exclusive().
+ */
+void replicas_sync(void);
+
+#endif /* __FREENETCONFD_REPLICAS_H__ */
@@ -0,0 +1,290 @@
+/*
+ * Copyright (C) 2014 Sartura, Ltd.
+ * Copyright (C) 2014 Cisco Systems, Inc.
+ *
+ * Author: Luka Perkov <luka.perkov@sartura.hr>
+ * Author: Petar Koretic <petar.koretic@sartura.hr>
+ *
+ * freenetconfd is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with freenetconfd. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <sys/socket.h>
+
+#include <libubox/uloop.h>
+
+#include "freenetconfd/freenetconfd.h"
+
+#include "connection.h"
+#include "replicas.h"
+#include "restart.h"
+
+/* descriptor of the socket to the old daemon, set for the upgraded one */
+#define RESTART_ENV "FREENETCONFD_HANDOFF"
+
+static void restart_signal_cb(struct uloop_fd *fd, unsigned int events);
+static void restart_peer_cb(struct uloop_fd *fd, unsigned int events);
+
+static char *restart_path = NULL;
+static char **restart_argv = NULL;
+static pid_t restart_pid;
+static int restart_pipe[2] = { -1, -1 };
+static struct uloop_fd restart_signal = { .cb = restart_signal_cb, .fd = -1 };
+
+/* old daemon's end, until the upgraded one is ready */
+static struct uloop_fd restart_peer = { .cb = restart_peer_cb, .fd = -1 };
+
+/* upgraded daemon's end */
+static int restart_handoff = -1;
+
+static void restart_signal_handler(int signo)
+{
+	int saved = errno;
+	char byte = signo;
+
+	// handled in uloop, see restart_signal_cb()
+	if (write(restart_pipe[1], &byte, sizeof(byte)) < 0)
+		DEBUG("signal %d lost\n", signo);
+
+	errno = saved;
+}
+
+static void restart_drain(void)
+{
+	if (connection_retiring())
+		return;
+
+	connection_drain();
+	replicas_drain();
+}
+
+/*
+ * restart_upgrade() - starts the binary this daemon was started from again
+ *
+ * Listening socket is sent to it right away, sessions once it reports that
+ * it is ready, see restart_peer_cb().
+ */
+static void restart_upgrade(void)
+{
+	char env[16];
+	int sv[2];
+	pid_t pid;
+
+	// replicas are restarted by the upgraded writer
+	if (getpid() != restart_pid)
+		return;
+
+	if (restart_peer.fd >= 0 || connection_retiring())
+	{
+		LOG("upgrade already in progress\n");
+		return;
+	}
+
+	if (!restart_path)
+	{
+		ERROR("unable to upgrade, path of the binary is unknown\n");
+		return;
+	}
+
+	if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv))
+	{
+		ERROR("unable to upgrade, no socket for handoff\n");
+		return;
+	}
+
+	// environment is prepared before fork, worker threads may hold malloc locks
+	snprintf(env, sizeof(env), "%d", sv[1]);
+	setenv(RESTART_ENV, env, 1);
+
+	pid = fork();
+
+	if (!pid)
+	{
+		fcntl(sv[1], F_SETFD, 0);
+		execv(restart_path, restart_argv);
+		_exit(127);
+	}
+
+	unsetenv(RESTART_ENV);
+	close(sv[1]);
+
+	if (pid < 0 || connection_handoff_listen(sv[0]))
+	{
+		ERROR("unable to start %s\n", restart_path);
+		close(sv[0]);
+		return;
+	}
+
+	restart_peer.fd = sv[0];
+	uloop_fd_add(&restart_peer, ULOOP_READ | ULOOP_BLOCKING);
+
+	LOG("upgrading, waiting for %s to start\n", restart_path);
+}
+
+static void restart_signal_cb(struct uloop_fd *fd, unsigned int events)
+{
+	char byte;
+
+	while (read(fd->fd, &byte, sizeof(byte)) == sizeof(byte))
+	{
+		if (byte == SIGTERM)
+			restart_drain();
+		else if (byte == SIGUSR2)
+			restart_upgrade();
+	}
+}
+
+static void restart_peer_cb(struct uloop_fd *fd, unsigned int events)
+{
+	char byte;
+	ssize_t len;
+
+	do
+		len = read(fd->fd, &byte, sizeof(byte));
+	while (len < 0 && errno == EINTR);
+
+	uloop_fd_delete(fd);
+
+	// it failed to start, sessions stay here
+	if (len != sizeof(byte) || connection_handoff(fd->fd))
+	{
+		ERROR("upgraded daemon did not start, going on\n");
+		close(fd->fd);
+		fd->fd = -1;
+		return;
+	}
+
+	LOG("upgraded daemon started, retiring\n");
+
+	// connection code owns the socket now
+	fd->fd = -1;
+
+	replicas_drain();
+}
+
+int restart_init(char **argv)
+{
+	char path[PATH_MAX], *env = getenv(RESTART_ENV), *end;
+	ssize_t len;
+	long fd;
+
+	restart_argv = argv;
+	restart_pid = getpid();
+
+	// read now, the file is replaced by the time of the upgrade
+	len = readlink("/proc/self/exe", path, sizeof(path) - 1);
+
+	if (len > 0)
+	{
+		path[len] = '\0';
+		restart_path = strdup(path);
+	}
+
+	if (!env)
+		return server_init();
+
+	unsetenv(RESTART_ENV);
+
+	fd = strtol(env, &end, 10);
+
+	if (*end || fd < 0 || fd > INT_MAX)
+	{
+		ERROR("invalid %s\n", RESTART_ENV);
+		return -1;
+	}
+
+	restart_handoff = fd;
+	fcntl(restart_handoff, F_SETFD, FD_CLOEXEC);
+
+	LOG("taking over from the daemon being upgraded\n");
+
+	return server_takeover(restart_handoff);
+}
+
+int restart_ready(void)
+{
+	struct sigaction sa = { .sa_handler = restart_signal_handler };
+	char byte = 1;
+
+	// every process has its own pipe, replicas drain on their own
+	if (pipe2(restart_pipe, O_CLOEXEC | O_NONBLOCK))
+		return -1;
+
+	restart_signal.fd = restart_pipe[0];
+	uloop_fd_add(&restart_signal, ULOOP_READ);
+
+	// uloop keeps handlers it finds installed
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGTERM, &sa, NULL);
+	sigaction(SIGUSR2, &sa, NULL);
+
+	if (restart_handoff < 0)
+		return 0;
+
+	// replica inherited the socket, only the writer takes sessions over
+	if (getpid() != restart_pid)
+	{
+		close(restart_handoff);
+		restart_handoff = -1;
+		return 0;
+	}
+
+	if (write(restart_handoff, &byte, sizeof(byte)) != sizeof(byte))
+	{
+		ERROR("daemon being upgraded went away\n");
+		close(restart_handoff);
+		restart_handoff = -1;
+		return 0;
+	}
+
+	connection_takeover(restart_handoff);
+	restart_handoff = -1;
+
+	return 0;
+}
+
+void restart_exit(void)
+{
+	if (restart_signal.fd >= 0)
+	{
+		uloop_fd_delete(&restart_signal);
+		restart_signal.fd = -1;
+	}
+
+	for (int i = 0; i < 2; i++)
+	{
+		if (restart_pipe[i] >= 0)
+			close(restart_pipe[i]);
+
+		restart_pipe[i] = -1;
+	}
+
+	if (restart_peer.fd >= 0)
+	{
+		uloop_fd_delete(&restart_peer);
+		close(restart_peer.fd);
+		restart_peer.fd = -1;
+	}
+
+	if (restart_handoff >= 0)
+		close(restart_handoff);
+
+	restart_handoff = -1;
+
+	free(restart_path);
+	restart_path = NULL;
+}
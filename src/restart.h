@@ -0,0 +1,44 @@
+/*
+ * Copyright (C) 2014 Sartura, Ltd.
+ * Copyright (C) 2014 Cisco Systems, Inc.
+ *
+ * Author: Luka Perkov <luka.perkov@sartura.hr>
+ * Author: Petar Koretic <petar.koretic@sartura.hr>
+ *
+ * freenetconfd is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with freenetconfd. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __FREENETCONFD_RESTART_H__
+#define __FREENETCONFD_RESTART_H__
+
+/**
+ * restart_init() - opens listening sockets
+ *
+ * Daemon started by an upgrade takes the sockets over from the old one,
+ * see restart_ready().
+ *
+ * Return: 0 on success, -1 on error
+ */
+int restart_init(char **argv);
+
+/**
+ * restart_ready() - handles SIGTERM and SIGUSR2 from now on
+ *
+ * SIGTERM stops accepting, lets sessions finish their rpcs and exits.
+ * SIGUSR2 executes the binary this daemon was started from, which takes
+ * the listening sockets and sessions over once it is ready, and exits.
+ *
+ * Upgraded daemon tells the old one it is ready here.
+ *
+ * Return: 0 on success, -1 on error
+ */
+int restart_ready(void);
+void restart_exit(void);
+
+#endif /* __FREENETCONFD_RESTART_H__ */
@@ -0,0 +1,366 @@
+/*
+ * Copyright (C) 2014 Sartura, Ltd.
+ * Copyright (C) 2014 Cisco Systems, Inc.
+ *
+ * Author: Luka Perkov <luka.perkov@sartura.hr>
+ * Author: Petar Koretic <petar.koretic@sartura.hr>
+ *
+ * freenetconfd is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with freenetconfd. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "freenetconfd/freenetconfd.h"
+#include "freenetconfd/datastore.h"
+#include "freenetconfd/plugin.h"
+
+#include "modules.h"
+#include "snapshot.h"
+
+/*
+ * Layout, in host byte order since only processes of the same binary read it:
+ *
+ *   u32 magic, u32 module count
+ *   per module: module name, nodes
+ *   nodes: per node u8 1, u8 flags, i32 choice_group, name, value, ns,
+ *          nodes of its children; u8 0 ends the siblings
+ *   strings: u32 length (SNAPSHOT_NULL for NULL), bytes, '\0'
+ */
+#define SNAPSHOT_MAGIC 0x464e4453
+#define SNAPSHOT_NULL UINT32_MAX
+#define SNAPSHOT_MAX_DEPTH 256
+
+#define SNAPSHOT_NODE 1
+#define SNAPSHOT_END 0
+
+#define SNAPSHOT_IS_CONFIG (1<<0)
+#define SNAPSHOT_IS_LIST (1<<1)
+#define SNAPSHOT_IS_KEY (1<<2)
+
+struct snapshot_writer
+{
+	char *data;
+	size_t len;
+	size_t size;
+	int error;
+};
+
+struct snapshot_reader
+{
+	const char *data;
+	size_t left;
+};
+
+static void snapshot_put(struct snapshot_writer *w, const void *data, size_t len)
+{
+	if (w->error)
+		return;
+
+	if (w->len + len > w->size)
+	{
+		size_t size = w->size ? w->size : 4096;
+
+		while (w->len + len > size)
+			size *= 2;
+
+		char *buf = realloc(w->data, size);
+
+		if (!buf)
+		{
+			w->error = 1;
+			return;
+		}
+
+		w->data = buf;
+		w->size = size;
+	}
+
+	memcpy(w->data + w->len, data, len);
+	w->len += len;
+}
+
+static void snapshot_put_u8(struct snapshot_writer *w, uint8_t value)
+{
+	snapshot_put(w, &value, sizeof(value));
+}
+
+static void snapshot_put_str(struct snapshot_writer *w, const char *str)
+{
+	uint32_t len = str ? strlen(str) : SNAPSHOT_NULL;
+
+	snapshot_put(w, &len, sizeof(len));
+
+	if (str)
+		snapshot_put(w, str, len + 1);
+}
+
+/*
+ * snapshot_put_nodes() - adds node, its next siblings and their subtrees
+ */
+static void snapshot_put_nodes(struct snapshot_writer *w, datastore_t *node)
+{
+	for (; node && !w->error; node = node->next)
+	{
+		datastore_t *cur = ds_published(node);
+		int32_t choice_group = cur->choice_group;
+
+		if (cur->update)
+			cur->update(cur);
+
+		// use get() if available
+		char *value = cur->get ? cur->get(cur) : cur->value;
+
+		snapshot_put_u8(w, SNAPSHOT_NODE);
+		snapshot_put_u8(w, (cur->is_config ? SNAPSHOT_IS_CONFIG : 0) |
+						(cur->is_list ? SNAPSHOT_IS_LIST : 0) |
+						(cur->is_key ? SNAPSHOT_IS_KEY : 0));
+		snapshot_put(w, &choice_group, sizeof(choice_group));
+		snapshot_put_str(w, cur->name);
+		snapshot_put_str(w, value);
+		snapshot_put_str(w, cur->ns);
+
+		// free value if returned with get (get always allocates)
+		if (cur->get)
+			free(value);
+
+		snapshot_put_nodes(w, cur->child);
+	}
+
+	snapshot_put_u8(w, SNAPSHOT_END);
+}
+
+int snapshot_create(char **buf, size_t *len)
+{
+	struct snapshot_writer w = { NULL, 0, 0, 0 };
+	struct module_list *elem;
+	uint32_t magic = SNAPSHOT_MAGIC, count = 0;
+	int epoch;
+
+	list_for_each_entry(elem, get_modules(), list)
+		count++;
+
+	snapshot_put(&w, &magic, sizeof(magic));
+	snapshot_put(&w, &count, sizeof(count));
+
+	epoch = ds_read_begin();
+
+	list_for_each_entry(elem, get_modules(), list)
+	{
+		datastore_t *root = elem->m->datastore;
+
+		modules_lock(elem, 0);
+
+		if (root && root->update)
+			root->update(root);
+
+		snapshot_put_str(&w, elem->name);
+		snapshot_put_nodes(&w, root ? root->child : NULL);
+
+		modules_unlock(elem);
+	}
+
+	ds_read_end(epoch);
+
+	if (w.error)
+	{
+		ERROR("not enough memory\n");
+		free(w.data);
+		return -1;
+	}
+
+	*buf = w.data;
+	*len = w.len;
+
+	return 0;
+}
+
+static int snapshot_get(struct snapshot_reader *r, void *data, size_t len)
+{
+	if (r->left < len)
+		return -1;
+
+	memcpy(data, r->data, len);
+	r->data += len;
+	r->left -= len;
+
+	return 0;
+}
+
+/*
+ * snapshot_get_str() - points str to string inside the snapshot
+ */
+static int snapshot_get_str(struct snapshot_reader *r, char **str)
+{
+	uint32_t len;
+
+	if (snapshot_get(r, &len, sizeof(len)))
+		return -1;
+
+	if (len == SNAPSHOT_NULL)
+	{
+		*str = NULL;
+		return 0;
+	}
+
+	if (r->left <= len || r->data[len] != '\0')
+		return -1;
+
+	*str = (char *) r->data;
+	r->data += len + 1;
+	r->left -= len + 1;
+
+	return 0;
+}
+
+/*
+ * snapshot_get_nodes() - reads siblings and their subtrees
+ *
+ * Nodes are only checked if parent is NULL.
+ */
+static int snapshot_get_nodes(struct snapshot_reader *r, datastore_t *parent, unsigned int depth)
+{
+	datastore_t *node = NULL;
+	uint8_t kind, flags;
+	int32_t choice_group;
+	char *name, *value, *ns;
+
+	if (depth > SNAPSHOT_MAX_DEPTH)
+		return -1;
+
+	while (1)
+	{
+		if (snapshot_get(r, &kind, sizeof(kind)))
+			return -1;
+
+		if (kind == SNAPSHOT_END)
+			return 0;
+
+		if (kind != SNAPSHOT_NODE ||
+			snapshot_get(r, &flags, sizeof(flags)) ||
+			snapshot_get(r, &choice_group, sizeof(choice_group)) ||
+			snapshot_get_str(r, &name) || !name ||
+			snapshot_get_str(r, &value) ||
+			snapshot_get_str(r, &ns))
+		{
+			return -1;
+		}
+
+		if (parent)
+		{
+			node = ds_add_child_create(parent, name, value, ns, NULL, 0);
+
+			if (!node)
+			{
+				ERROR("not enough memory\n");
+				return -1;
+			}
+
+			node->is_config = !!(flags & SNAPSHOT_IS_CONFIG);
+			node->is_list = !!(flags & SNAPSHOT_IS_LIST);
+			node->is_key = !!(flags & SNAPSHOT_IS_KEY);
+			node->choice_group = choice_group;
+		}
+
+		if (snapshot_get_nodes(r, node, depth + 1))
+			return -1;
+	}
+}
+
+static int snapshot_get_header(struct snapshot_reader *r, uint32_t *count)
+{
+	uint32_t magic;
+
+	if (snapshot_get(r, &magic, sizeof(magic)) || magic != SNAPSHOT_MAGIC)
+		return -1;
+
+	return snapshot_get(r, count, sizeof(*count));
+}
+
+static struct module_list *snapshot_module(const char *name)
+{
+	struct module_list *elem;
+
+	list_for_each_entry(elem, get_modules(), list)
+	{
+		if (!strcmp(elem->name, name))
+			return elem;
+	}
+
+	return NULL;
+}
+
+int snapshot_apply(const char *buf, size_t len)
+{
+	struct snapshot_reader r = { buf, len };
+	struct module_list *elem;
+	datastore_t *root, *fresh;
+	uint32_t count;
+	char *name;
+	int rc;
+
+	// check everything first, a malformed snapshot changes nothing
+	if (snapshot_get_header(&r, &count))
+		goto malformed;
+
+	for (uint32_t i = 0; i < count; i++)
+	{
+		if (snapshot_get_str(&r, &name) || !name || snapshot_get_nodes(&r, NULL, 0))
+			goto malformed;
+	}
+
+	if (r.left)
+		goto malformed;
+
+	r.data = buf;
+	r.left = len;
+	snapshot_get_header(&r, &count);
+
+	for (uint32_t i = 0; i < count; i++)
+	{
+		snapshot_get_str(&r, &name);
+
+		elem = snapshot_module(name);
+		root = elem ? elem->m->datastore : NULL;
+
+		// module missing here, its part is skipped
+		if (!root)
+		{
+			snapshot_get_nodes(&r, NULL, 0);
+			continue;
+		}
+
+		// built aside and swapped in, only what differs counts as changed
+		fresh = ds_create(root->name, NULL, root->ns);
+		rc = fresh ? snapshot_get_nodes(&r, fresh, 0) : -1;
+
+		modules_lock(elem, 1);
+
+		if (!rc)
+			ds_replace_children(root, fresh);
+
+		root->update = NULL;
+		root->get = NULL;
+
+		modules_unlock(elem);
+
+		ds_free(fresh, 0);
+
+		if (rc)
+			return -1;
+	}
+
+	return 0;
+
+malformed:
+	ERROR("malformed datastore snapshot\n");
+
+	return -1;
+}
@@ -0,0 +1,44 @@
+/*
+ * Copyright (C) 2014 Sartura, Ltd.
+ * Copyright (C) 2014 Cisco Systems, Inc.
+ *
+ * Author: Luka Perkov <luka.perkov@sartura.hr>
+ * Author: Petar Koretic <petar.koretic@sartura.hr>
+ *
+ * freenetconfd is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with freenetconfd. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __FREENETCONFD_SNAPSHOT_H__
+#define __FREENETCONFD_SNAPSHOT_H__
+
+#include <stddef.h>
+
+/**
+ * snapshot_create() - serializes datastores of all modules
+ *
+ * State data is read with update() and get() like a get would, so the
+ * snapshot holds plain values only.
+ *
+ * @buf:	malloc'd snapshot
+ *
+ * Return: 0 on success, -1 if out of memory
+ */
+int snapshot_create(char **buf, size_t *len);
+
+/**
+ * snapshot_apply() - replaces datastores of all modules with snapshot
+ *
+ * Snapshot is checked before anything is changed. Nodes created from it
+ * have no callbacks, module roots lose update() and get().
+ *
+ * Return: 0 on success, -1 if snapshot is malformed
+ */
+int snapshot_apply(const char *buf, size_t len);
+
+#endif /* __FREENETCONFD_SNAPSHOT_H__ */
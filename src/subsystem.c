@@ -0,0 +1,121 @@
+/*
+ * Copyright (C) 2014 Sartura, Ltd.
+ * Copyright (C) 2014 Cisco Systems, Inc.
+ *
+ * Author: Luka Perkov <luka.perkov@sartura.hr>
+ * Author: Petar Koretic <petar.koretic@sartura.hr>
+ *
+ * freenetconfd is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with freenetconfd. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/*
+ * freenetconfd-subsystem - netconf subsystem for sshd
+ *
+ *   Subsystem netconf /usr/bin/freenetconfd-subsystem [path]
+ *
+ * Passes ssh channel, its stdin and stdout, to freenetconfd listening on
+ * subsystem socket path, which then reads and writes the channel directly.
+ * Stays around until freenetconfd closes the socket at the end of the
+ * session, sshd stops feeding the channel once its subsystem exits.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "freenetconfd/freenetconfd.h"
+
+#define SUBSYSTEM_PATH "/var/run/freenetconfd-subsystem.sock"
+
+/*
+ * subsystem_same() - checks if stdin and stdout are the same socket
+ */
+static int subsystem_same(void)
+{
+	struct stat in, out;
+
+	if (fstat(STDIN_FILENO, &in) || fstat(STDOUT_FILENO, &out))
+		return 0;
+
+	return in.st_dev == out.st_dev && in.st_ino == out.st_ino;
+}
+
+static int subsystem_send(int fd)
+{
+	int fds[2] = { STDIN_FILENO, STDOUT_FILENO };
+	int fds_count = subsystem_same() ? 1 : 2;
+	char control[CMSG_SPACE(sizeof(fds))];
+	char byte = 0;
+	struct iovec iov = { .iov_base = &byte, .iov_len = 1 };
+	struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1, .msg_control = control };
+	struct cmsghdr *cmsg;
+	ssize_t written;
+
+	memset(control, 0, sizeof(control));
+	msg.msg_controllen = CMSG_SPACE(fds_count * sizeof(int));
+
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(fds_count * sizeof(int));
+	memcpy(CMSG_DATA(cmsg), fds, fds_count * sizeof(int));
+
+	do
+		written = sendmsg(fd, &msg, MSG_NOSIGNAL);
+	while (written < 0 && errno == EINTR);
+
+	return written == 1 ? 0 : -1;
+}
+
+int
+main(int argc, char **argv)
+{
+	struct sockaddr_un sun = { .sun_family = AF_UNIX };
+	const char *path = argc > 1 ? argv[1] : SUBSYSTEM_PATH;
+	char byte;
+	ssize_t len;
+	int fd;
+
+	if (strlen(path) >= sizeof(sun.sun_path))
+	{
+		ERROR("subsystem socket path too long\n");
+		return EXIT_FAILURE;
+	}
+
+	strcpy(sun.sun_path, path);
+
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+	if (fd < 0 || connect(fd, (struct sockaddr *) &sun, sizeof(sun)))
+	{
+		ERROR("unable to connect to '%s'\n", path);
+		return EXIT_FAILURE;
+	}
+
+	if (subsystem_send(fd))
+	{
+		ERROR("unable to pass ssh channel\n");
+		return EXIT_FAILURE;
+	}
+
+	// channel is freenetconfd's now
+	close(STDIN_FILENO);
+	close(STDOUT_FILENO);
+
+	do
+		len = read(fd, &byte, 1);
+	while (len < 0 && errno == EINTR);
+
+	return EXIT_SUCCESS;
+}
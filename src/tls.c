@@ -0,0 +1,237 @@
+/*
+ * Copyright (C) 2014 Sartura, Ltd.
+ * Copyright (C) 2014 Cisco Systems, Inc.
+ *
+ * Author: Luka Perkov <luka.perkov@sartura.hr>
+ * Author: Petar Koretic <petar.koretic@sartura.hr>
+ *
+ * freenetconfd is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with freenetconfd. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <stdlib.h>
+#include <errno.h>
+
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+
+#include "freenetconfd/freenetconfd.h"
+
+#include "config.h"
+#include "tls.h"
+
+struct tls
+{
+	SSL *ssl;
+	bool want_write;
+};
+
+static SSL_CTX *ctx = NULL;
+
+static void tls_error(const char *what)
+{
+	unsigned long e;
+
+	while ((e = ERR_get_error()))
+		ERROR("%s: %s\n", what, ERR_error_string(e, NULL));
+}
+
+int tls_init(void)
+{
+	// replicas inherit the writer's
+	if (ctx)
+		return 0;
+
+	// rfc 7589 wants clients authenticated with certificates
+	if (!config.tls_cert || !config.tls_key || !config.tls_ca)
+	{
+		ERROR("tls listener needs tls_cert, tls_key and tls_ca\n");
+		return -1;
+	}
+
+	ctx = SSL_CTX_new(TLS_server_method());
+
+	if (!ctx)
+		goto error;
+
+	SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+	SSL_CTX_set_options(ctx, SSL_OP_NO_RENEGOTIATION);
+	SSL_CTX_set_mode(ctx, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+
+#ifdef SSL_OP_ENABLE_KTLS
+	SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS);
+#endif
+
+	// stateless tickets only, any process holding the ticket keys resumes
+	SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_OFF);
+	SSL_CTX_set_session_id_context(ctx, (const unsigned char *) PROJECT_NAME, sizeof(PROJECT_NAME) - 1);
+
+	if (SSL_CTX_use_certificate_chain_file(ctx, config.tls_cert) != 1 ||
+		SSL_CTX_use_PrivateKey_file(ctx, config.tls_key, SSL_FILETYPE_PEM) != 1 ||
+		SSL_CTX_check_private_key(ctx) != 1)
+		goto error;
+
+	if (SSL_CTX_load_verify_locations(ctx, config.tls_ca, NULL) != 1)
+		goto error;
+
+	SSL_CTX_set_verify(ctx, SSL_VERIFY_PEER | SSL_VERIFY_FAIL_IF_NO_PEER_CERT, NULL);
+
+	return 0;
+
+error:
+	tls_error("tls init failed");
+	SSL_CTX_free(ctx);
+	ctx = NULL;
+
+	return -1;
+}
+
+void tls_exit(void)
+{
+	SSL_CTX_free(ctx);
+	ctx = NULL;
+}
+
+struct tls *tls_new(int fd)
+{
+	struct tls *t = calloc(1, sizeof(*t));
+
+	if (!t)
+		return NULL;
+
+	t->ssl = SSL_new(ctx);
+
+	if (!t->ssl || SSL_set_fd(t->ssl, fd) != 1)
+	{
+		SSL_free(t->ssl);
+		free(t);
+		return NULL;
+	}
+
+	SSL_set_accept_state(t->ssl);
+
+	return t;
+}
+
+/*
+ * tls_free() - frees tls state, socket is left open and no close_notify
+ * is sent
+ */
+void tls_free(struct tls *t)
+{
+	if (!t)
+		return;
+
+	SSL_free(t->ssl);
+	free(t);
+}
+
+/*
+ * tls_result() - turns result of an SSL call into -1 and errno
+ */
+static int tls_result(struct tls *t, int rc)
+{
+	int e = SSL_get_error(t->ssl, rc);
+
+	t->want_write = false;
+
+	switch (e)
+	{
+		case SSL_ERROR_NONE:
+			return rc;
+
+		case SSL_ERROR_WANT_WRITE:
+			t->want_write = true;
+			// fall through
+
+		case SSL_ERROR_WANT_READ:
+			errno = EAGAIN;
+			return -1;
+
+		case SSL_ERROR_ZERO_RETURN:
+			return 0;
+
+		case SSL_ERROR_SYSCALL:
+			ERR_clear_error();
+
+			// peer went away without close_notify
+			if (!errno)
+				return 0;
+
+			return -1;
+	}
+
+	tls_error("tls session failed");
+	errno = EPROTO;
+
+	return -1;
+}
+
+/*
+ * tls_handshake() - continues handshake
+ *
+ * Return: 0 once done, -1 on error
+ */
+int tls_handshake(struct tls *t)
+{
+	int rc;
+
+	ERR_clear_error();
+	errno = 0;
+	rc = SSL_do_handshake(t->ssl);
+
+	if (rc == 1)
+		return 0;
+
+	rc = tls_result(t, rc);
+
+	// closed during handshake
+	if (!rc)
+		errno = ECONNRESET;
+
+	return -1;
+}
+
+bool tls_want_write(struct tls *t)
+{
+	return t->want_write;
+}
+
+bool tls_offloaded(struct tls *t)
+{
+#if defined(SSL_OP_ENABLE_KTLS) && !defined(OPENSSL_NO_KTLS)
+	// records read ahead of the switch are in userspace only
+	return BIO_get_ktls_send(SSL_get_wbio(t->ssl)) &&
+		   BIO_get_ktls_recv(SSL_get_rbio(t->ssl)) &&
+		   !SSL_has_pending(t->ssl);
+#else
+	return false;
+#endif
+}
+
+bool tls_pending(struct tls *t)
+{
+	return SSL_has_pending(t->ssl);
+}
+
+int tls_read(struct tls *t, char *buf, int len)
+{
+	ERR_clear_error();
+	errno = 0;
+
+	return tls_result(t, SSL_read(t->ssl, buf, len));
+}
+
+int tls_write(struct tls *t, const char *buf, int len)
+{
+	ERR_clear_error();
+	errno = 0;
+
+	return tls_result(t, SSL_write(t->ssl, buf, len));
+}
@@ -0,0 +1,89 @@
+/*
+ * Copyright (C) 2014 Sartura, Ltd.
+ * Copyright (C) 2014 Cisco Systems, Inc.
+ *
+ * Author: Luka Perkov <luka.perkov@sartura.hr>
+ * Author: Petar Koretic <petar.koretic@sartura.hr>
+ *
+ * freenetconfd is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with freenetconfd. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef __FREENETCONFD_TLS_H__
+#define __FREENETCONFD_TLS_H__
+
+#include <stdbool.h>
+
+#include "freenetconfd/freenetconfd.h"
+
+/*
+ * NETCONF over TLS (RFC 7589) sessions. Once the handshake is done and the
+ * kernel takes the record layer over (kTLS), the session is a plain socket
+ * again and tls state is dropped.
+ *
+ * Errors are returned as -1 with errno set, EAGAIN if the socket has to
+ * become readable, or writable if tls_want_write() says so.
+ */
+struct tls;
+
+#ifdef FREENETCONFD_TLS
+
+/**
+ * tls_init() - loads certificates of tls listeners
+ *
+ * Ticket keys are made here as well, replicas forked later resume sessions
+ * started with the writer and each other.
+ *
+ * Return: 0 on success, -1 on error
+ */
+int tls_init(void);
+void tls_exit(void);
+
+struct tls *tls_new(int fd);
+void tls_free(struct tls *t);
+
+int tls_handshake(struct tls *t);
+bool tls_want_write(struct tls *t);
+
+/**
+ * tls_offloaded() - checks if kernel does the record layer from now on
+ *
+ * Session then reads and writes its socket directly, t can be freed.
+ */
+bool tls_offloaded(struct tls *t);
+
+/**
+ * tls_pending() - checks if data was decrypted that was not read yet
+ */
+bool tls_pending(struct tls *t);
+
+int tls_read(struct tls *t, char *buf, int len);
+int tls_write(struct tls *t, const char *buf, int len);
+
+#else
+
+static inline int tls_init(void)
+{
+	ERROR("built without tls support\n");
+	return -1;
+}
+
+static inline void tls_exit(void) { }
+static inline struct tls *tls_new(int fd) { return NULL; }
+static inline void tls_free(struct tls *t) { }
+static inline int tls_handshake(struct tls *t) { return -1; }
+static inline bool tls_want_write(struct tls *t) { return false; }
+static inline bool tls_offloaded(struct tls *t) { return false; }
+static inline bool tls_pending(struct tls *t) { return false; }
+static inline int tls_read(struct tls *t, char *buf, int len) { return -1; }
+static inline int tls_write(struct tls *t, const char *buf, int len) { return -1; }
+
+#endif /* FREENETCONFD_TLS */
+
+#endif /* __FREENETCONFD_TLS_H__ */
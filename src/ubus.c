@@ -15,17 +15,50 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <inttypes.h>
+#include <ctype.h>
 #include <unistd.h>
 #include <libubus.h>
 
 #include "freenetconfd/freenetconfd.h"
+#include "freenetconfd/plugin.h"
 
 #include "ubus.h"
+#include "config.h"
+#include "connection.h"
+
+#define UBUS_EVENT_NS "urn:freenetconfd:params:xml:ns:ubus"
+
+/* ubus events of a config stream section are sent to the stream */
+struct ubus_event
+{
+	struct ubus_event_handler ev;
+	const char *stream;
+};
 
 static struct ubus_context *ubus = NULL;
 static struct ubus_object main_object;
+static struct blob_buf b;
+static struct ubus_event *events = NULL;
+static unsigned int event_count = 0;
 
-static const struct ubus_method fnd_methods[] = {};
+static int
+fnd_handle_sessions(struct ubus_context *ctx, struct ubus_object *obj,
+					struct ubus_request_data *req, const char *method,
+					struct blob_attr *msg)
+{
+	blob_buf_init(&b, 0);
+	connection_dump(&b);
+	ubus_send_reply(ctx, req, b.head);
+
+	return 0;
+}
+
+static const struct ubus_method fnd_methods[] =
+{
+	UBUS_METHOD_NOARG("sessions", fnd_handle_sessions),
+};
 
 static struct ubus_object_type main_object_type =
 	UBUS_OBJECT_TYPE("freenetconfd", fnd_methods);
@@ -38,6 +71,176 @@ static struct ubus_object main_object =
 	.n_methods = ARRAY_SIZE(fnd_methods),
 };
 
+static void ubus_event_text(FILE *f, const char *str)
+{
+	for (; *str; str++)
+	{
+		switch (*str)
+		{
+			case '<':
+				fputs("&lt;", f);
+				break;
+
+			case '>':
+				fputs("&gt;", f);
+				break;
+
+			case '&':
+				fputs("&amp;", f);
+				break;
+
+			default:
+				fputc(*str, f);
+		}
+	}
+}
+
+/* names that are not element names are left out with their values */
+static int ubus_event_name_valid(const char *name)
+{
+	if (!isalpha((unsigned char) *name) && *name != '_')
+		return 0;
+
+	for (; *name; name++)
+	{
+		if (!isalnum((unsigned char) *name) && !strchr("_-.", *name))
+			return 0;
+	}
+
+	return 1;
+}
+
+/*
+ * ubus_event_attr() - writes attribute as element called name
+ *
+ * Tables become nested elements, each entry of an array is an element
+ * called as the array.
+ */
+static void ubus_event_attr(FILE *f, const char *name, struct blob_attr *attr)
+{
+	struct blob_attr *cur;
+	int rem;
+
+	if (blobmsg_type(attr) == BLOBMSG_TYPE_ARRAY)
+	{
+		blobmsg_for_each_attr(cur, attr, rem)
+			ubus_event_attr(f, name, cur);
+
+		return;
+	}
+
+	fprintf(f, "<%s>", name);
+
+	switch (blobmsg_type(attr))
+	{
+		case BLOBMSG_TYPE_TABLE:
+			blobmsg_for_each_attr(cur, attr, rem)
+			{
+				if (ubus_event_name_valid(blobmsg_name(cur)))
+					ubus_event_attr(f, blobmsg_name(cur), cur);
+			}
+
+			break;
+
+		case BLOBMSG_TYPE_STRING:
+			ubus_event_text(f, blobmsg_get_string(attr));
+			break;
+
+		case BLOBMSG_TYPE_INT64:
+			fprintf(f, "%" PRId64, (int64_t) blobmsg_get_u64(attr));
+			break;
+
+		case BLOBMSG_TYPE_INT32:
+			fprintf(f, "%" PRId32, (int32_t) blobmsg_get_u32(attr));
+			break;
+
+		case BLOBMSG_TYPE_INT16:
+			fprintf(f, "%" PRId16, (int16_t) blobmsg_get_u16(attr));
+			break;
+
+		case BLOBMSG_TYPE_BOOL:
+			fputs(blobmsg_get_bool(attr) ? "true" : "false", f);
+			break;
+	}
+
+	fprintf(f, "</%s>", name);
+}
+
+/*
+ * ubus_event_cb() - sends ubus event to its stream
+ *
+ * Event is sent as ubus-event with its type and data as elements.
+ */
+static void ubus_event_cb(struct ubus_context *ctx, struct ubus_event_handler *ev,
+						  const char *type, struct blob_attr *msg)
+{
+	struct ubus_event *e = container_of(ev, struct ubus_event, ev);
+	struct blob_attr *cur;
+	char *xml = NULL;
+	size_t len = 0;
+	FILE *f;
+	int rem;
+
+	if (!(f = open_memstream(&xml, &len)))
+		return;
+
+	fputs("<ubus-event xmlns=\"" UBUS_EVENT_NS "\"><type>", f);
+	ubus_event_text(f, type);
+	fputs("</type><data>", f);
+
+	if (msg)
+	{
+		blob_for_each_attr(cur, msg, rem)
+		{
+			if (ubus_event_name_valid(blobmsg_name(cur)))
+				ubus_event_attr(f, blobmsg_name(cur), cur);
+		}
+	}
+
+	fputs("</data></ubus-event>", f);
+
+	if (fclose(f) || notification_send(e->stream, xml))
+		ERROR("ubus event '%s' not sent to stream %s\n", type, e->stream);
+
+	free(xml);
+}
+
+/* ubus_events_init() - listens to ubus events of config streams */
+static int ubus_events_init(void)
+{
+	unsigned int count = 0;
+
+	for (unsigned int i = 0; i < config.stream_count; i++)
+		count += config.streams[i].event_count;
+
+	if (!count)
+		return 0;
+
+	if (!(events = calloc(count, sizeof(*events))))
+		return -1;
+
+	for (unsigned int i = 0; i < config.stream_count; i++)
+	{
+		for (unsigned int j = 0; j < config.streams[i].event_count; j++)
+		{
+			struct ubus_event *e = &events[event_count];
+
+			e->ev.cb = ubus_event_cb;
+			e->stream = config.streams[i].name;
+
+			if (ubus_register_event_handler(ubus, &e->ev, config.streams[i].events[j]))
+			{
+				ERROR("unable to listen to ubus event '%s'\n", config.streams[i].events[j]);
+				return -1;
+			}
+
+			event_count++;
+		}
+	}
+
+	return 0;
+}
+
 int
 ubus_init(void)
 {
@@ -49,11 +252,22 @@ ubus_init(void)
 
 	if (ubus_add_object(ubus, &main_object)) return -1;
 
+	if (ubus_events_init()) return -1;
+
 	return 0;
 }
 
 void
 ubus_exit(void)
 {
+	for (unsigned int i = 0; i < event_count; i++)
+		ubus_unregister_event_handler(ubus, &events[i].ev);
+
+	free(events);
+	events = NULL;
+	event_count = 0;
+
 	if (ubus) ubus_free(ubus);
+
+	blob_buf_free(&b);
 }
@@ -0,0 +1,345 @@
+/*
+ * Copyright (C) 2014 Sartura, Ltd.
+ * Copyright (C) 2014 Cisco Systems, Inc.
+ *
+ * Author: Luka Perkov <luka.perkov@sartura.hr>
+ * Author: Petar Koretic <petar.koretic@sartura.hr>
+ *
+ * freenetconfd is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with freenetconfd. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+
+#include <liburing.h>
+
+#include "freenetconfd/freenetconfd.h"
+
+#include "uring.h"
+
+#define URING_ENTRIES 256
+#define URING_CQ_ENTRIES 4096
+
+/* receive buffers the kernel picks from, count is a power of two */
+#define URING_BUFFERS 256
+#define URING_BUFFER_SIZE 4096
+#define URING_GROUP 0
+
+static struct io_uring ring;
+static bool ready = false;
+static struct io_uring_buf_ring *buffers = NULL;
+static char *buffer_data = NULL;
+
+/* last queued request asked for the next one to be linked to it */
+static struct io_uring_sqe *linked = NULL;
+
+/*
+ * uring_forked() - drops ring inherited by a child
+ *
+ * Ring is shared with the parent, so nothing is cancelled or unregistered,
+ * only the child's mappings and descriptor go.
+ */
+static void uring_forked(void)
+{
+	if (!ready)
+		return;
+
+	munmap(buffers, URING_BUFFERS * sizeof(struct io_uring_buf));
+	free(buffer_data);
+	io_uring_queue_exit(&ring);
+
+	buffers = NULL;
+	buffer_data = NULL;
+	linked = NULL;
+	ready = false;
+}
+
+static void uring_recycle(unsigned int id)
+{
+	io_uring_buf_ring_add(buffers, buffer_data + id * URING_BUFFER_SIZE, URING_BUFFER_SIZE, id,
+						  io_uring_buf_ring_mask(URING_BUFFERS), 0);
+	io_uring_buf_ring_advance(buffers, 1);
+}
+
+int uring_init(void)
+{
+	static bool atfork = false;
+	struct io_uring_params p = { .flags = IORING_SETUP_CQSIZE, .cq_entries = URING_CQ_ENTRIES };
+	struct io_uring_sync_cancel_reg reg = { .fd = -1, .flags = IORING_ASYNC_CANCEL_FD };
+	int rc;
+
+	if (ready)
+		return 0;
+
+	if (!atfork && pthread_atfork(NULL, NULL, uring_forked))
+		return -1;
+
+	atfork = true;
+
+	rc = io_uring_queue_init_params(URING_ENTRIES, &ring, &p);
+
+	if (rc)
+	{
+		errno = -rc;
+		return -1;
+	}
+
+	// multishot recv came with synchronous cancel, a kernel without it
+	// is found out here rather than with the first session
+	if (io_uring_register_sync_cancel(&ring, &reg) == -EINVAL)
+	{
+		errno = ENOSYS;
+		goto error;
+	}
+
+	buffer_data = malloc(URING_BUFFERS * URING_BUFFER_SIZE);
+	buffers = io_uring_setup_buf_ring(&ring, URING_BUFFERS, URING_GROUP, 0, &rc);
+
+	if (!buffer_data || !buffers)
+	{
+		errno = buffers ? ENOMEM : -rc;
+		goto error;
+	}
+
+	for (unsigned int i = 0; i < URING_BUFFERS; i++)
+		uring_recycle(i);
+
+	ready = true;
+
+	return 0;
+
+error:
+	if (buffers)
+		io_uring_free_buf_ring(&ring, buffers, URING_BUFFERS, URING_GROUP);
+
+	free(buffer_data);
+	io_uring_queue_exit(&ring);
+
+	buffers = NULL;
+	buffer_data = NULL;
+
+	return -1;
+}
+
+void uring_exit(void)
+{
+	if (!ready)
+		return;
+
+	io_uring_free_buf_ring(&ring, buffers, URING_BUFFERS, URING_GROUP);
+	free(buffer_data);
+	io_uring_queue_exit(&ring);
+
+	buffers = NULL;
+	buffer_data = NULL;
+	linked = NULL;
+	ready = false;
+}
+
+int uring_fd(void)
+{
+	return ready ? ring.ring_fd : -1;
+}
+
+/*
+ * uring_sqe() - gets entry for a new request
+ *
+ * Full queue is submitted to make room, unless a request is waiting to be
+ * linked to the new one. Submitting would end its chain, so it is ended
+ * here and the caller queues the new request later.
+ */
+static struct io_uring_sqe *uring_sqe(void)
+{
+	struct io_uring_sqe *sqe;
+
+	if (!ready)
+		return NULL;
+
+	sqe = io_uring_get_sqe(&ring);
+
+	if (sqe)
+		return sqe;
+
+	if (linked)
+	{
+		linked->flags &= ~IOSQE_IO_LINK;
+		linked = NULL;
+		return NULL;
+	}
+
+	if (io_uring_submit(&ring) < 0)
+		return NULL;
+
+	return io_uring_get_sqe(&ring);
+}
+
+int uring_accept(struct uring_req *r, int fd)
+{
+	struct io_uring_sqe *sqe = uring_sqe();
+
+	if (!sqe)
+		return -1;
+
+	io_uring_prep_multishot_accept(sqe, fd, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK);
+	io_uring_sqe_set_data(sqe, r);
+	linked = NULL;
+
+	return 0;
+}
+
+int uring_recv(struct uring_req *r, int fd)
+{
+	struct io_uring_sqe *sqe = uring_sqe();
+
+	if (!sqe)
+		return -1;
+
+	io_uring_prep_recv_multishot(sqe, fd, NULL, 0, 0);
+	io_uring_sqe_set_flags(sqe, IOSQE_BUFFER_SELECT);
+	sqe->buf_group = URING_GROUP;
+	io_uring_sqe_set_data(sqe, r);
+	linked = NULL;
+
+	return 0;
+}
+
+int uring_send(struct uring_req *r, int fd, const char *buf, size_t len, bool link)
+{
+	struct io_uring_sqe *sqe = uring_sqe();
+
+	if (!sqe)
+		return -1;
+
+	// short send fails the link, requests after it are cancelled
+	io_uring_prep_send(sqe, fd, buf, len, MSG_NOSIGNAL | MSG_WAITALL);
+	io_uring_sqe_set_data(sqe, r);
+
+	if (link)
+		io_uring_sqe_set_flags(sqe, IOSQE_IO_LINK);
+
+	linked = link ? sqe : NULL;
+
+	return 0;
+}
+
+int uring_cancel(struct uring_req *r)
+{
+	struct io_uring_sqe *sqe = uring_sqe();
+
+	if (!sqe)
+		return -1;
+
+	io_uring_prep_cancel(sqe, r, 0);
+	io_uring_sqe_set_data(sqe, NULL);
+	linked = NULL;
+
+	return 0;
+}
+
+int uring_cancel_fd(int fd)
+{
+	struct io_uring_sqe *sqe = uring_sqe();
+
+	if (!sqe)
+		return -1;
+
+	io_uring_prep_cancel_fd(sqe, fd, IORING_ASYNC_CANCEL_ALL);
+	io_uring_sqe_set_data(sqe, NULL);
+	linked = NULL;
+
+	// descriptor is looked up once submitted
+	return uring_submit();
+}
+
+int uring_cancel_sync(int fd)
+{
+	struct io_uring_sync_cancel_reg reg =
+	{
+		.fd = fd,
+		.flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL,
+		.timeout = { .tv_sec = -1, .tv_nsec = -1 }
+	};
+	int rc;
+
+	// requests still queued would be missed
+	if (uring_submit())
+		return -1;
+
+	do
+		rc = io_uring_register_sync_cancel(&ring, &reg);
+	while (rc == -EINTR);
+
+	if (rc < 0 && rc != -ENOENT)
+	{
+		errno = -rc;
+		return -1;
+	}
+
+	return 0;
+}
+
+int uring_submit(void)
+{
+	int rc;
+
+	if (!ready)
+		return -1;
+
+	linked = NULL;
+	rc = io_uring_submit(&ring);
+
+	if (rc < 0)
+	{
+		errno = -rc;
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * uring_complete() - hands completions to their requests
+ *
+ * Entry is consumed before its callback runs, callbacks may queue requests
+ * and call this again.
+ */
+void uring_complete(void)
+{
+	struct io_uring_cqe *cqe;
+	struct uring_req *r;
+	unsigned int flags, id = 0;
+	char *data;
+	int res;
+
+	while (ready && !io_uring_peek_cqe(&ring, &cqe))
+	{
+		r = io_uring_cqe_get_data(cqe);
+		res = cqe->res;
+		flags = cqe->flags;
+		data = NULL;
+
+		io_uring_cqe_seen(&ring, cqe);
+
+		if (flags & IORING_CQE_F_BUFFER)
+		{
+			id = flags >> IORING_CQE_BUFFER_SHIFT;
+			data = buffer_data + id * URING_BUFFER_SIZE;
+		}
+
+		// cancel requests have none
+		if (r)
+			r->cb(r, res, data, flags & IORING_CQE_F_MORE);
+
+		if (data)
+			uring_recycle(id);
+	}
+}
@@ -0,0 +1,112 @@
+/*
+ * Copyright (C) 2014 Sartura, Ltd.
+ * Copyright (C) 2014 Cisco Systems, Inc.
+ *
+ * Author: Luka Perkov <luka.perkov@sartura.hr>
+ * Author: Petar Koretic <petar.koretic@sartura.hr>
+ *
+ * freenetconfd is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with freenetconfd. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __FREENETCONFD_URING_H__
+#define __FREENETCONFD_URING_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * io_uring backend for plain sessions and their listeners. Listeners accept
+ * with one multishot accept, sessions read with one multishot recv into
+ * buffers the kernel picks from a shared ring, replies go out as linked
+ * sends. Requests are only queued, uring_submit() passes all of them to
+ * the kernel in one call and uring_complete() hands completions to their
+ * callbacks. Both are driven from uloop, the ring's descriptor becomes
+ * readable once there are completions.
+ */
+struct uring_req
+{
+	/*
+	 * Called for every completion, res as of the syscall the request
+	 * stands for. Received data is in data, valid until cb returns. more
+	 * is false for the last completion of a request.
+	 */
+	void (*cb)(struct uring_req *r, int res, char *data, bool more);
+};
+
+#ifdef FREENETCONFD_IO_URING
+
+/**
+ * uring_init() - sets the ring up
+ *
+ * Processes forked later leave the ring to their parent, they set up their
+ * own if they need one.
+ *
+ * Return: 0 on success, -1 if kernel can't do what sessions need
+ */
+int uring_init(void);
+void uring_exit(void);
+
+/**
+ * uring_fd() - descriptor that is readable while there are completions
+ *
+ * Return: the descriptor, -1 without a ring
+ */
+int uring_fd(void);
+
+int uring_accept(struct uring_req *r, int fd);
+int uring_recv(struct uring_req *r, int fd);
+
+/**
+ * uring_send() - sends all of buf
+ *
+ * If link is set, next request queued is only started once this one sent
+ * everything, and cancelled if it did not.
+ */
+int uring_send(struct uring_req *r, int fd, const char *buf, size_t len, bool link);
+
+/**
+ * uring_cancel() - cancels request r, its last completion follows
+ */
+int uring_cancel(struct uring_req *r);
+
+/**
+ * uring_cancel_fd() - cancels all requests on fd, fd may be closed once
+ * this returns
+ *
+ * Return: 0 on success, -1 on error
+ */
+int uring_cancel_fd(int fd);
+
+/**
+ * uring_cancel_sync() - cancels all requests on fd and waits for them
+ *
+ * Completions they already had are delivered by next uring_complete().
+ */
+int uring_cancel_sync(int fd);
+
+int uring_submit(void);
+void uring_complete(void);
+
+#else
+
+static inline int uring_init(void) { return -1; }
+static inline void uring_exit(void) { }
+static inline int uring_fd(void) { return -1; }
+static inline int uring_accept(struct uring_req *r, int fd) { return -1; }
+static inline int uring_recv(struct uring_req *r, int fd) { return -1; }
+static inline int uring_send(struct uring_req *r, int fd, const char *buf, size_t len, bool link) { return -1; }
+static inline int uring_cancel(struct uring_req *r) { return -1; }
+static inline int uring_cancel_fd(int fd) { return -1; }
+static inline int uring_cancel_sync(int fd) { return -1; }
+static inline int uring_submit(void) { return -1; }
+static inline void uring_complete(void) { }
+
+#endif /* FREENETCONFD_IO_URING */
+
+#endif /* __FREENETCONFD_URING_H__ */
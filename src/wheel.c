@@ -0,0 +1,120 @@
+/*
+ * Copyright (C) 2014 Sartura, Ltd.
+ * Copyright (C) 2014 Cisco Systems, Inc.
+ *
+ * Author: Luka Perkov <luka.perkov@sartura.hr>
+ * Author: Petar Koretic <petar.koretic@sartura.hr>
+ *
+ * freenetconfd is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with freenetconfd. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdint.h>
+#include <time.h>
+
+#include <libubox/uloop.h>
+
+#include "wheel.h"
+
+/* 51.2 s per round, longer timers stay in their slot for more rounds */
+#define WHEEL_TICK_MS 100
+#define WHEEL_SLOTS 512
+
+static void wheel_run(struct uloop_timeout *t);
+
+static struct list_head slots[WHEEL_SLOTS];
+static bool initialized = false;
+static uint64_t wheel_tick; // last tick whose slot was run
+static unsigned int wheel_count = 0;
+static struct uloop_timeout wheel_timeout = { .cb = wheel_run };
+
+static uint64_t wheel_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ((uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000) / WHEEL_TICK_MS;
+}
+
+void wheel_timer_set(struct wheel_timer *t, unsigned int ms)
+{
+	uint64_t now = wheel_now();
+
+	if (!initialized)
+	{
+		for (int i = 0; i < WHEEL_SLOTS; i++)
+			INIT_LIST_HEAD(&slots[i]);
+
+		initialized = true;
+	}
+
+	wheel_timer_cancel(t);
+
+	if (!wheel_count)
+		wheel_tick = now;
+
+	// never in the slot being run, at least one tick from now
+	t->expires = now + (ms + WHEEL_TICK_MS - 1) / WHEEL_TICK_MS;
+
+	if (t->expires <= wheel_tick)
+		t->expires = wheel_tick + 1;
+
+	list_add_tail(&t->list, &slots[t->expires % WHEEL_SLOTS]);
+	t->pending = true;
+
+	// wheel only turns while there are timers on it
+	if (!wheel_count++)
+		uloop_timeout_set(&wheel_timeout, WHEEL_TICK_MS);
+}
+
+void wheel_timer_cancel(struct wheel_timer *t)
+{
+	if (!t->pending)
+		return;
+
+	list_del(&t->list);
+	t->pending = false;
+	wheel_count--;
+}
+
+static void wheel_run(struct uloop_timeout *t)
+{
+	struct wheel_timer *w, *tmp;
+	uint64_t now = wheel_now();
+	LIST_HEAD(expired);
+
+	// late loop catches up, one round visits every slot
+	if (now - wheel_tick > WHEEL_SLOTS)
+		wheel_tick = now - WHEEL_SLOTS;
+
+	while (wheel_tick < now)
+	{
+		wheel_tick++;
+
+		list_for_each_entry_safe(w, tmp, &slots[wheel_tick % WHEEL_SLOTS], list)
+		{
+			if (w->expires <= wheel_tick)
+				list_move_tail(&w->list, &expired);
+		}
+	}
+
+	// callbacks may set or cancel any timer
+	while (!list_empty(&expired))
+	{
+		w = list_first_entry(&expired, struct wheel_timer, list);
+		list_del(&w->list);
+		w->pending = false;
+		wheel_count--;
+
+		w->cb(w);
+	}
+
+	if (wheel_count)
+		uloop_timeout_set(t, WHEEL_TICK_MS);
+}
@@ -0,0 +1,44 @@
+/*
+ * Copyright (C) 2014 Sartura, Ltd.
+ * Copyright (C) 2014 Cisco Systems, Inc.
+ *
+ * Author: Luka Perkov <luka.perkov@sartura.hr>
+ * Author: Petar Koretic <petar.koretic@sartura.hr>
+ *
+ * freenetconfd is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with freenetconfd. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __FREENETCONFD_WHEEL_H__
+#define __FREENETCONFD_WHEEL_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <libubox/list.h>
+
+/*
+ * Hashed timer wheel for timers of every session. Setting and cancelling
+ * is O(1) and a single uloop timeout drives all of them, at 100 ms
+ * resolution.
+ */
+struct wheel_timer
+{
+	struct list_head list;
+	uint64_t expires; // tick
+	bool pending;
+	void (*cb)(struct wheel_timer *t);
+};
+
+/**
+ * wheel_timer_set() - (re)starts timer, cb runs in about ms
+ */
+void wheel_timer_set(struct wheel_timer *t, unsigned int ms);
+void wheel_timer_cancel(struct wheel_timer *t);
+
+#endif /* __FREENETCONFD_WHEEL_H__ */
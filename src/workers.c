@@ -0,0 +1,167 @@
+/*
+ * Copyright (C) 2014 Sartura, Ltd.
+ * Copyright (C) 2014 Cisco Systems, Inc.
+ *
+ * Author: Luka Perkov <luka.perkov@sartura.hr>
+ * Author: Petar Koretic <petar.koretic@sartura.hr>
+ *
+ * freenetconfd is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with freenetconfd. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+
+#include <libubox/list.h>
+#include <libubox/uloop.h>
+
+#include "freenetconfd/freenetconfd.h"
+
+#include "config.h"
+#include "workers.h"
+
+static void workers_done_cb(struct uloop_fd *fd, unsigned int events);
+
+static pthread_t *threads = NULL;
+static unsigned int threads_count = 0;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+static LIST_HEAD(pending);
+static LIST_HEAD(finished);
+static bool stopping = false;
+
+/* wakes uloop when jobs finished */
+static struct uloop_fd done_fd = { .cb = workers_done_cb, .fd = -1 };
+
+static void *workers_thread(void *arg)
+{
+	worker_job_t *job;
+	uint64_t one = 1;
+
+	pthread_mutex_lock(&lock);
+
+	for (;;)
+	{
+		while (list_empty(&pending) && !stopping)
+			pthread_cond_wait(&cond, &lock);
+
+		if (stopping)
+			break;
+
+		job = list_first_entry(&pending, worker_job_t, list);
+		list_del(&job->list);
+		pthread_mutex_unlock(&lock);
+
+		job->run(job);
+
+		pthread_mutex_lock(&lock);
+		list_add_tail(&job->list, &finished);
+
+		if (write(done_fd.fd, &one, sizeof(one)) < 0)
+			ERROR("unable to wake main loop\n");
+	}
+
+	pthread_mutex_unlock(&lock);
+
+	return NULL;
+}
+
+/*
+ * workers_done_cb() - completes finished jobs on the uloop thread
+ */
+static void workers_done_cb(struct uloop_fd *fd, unsigned int events)
+{
+	LIST_HEAD(done);
+	worker_job_t *job, *tmp;
+	uint64_t count;
+
+	if (read(fd->fd, &count, sizeof(count)) < 0)
+		return;
+
+	pthread_mutex_lock(&lock);
+	list_splice_init(&finished, &done);
+	pthread_mutex_unlock(&lock);
+
+	list_for_each_entry_safe(job, tmp, &done, list)
+	{
+		list_del(&job->list);
+		job->done(job);
+	}
+}
+
+void workers_submit(worker_job_t *job)
+{
+	pthread_mutex_lock(&lock);
+	list_add_tail(&job->list, &pending);
+	pthread_cond_signal(&cond);
+	pthread_mutex_unlock(&lock);
+}
+
+int workers_init(void)
+{
+	if (!config.workers)
+		return 0;
+
+	done_fd.fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+	if (done_fd.fd < 0)
+	{
+		ERROR("unable to create eventfd\n");
+		return -1;
+	}
+
+	threads = calloc(config.workers, sizeof(pthread_t));
+
+	if (!threads)
+	{
+		ERROR("not enough memory for worker threads\n");
+		return -1;
+	}
+
+	for (threads_count = 0; threads_count < config.workers; threads_count++)
+	{
+		if (pthread_create(&threads[threads_count], NULL, workers_thread, NULL))
+		{
+			ERROR("unable to start worker thread\n");
+			return -1;
+		}
+	}
+
+	uloop_fd_add(&done_fd, ULOOP_READ);
+
+	DEBUG("started %u worker threads\n", threads_count);
+
+	return 0;
+}
+
+void workers_exit(void)
+{
+	pthread_mutex_lock(&lock);
+	stopping = true;
+	pthread_cond_broadcast(&cond);
+	pthread_mutex_unlock(&lock);
+
+	for (unsigned int i = 0; i < threads_count; i++)
+		pthread_join(threads[i], NULL);
+
+	free(threads);
+	threads = NULL;
+	threads_count = 0;
+
+	if (done_fd.fd >= 0)
+	{
+		uloop_fd_delete(&done_fd);
+		close(done_fd.fd);
+		done_fd.fd = -1;
+	}
+}
@@ -0,0 +1,51 @@
+/*
+ * Copyright (C) 2014 Sartura, Ltd.
+ * Copyright (C) 2014 Cisco Systems, Inc.
+ *
+ * Author: Luka Perkov <luka.perkov@sartura.hr>
+ * Author: Petar Koretic <petar.koretic@sartura.hr>
+ *
+ * freenetconfd is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with freenetconfd. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __FREENETCONFD_WORKERS_H__
+#define __FREENETCONFD_WORKERS_H__
+
+#include <libubox/list.h>
+
+/**
+ * worker_job_t - work handed to the worker threads
+ *
+ * @run:	called on a worker thread
+ * @done:	called on the uloop thread once run returned
+ */
+typedef struct worker_job
+{
+	struct list_head list;
+	void (*run)(struct worker_job *job);
+	void (*done)(struct worker_job *job);
+} worker_job_t;
+
+/**
+ * workers_init() - starts config.workers threads
+ *
+ * No threads are started if config.workers is 0, workers_submit() must not
+ * be used then.
+ */
+int workers_init(void);
+void workers_exit(void);
+
+/**
+ * workers_submit() - queues job for the next idle worker thread
+ *
+ * Jobs run in submission order but may finish in any order.
+ */
+void workers_submit(worker_job_t *job);
+
+#endif /* __FREENETCONFD_WORKERS_H__ */
@@ -0,0 +1,970 @@
+/*
+ * Copyright (C) 2014 Sartura, Ltd.
+ * Copyright (C) 2014 Cisco Systems, Inc.
+ *
+ * Author: Luka Perkov <luka.perkov@sartura.hr>
+ * Author: Petar Koretic <petar.koretic@sartura.hr>
+ *
+ * freenetconfd is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with freenetconfd. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <ctype.h>
+
+#include "freenetconfd/freenetconfd.h"
+#include "freenetconfd/datastore.h"
+#include "freenetconfd/plugin.h"
+
+#include "xpath.h"
+#include "modules.h"
+
+#define XPATH_MAP_INITIAL_SIZE 64
+
+/* datastore node to xml node map, used as a set when values are NULL */
+typedef struct xpath_map
+{
+	datastore_t **keys;
+	node_t **values;
+	unsigned int size;
+	unsigned int used;
+} xpath_map_t;
+
+typedef int (*xpath_visit_t)(datastore_t *node, void *priv);
+
+struct xpath_walk
+{
+	int get_config;
+	xpath_visit_t visit;
+	void *priv;
+};
+
+struct xpath_out
+{
+	node_t *out;
+	int get_config;
+	xpath_map_t selected;
+	datastore_t **nodes; // selected nodes, in order of selection
+	unsigned int nodes_count;
+	unsigned int nodes_size;
+	xpath_map_t ancestors; // ancestors of selected nodes added to out
+};
+
+static xpath_path_t *xpath_parse_path(const char **p, int relative);
+static void xpath_free_path(xpath_path_t *path);
+static int xpath_walk(xpath_path_t *path, int step, datastore_t *node, struct xpath_walk *w);
+
+static void xpath_skip_ws(const char **p)
+{
+	while (isspace((unsigned char) **p))
+		(*p)++;
+}
+
+static int xpath_is_name_start(char c)
+{
+	return isalpha((unsigned char) c) || c == '_';
+}
+
+static int xpath_is_name_char(char c)
+{
+	return isalnum((unsigned char) c) || c == '_' || c == '-' || c == '.';
+}
+
+/**
+ * xpath_parse_name() parses name test, prefix is skipped
+ */
+static char *xpath_parse_name(const char **p)
+{
+	const char *start = *p;
+
+	if (!xpath_is_name_start(**p))
+		return NULL;
+
+	while (xpath_is_name_char(**p))
+		(*p)++;
+
+	if (**p == ':' && xpath_is_name_start((*p)[1]))
+	{
+		start = ++(*p);
+
+		while (xpath_is_name_char(**p))
+			(*p)++;
+	}
+
+	return strndup(start, *p - start);
+}
+
+static int xpath_parse_term(const char **p, xpath_term_t *term)
+{
+	xpath_skip_ws(p);
+
+	if (isdigit((unsigned char) **p))
+	{
+		char *end;
+		term->position = strtol(*p, &end, 10);
+		*p = end;
+
+		return term->position > 0 ? 0 : -1;
+	}
+
+	term->path = xpath_parse_path(p, 1);
+
+	if (!term->path)
+		return -1;
+
+	xpath_skip_ws(p);
+
+	if (!strncmp(*p, "!=", 2))
+		term->op = XPATH_OP_NE, *p += 2;
+	else if (!strncmp(*p, "<=", 2))
+		term->op = XPATH_OP_LE, *p += 2;
+	else if (!strncmp(*p, ">=", 2))
+		term->op = XPATH_OP_GE, *p += 2;
+	else if (**p == '=')
+		term->op = XPATH_OP_EQ, (*p)++;
+	else if (**p == '<')
+		term->op = XPATH_OP_LT, (*p)++;
+	else if (**p == '>')
+		term->op = XPATH_OP_GT, (*p)++;
+	else
+		return 0; // existence test
+
+	xpath_skip_ws(p);
+
+	if (**p == '\'' || **p == '"')
+	{
+		const char *end = strchr(*p + 1, **p);
+
+		if (!end)
+			return -1;
+
+		term->value = strndup(*p + 1, end - *p - 1);
+		*p = end + 1;
+	}
+	else
+	{
+		char *end;
+		strtod(*p, &end);
+
+		if (end == *p)
+			return -1;
+
+		term->value = strndup(*p, end - *p);
+		term->numeric = 1;
+		*p = end;
+	}
+
+	return term->value ? 0 : -1;
+}
+
+static void xpath_free_pred(xpath_pred_t *pred)
+{
+	while (pred)
+	{
+		xpath_pred_t *or = pred->or;
+
+		for (int i = 0; i < pred->terms_count; i++)
+		{
+			xpath_free_path(pred->terms[i].path);
+			free(pred->terms[i].value);
+		}
+
+		free(pred->terms);
+		free(pred);
+
+		pred = or;
+	}
+}
+
+static xpath_pred_t *xpath_parse_pred(const char **p)
+{
+	xpath_pred_t *head = calloc(1, sizeof(xpath_pred_t));
+	xpath_pred_t *alt = head;
+
+	while (alt)
+	{
+		xpath_term_t *terms = realloc(alt->terms, (alt->terms_count + 1) * sizeof(xpath_term_t));
+
+		if (!terms)
+			break;
+
+		alt->terms = terms;
+		memset(&terms[alt->terms_count], 0, sizeof(xpath_term_t));
+
+		if (xpath_parse_term(p, &terms[alt->terms_count++]))
+			break;
+
+		xpath_skip_ws(p);
+
+		if (!strncmp(*p, "and", 3) && isspace((unsigned char) (*p)[3]))
+		{
+			*p += 3;
+			continue;
+		}
+
+		if (!strncmp(*p, "or", 2) && isspace((unsigned char) (*p)[2]))
+		{
+			*p += 2;
+			alt = alt->or = calloc(1, sizeof(xpath_pred_t));
+			continue;
+		}
+
+		return head;
+	}
+
+	xpath_free_pred(head);
+
+	return NULL;
+}
+
+static void xpath_free_path(xpath_path_t *path)
+{
+	if (!path)
+		return;
+
+	for (int i = 0; i < path->steps_count; i++)
+	{
+		for (int j = 0; j < path->steps[i].preds_count; j++)
+			xpath_free_pred(path->steps[i].preds[j]);
+
+		free(path->steps[i].preds);
+		free(path->steps[i].name);
+	}
+
+	free(path->steps);
+	free(path);
+}
+
+static int xpath_parse_step(const char **p, xpath_step_t *step)
+{
+	if (!strncmp(*p, "..", 2))
+	{
+		step->axis = XPATH_AXIS_PARENT;
+		*p += 2;
+
+		return 0;
+	}
+
+	if (**p == '.')
+	{
+		step->axis = XPATH_AXIS_SELF;
+		(*p)++;
+
+		return 0;
+	}
+
+	if (**p == '*')
+		(*p)++;
+	else if (!(step->name = xpath_parse_name(p)))
+		return -1;
+
+	xpath_skip_ws(p);
+
+	while (**p == '[')
+	{
+		(*p)++;
+
+		xpath_pred_t **preds = realloc(step->preds, (step->preds_count + 1) * sizeof(xpath_pred_t *));
+
+		if (!preds)
+			return -1;
+
+		step->preds = preds;
+
+		if (!(preds[step->preds_count] = xpath_parse_pred(p)))
+			return -1;
+
+		step->preds_count++;
+
+		if (**p != ']')
+			return -1;
+
+		(*p)++;
+		xpath_skip_ws(p);
+	}
+
+	return 0;
+}
+
+/**
+ * xpath_parse_path() parses location path
+ *
+ * @relative 1 if absolute paths aren't allowed (predicates)
+ */
+static xpath_path_t *xpath_parse_path(const char **p, int relative)
+{
+	xpath_path_t *path = calloc(1, sizeof(xpath_path_t));
+	enum xpath_axis axis = XPATH_AXIS_CHILD;
+
+	if (!path)
+		return NULL;
+
+	xpath_skip_ws(p);
+
+	if (**p == '/')
+	{
+		if (relative)
+			goto error;
+
+		if ((*p)[1] == '/')
+		{
+			axis = XPATH_AXIS_DESCENDANT;
+			*p += 2;
+		}
+		else
+		{
+			(*p)++;
+			xpath_skip_ws(p);
+
+			// "/" selects everything
+			if (!**p || **p == '|')
+				return path;
+		}
+	}
+
+	for (;;)
+	{
+		xpath_step_t *steps = realloc(path->steps, (path->steps_count + 1) * sizeof(xpath_step_t));
+
+		if (!steps)
+			goto error;
+
+		path->steps = steps;
+		memset(&steps[path->steps_count], 0, sizeof(xpath_step_t));
+
+		xpath_step_t *step = &steps[path->steps_count++];
+
+		xpath_skip_ws(p);
+
+		if (xpath_parse_step(p, step))
+			goto error;
+
+		if (axis == XPATH_AXIS_DESCENDANT && step->axis != XPATH_AXIS_CHILD)
+			goto error;
+
+		if (step->axis == XPATH_AXIS_CHILD)
+			step->axis = axis;
+
+		xpath_skip_ws(p);
+
+		if (**p != '/')
+			break;
+
+		if ((*p)[1] == '/')
+		{
+			axis = XPATH_AXIS_DESCENDANT;
+			*p += 2;
+		}
+		else
+		{
+			axis = XPATH_AXIS_CHILD;
+			(*p)++;
+		}
+	}
+
+	return path;
+
+error:
+	xpath_free_path(path);
+
+	return NULL;
+}
+
+xpath_t *xpath_compile(const char *expr)
+{
+	xpath_t *xpath = calloc(1, sizeof(xpath_t));
+	const char *p = expr;
+
+	if (!xpath)
+	{
+		ERROR("not enough memory\n");
+		return NULL;
+	}
+
+	for (;;)
+	{
+		xpath_path_t **paths = realloc(xpath->paths, (xpath->paths_count + 1) * sizeof(xpath_path_t *));
+
+		if (!paths)
+			goto error;
+
+		xpath->paths = paths;
+
+		if (!(paths[xpath->paths_count] = xpath_parse_path(&p, 0)))
+			goto error;
+
+		xpath->paths_count++;
+
+		xpath_skip_ws(&p);
+
+		if (*p != '|')
+			break;
+
+		p++;
+	}
+
+	if (*p)
+		goto error;
+
+	return xpath;
+
+error:
+	DEBUG("xpath syntax error at: %s\n", p);
+	xpath_free(xpath);
+
+	return NULL;
+}
+
+void xpath_free(xpath_t *xpath)
+{
+	if (!xpath)
+		return;
+
+	for (int i = 0; i < xpath->paths_count; i++)
+		xpath_free_path(xpath->paths[i]);
+
+	free(xpath->paths);
+	free(xpath);
+}
+
+static int xpath_compare(datastore_t *node, xpath_term_t *term)
+{
+	if (term->op == XPATH_OP_EXISTS)
+		return 1;
+
+	char *value = node->get ? node->get(node) : node->value;
+	int rc = 0;
+
+	if (value)
+	{
+		int cmp;
+
+		if (term->numeric || term->op >= XPATH_OP_LT)
+		{
+			char *end;
+			double a = strtod(value, &end);
+			double b = strtod(term->value, NULL);
+
+			// not a number is only unequal
+			if (end == value)
+				cmp = term->op == XPATH_OP_NE ? 1 : -2;
+			else
+				cmp = (a > b) - (a < b);
+		}
+		else
+		{
+			cmp = strcmp(value, term->value);
+		}
+
+		switch (term->op)
+		{
+			case XPATH_OP_EQ:
+				rc = !cmp;
+				break;
+
+			case XPATH_OP_NE:
+				rc = cmp != 0;
+				break;
+
+			case XPATH_OP_LT:
+				rc = cmp == -1;
+				break;
+
+			case XPATH_OP_LE:
+				rc = cmp == -1 || !cmp;
+				break;
+
+			case XPATH_OP_GT:
+				rc = cmp == 1;
+				break;
+
+			case XPATH_OP_GE:
+				rc = cmp == 1 || !cmp;
+				break;
+
+			default:
+				break;
+		}
+	}
+
+	// get always allocates
+	if (node->get)
+		free(value);
+
+	return rc;
+}
+
+static int xpath_visit_term(datastore_t *node, void *priv)
+{
+	return xpath_compare(node, priv);
+}
+
+static int xpath_pred_true(xpath_pred_t *pred, datastore_t *node, int position, int get_config)
+{
+	for (; pred; pred = pred->or)
+	{
+		int i;
+
+		for (i = 0; i < pred->terms_count; i++)
+		{
+			xpath_term_t *term = &pred->terms[i];
+
+			if (!term->path)
+			{
+				if (position != term->position)
+					break;
+
+				continue;
+			}
+
+			struct xpath_walk w = { get_config, xpath_visit_term, term };
+
+			if (!xpath_walk(term->path, 0, node, &w))
+				break;
+		}
+
+		if (i == pred->terms_count)
+			return 1;
+	}
+
+	return 0;
+}
+
+/**
+ * xpath_key() makes list key from equality terms of pred
+ *
+ * Return: key, NULL if pred doesn't select entry by its whole key
+ */
+static ds_key_t *xpath_key(xpath_pred_t *pred, datastore_t *entry)
+{
+	ds_key_t *key = NULL;
+	int key_parts = 0, parts = 0;
+
+	if (pred->or)
+		return NULL;
+
+	for (datastore_t *cur = entry->child; cur; cur = cur->next)
+	{
+		if (cur->is_key)
+			key_parts++;
+	}
+
+	if (!key_parts)
+		return NULL;
+
+	for (int i = 0; i < pred->terms_count; i++)
+	{
+		xpath_term_t *term = &pred->terms[i];
+
+		// numbers compare by value, not by string
+		if (!term->path || term->op != XPATH_OP_EQ || term->numeric)
+			continue;
+
+		xpath_step_t *step = &term->path->steps[0];
+
+		if (term->path->steps_count != 1 || step->axis != XPATH_AXIS_CHILD || !step->name || step->preds_count)
+			continue;
+
+		if (!ds_element_has_key_part(entry, step->name, NULL))
+			continue;
+
+		ds_key_t *key_part = malloc(sizeof(ds_key_t));
+
+		if (!key_part)
+		{
+			ERROR("not enough memory\n");
+			ds_free_key(key);
+			return NULL;
+		}
+
+		key_part->name = step->name;
+		key_part->value = term->value;
+		key_part->next = key;
+		key = key_part;
+		parts++;
+	}
+
+	if (parts != key_parts)
+	{
+		ds_free_key(key);
+		return NULL;
+	}
+
+	return key;
+}
+
+static int xpath_candidate(xpath_step_t *step, datastore_t *node, int *positions, int get_config)
+{
+	if (get_config && !node->is_config)
+		return 0;
+
+	if (step->name && (!node->name || strcmp(node->name, step->name)))
+		return 0;
+
+	for (int i = 0; i < step->preds_count; i++)
+	{
+		if (!xpath_pred_true(step->preds[i], node, ++positions[i], get_config))
+			return 0;
+	}
+
+	return 1;
+}
+
+static int xpath_children(xpath_path_t *path, int step, datastore_t *node, struct xpath_walk *w)
+{
+	xpath_step_t *s = &path->steps[step];
+	int *positions = NULL;
+	int rc = 0;
+
+	if (s->preds_count && !(positions = calloc(s->preds_count, sizeof(int))))
+	{
+		ERROR("not enough memory\n");
+		return 0;
+	}
+
+	if (s->name)
+	{
+		datastore_t *cur = ds_find_child(node, s->name, NULL);
+		ds_key_t *key = NULL;
+
+		// list entry selected by its whole key is looked up directly
+		if (cur && cur->is_list && s->preds_count && (key = xpath_key(s->preds[0], cur)))
+		{
+			cur = ds_find_node_by_key(cur, key);
+			ds_free_key(key);
+
+			if (cur && xpath_candidate(s, cur, positions, w->get_config))
+				rc = xpath_walk(path, step + 1, cur, w);
+		}
+		else
+		{
+			for (; cur && !rc; cur = ds_next_by_name(cur))
+			{
+				if (xpath_candidate(s, cur, positions, w->get_config))
+					rc = xpath_walk(path, step + 1, cur, w);
+			}
+		}
+	}
+	else
+	{
+		for (datastore_t *cur = ds_published(node)->child; cur && !rc; cur = cur->next)
+		{
+			if (xpath_candidate(s, cur, positions, w->get_config))
+				rc = xpath_walk(path, step + 1, cur, w);
+		}
+	}
+
+	free(positions);
+
+	return rc;
+}
+
+static int xpath_descendants(xpath_path_t *path, int step, datastore_t *node, struct xpath_walk *w)
+{
+	int rc = xpath_children(path, step, node, w);
+
+	for (datastore_t *cur = ds_published(node)->child; cur && !rc; cur = cur->next)
+		rc = xpath_descendants(path, step, cur, w);
+
+	return rc;
+}
+
+/**
+ * xpath_walk() calls w->visit for every node path selects from node
+ *
+ * Return: first non zero value returned by w->visit, 0 otherwise
+ */
+static int xpath_walk(xpath_path_t *path, int step, datastore_t *node, struct xpath_walk *w)
+{
+	if (step == path->steps_count)
+		return w->visit(node, w->priv);
+
+	switch (path->steps[step].axis)
+	{
+		case XPATH_AXIS_CHILD:
+			return xpath_children(path, step, node, w);
+
+		case XPATH_AXIS_DESCENDANT:
+			return xpath_descendants(path, step, node, w);
+
+		case XPATH_AXIS_SELF:
+			break;
+
+		case XPATH_AXIS_PARENT:
+			node = node->parent;
+			break;
+	}
+
+	if (!node || (w->get_config && !node->is_config))
+		return 0;
+
+	return xpath_walk(path, step + 1, node, w);
+}
+
+static unsigned int xpath_map_hash(datastore_t *node)
+{
+	return (unsigned int) (((uintptr_t) node >> 4) * 2654435761u);
+}
+
+static void xpath_map_free(xpath_map_t *map)
+{
+	free(map->keys);
+	free(map->values);
+}
+
+/**
+ * xpath_map_get() finds value of node
+ *
+ * Return: pointer to the value, NULL if node isn't in the map
+ */
+static node_t **xpath_map_get(xpath_map_t *map, datastore_t *node)
+{
+	if (!map->size)
+		return NULL;
+
+	for (unsigned int i = xpath_map_hash(node) & (map->size - 1); map->keys[i]; i = (i + 1) & (map->size - 1))
+	{
+		if (map->keys[i] == node)
+			return &map->values[i];
+	}
+
+	return NULL;
+}
+
+static int xpath_map_put(xpath_map_t *map, datastore_t *node, node_t *value)
+{
+	if ((map->used + 1) * 2 > map->size)
+	{
+		unsigned int size = map->size ? map->size * 2 : XPATH_MAP_INITIAL_SIZE;
+		datastore_t **keys = calloc(size, sizeof(datastore_t *));
+		node_t **values = calloc(size, sizeof(node_t *));
+
+		if (!keys || !values)
+		{
+			ERROR("not enough memory\n");
+			free(keys);
+			free(values);
+			return -1;
+		}
+
+		for (unsigned int i = 0; i < map->size; i++)
+		{
+			if (!map->keys[i])
+				continue;
+
+			unsigned int j = xpath_map_hash(map->keys[i]) & (size - 1);
+
+			while (keys[j])
+				j = (j + 1) & (size - 1);
+
+			keys[j] = map->keys[i];
+			values[j] = map->values[i];
+		}
+
+		xpath_map_free(map);
+
+		map->keys = keys;
+		map->values = values;
+		map->size = size;
+	}
+
+	unsigned int i = xpath_map_hash(node) & (map->size - 1);
+
+	while (map->keys[i] && map->keys[i] != node)
+		i = (i + 1) & (map->size - 1);
+
+	if (!map->keys[i])
+		map->used++;
+
+	map->keys[i] = node;
+	map->values[i] = value;
+
+	return 0;
+}
+
+static int xpath_visit_select(datastore_t *node, void *priv)
+{
+	struct xpath_out *o = priv;
+
+	if (xpath_map_get(&o->selected, node))
+		return 0;
+
+	if (o->nodes_count == o->nodes_size)
+	{
+		unsigned int size = o->nodes_size ? o->nodes_size * 2 : XPATH_MAP_INITIAL_SIZE;
+		datastore_t **nodes = realloc(o->nodes, size * sizeof(datastore_t *));
+
+		if (!nodes)
+		{
+			ERROR("not enough memory\n");
+			return 0;
+		}
+
+		o->nodes = nodes;
+		o->nodes_size = size;
+	}
+
+	if (xpath_map_put(&o->selected, node, NULL))
+		return 0;
+
+	o->nodes[o->nodes_count++] = node;
+
+	return 0;
+}
+
+/**
+ * xpath_out_node() adds node to out unless it's already there
+ *
+ * Only node itself is added, with keys if it's a list entry.
+ */
+static node_t *xpath_out_node(struct xpath_out *o, datastore_t *node)
+{
+	// module datastore root
+	if (!node->parent)
+		return o->out;
+
+	node_t **found = xpath_map_get(&o->ancestors, node);
+
+	if (found)
+		return *found;
+
+	node_t *parent = xpath_out_node(o, node->parent);
+	node_t *nn = roxml_add_node(parent, 0, ROXML_ELM_NODE, node->name, NULL);
+
+	if (node->ns)
+		roxml_add_node(nn, 0, ROXML_ATTR_NODE, "xmlns", node->ns); // add namespace
+
+	if (node->is_list)
+	{
+		for (datastore_t *cur = node->child; cur; cur = cur->next)
+		{
+			if (cur->is_key)
+				ds_get_all(cur, nn, o->get_config, 0);
+		}
+	}
+
+	xpath_map_put(&o->ancestors, node, nn);
+
+	return nn;
+}
+
+/**
+ * xpath_out_window() adds selected entries of a list selected by options
+ */
+static void xpath_out_window(datastore_t **nodes, int count, node_t *out, int get_config, ds_get_options_t *options)
+{
+	int step = options->backwards ? -1 : 1;
+	int i = options->backwards ? count - 1 : 0;
+	node_t *last = NULL;
+
+	options->paged++;
+
+	if (options->cursor)
+	{
+		// entry comes from the key index, only its position is searched,
+		// entries before the first selected one can't be in nodes anyway
+		datastore_t *entry = count ? ds_list_cursor_find(nodes[0], options->cursor) : NULL;
+
+		for (; entry && i >= 0 && i < count && nodes[i] != entry; i += step);
+
+		if (!entry || i < 0 || i >= count)
+			return;
+
+		options->cursor_found = 1;
+	}
+
+	if (options->offset >= (unsigned int) count)
+		return;
+
+	i += step * (int) options->offset;
+
+	for (unsigned int n = 0; i >= 0 && i < count && (!options->limit || n < options->limit); i += step, n++)
+		last = ds_get_all_options(nodes[i], out, get_config, 0, options);
+
+	// let client know where to continue
+	if (i >= 0 && i < count)
+		ds_set_next_cursor(last, nodes[i]);
+}
+
+int xpath_select(xpath_t *xpath, datastore_t *root, int (*visit)(datastore_t *node, void *priv), void *priv)
+{
+	struct xpath_walk w = { 0, visit, priv };
+	int rc = 0;
+
+	for (int i = 0; i < xpath->paths_count && !rc; i++)
+		rc = xpath_walk(xpath->paths[i], 0, root, &w);
+
+	return rc;
+}
+
+void xpath_eval(xpath_t *xpath, node_t *out, int get_config, ds_get_options_t *options)
+{
+	struct list_head *modules = get_modules();
+	struct module_list *elem;
+
+	struct xpath_out o = { .out = out, .get_config = get_config };
+	struct xpath_walk w = { get_config, xpath_visit_select, &o };
+
+	for (int i = 0; i < xpath->paths_count; i++)
+	{
+		list_for_each_entry(elem, modules, list)
+		{
+			if (elem->m->datastore)
+				xpath_walk(xpath->paths[i], 0, elem->m->datastore, &w);
+		}
+	}
+
+	int paged = ds_get_paged(options);
+
+	for (unsigned int i = 0, end; i < o.nodes_count; i = end)
+	{
+		datastore_t *node = o.nodes[i];
+		datastore_t *cur;
+		int window = paged && node->is_list && node->parent && ds_get_target(options, node, 1);
+
+		end = i + 1;
+
+		// selected entries of the same list are paginated together
+		if (window)
+		{
+			for (; end < o.nodes_count; end++)
+			{
+				cur = o.nodes[end];
+
+				if (cur->parent != node->parent || !cur->is_list || strcmp(cur->name, node->name))
+					break;
+			}
+		}
+
+		// skip nodes added with a selected ancestor
+		for (cur = node->parent; cur && !xpath_map_get(&o.selected, cur); cur = cur->parent);
+
+		if (cur)
+			continue;
+
+		if (!node->parent)
+		{
+			ds_get_all_options(node->child, out, get_config, 1, options);
+			continue;
+		}
+
+		node_t *parent = xpath_out_node(&o, node->parent);
+
+		if (window)
+			xpath_out_window(&o.nodes[i], end - i, parent, get_config, options);
+		else if (!(node->is_key && node->parent->is_list)) // keys are already added with the list entry
+			ds_get_all_options(node, parent, get_config, 0, options);
+	}
+
+	free(o.nodes);
+	xpath_map_free(&o.selected);
+	xpath_map_free(&o.ancestors);
+}
@@ -0,0 +1,128 @@
+/*
+ * Copyright (C) 2014 Sartura, Ltd.
+ * Copyright (C) 2014 Cisco Systems, Inc.
+ *
+ * Author: Luka Perkov <luka.perkov@sartura.hr>
+ * Author: Petar Koretic <petar.koretic@sartura.hr>
+ *
+ * freenetconfd is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with freenetconfd. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef __FREENETCONFD_XPATH_H__
+#define __FREENETCONFD_XPATH_H__
+
+#include <roxml.h>
+
+#include "freenetconfd/datastore.h"
+
+/*
+ * XPath 1.0 subset used by <filter type="xpath">
+ *
+ * Supported are location paths with child, descendant (//), self (.)
+ * and parent (..) steps, name tests with optional prefix and *, predicates
+ * comparing relative paths to literals (=, !=, <, <=, >, >=), existence
+ * and position predicates combined with "and" and "or", and unions of
+ * paths with "|". Prefixes aren't resolved, names are matched locally.
+ */
+
+enum xpath_axis
+{
+	XPATH_AXIS_CHILD,
+	XPATH_AXIS_DESCENDANT,
+	XPATH_AXIS_SELF,
+	XPATH_AXIS_PARENT
+};
+
+enum xpath_op
+{
+	XPATH_OP_EXISTS,
+	XPATH_OP_EQ,
+	XPATH_OP_NE,
+	XPATH_OP_LT,
+	XPATH_OP_LE,
+	XPATH_OP_GT,
+	XPATH_OP_GE
+};
+
+struct xpath_path;
+
+typedef struct xpath_term
+{
+	struct xpath_path *path; // NULL for position predicates
+	enum xpath_op op;
+	char *value;
+	int numeric; // value is a number literal
+	int position;
+} xpath_term_t;
+
+typedef struct xpath_pred
+{
+	xpath_term_t *terms; // all have to be true
+	int terms_count;
+	struct xpath_pred *or; // alternative
+} xpath_pred_t;
+
+typedef struct xpath_step
+{
+	enum xpath_axis axis;
+	char *name; // NULL matches any name
+	xpath_pred_t **preds;
+	int preds_count;
+} xpath_step_t;
+
+typedef struct xpath_path
+{
+	xpath_step_t *steps;
+	int steps_count;
+} xpath_path_t;
+
+typedef struct xpath
+{
+	xpath_path_t **paths; // union
+	int paths_count;
+} xpath_t;
+
+/**
+ * xpath_compile() - compiles xpath expression
+ *
+ * @expr expression from select attribute
+ *
+ * Return: compiled expression, NULL on syntax error, free it with xpath_free()
+ */
+xpath_t *xpath_compile(const char *expr);
+
+/**
+ * xpath_eval() - adds data selected by xpath to out
+ *
+ * @xpath compiled expression
+ * @out xml node to add data to
+ * @get_config 1 to select only configuration data
+ * @options list pagination and depth, can be NULL
+ *
+ * Selected nodes are added with their ancestors, ancestor list entries
+ * carry their keys. Predicates covering the whole key of a list are
+ * resolved through the list key index. With pagination requested, selected
+ * entries of the same list are paginated together.
+ */
+void xpath_eval(xpath_t *xpath, node_t *out, int get_config, ds_get_options_t *options);
+
+/**
+ * xpath_select() - calls visit for every node xpath selects under root
+ *
+ * @root node standing in for the datastore of a module, paths start at
+ * its children
+ *
+ * Return: first non zero value returned by visit, 0 otherwise
+ */
+int xpath_select(xpath_t *xpath, datastore_t *root, int (*visit)(datastore_t *node, void *priv), void *priv);
+
+void xpath_free(xpath_t *xpath);
+
+#endif /* __FREENETCONFD_XPATH_H__ */